@@ -0,0 +1,217 @@
+#include "ffmpeg.h"
+// throughput benchmark of the reader/writer paths on deterministic synthetic input, results as json
+typedef struct BenchResult
+{
+    const char* pTest;
+    int frames;
+    double sec, mb;
+    double* pLatMs;
+    int latNum;
+}BenchResult;
+typedef struct BenchConfig
+{
+    int width, height, frames, seeks, probes, threads;
+    double fps;
+    FFPixFmt pixfmt;
+    const char *pCodec, *pParam, *pDir, *pJson;
+}BenchConfig;
+static int bench_cmp_double(const void* a, const void* b)
+{
+    double x=*(const double*)a, y=*(const double*)b;
+    return (x>y)-(x<y);
+}
+static double bench_percentile(const double* p, int num, double q)
+{
+    return num>0?p[MIN(num-1, (int)(q*(num-1)+0.5))]:0;
+}
+// moving gradient, a moving box and low level noise, so that encoders have real work and every run sees the same frames
+static void bench_fill_frame(uint8* pFrame, int width, int height, FFPixFmt pixfmt, int idx)
+{
+    uint8* ppData[4];
+    int isWide=ffmpeg_is_10bit(pixfmt), maxv=(pixfmt==FF_BGR48 || pixfmt==FF_RGB48?65535:(isWide?1023:255));
+    int yshift=ffmpeg_yuv_half_height(pixfmt), cn=ffmpeg_yuv_isRGB(pixfmt)?1:ffmpeg_yuv_channel(pixfmt);
+    unsigned int seed=0x9e3779b9u*(idx+1);
+    ffmpeg_yuv_split_planes(pFrame, width, height, pixfmt, ppData);
+    for(int i=0; i<cn; i++)
+    {
+        int rows=(i==0?height:height>>yshift), cols=ffmpeg_yuv_plane_stride(width, pixfmt, i)/(isWide+1);
+        int bx=(idx*7)%MAX(1, cols), by=(idx*3)%MAX(1, rows);
+        for(int y=0; y<rows; y++)
+        {
+            for(int x=0; x<cols; x++)
+            {
+                seed=seed*1664525u+1013904223u;
+                int v=(x+2*y+3*idx+i*64)%256+(int)(seed>>29);
+                if(x>=bx && x<bx+cols/8 && y>=by && y<by+rows/8) v=255-v%256;
+                v=BETWEEN(v*maxv/255, 0, maxv);
+                if(isWide) ((uint16*)ppData[i])[(size_t)y*cols+x]=(uint16)v;
+                else ppData[i][(size_t)y*cols+x]=(uint8)v;
+            }
+        }
+    }
+}
+static void bench_add(BenchResult* r, double ms)
+{
+    r->pLatMs=(double*)realloc(r->pLatMs, sizeof(double)*(r->latNum+1));
+    r->pLatMs[r->latNum++]=ms;
+}
+static void bench_print(FILE* fp, BenchResult* pResult, int num, const BenchConfig* c)
+{
+    fprintf(fp, "{\n  \"config\": {\"width\": %d, \"height\": %d, \"pix_fmt\": \"%s\", \"fps\": %g, \"frames\": %d, \"codec\": \"%s\", \"param\": \"%s\", \"threads\": %d, \"cpus\": %d, \"simd\": %d},\n  \"results\": [\n",
+        c->width, c->height, ffmpeg_pixfmt2string(c->pixfmt), c->fps, c->frames, c->pCodec, c->pParam, c->threads, ffmpeg_get_cpu_num(), (int)ffmpeg_simd()->isa);
+    for(int i=0; i<num; i++)
+    {
+        BenchResult* r=&pResult[i];
+        qsort(r->pLatMs, r->latNum, sizeof(double), bench_cmp_double);
+        double sec=MAX(r->sec, 1e-9);
+        fprintf(fp, "    {\"test\": \"%s\", \"frames\": %d, \"sec\": %.6f, \"fps\": %.3f, \"mb_per_sec\": %.3f, \"latency_ms\": {\"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f}}%s\n",
+            r->pTest, r->frames, r->sec, r->frames/sec, r->mb/sec, bench_percentile(r->pLatMs, r->latNum, 0.5), bench_percentile(r->pLatMs, r->latNum, 0.9),
+            bench_percentile(r->pLatMs, r->latNum, 0.99), r->latNum>0?r->pLatMs[r->latNum-1]:0, i+1<num?",":"");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+// encode: synthetic frames into pDst through ffmpeg_set_frame(), the file is the input of the decode tests
+static void bench_write(BenchResult* r, const char* pDst, const BenchConfig* c, int isRaw)
+{
+    int64 frameSize=ffmpeg_yuv_compute_frame_size(c->width, c->height, c->pixfmt);
+    uint8* pFrame=(uint8*)malloc(frameSize);
+    int64 t0=ffmpeg_get_time_us();
+    FILE* fp=(isRaw?ffmpeg_create_writer(pDst, c->pixfmt, c->width, c->height, c->fps, FF_CRF_AUTO, NULL, NULL)
+        :ffmpeg_create_writer_full(pDst, c->pixfmt, c->width, c->height, c->fps, FF_CRF_AUTO, c->pCodec, c->pParam, c->threads, NULL));
+    for(int i=0; fp && i<c->frames; i++)
+    {
+        bench_fill_frame(pFrame, c->width, c->height, c->pixfmt, i);
+        int64 t=ffmpeg_get_time_us();
+        if(ffmpeg_set_frame(fp, pFrame, frameSize)!=frameSize)
+            break;
+        bench_add(r, (ffmpeg_get_time_us()-t)*1e-3);
+        r->frames++, r->mb+=frameSize/1048576.0;
+    }
+    if(fp) ffmpeg_close(fp);
+    r->sec=(ffmpeg_get_time_us()-t0)*1e-6;
+    free(pFrame);
+}
+static void bench_read(BenchResult* r, const char* pSrc, const BenchConfig* c, const char* pRoundTrip)
+{
+    int64 frameSize=ffmpeg_yuv_compute_frame_size(c->width, c->height, c->pixfmt);
+    uint8* pFrame=(uint8*)malloc(frameSize);
+    int64 t0=ffmpeg_get_time_us();
+    FILE* fp=ffmpeg_create_reader_ex(pSrc, c->pixfmt, c->width, c->height, c->threads, NULL);
+    FILE* fpDst=(pRoundTrip?ffmpeg_create_writer_full(pRoundTrip, c->pixfmt, c->width, c->height, c->fps, FF_CRF_AUTO, c->pCodec, c->pParam, c->threads, NULL):NULL);
+    for(;;)
+    {
+        int64 t=ffmpeg_get_time_us();
+        if(fp==0 || ffmpeg_get_frame(fp, pFrame, frameSize)!=frameSize)
+            break;
+        if(fpDst && ffmpeg_set_frame(fpDst, pFrame, frameSize)!=frameSize)
+            break;
+        bench_add(r, (ffmpeg_get_time_us()-t)*1e-3);
+        r->frames++, r->mb+=frameSize/1048576.0;
+    }
+    if(fp) ffmpeg_close(fp);
+    if(fpDst) ffmpeg_close(fpDst);
+    r->sec=(ffmpeg_get_time_us()-t0)*1e-6;
+    free(pFrame);
+}
+static void bench_probe(BenchResult* r, const char* pSrc, const BenchConfig* c)
+{
+    ffmpeg_probe_cache_enable(0);
+    int64 t0=ffmpeg_get_time_us();
+    for(int i=0; i<c->probes; i++)
+    {
+        FFInfo info;
+        int64 t=ffmpeg_get_time_us();
+        ffmpeg_get_video_info(pSrc, &info);
+        bench_add(r, (ffmpeg_get_time_us()-t)*1e-3);
+        r->frames+=(info.width==c->width);
+    }
+    r->sec=(ffmpeg_get_time_us()-t0)*1e-6;
+    ffmpeg_probe_cache_enable(1);
+}
+// random access: seek + one frame, positions from a fixed LCG
+static void bench_seek(BenchResult* r, const char* pSrc, const BenchConfig* c)
+{
+    int64 frameSize=ffmpeg_yuv_compute_frame_size(c->width, c->height, c->pixfmt);
+    uint8* pFrame=(uint8*)malloc(frameSize);
+    unsigned int seed=12345;
+    FILE* fp=ffmpeg_create_reader_ex(pSrc, c->pixfmt, c->width, c->height, c->threads, NULL);
+    int64 t0=ffmpeg_get_time_us();
+    for(int i=0; fp && i<c->seeks; i++)
+    {
+        seed=seed*1664525u+1013904223u;
+        int idx=(int)((seed>>8)%(unsigned int)c->frames);
+        int64 t=ffmpeg_get_time_us();
+        if(!ffmpeg_seek_frame(fp, idx) || ffmpeg_get_frame(fp, pFrame, frameSize)!=frameSize)
+            continue;
+        bench_add(r, (ffmpeg_get_time_us()-t)*1e-3);
+        r->frames++, r->mb+=frameSize/1048576.0;
+    }
+    r->sec=(ffmpeg_get_time_us()-t0)*1e-6;
+    if(fp) ffmpeg_close(fp);
+    free(pFrame);
+}
+int main(int argc, const char* argv[])
+{
+    BenchConfig c={1280, 720, 300, 50, 20, 0, 30, FF_I420, LIBX264, "-preset ultrafast -g 30", ".", NULL};
+    const char* pTests="encode,decode,roundtrip,raw,probe,seek";
+    for(int i=1; i<argc; i+=2)
+    {
+        if(i+1>=argc) argv[i]="";
+        if(strcmp(argv[i], "-s")==0) sscanf(argv[i+1], "%dx%d", &c.width, &c.height);
+        else if(strcmp(argv[i], "-pix_fmt")==0) c.pixfmt=ffmpeg_string2pixfmt(argv[i+1]);
+        else if(strcmp(argv[i], "-frames")==0) c.frames=atoi(argv[i+1]);
+        else if(strcmp(argv[i], "-r")==0) c.fps=atof(argv[i+1]);
+        else if(strcmp(argv[i], "-vcodec")==0) c.pCodec=argv[i+1];
+        else if(strcmp(argv[i], "-param")==0) c.pParam=argv[i+1];
+        else if(strcmp(argv[i], "-threads")==0) c.threads=atoi(argv[i+1]);
+        else if(strcmp(argv[i], "-seeks")==0) c.seeks=atoi(argv[i+1]);
+        else if(strcmp(argv[i], "-probes")==0) c.probes=atoi(argv[i+1]);
+        else if(strcmp(argv[i], "-tests")==0) pTests=argv[i+1];
+        else if(strcmp(argv[i], "-dir")==0) c.pDir=argv[i+1];
+        else if(strcmp(argv[i], "-o")==0) c.pJson=argv[i+1];
+        else
+        {
+            printf("usage: bench [-s 1280x720] [-pix_fmt yuv420p] [-frames 300] [-r 30] [-vcodec libx264] [-param \"-preset ultrafast -g 30\"] [-threads 0]\n"
+                "             [-seeks 50] [-probes 20] [-tests encode,decode,roundtrip,raw,probe,seek] [-dir .] [-o result.json]\n");
+            return -1;
+        }
+    }
+    if(c.pixfmt<=FF_YUV || c.width<=0 || c.height<=0 || c.frames<=0)
+    {
+        printf("bench: bad size, frame number or pix_fmt\n");
+        return -1;
+    }
+    char pVideo[1024], pRaw[1024], pRoundTrip[1024];
+    snprintf(pVideo, sizeof(pVideo), "%s/bench_%dx%d.mp4", c.pDir, c.width, c.height);
+    snprintf(pRoundTrip, sizeof(pRoundTrip), "%s/bench_%dx%d_roundtrip.mp4", c.pDir, c.width, c.height);
+    snprintf(pRaw, sizeof(pRaw), "%s/bench_%dx%d_%g.yuv", c.pDir, c.width, c.height, c.fps);
+    ffmpeg_yuv_set_default_pixfmt(c.pixfmt);
+    BenchResult pResult[8];
+    int num=0;
+    memset(pResult, 0, sizeof(pResult));
+    // the encoded file and the raw file are always written, the tests that are not asked for are just not reported
+    BenchResult rawWrite={"raw_write"}, encode={"encode"};
+    bench_write(&rawWrite, pRaw, &c, 1);
+    bench_write(&encode, pVideo, &c, 0);
+    if(strstr(pTests, "encode")) pResult[num++]=encode;
+    if(strstr(pTests, "raw")) pResult[num++]=rawWrite;
+    if(strstr(pTests, "decode")) pResult[num].pTest="decode", bench_read(&pResult[num++], pVideo, &c, NULL);
+    if(strstr(pTests, "raw")) pResult[num].pTest="raw_read", bench_read(&pResult[num++], pRaw, &c, NULL);
+    if(strstr(pTests, "roundtrip")) pResult[num].pTest="roundtrip", bench_read(&pResult[num++], pVideo, &c, pRoundTrip);
+    if(strstr(pTests, "probe")) pResult[num].pTest="probe", bench_probe(&pResult[num++], pVideo, &c);
+    if(strstr(pTests, "seek")) pResult[num].pTest="seek", bench_seek(&pResult[num++], pVideo, &c);
+    for(int i=0; i<num; i++)
+        printf("%-10s %6d frames  %8.2f fps  %8.2f MB/s\n", pResult[i].pTest, pResult[i].frames, pResult[i].frames/MAX(pResult[i].sec, 1e-9), pResult[i].mb/MAX(pResult[i].sec, 1e-9));
+    FILE* fp=(c.pJson?fopen(c.pJson, "w"):stdout);
+    if(fp)
+    {
+        bench_print(fp, pResult, num, &c);
+        if(fp!=stdout) fclose(fp);
+    }
+    for(int i=0; i<num; i++)
+        free(pResult[i].pLatMs);
+    if(!strstr(pTests, "encode")) free(encode.pLatMs);
+    if(!strstr(pTests, "raw")) free(rawWrite.pLatMs);
+    remove(pRaw); remove(pRoundTrip);
+    return 0;
+}
@@ -6,6 +6,9 @@
 #ifndef __FFMPEG_H__
 #define __FFMPEG_H__
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#   define _GNU_SOURCE  // pipe2/splice/vmsplice/F_SETPIPE_SZ, include ffmpeg.h before other system headers
+#endif
 #ifndef OUT
 #   define OUT
 #   define IN
@@ -14,18 +17,47 @@
 #include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
+#include "math.h"
 #define __USE_LARGEFILE64  1
 #define __LARGE64_FILES
 #include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 
 typedef unsigned char uint8, Byte;
+typedef unsigned short uint16;
 
 #ifdef _WIN32
 #define popen _popen
 #define pclose _pclose
 #define stat64 _stat64
 #define fseek64 _fseeki64
+#define ftell64 _ftelli64
 #define forceinline      __forceinline
+#define FF_THREAD_LOCAL  __declspec(thread)
 typedef           __int64    int64;
 typedef  unsigned __int64    uint64;
 #define IO_NULL "nul"
@@ -39,10 +71,13 @@ typedef  unsigned __int64    uint64;
 #  ifdef __ANDROID__
 #pragma message("__ANDROID__ defined")
 #define fseek64 fseeko
+#define ftell64 ftello
 #  else
 #define fseek64 fseeko64
+#define ftell64 ftello64
 #  endif
 #define forceinline  inline __attribute__((always_inline))
+#define FF_THREAD_LOCAL  __thread
 typedef           long long  int64;
 typedef  unsigned long long  uint64;
 #define IO_R "r"
@@ -59,6 +94,108 @@ typedef  unsigned long long  uint64;
 #endif
 #define BETWEEN(x, xMin, xMax) ((x)<(xMin)?(xMin):((x)>(xMax)?(xMax):(x)))
 
+// thread/mutex/condition helpers
+#ifdef _WIN32
+typedef HANDLE FFThread;
+typedef SRWLOCK FFMutex;
+typedef CONDITION_VARIABLE FFCond;
+#define FF_MUTEX_INITIALIZER SRWLOCK_INIT
+typedef struct { void* (*proc)(void*); void* pArg; } _FFThreadStart;
+static DWORD WINAPI _ffmpeg_thread_entry(LPVOID p)
+{
+    _FFThreadStart start=*(_FFThreadStart*)p;
+    free(p);
+    start.proc(start.pArg);
+    return 0;
+}
+static int ffmpeg_thread_create(FFThread* pThread, void* (*proc)(void*), void* pArg)
+{
+    _FFThreadStart* p=(_FFThreadStart*)malloc(sizeof(_FFThreadStart));
+    p->proc=proc, p->pArg=pArg;
+    *pThread=CreateThread(NULL, 0, _ffmpeg_thread_entry, p, 0, NULL);
+    if(*pThread==NULL) { free(p); return 0; }
+    return 1;
+}
+static forceinline void ffmpeg_thread_join(FFThread thread) { WaitForSingleObject(thread, INFINITE); CloseHandle(thread); }
+static forceinline void ffmpeg_mutex_init(FFMutex* p) { InitializeSRWLock(p); }
+static forceinline void ffmpeg_mutex_destroy(FFMutex* p) { (void)p; }
+static forceinline void ffmpeg_mutex_lock(FFMutex* p) { AcquireSRWLockExclusive(p); }
+static forceinline void ffmpeg_mutex_unlock(FFMutex* p) { ReleaseSRWLockExclusive(p); }
+static forceinline void ffmpeg_cond_init(FFCond* p) { InitializeConditionVariable(p); }
+static forceinline void ffmpeg_cond_destroy(FFCond* p) { (void)p; }
+static forceinline void ffmpeg_cond_wait(FFCond* p, FFMutex* pMutex) { SleepConditionVariableSRW(p, pMutex, INFINITE, 0); }
+static forceinline void ffmpeg_cond_broadcast(FFCond* p) { WakeAllConditionVariable(p); }
+static forceinline int64 ffmpeg_get_time_us()
+{
+    static LARGE_INTEGER freq={0};
+    LARGE_INTEGER t;
+    if(freq.QuadPart==0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (int64)(t.QuadPart*1000000.0/freq.QuadPart);
+}
+#else
+typedef pthread_t FFThread;
+typedef pthread_mutex_t FFMutex;
+typedef pthread_cond_t FFCond;
+#define FF_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+static forceinline int ffmpeg_thread_create(FFThread* pThread, void* (*proc)(void*), void* pArg) { return pthread_create(pThread, NULL, proc, pArg)==0; }
+static forceinline void ffmpeg_thread_join(FFThread thread) { pthread_join(thread, NULL); }
+static forceinline void ffmpeg_mutex_init(FFMutex* p) { pthread_mutex_init(p, NULL); }
+static forceinline void ffmpeg_mutex_destroy(FFMutex* p) { pthread_mutex_destroy(p); }
+static forceinline void ffmpeg_mutex_lock(FFMutex* p) { pthread_mutex_lock(p); }
+static forceinline void ffmpeg_mutex_unlock(FFMutex* p) { pthread_mutex_unlock(p); }
+static forceinline void ffmpeg_cond_init(FFCond* p) { pthread_cond_init(p, NULL); }
+static forceinline void ffmpeg_cond_destroy(FFCond* p) { pthread_cond_destroy(p); }
+static forceinline void ffmpeg_cond_wait(FFCond* p, FFMutex* pMutex) { pthread_cond_wait(p, pMutex); }
+static forceinline void ffmpeg_cond_broadcast(FFCond* p) { pthread_cond_broadcast(p); }
+static forceinline int64 ffmpeg_get_time_us()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64)t.tv_sec*1000000+t.tv_nsec/1000;
+}
+#endif
+static forceinline int ffmpeg_get_cpu_num()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    return (int)MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+}
+// atomics on a long (sequentially consistent), add returns the new value
+#ifdef _WIN32
+static forceinline long ffmpeg_atomic_load(volatile long* p) { return InterlockedCompareExchange(p, 0, 0); }
+static forceinline void ffmpeg_atomic_store(volatile long* p, long v) { InterlockedExchange(p, v); }
+static forceinline long ffmpeg_atomic_add(volatile long* p, long v) { return InterlockedExchangeAdd(p, v)+v; }
+static forceinline int ffmpeg_atomic_cas(volatile long* p, long expected, long desired) { return InterlockedCompareExchange(p, desired, expected)==expected; }
+#else
+static forceinline long ffmpeg_atomic_load(volatile long* p) { return __atomic_load_n(p, __ATOMIC_SEQ_CST); }
+static forceinline void ffmpeg_atomic_store(volatile long* p, long v) { __atomic_store_n(p, v, __ATOMIC_SEQ_CST); }
+static forceinline long ffmpeg_atomic_add(volatile long* p, long v) { return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST); }
+static forceinline int ffmpeg_atomic_cas(volatile long* p, long expected, long desired) { return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+#endif
+// align must be a power of two
+static forceinline void* ffmpeg_aligned_malloc(size_t size, size_t align)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, align);
+#else
+    void* p=NULL;
+    return posix_memalign(&p, MAX(align, sizeof(void*)), size)==0?p:NULL;
+#endif
+}
+static forceinline void ffmpeg_aligned_free(void* p)
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
 #define LIBX264 "libx264"
 #define LIBX265 "libx265"
 
@@ -150,6 +287,22 @@ static int ffmpeg_is_videofile(const char* pName)
     }
     return 0;
 }
+// raw planar/packed frames without header, geometry comes from the file name
+static int ffmpeg_is_rawfile(const char* pName)
+{
+    static const char* ppName[]={".yuv", ".rgb", ".I420", ".I422", ".I444", ".I420P10", ".I422P10", ".I422H10", ".I444P10"};
+    const int num=(int)(sizeof(ppName)/sizeof(*ppName));
+    const char* p = strrchr(pName, '.');
+    if(p)
+    {
+        for(int i=0; i<num; i++)
+        {
+            if(stricmp(p, ppName[i])==0)
+                return 1;
+        }
+    }
+    return !ffmpeg_is_videofile(pName);
+}
 static const char* ffmpeg_pixfmt2string(const FFPixFmt pixfmt)
 {
     static const char* pPixFmt[]={"unknown", "yuv", "yuv420p", "yuv422p", "yuv444p", "yuvj420p", "yuvj422p", "yuvj444p", "yuv420p10le", "yuv422p10le", "yuv444p10le", "bgr48le", "rgb48le", "bgr24", "rgb24", "bgra", "rgba", "abgr", "argb", "gray"};
@@ -178,12 +331,30 @@ static const FFPixFmt ffmpeg_yuv_str2pixfmt(const char* pPixFmt)
 }
 #define ffmpeg_yuv_half_height(pixfmt) ((pixfmt)==FF_I420 || (pixfmt)==FF_I420P10 || (pixfmt)==FF_J420)
 #define ffmpeg_yuv_half_width(pixfmt) ((pixfmt)==FF_I420 || (pixfmt)==FF_I422 || (pixfmt)==FF_I420P10 || (pixfmt)==FF_I422P10 || (pixfmt)==FF_J420 || (pixfmt)==FF_J422)
-static forceinline int ffmpeg_yuv_compute_frame_size(int width, int height, FFPixFmt pixfmt)
+// 64-bit: 16K frames and offsets of frame idx (idx*frameSize) do not fit an int
+static forceinline int64 ffmpeg_yuv_compute_frame_size(int width, int height, FFPixFmt pixfmt)
 {
     int scale=ffmpeg_is_10bit(pixfmt)+1, yshift=ffmpeg_yuv_half_height(pixfmt), xshift=ffmpeg_yuv_half_width(pixfmt);
-    int dataSize=width*height+(height>>yshift)*(width>>xshift)*(ffmpeg_yuv_channel(pixfmt)-1);
+    int64 dataSize=(int64)width*height+(int64)(height>>yshift)*(width>>xshift)*(ffmpeg_yuv_channel(pixfmt)-1);
     return dataSize*scale;
 }
+// plane sizes in bytes, returns the number of planes (packed RGB is a single plane)
+static forceinline int ffmpeg_yuv_plane_size(int width, int height, FFPixFmt pixfmt, OUT int64 pSize[4])
+{
+    int scale=ffmpeg_is_10bit(pixfmt)+1, yshift=ffmpeg_yuv_half_height(pixfmt), xshift=ffmpeg_yuv_half_width(pixfmt), cn=ffmpeg_yuv_channel(pixfmt);
+    pSize[0]=(int64)width*height*scale;
+    pSize[1]=pSize[2]=pSize[3]=(int64)(height>>yshift)*(width>>xshift)*scale;
+    if(ffmpeg_yuv_isRGB(pixfmt))
+        pSize[0]*=cn, cn=1;
+    return cn;
+}
+static forceinline void ffmpeg_yuv_split_planes(uint8* pFrame, int width, int height, FFPixFmt pixfmt, OUT uint8* ppData[4])
+{
+    int64 pSize[4];
+    int cn=ffmpeg_yuv_plane_size(width, height, pixfmt, pSize);
+    for(int i=0; i<4; i++)
+        ppData[i]=(i<cn?pFrame:NULL), pFrame+=(i<cn?pSize[i]:0);
+}
 static forceinline int64 ffmpeg_yuv_get_filesize(const char* pFileName)
 {
     struct stat64 buf;
@@ -196,309 +367,5626 @@ static forceinline int64 ffmpeg_yuv_get_filesize(const char* pFileName)
     return fileSize;
 }
 
-#define ffmpeg_yuv_frame_num(pFileName, width, height, pixfmt) (int)(ffmpeg_yuv_get_filesize(pFileName)/ffmpeg_yuv_compute_frame_size(width, height, pixfmt))
-static FFColSpc _ffmpeg_str2ColorSpace(const char* pName)
+// work-stealing thread pool: every worker owns a deque of tasks fn(pCtx, i), takes from its front and, when it runs dry, steals
+// from the back of the others. a submission is split into runs of consecutive items, one run per deque, so neighbouring items
+// stay on one core. a thread waiting for its group runs queued tasks meanwhile, waiting inside a task (nested fork/join) is fine.
+// ffmpeg_pool_default() is created on first use and shared by the whole process
+typedef struct FFPoolGroup
 {
-    if(strcmp(pName, "bt709")==0) return FF_COL_SPC_BT709;
-    if(strcmp(pName, "bt470bg")==0 || strcmp(pName, "smpte170m")==0) return FF_COL_SPC_BT601;
-    if(strcmp(pName, "bt2020nc")==0 || strcmp(pName, "bt2020c")==0) return FF_COL_SPC_BT2020;
-    if(strcmp(pName, "smpte240m")==0) return FF_COL_SPC_SMPTE240M;
-    return FF_COL_SPC_UNKNOWN;
-}
-static FFColPri _ffmpeg_str2ColorPrims(const char* pName)
+    volatile long pending;  // tasks submitted and not finished yet
+}FFPoolGroup;
+typedef struct _FFPoolTask
 {
-    if(strcmp(pName, "bt709")==0) return FF_COL_PRI_BT709;
-    if(strcmp(pName, "bt470bg")==0) return FF_COL_PRI_BT601PAL;
-    if(strcmp(pName, "smpte170m")==0 || strcmp(pName, "smpte240m")==0) return FF_COL_PRI_BT601NTSC;
-    if(strcmp(pName, "bt2020")==0) return FF_COL_PRI_BT2020;
-    if(strcmp(pName, "bt470m")==0) return FF_COL_PRI_BT470M;
-    return FF_COL_PRI_UNKNOWN;
-}
-static FFColTrc _ffmpeg_str2ColorTrans(const char* pName)
+    void (*fn)(void* pCtx, int i);
+    void* pCtx;
+    int i;
+    FFPoolGroup* pGroup;
+}_FFPoolTask;
+typedef struct FFPool FFPool;
+typedef struct _FFPoolDeque
 {
-    if(strcmp(pName, "bt709")==0) return FF_COL_TRC_BT709;
-    if(strcmp(pName, "smpte170m")==0) return FF_COL_TRC_BT601;
-    if(strcmp(pName, "arib-std-b67")==0) return FF_COL_TRC_HLG;
-    if(strcmp(pName, "smpte2084")==0) return FF_COL_TRC_PQ;
-    if(strcmp(pName, "smpte240m")==0) return FF_COL_TRC_SMPTE240M;
-    return FF_COL_TRC_UNKNOWN;
+    FFPool* pPool;
+    FFMutex mutex;
+    _FFPoolTask* pTask;
+    int head, count, cap;
+}_FFPoolDeque;
+typedef struct FFPoolStat
+{
+    int64 tasks, steals;  // steals: tasks a worker took from the deque of another one
+    int threads;
+}FFPoolStat;
+struct FFPool
+{
+    int threads, dequeNum, next;  // next: deque that gets the first run of the next submission
+    _FFPoolDeque* pDeque;
+    FFThread* pThread;
+    volatile long queued, tasks, steals;
+    int isExit;
+    FFMutex mutex;
+    FFCond cond;  // new tasks, finished groups and exit
+};
+// self<0: a thread that is not a worker of p, it takes from the fronts like an owner
+static int _ffmpeg_pool_take(FFPool* p, int self, OUT _FFPoolTask* t)
+{
+    if(ffmpeg_atomic_load(&p->queued)<=0)
+        return 0;
+    for(int k=0; k<p->dequeNum; k++)
+    {
+        _FFPoolDeque* d=&p->pDeque[(MAX(self, 0)+k)%p->dequeNum];
+        int isSteal=(self>=0 && k>0), isOK=0;
+        ffmpeg_mutex_lock(&d->mutex);
+        if(d->count>0)
+        {
+            *t=d->pTask[isSteal?(d->head+d->count-1)%d->cap:d->head];
+            if(!isSteal) d->head=(d->head+1)%d->cap;
+            d->count--, isOK=1;
+        }
+        ffmpeg_mutex_unlock(&d->mutex);
+        if(isOK)
+        {
+            ffmpeg_atomic_add(&p->queued, -1);
+            if(isSteal) ffmpeg_atomic_add(&p->steals, 1);
+            return 1;
+        }
+    }
+    return 0;
 }
-
-#define FF_COL_SPC_LIST_NAME {"unknown", "bt709", "bt601", "bt2020nc", "smpte240m"}
-#define FF_COL_PRI_LIST_NAME {"unknown", "bt709", "bt470bg", "smpte170m", "bt2020", "bt470m"}
-#define FF_COL_TRC_LIST_NAME {"unknown", "bt709", "smpte170m", "HLG", "PQ", "smpte240m"}
-static const char* ffmpeg_GetColorSpaceName(FFColSpc spc) { const char* ppName[]=FF_COL_SPC_LIST_NAME; return ppName[BETWEEN(spc, FF_COL_SPC_UNKNOWN, FF_COL_SPC_MAX)]; }
-static const char* ffmpeg_GetColorPrimsName(FFColPri pri) { const char* ppName[]=FF_COL_PRI_LIST_NAME; return ppName[BETWEEN(pri, FF_COL_PRI_UNKNOWN, FF_COL_PRI_MAX)]; }
-static const char* ffmpeg_GetColorTransName(FFColTrc trc) { const char* ppName[]=FF_COL_TRC_LIST_NAME; return ppName[BETWEEN(trc, FF_COL_TRC_UNKNOWN, FF_COL_TRC_MAX)]; }
-
-// file name should like this: "xxxx_wxh_fps.fmt.yuv" or "xxxx_wxh_fps.fmt"
-static FFPixFmt _ffmpeg_yuv_split_width_height(const char* pFileName, OUT int* pWidth, OUT int* pHeight, OUT double* pFps, double defFps)
+static void _ffmpeg_pool_run(FFPool* p, _FFPoolTask* t)
 {
-    FFPixFmt fmt0=FF_NONE, fmt1=FF_NONE;
-    int len=(int)strlen(pFileName);
-    int namePos=len-1, extPos=len-1;
-    while(namePos>=0 && pFileName[namePos]!='\\' && pFileName[namePos]!='/')
-        namePos--;
-    namePos++;
-    while(extPos>=namePos && pFileName[extPos]!='.')
-        extPos--;
-    if(pFileName[extPos]=='.' && (fmt0=ffmpeg_yuv_str2pixfmt(pFileName+extPos+1))==FF_YUV)
+    t->fn(t->pCtx, t->i);
+    ffmpeg_atomic_add(&p->tasks, 1);
+    if(ffmpeg_atomic_add(&t->pGroup->pending, -1)==0)
     {
-        int j=extPos-1;
-        while(j>0 && pFileName[j]!='.')
-            j--;
-        if(pFileName[j]=='.'&& (fmt1=ffmpeg_yuv_str2pixfmt(pFileName+j+1))>FF_YUV)
-            fmt0=fmt1;
+        ffmpeg_mutex_lock(&p->mutex);
+        ffmpeg_cond_broadcast(&p->cond);
+        ffmpeg_mutex_unlock(&p->mutex);
     }
-    fmt0=(fmt0<=FF_YUV?ffmpeg_yuv_get_default_pixfmt():fmt0);
-    int i, width=0, height=0;
-    double fps=0;
-    for(i=extPos-1; i>namePos; i--)
+}
+static void* _ffmpeg_pool_proc(void* pArg)
+{
+    _FFPoolDeque* d=(_FFPoolDeque*)pArg;
+    FFPool* p=d->pPool;
+    int self=(int)(d-p->pDeque), isExit=0;
+    _FFPoolTask t;
+    while(!isExit)
     {
-        if((pFileName[i]=='x' || pFileName[i]=='X') && (IS_NUMBER(pFileName[i-1]) && IS_NUMBER(pFileName[i+1])))
+        if(_ffmpeg_pool_take(p, self, &t))
         {
-            int j=i-1, k, radix=1;
-            for(j=i-1, width=0; j>=namePos && IS_NUMBER(pFileName[j]); j--, radix*=10)
-                width=radix*(pFileName[j]-'0')+width;
-            for(k=i+1, height=0; k<extPos && IS_NUMBER(pFileName[k]); k++)
-                height=10*height+(pFileName[k]-'0');
-            if(k<extPos && IS_NUMBER(pFileName[k+1]))
-                fps=atof(pFileName+k+1);
-            break;
+            _ffmpeg_pool_run(p, &t);
+            continue;
         }
+        ffmpeg_mutex_lock(&p->mutex);
+        while(ffmpeg_atomic_load(&p->queued)<=0 && !p->isExit)
+            ffmpeg_cond_wait(&p->cond, &p->mutex);
+        isExit=(p->isExit && ffmpeg_atomic_load(&p->queued)<=0);
+        ffmpeg_mutex_unlock(&p->mutex);
     }
-    if(pWidth) *pWidth=width;
-    if(pHeight) *pHeight=height;
-    if(pFps) *pFps=(fps<=0?defFps:fps);
-    return fmt0;
+    return NULL;
 }
-static forceinline FFPixFmt ffmpeg_yuv_split_width_height(const char* pFileName, OUT int* pWidth, OUT int* pHeight, OUT double* pFps)
+// runs the tasks still queued, then stops the workers
+static void ffmpeg_pool_close(FFPool* p)
 {
-    return _ffmpeg_yuv_split_width_height(pFileName, pWidth, pHeight, pFps, 25);
+    if(p==0)
+        return;
+    ffmpeg_mutex_lock(&p->mutex);
+    p->isExit=1;
+    ffmpeg_cond_broadcast(&p->cond);
+    ffmpeg_mutex_unlock(&p->mutex);
+    for(int i=0; i<p->threads; i++)
+        ffmpeg_thread_join(p->pThread[i]);
+    for(int i=0; i<p->dequeNum; i++)
+        ffmpeg_mutex_destroy(&p->pDeque[i].mutex), free(p->pDeque[i].pTask);
+    ffmpeg_cond_destroy(&p->cond), ffmpeg_mutex_destroy(&p->mutex);
+    free(p->pDeque), free(p->pThread), free(p);
 }
-// ffmpeg_yuv_set_default_pixfmt() before ffmpeg_video_info() if pName is xxx_wxh_fps.yuv
-static FFInfo* ffmpeg_get_video_info(const char* pName, OUT FFInfo* pInfo)
+// threads: worker threads, <0: one less than the cores (the thread that waits is the last one). 0 is valid: waiters run everything
+static FFPool* ffmpeg_pool_create(int threads)
 {
-    static FFInfo info;
-    if(pInfo==0) pInfo=&info;
-    memset(pInfo, 0, sizeof(FFInfo));
-    if(ffmpeg_is_videofile(pName))
+    FFPool* p=(FFPool*)calloc(1, sizeof(FFPool));
+    threads=(threads<0?ffmpeg_get_cpu_num()-1:threads);
+    p->dequeNum=MAX(1, threads);
+    p->pDeque=(_FFPoolDeque*)calloc(p->dequeNum, sizeof(_FFPoolDeque)), p->pThread=(FFThread*)calloc(MAX(1, threads), sizeof(FFThread));
+    ffmpeg_mutex_init(&p->mutex), ffmpeg_cond_init(&p->cond);
+    for(int i=0; i<p->dequeNum; i++)
+        p->pDeque[i].pPool=p, ffmpeg_mutex_init(&p->pDeque[i].mutex);
+    for(int i=0; i<threads; i++)
+        p->threads+=ffmpeg_thread_create(&p->pThread[p->threads], _ffmpeg_pool_proc, &p->pDeque[p->threads]);
+    return p;
+}
+static FFPool* ffmpeg_pool_default()
+{
+    static FFPool* p=0;
+    static FFMutex mutex=FF_MUTEX_INITIALIZER;
+    ffmpeg_mutex_lock(&mutex);
+    if(p==0) p=ffmpeg_pool_create(-1);
+    ffmpeg_mutex_unlock(&mutex);
+    return p;
+}
+// queues fn(pCtx, first..first+num-1) in group g (zeroed before its first use), returns at once
+static void ffmpeg_pool_submit(FFPool* p, FFPoolGroup* g, void (*fn)(void* pCtx, int i), void* pCtx, int first, int num)
+{
+    if(num<=0)
+        return;
+    int run=(num+p->dequeNum-1)/p->dequeNum, start;
+    ffmpeg_atomic_add(&g->pending, num), ffmpeg_atomic_add(&p->queued, num);
+    ffmpeg_mutex_lock(&p->mutex);
+    start=p->next, p->next=(p->next+1)%p->dequeNum;
+    ffmpeg_mutex_unlock(&p->mutex);
+    for(int k=0; k*run<num; k++)
     {
-        char pPixfmt[32]={0}, pCodec[128]={0};
-        int cmdLen=1024, textLen=128*1024, len=cmdLen+textLen;
-        char *pText=(char*)malloc(len);
-        memset(pText, 0, len);
-        char* pCmd=pText+textLen;
-        sprintf(pCmd, "%s -i \"%s\" 2>&1", FFMPEG_BIN, pName);
-        FILE *fp=popen(pCmd, "r");
-        int isFindVideo=0, isFindAudio=0, limit=1;
-        double fps=-1, tbr=-1, tbn=-1, tbc=-1;
-        if(fp)
+        _FFPoolDeque* d=&p->pDeque[(start+k)%p->dequeNum];
+        int n=MIN(run, num-k*run);
+        ffmpeg_mutex_lock(&d->mutex);
+        if(d->count+n>d->cap)
         {
-            const char* p=0;
-            int isFindVideo=0;
-            //Printf_DEBUG(TEXT_COLOR_YELLOW, "%s\n", pCmd);
-            while(fgets(pText, textLen, fp))
-            {
-                //Printf_DEBUG(TEXT_COLOR_YELLOW, pText);
-                if(isFindVideo==0 && strncmp(pText, "  Duration: ", strlen("  Duration: "))==0)
-                {
-                    //Printf_DEBUG(TEXT_COLOR_WHITE, pText);
-                    int h, m, s, ms;
-                    if(sscanf(pText, "  Duration: %d:%d:%d.%d", &h, &m, &s, &ms)==4)
-                        pInfo->sec=h*3600+m*60+s+ms/100.0;
-                    if((p=strstr(pText, "bitrate: ")))
-                        pInfo->total_bitrate=(float)atof(p+strlen("bitrate: "));
-                        //sscanf(p, "bitrate: %d kb/s", &pInfo->total_bitrate);
-                }
-                if(sscanf(pText, "  Stream #%*[^ ] Video: %127[^,], %30[0-9a-zA-Z]", pCodec, pPixfmt)==2)
-                {
-                    isFindVideo=1;
-                    //Printf_DEBUG(TEXT_COLOR_MAGENTA, pText);
-                    if(sscanf(pCodec, "%15[0-9a-zA-Z]", pInfo->pCodec)<1)
-                        strcpy(pInfo->pCodec, "unknown");
-                    pInfo->pixfmt=ffmpeg_string2pixfmt(pPixfmt);
-                    p=strstr(pText, pPixfmt)+strlen(pPixfmt);
-                    if(p[0]=='(')
-                    {
-                        char pRange[16]={0}, pColorSpace[16]={0}, pColorPrims[16]={0}, pColorTrans[16]={0};
-                        int nRet=0;
-                        if((nRet=sscanf(p+1, "%15[0-9a-zA-Z], %15[0-9a-zA-Z]/%15[0-9a-zA-Z]/%15[-0-9a-zA-Z]", pRange, pColorSpace, pColorPrims, pColorTrans))<4)
-                        {
-                            if(_ffmpeg_str2ColorSpace(pRange)>FF_COL_SPC_UNKNOWN && _ffmpeg_str2ColorSpace(pColorSpace)==FF_COL_SPC_UNKNOWN)
-                                strcpy(pColorSpace, pRange);
-                            if(nRet<=2) { strcpy(pColorPrims, pColorSpace); strcpy(pColorTrans, pColorSpace); }
-                        }
-                        pInfo->col_spc=_ffmpeg_str2ColorSpace(pColorSpace);
-                        pInfo->col_pri=_ffmpeg_str2ColorPrims(pColorPrims);
-                        pInfo->col_trc=_ffmpeg_str2ColorTrans(pColorTrans);
-                        p=strstr(p, ")")+1;
-                    }
-                    if(sscanf(p+1, "%dx%d", &pInfo->width, &pInfo->height)<2)
-                        pInfo->width=pInfo->height=0;
-                    double fps=0, tbr=0, tbn=0;
-                    if(NULL!=(p=strstr(pText, " fps"))) { while(p>pText && p[-1]!=' ') p--; fps=atof(p); }
-                    if(NULL!=(p=strstr(pText, " tbr"))) { while(p>pText && p[-1]!=' ') p--; tbr=atof(p); }
-                    if(NULL!=(p=strstr(pText, " tbn"))) { while(p>pText && p[-1]!=' ') p--; tbn=atof(p); }
-                    if(fps>0 && tbr>0)
-                        pInfo->fps=(0.5<=fps/tbr && fps/tbr<=2?tbr:fps);
-                    else
-                        pInfo->fps=(tbr>0?tbr:fps);
-                    if(NULL!=(p=strstr(pText, " kb/s"))) { while(p>pText && p[-1]!=' ') p--; pInfo->video_bitrate=(float)atof(p); }
-                    pInfo->frame_num=(int)(pInfo->fps*pInfo->sec+0.5);
-                    break;
-                }
-            }
-            fclose(fp);
+            // unwrap into a larger ring
+            int cap=MAX(64, (d->count+n)*2);
+            _FFPoolTask* pTask=(_FFPoolTask*)malloc(sizeof(_FFPoolTask)*cap);
+            for(int j=0; j<d->count; j++) pTask[j]=d->pTask[(d->head+j)%d->cap];
+            free(d->pTask), d->pTask=pTask, d->cap=cap, d->head=0;
         }
-        free(pText);
-    }
-    else
-    {
-        int64 filesize=ffmpeg_yuv_get_filesize(pName);
-        pInfo->pixfmt=ffmpeg_yuv_split_width_height(pName, &pInfo->width, &pInfo->height, &pInfo->fps);
-        int framesize=ffmpeg_yuv_compute_frame_size(pInfo->width, pInfo->height, pInfo->pixfmt);
-        pInfo->frame_num=(int)(filesize/MAX(1, framesize));
-        pInfo->sec=pInfo->frame_num/pInfo->fps;
-        pInfo->video_bitrate=pInfo->total_bitrate=(float)((double)filesize*8e-3/MAX(1e-4, pInfo->sec));
-        strcpy(pInfo->pCodec, "rawvideo");
+        for(int j=0; j<n; j++)
+        {
+            _FFPoolTask* t=&d->pTask[(d->head+d->count++)%d->cap];
+            t->fn=fn, t->pCtx=pCtx, t->i=first+k*run+j, t->pGroup=g;
+        }
+        ffmpeg_mutex_unlock(&d->mutex);
     }
-    return pInfo;
+    ffmpeg_mutex_lock(&p->mutex);
+    ffmpeg_cond_broadcast(&p->cond);
+    ffmpeg_mutex_unlock(&p->mutex);
 }
-static forceinline int ffmpeg_yuv_had_fps(const char* pName)
+static forceinline int ffmpeg_pool_is_done(FFPoolGroup* g)
 {
-    if(!ffmpeg_is_videofile(pName))
-    {
-        double fps=0;
-        _ffmpeg_yuv_split_width_height(pName, 0, 0, &fps, -1);
-        return (fps>0);
-    }
-    return 1;
+    return ffmpeg_atomic_load(&g->pending)<=0;
 }
-static FILE* ffmpeg_create_reader_full(const char* pName, FFPixFmt pixfmt, int width, int height, int idxFrame, int threads, const char* pFFmpeg, const char* pParam)
+// returns once every task of g has finished, runs queued tasks (of any group) while it waits
+static void ffmpeg_pool_wait(FFPool* p, FFPoolGroup* g)
 {
-    FILE *fp=0;
-    char pCmd[1024], pSrcInfo[128]="", pSS[32]="", pThread[32]="";
-    int isVideo=ffmpeg_is_videofile(pName);
-    pFFmpeg=(pFFmpeg==0?FFMPEG_BIN:pFFmpeg);
-    pParam=(pParam==0?"":pParam);
-    if(pixfmt<=FF_YUV || width<=0 || height<=0 || !isVideo || idxFrame>0)
+    _FFPoolTask t;
+    while(ffmpeg_atomic_load(&g->pending)>0)
     {
-        FFInfo info;
-        ffmpeg_get_video_info(pName, &info);
-        if(pixfmt<=FF_YUV)
-            pixfmt=info.pixfmt;
-        if(width<=0 || height<=0)
-            width=info.width, height=info.height;
-        if(!isVideo)
-            sprintf(pSrcInfo, "-s %dx%d -pix_fmt %s -f rawvideo -r %g", info.width, info.height, ffmpeg_pixfmt2string(info.pixfmt), info.fps);
-        if(idxFrame>0)
-            sprintf(pSS, "-ss %.6f", (idxFrame-0.5)/info.fps);
+        if(_ffmpeg_pool_take(p, -1, &t))
+        {
+            _ffmpeg_pool_run(p, &t);
+            continue;
+        }
+        ffmpeg_mutex_lock(&p->mutex);
+        while(ffmpeg_atomic_load(&g->pending)>0 && ffmpeg_atomic_load(&p->queued)<=0)
+            ffmpeg_cond_wait(&p->cond, &p->mutex);
+        ffmpeg_mutex_unlock(&p->mutex);
     }
-    if(threads>0) sprintf(pThread, "-threads %d", threads);
-    //if(threads<=0) threads=2;
-    int n=sprintf(pCmd, "%s %s %s %s -i \"%s\" -loglevel error -f image2pipe -pix_fmt %s -vcodec rawvideo -s %dx%d -sws_flags bicubic %s - ", pFFmpeg, pSS, pSrcInfo, pThread, pName, ffmpeg_pixfmt2string(pixfmt), width, height, pParam);
-    n+=sprintf(pCmd+n, " 2>" IO_NULL);
-    // Printf_DEBUG(TEXT_COLOR_BLUE, "%s\n", pCmd);
-    fp=popen(pCmd, IO_R);
-    return fp;
 }
-static forceinline FILE* ffmpeg_create_reader_ex(const char* pName, FFPixFmt pixfmt, int width, int height, int threads, const char* pFFmpeg)
+static FFPoolStat ffmpeg_pool_get_stat(FFPool* p)
 {
-    return ffmpeg_create_reader_full(pName, pixfmt, width, height, 0, threads, pFFmpeg, NULL);
+    FFPoolStat stat;
+    stat.tasks=ffmpeg_atomic_load(&p->tasks), stat.steals=ffmpeg_atomic_load(&p->steals), stat.threads=p->threads;
+    return stat;
 }
-static forceinline FILE* ffmpeg_create_reader(const char* pName, FFPixFmt pixfmt)
+
+// fork/join over num items on up to 'threads' threads (<=0: all cores), fn(pCtx, i) for every i. runs on the shared pool:
+// MIN(threads, num) runner tasks pull the items in order, the calling thread is one of them
+typedef struct _FFParallel
 {
-    return ffmpeg_create_reader_ex(pName, pixfmt, 0, 0, 0, NULL);
+    void (*fn)(void* pCtx, int i);
+    void* pCtx;
+    int num;
+    volatile long next;
+}_FFParallel;
+static void _ffmpeg_parallel_task(void* pArg, int k)
+{
+    _FFParallel* p=(_FFParallel*)pArg;
+    (void)k;
+    for(long i; (i=ffmpeg_atomic_add(&p->next, 1)-1)<p->num; )
+        p->fn(p->pCtx, (int)i);
 }
-static int ffmpeg_get_frame(FILE* fp, void* pData, int dataSize)
+static void _ffmpeg_parallel_for(int num, void (*fn)(void* pCtx, int i), void* pCtx, int threads)
 {
-    return (int)fread(pData, 1, dataSize, fp);
+    _FFParallel par={fn, pCtx, num, 0};
+    FFPoolGroup group={0};
+    threads=MIN(threads<=0?ffmpeg_get_cpu_num():threads, num);
+    if(threads<=1)
+    {
+        _ffmpeg_parallel_task(&par, 0);
+        return;
+    }
+    FFPool* pPool=ffmpeg_pool_default();
+    ffmpeg_pool_submit(pPool, &group, _ffmpeg_parallel_task, &par, 0, threads);
+    ffmpeg_pool_wait(pPool, &group);
 }
-static int ffmpeg_get_frame2(FILE* fp, void* pY, int ySize, void* pU, int uSize, void* pV, int vSize)
+
+// SIMD kernels with runtime CPU dispatch, every kernel is bit-exact with its C version
+typedef enum FFIsa
 {
-    int y=(int)fread(pY, 1, ySize, fp), u=(int)fread(pU, 1, uSize, fp), v=(int)fread(pV, 1, vSize, fp);
-    return y+u+v;
+    FF_ISA_AUTO=-1, FF_ISA_C, FF_ISA_SSE4, FF_ISA_AVX2, FF_ISA_AVX512
+}FFIsa;
+typedef struct FFSimdKernel
+{
+    FFIsa isa;
+    void (*pfnLoad8)(const uint8* pSrc, uint16* pDst, int n);                          // dst=src<<8
+    void (*pfnStore8)(const uint16* pSrc, uint8* pDst, int n);                         // dst=min((src+128)>>8, 255)
+    void (*pfnMat3)(uint16* p0, uint16* p1, uint16* p2, int n, const int pCoef[12]);  // p=clip((C*p+o)>>12), C: Q12 3x3, o: pCoef[9..11]
+    void (*pfnVFilter)(const uint16* const* ppRow, const short* pCoef, int taps, uint16* pDst, int n);  // dst=min((sum(coef*row)+8192)>>14, 65535), coef: Q14>=0
+    void (*pfnHFilter)(const uint16* pSrc, const int* pFirst, const short* pCoef, int stride, uint16* pDst, int n);  // same along a row from pSrc+pFirst[i], stride%8==0
+    int64 (*pfnSse)(const uint8* pA, const uint8* pB, int n, int is16);  // sum((a-b)^2) of n 8-bit (or 16-bit, values<=1023) samples
+    void (*pfnSsim4x4)(const uint8* pA, int strideA, const uint8* pB, int strideB, int is16, int blocks, int (*pSum)[4]);  // per 4x4 block: sum a, sum b, sum a^2+b^2, sum ab
+    void (*pfnSum8x8)(const uint8* p, int stride, int is16, int blocks, int* pSum);  // sum of every 8x8 block of a row of blocks
+}FFSimdKernel;
+static void _ffmpeg_load8_c(const uint8* pSrc, uint16* pDst, int n)
+{
+    for(int i=0; i<n; i++) pDst[i]=(uint16)(pSrc[i]<<8);
 }
-static int ffmpeg_get_frame3(FILE* fp, uint8* ppData[4], FFPixFmt pixfmt, int width, int height)
+static void _ffmpeg_store8_c(const uint16* pSrc, uint8* pDst, int n)
 {
-    int scale=ffmpeg_is_10bit(pixfmt)+1, yshift=ffmpeg_yuv_half_height(pixfmt), xshift=ffmpeg_yuv_half_width(pixfmt), nSize=0;
-    int pSize[4]={width*height, (height>>yshift)*(width>>xshift), (height>>yshift)*(width>>xshift), (height>>yshift)*(width>>xshift)}, cn=ffmpeg_yuv_channel(pixfmt);
-    if(ffmpeg_yuv_isRGB(pixfmt))
-        pSize[0]=width*height*cn, cn=1;
+    for(int i=0; i<n; i++) pDst[i]=(uint8)MIN((pSrc[i]+128)>>8, 255);
+}
+static void _ffmpeg_mat3_c(uint16* p0, uint16* p1, uint16* p2, int n, const int* c)
+{
+    for(int i=0; i<n; i++)
+    {
+        int a=p0[i], b=p1[i], d=p2[i];
+        int r0=(c[0]*a+c[1]*b+c[2]*d+c[9])>>12, r1=(c[3]*a+c[4]*b+c[5]*d+c[10])>>12, r2=(c[6]*a+c[7]*b+c[8]*d+c[11])>>12;
+        p0[i]=(uint16)BETWEEN(r0, 0, 65535), p1[i]=(uint16)BETWEEN(r1, 0, 65535), p2[i]=(uint16)BETWEEN(r2, 0, 65535);
+    }
+}
+static void _ffmpeg_vfilter_c(const uint16* const* ppRow, const short* pCoef, int taps, uint16* pDst, int n)
+{
+    for(int i=0; i<n; i++)
+    {
+        int sum=8192;
+        for(int k=0; k<taps; k++) sum+=pCoef[k]*ppRow[k][i];
+        pDst[i]=(uint16)MIN(sum>>14, 65535);
+    }
+}
+static void _ffmpeg_hfilter_c(const uint16* pSrc, const int* pFirst, const short* pCoef, int stride, uint16* pDst, int n)
+{
+    for(int i=0; i<n; i++)
+    {
+        const uint16* p=pSrc+pFirst[i];
+        const short* c=pCoef+(size_t)i*stride;
+        int sum=8192;
+        for(int k=0; k<stride; k++) sum+=c[k]*p[k];
+        pDst[i]=(uint16)MIN(sum>>14, 65535);
+    }
+}
+static int64 _ffmpeg_sse_c(const uint8* pA, const uint8* pB, int n, int is16)
+{
+    int64 sum=0;
+    if(is16) for(int i=0; i<n; i++) { int d=((const uint16*)pA)[i]-((const uint16*)pB)[i]; sum+=d*d; }
+    else for(int i=0; i<n; i++) { int d=pA[i]-pB[i]; sum+=d*d; }
+    return sum;
+}
+static void _ffmpeg_ssim4x4_c(const uint8* pA, int strideA, const uint8* pB, int strideB, int is16, int blocks, int (*pSum)[4])
+{
+    for(int i=0; i<blocks; i++)
+    {
+        int s1=0, s2=0, ss=0, s12=0;
+        for(int y=0; y<4; y++)
+        {
+            for(int x=i*4; x<i*4+4; x++)
+            {
+                int a=(is16?((const uint16*)(pA+(size_t)y*strideA))[x]:pA[(size_t)y*strideA+x]);
+                int b=(is16?((const uint16*)(pB+(size_t)y*strideB))[x]:pB[(size_t)y*strideB+x]);
+                s1+=a, s2+=b, ss+=a*a+b*b, s12+=a*b;
+            }
+        }
+        pSum[i][0]=s1, pSum[i][1]=s2, pSum[i][2]=ss, pSum[i][3]=s12;
+    }
+}
+static void _ffmpeg_sum8x8_c(const uint8* p, int stride, int is16, int blocks, int* pSum)
+{
+    for(int i=0; i<blocks; i++)
+    {
+        int sum=0;
+        for(int y=0; y<8; y++)
+            for(int x=i*8; x<i*8+8; x++)
+                sum+=(is16?((const uint16*)(p+(size_t)y*stride))[x]:p[(size_t)y*stride+x]);
+        pSum[i]=sum;
+    }
+}
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FF_HAVE_X86_SIMD 1
+#define FF_TARGET(isa) __attribute__((target(isa)))
+FF_TARGET("sse4.1") static void _ffmpeg_load8_sse4(const uint8* pSrc, uint16* pDst, int n)
+{
+    int i=0;
+    for(; i+16<=n; i+=16)
+    {
+        __m128i x=_mm_loadu_si128((const __m128i*)(pSrc+i)), z=_mm_setzero_si128();
+        _mm_storeu_si128((__m128i*)(pDst+i), _mm_unpacklo_epi8(z, x));
+        _mm_storeu_si128((__m128i*)(pDst+i+8), _mm_unpackhi_epi8(z, x));
+    }
+    _ffmpeg_load8_c(pSrc+i, pDst+i, n-i);
+}
+FF_TARGET("sse4.1") static void _ffmpeg_store8_sse4(const uint16* pSrc, uint8* pDst, int n)
+{
+    int i=0;
+    const __m128i r=_mm_set1_epi16(128);
+    for(; i+16<=n; i+=16)
+    {
+        __m128i a=_mm_srli_epi16(_mm_adds_epu16(_mm_loadu_si128((const __m128i*)(pSrc+i)), r), 8);
+        __m128i b=_mm_srli_epi16(_mm_adds_epu16(_mm_loadu_si128((const __m128i*)(pSrc+i+8)), r), 8);
+        _mm_storeu_si128((__m128i*)(pDst+i), _mm_packus_epi16(a, b));
+    }
+    _ffmpeg_store8_c(pSrc+i, pDst+i, n-i);
+}
+FF_TARGET("sse4.1") static void _ffmpeg_mat3_sse4(uint16* p0, uint16* p1, uint16* p2, int n, const int* c)
+{
+    int i=0;
+    __m128i k[12];
+    for(int j=0; j<12; j++) k[j]=_mm_set1_epi32(c[j]);
+    for(; i+4<=n; i+=4)
+    {
+        __m128i a=_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(p0+i)));
+        __m128i b=_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(p1+i)));
+        __m128i d=_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(p2+i)));
+        __m128i r[3];
+        for(int j=0; j<3; j++)
+        {
+            r[j]=_mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(a, k[j*3]), _mm_mullo_epi32(b, k[j*3+1])), _mm_add_epi32(_mm_mullo_epi32(d, k[j*3+2]), k[9+j]));
+            r[j]=_mm_packus_epi32(_mm_srai_epi32(r[j], 12), _mm_setzero_si128());
+        }
+        _mm_storel_epi64((__m128i*)(p0+i), r[0]); _mm_storel_epi64((__m128i*)(p1+i), r[1]); _mm_storel_epi64((__m128i*)(p2+i), r[2]);
+    }
+    _ffmpeg_mat3_c(p0+i, p1+i, p2+i, n-i, c);
+}
+FF_TARGET("sse4.1") static void _ffmpeg_vfilter_sse4(const uint16* const* ppRow, const short* pCoef, int taps, uint16* pDst, int n)
+{
+    int i=0;
+    for(; i+8<=n; i+=8)
+    {
+        __m128i lo=_mm_set1_epi32(8192), hi=lo;
+        for(int k=0; k<taps; k++)
+        {
+            __m128i x=_mm_loadu_si128((const __m128i*)(ppRow[k]+i)), c=_mm_set1_epi32(pCoef[k]);
+            lo=_mm_add_epi32(lo, _mm_mullo_epi32(_mm_cvtepu16_epi32(x), c));
+            hi=_mm_add_epi32(hi, _mm_mullo_epi32(_mm_cvtepu16_epi32(_mm_srli_si128(x, 8)), c));
+        }
+        _mm_storeu_si128((__m128i*)(pDst+i), _mm_packus_epi32(_mm_srli_epi32(lo, 14), _mm_srli_epi32(hi, 14)));
+    }
+    const uint16* ppTail[64];
+    for(int k=0; k<taps && i<n; k++) ppTail[k]=ppRow[k]+i;
+    if(i<n) _ffmpeg_vfilter_c(ppTail, pCoef, taps, pDst+i, n-i);
+}
+// samples are biased to int16 (x-32768) for pmaddwd, the bias comes back as 32768*sum(coef)=1<<29
+FF_TARGET("sse4.1") static void _ffmpeg_hfilter_sse4(const uint16* pSrc, const int* pFirst, const short* pCoef, int stride, uint16* pDst, int n)
+{
+    int i=0;
+    const __m128i bias=_mm_set1_epi16(-32768), round=_mm_set1_epi32((1<<29)+8192);
+    for(; i+4<=n; i+=4)
+    {
+        __m128i v[4]={_mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128()};
+        for(int k=0; k<stride; k+=8)
+        {
+            for(int j=0; j<4; j++)
+            {
+                const uint16* p=pSrc+pFirst[i+j]+k;
+                const short* c=pCoef+(size_t)(i+j)*stride+k;
+                v[j]=_mm_add_epi32(v[j], _mm_madd_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i*)p), bias), _mm_loadu_si128((const __m128i*)c)));
+            }
+        }
+        __m128i s=_mm_add_epi32(_mm_hadd_epi32(_mm_hadd_epi32(v[0], v[1]), _mm_hadd_epi32(v[2], v[3])), round);
+        s=_mm_srli_epi32(s, 14);
+        _mm_storel_epi64((__m128i*)(pDst+i), _mm_packus_epi32(s, s));
+    }
+    _ffmpeg_hfilter_c(pSrc, pFirst+i, pCoef+(size_t)i*stride, stride, pDst+i, n-i);
+}
+FF_TARGET("sse4.1") static int64 _ffmpeg_sse_sse4(const uint8* pA, const uint8* pB, int n, int is16)
+{
+    int64 sum=0;
+    int i=0;
+    while(i+8<=n)
+    {
+        // 32-bit lanes hold at most 256 iterations of 2*1023^2
+        __m128i acc=_mm_setzero_si128();
+        for(int k=0; k<256 && i+8<=n; k++, i+=8)
+        {
+            __m128i a=(is16?_mm_loadu_si128((const __m128i*)(pA+i*2)):_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(pA+i))));
+            __m128i b=(is16?_mm_loadu_si128((const __m128i*)(pB+i*2)):_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(pB+i))));
+            __m128i d=_mm_sub_epi16(a, b);
+            acc=_mm_add_epi32(acc, _mm_madd_epi16(d, d));
+        }
+        acc=_mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+        acc=_mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+        sum+=(unsigned)_mm_cvtsi128_si32(acc);
+    }
+    return sum+_ffmpeg_sse_c(pA+i*(is16+1), pB+i*(is16+1), n-i, is16);
+}
+FF_TARGET("sse4.1") static void _ffmpeg_ssim4x4_sse4(const uint8* pA, int strideA, const uint8* pB, int strideB, int is16, int blocks, int (*pSum)[4])
+{
+    int i=0;
+    const __m128i one=_mm_set1_epi16(1);
+    for(; i+2<=blocks; i+=2)
+    {
+        __m128i s1=_mm_setzero_si128(), s2=s1, ss=s1, s12=s1;
+        for(int y=0; y<4; y++)
+        {
+            const uint8 *a8=pA+(size_t)y*strideA, *b8=pB+(size_t)y*strideB;
+            __m128i a=(is16?_mm_loadu_si128((const __m128i*)(a8+i*8)):_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(a8+i*4))));
+            __m128i b=(is16?_mm_loadu_si128((const __m128i*)(b8+i*8)):_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(b8+i*4))));
+            s1=_mm_add_epi32(s1, _mm_madd_epi16(a, one)), s2=_mm_add_epi32(s2, _mm_madd_epi16(b, one));
+            ss=_mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(a, a), _mm_madd_epi16(b, b))), s12=_mm_add_epi32(s12, _mm_madd_epi16(a, b));
+        }
+        // pairs -> blocks: x=[s1 b0, s1 b1, s2 b0, s2 b1], y=[ss b0, ss b1, s12 b0, s12 b1]
+        __m128i x=_mm_shuffle_epi32(_mm_hadd_epi32(s1, s2), 0xd8), y=_mm_shuffle_epi32(_mm_hadd_epi32(ss, s12), 0xd8);
+        _mm_storeu_si128((__m128i*)pSum[i], _mm_unpacklo_epi64(x, y));
+        _mm_storeu_si128((__m128i*)pSum[i+1], _mm_unpackhi_epi64(x, y));
+    }
+    _ffmpeg_ssim4x4_c(pA+i*4*(is16+1), strideA, pB+i*4*(is16+1), strideB, is16, blocks-i, pSum+i);
+}
+FF_TARGET("sse4.1") static void _ffmpeg_sum8x8_sse4(const uint8* p, int stride, int is16, int blocks, int* pSum)
+{
+    int i=0;
+    const __m128i one=_mm_set1_epi16(1), zero=_mm_setzero_si128();
+    for(; i+2<=blocks; i+=2)
+    {
+        __m128i s0=zero, s1=zero;
+        for(int y=0; y<8; y++)
+        {
+            const uint8* r=p+(size_t)y*stride;
+            if(is16) s0=_mm_add_epi32(s0, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(r+i*16)), one)), s1=_mm_add_epi32(s1, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(r+i*16+16)), one));
+            else s0=_mm_add_epi64(s0, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(r+i*8)), zero));
+        }
+        // 8-bit: one sum per 64-bit half, 10-bit: 4 partial sums per block
+        s0=(is16?_mm_hadd_epi32(_mm_hadd_epi32(s0, s1), s0):_mm_shuffle_epi32(s0, 0x08));
+        _mm_storel_epi64((__m128i*)(pSum+i), s0);
+    }
+    _ffmpeg_sum8x8_c(p+i*8*(is16+1), stride, is16, blocks-i, pSum+i);
+}
+FF_TARGET("avx2") static void _ffmpeg_load8_avx2(const uint8* pSrc, uint16* pDst, int n)
+{
+    int i=0;
+    for(; i+16<=n; i+=16)
+        _mm256_storeu_si256((__m256i*)(pDst+i), _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pSrc+i))), 8));
+    _ffmpeg_load8_c(pSrc+i, pDst+i, n-i);
+}
+FF_TARGET("avx2") static void _ffmpeg_store8_avx2(const uint16* pSrc, uint8* pDst, int n)
+{
+    int i=0;
+    const __m256i r=_mm256_set1_epi16(128);
+    for(; i+16<=n; i+=16)
+    {
+        __m256i a=_mm256_srli_epi16(_mm256_adds_epu16(_mm256_loadu_si256((const __m256i*)(pSrc+i)), r), 8);
+        _mm_storeu_si128((__m128i*)(pDst+i), _mm_packus_epi16(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1)));
+    }
+    _ffmpeg_store8_c(pSrc+i, pDst+i, n-i);
+}
+FF_TARGET("avx2") static void _ffmpeg_mat3_avx2(uint16* p0, uint16* p1, uint16* p2, int n, const int* c)
+{
+    int i=0;
+    __m256i k[12];
+    for(int j=0; j<12; j++) k[j]=_mm256_set1_epi32(c[j]);
+    for(; i+8<=n; i+=8)
+    {
+        __m256i a=_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(p0+i)));
+        __m256i b=_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(p1+i)));
+        __m256i d=_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(p2+i)));
+        uint16* pp[3]={p0, p1, p2};
+        for(int j=0; j<3; j++)
+        {
+            __m256i x=_mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(a, k[j*3]), _mm256_mullo_epi32(b, k[j*3+1])), _mm256_add_epi32(_mm256_mullo_epi32(d, k[j*3+2]), k[9+j]));
+            x=_mm256_srai_epi32(x, 12);
+            _mm_storeu_si128((__m128i*)(pp[j]+i), _mm_packus_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1)));
+        }
+    }
+    _ffmpeg_mat3_c(p0+i, p1+i, p2+i, n-i, c);
+}
+FF_TARGET("avx2") static void _ffmpeg_vfilter_avx2(const uint16* const* ppRow, const short* pCoef, int taps, uint16* pDst, int n)
+{
+    int i=0;
+    for(; i+16<=n; i+=16)
+    {
+        __m256i lo=_mm256_set1_epi32(8192), hi=lo;
+        for(int k=0; k<taps; k++)
+        {
+            __m256i c=_mm256_set1_epi32(pCoef[k]);
+            lo=_mm256_add_epi32(lo, _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(ppRow[k]+i))), c));
+            hi=_mm256_add_epi32(hi, _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(ppRow[k]+i+8))), c));
+        }
+        // packus works per 128-bit lane: lanes of lo/hi are reordered back with a 64-bit permute
+        __m256i x=_mm256_packus_epi32(_mm256_srli_epi32(lo, 14), _mm256_srli_epi32(hi, 14));
+        _mm256_storeu_si256((__m256i*)(pDst+i), _mm256_permute4x64_epi64(x, 0xd8));
+    }
+    const uint16* ppTail[64];
+    for(int k=0; k<taps && i<n; k++) ppTail[k]=ppRow[k]+i;
+    if(i<n) _ffmpeg_vfilter_c(ppTail, pCoef, taps, pDst+i, n-i);
+}
+FF_TARGET("avx2") static void _ffmpeg_hfilter_avx2(const uint16* pSrc, const int* pFirst, const short* pCoef, int stride, uint16* pDst, int n)
+{
+    int i=0;
+    const __m256i bias=_mm256_set1_epi16(-32768), round=_mm256_set1_epi32((1<<29)+8192);
+    for(; i+8<=n; i+=8)
+    {
+        // v[j]: partial sums of output 2j (low lane) and 2j+1 (high lane)
+        __m256i v[4]={_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256()};
+        for(int k=0; k<stride; k+=8)
+        {
+            for(int j=0; j<4; j++)
+            {
+                const uint16 *p0=pSrc+pFirst[i+2*j]+k, *p1=pSrc+pFirst[i+2*j+1]+k;
+                const short *c0=pCoef+(size_t)(i+2*j)*stride+k, *c1=c0+stride;
+                __m256i x=_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p0)), _mm_loadu_si128((const __m128i*)p1), 1);
+                __m256i c=_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)c0)), _mm_loadu_si128((const __m128i*)c1), 1);
+                v[j]=_mm256_add_epi32(v[j], _mm256_madd_epi16(_mm256_xor_si256(x, bias), c));
+            }
+        }
+        // lane 0: outputs 0,2,4,6, lane 1: 1,3,5,7
+        __m256i s=_mm256_hadd_epi32(_mm256_hadd_epi32(v[0], v[1]), _mm256_hadd_epi32(v[2], v[3]));
+        s=_mm256_srli_epi32(_mm256_add_epi32(s, round), 14);
+        __m128i lo=_mm256_castsi256_si128(s), hi=_mm256_extracti128_si256(s, 1);
+        _mm_storeu_si128((__m128i*)(pDst+i), _mm_packus_epi32(_mm_unpacklo_epi32(lo, hi), _mm_unpackhi_epi32(lo, hi)));
+    }
+    _ffmpeg_hfilter_c(pSrc, pFirst+i, pCoef+(size_t)i*stride, stride, pDst+i, n-i);
+}
+FF_TARGET("avx2") static int64 _ffmpeg_sse_avx2(const uint8* pA, const uint8* pB, int n, int is16)
+{
+    int64 sum=0;
+    int i=0;
+    while(i+16<=n)
+    {
+        __m256i acc=_mm256_setzero_si256();
+        for(int k=0; k<128 && i+16<=n; k++, i+=16)
+        {
+            __m256i a=(is16?_mm256_loadu_si256((const __m256i*)(pA+i*2)):_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pA+i))));
+            __m256i b=(is16?_mm256_loadu_si256((const __m256i*)(pB+i*2)):_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pB+i))));
+            __m256i d=_mm256_sub_epi16(a, b);
+            acc=_mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+        }
+        __m128i s=_mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        s=_mm_add_epi32(s, _mm_srli_si128(s, 8));
+        s=_mm_add_epi32(s, _mm_srli_si128(s, 4));
+        sum+=(unsigned)_mm_cvtsi128_si32(s);
+    }
+    return sum+_ffmpeg_sse_c(pA+i*(is16+1), pB+i*(is16+1), n-i, is16);
+}
+FF_TARGET("avx2") static void _ffmpeg_ssim4x4_avx2(const uint8* pA, int strideA, const uint8* pB, int strideB, int is16, int blocks, int (*pSum)[4])
+{
+    int i=0;
+    const __m256i one=_mm256_set1_epi16(1);
+    for(; i+4<=blocks; i+=4)
+    {
+        __m256i s1=_mm256_setzero_si256(), s2=s1, ss=s1, s12=s1;
+        for(int y=0; y<4; y++)
+        {
+            const uint8 *a8=pA+(size_t)y*strideA, *b8=pB+(size_t)y*strideB;
+            __m256i a=(is16?_mm256_loadu_si256((const __m256i*)(a8+i*8)):_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a8+i*4))));
+            __m256i b=(is16?_mm256_loadu_si256((const __m256i*)(b8+i*8)):_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b8+i*4))));
+            s1=_mm256_add_epi32(s1, _mm256_madd_epi16(a, one)), s2=_mm256_add_epi32(s2, _mm256_madd_epi16(b, one));
+            ss=_mm256_add_epi32(ss, _mm256_add_epi32(_mm256_madd_epi16(a, a), _mm256_madd_epi16(b, b))), s12=_mm256_add_epi32(s12, _mm256_madd_epi16(a, b));
+        }
+        // same as sse4 per 128-bit lane: lane 0 holds blocks 0,1 and lane 1 blocks 2,3
+        __m256i x=_mm256_shuffle_epi32(_mm256_hadd_epi32(s1, s2), 0xd8), y=_mm256_shuffle_epi32(_mm256_hadd_epi32(ss, s12), 0xd8);
+        __m256i lo=_mm256_unpacklo_epi64(x, y), hi=_mm256_unpackhi_epi64(x, y);
+        _mm256_storeu_si256((__m256i*)pSum[i], _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*)pSum[i+2], _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    _ffmpeg_ssim4x4_c(pA+i*4*(is16+1), strideA, pB+i*4*(is16+1), strideB, is16, blocks-i, pSum+i);
+}
+FF_TARGET("avx2") static void _ffmpeg_sum8x8_avx2(const uint8* p, int stride, int is16, int blocks, int* pSum)
+{
+    int i=0;
+    const __m256i one=_mm256_set1_epi16(1), zero=_mm256_setzero_si256();
+    for(; i+4<=blocks; i+=4)
+    {
+        __m256i s0=zero, s1=zero;
+        for(int y=0; y<8; y++)
+        {
+            const uint8* r=p+(size_t)y*stride;
+            if(is16) s0=_mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)(r+i*16)), one)), s1=_mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)(r+i*16+32)), one));
+            else s0=_mm256_add_epi64(s0, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(r+i*8)), zero));
+        }
+        // 10-bit: lane 0 ends up with blocks 0,2 and lane 1 with 1,3, 8-bit: 64-bit sums of blocks 0..3
+        __m128i lo, hi;
+        if(is16) s0=_mm256_hadd_epi32(_mm256_hadd_epi32(s0, s1), s0), lo=_mm256_castsi256_si128(s0), hi=_mm256_extracti128_si256(s0, 1), lo=_mm_unpacklo_epi32(lo, hi);
+        else lo=_mm_shuffle_epi32(_mm256_castsi256_si128(s0), 0x08), hi=_mm_shuffle_epi32(_mm256_extracti128_si256(s0, 1), 0x08), lo=_mm_unpacklo_epi64(lo, hi);
+        _mm_storeu_si128((__m128i*)(pSum+i), lo);
+    }
+    _ffmpeg_sum8x8_c(p+i*8*(is16+1), stride, is16, blocks-i, pSum+i);
+}
+FF_TARGET("avx512f,avx512bw") static void _ffmpeg_load8_avx512(const uint8* pSrc, uint16* pDst, int n)
+{
+    int i=0;
+    for(; i+32<=n; i+=32)
+        _mm512_storeu_si512((void*)(pDst+i), _mm512_slli_epi16(_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(pSrc+i))), 8));
+    _ffmpeg_load8_c(pSrc+i, pDst+i, n-i);
+}
+FF_TARGET("avx512f,avx512bw") static void _ffmpeg_store8_avx512(const uint16* pSrc, uint8* pDst, int n)
+{
+    int i=0;
+    const __m512i r=_mm512_set1_epi16(128);
+    for(; i+32<=n; i+=32)
+        _mm256_storeu_si256((__m256i*)(pDst+i), _mm512_cvtepi16_epi8(_mm512_srli_epi16(_mm512_adds_epu16(_mm512_loadu_si512((const void*)(pSrc+i)), r), 8)));
+    _ffmpeg_store8_c(pSrc+i, pDst+i, n-i);
+}
+FF_TARGET("avx512f,avx512bw") static void _ffmpeg_mat3_avx512(uint16* p0, uint16* p1, uint16* p2, int n, const int* c)
+{
+    int i=0;
+    __m512i k[12];
+    const __m512i zero=_mm512_setzero_si512(), vmax=_mm512_set1_epi32(65535);
+    for(int j=0; j<12; j++) k[j]=_mm512_set1_epi32(c[j]);
+    for(; i+16<=n; i+=16)
+    {
+        __m512i a=_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(p0+i)));
+        __m512i b=_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(p1+i)));
+        __m512i d=_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(p2+i)));
+        uint16* pp[3]={p0, p1, p2};
+        for(int j=0; j<3; j++)
+        {
+            __m512i x=_mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(a, k[j*3]), _mm512_mullo_epi32(b, k[j*3+1])), _mm512_add_epi32(_mm512_mullo_epi32(d, k[j*3+2]), k[9+j]));
+            x=_mm512_min_epi32(_mm512_max_epi32(_mm512_srai_epi32(x, 12), zero), vmax);
+            _mm256_storeu_si256((__m256i*)(pp[j]+i), _mm512_cvtepi32_epi16(x));
+        }
+    }
+    _ffmpeg_mat3_c(p0+i, p1+i, p2+i, n-i, c);
+}
+FF_TARGET("avx512f,avx512bw") static void _ffmpeg_vfilter_avx512(const uint16* const* ppRow, const short* pCoef, int taps, uint16* pDst, int n)
+{
+    int i=0;
+    const __m512i vmax=_mm512_set1_epi32(65535);
+    for(; i+16<=n; i+=16)
+    {
+        __m512i sum=_mm512_set1_epi32(8192);
+        for(int k=0; k<taps; k++)
+            sum=_mm512_add_epi32(sum, _mm512_mullo_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(ppRow[k]+i))), _mm512_set1_epi32(pCoef[k])));
+        _mm256_storeu_si256((__m256i*)(pDst+i), _mm512_cvtepi32_epi16(_mm512_min_epu32(_mm512_srli_epi32(sum, 14), vmax)));
+    }
+    const uint16* ppTail[64];
+    for(int k=0; k<taps && i<n; k++) ppTail[k]=ppRow[k]+i;
+    if(i<n) _ffmpeg_vfilter_c(ppTail, pCoef, taps, pDst+i, n-i);
+}
+#endif
+static FFIsa _ffmpeg_cpu_isa()
+{
+#ifdef FF_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return FF_ISA_AVX512;
+    if(__builtin_cpu_supports("avx2")) return FF_ISA_AVX2;
+    if(__builtin_cpu_supports("sse4.1")) return FF_ISA_SSE4;
+#endif
+    return FF_ISA_C;
+}
+static FFSimdKernel* _ffmpeg_simd_table()
+{
+    static FFSimdKernel k={FF_ISA_AUTO, 0, 0, 0, 0, 0, 0, 0, 0};
+    return &k;
+}
+// selects the kernels of isa (capped to what the cpu supports, FF_ISA_AUTO: best), returns the isa in use
+static FFIsa ffmpeg_simd_set_isa(FFIsa isa)
+{
+    FFSimdKernel* k=_ffmpeg_simd_table();
+    FFIsa cpu=_ffmpeg_cpu_isa();
+    isa=(isa==FF_ISA_AUTO || isa>cpu?cpu:isa);
+    k->pfnLoad8=_ffmpeg_load8_c, k->pfnStore8=_ffmpeg_store8_c, k->pfnMat3=_ffmpeg_mat3_c, k->pfnVFilter=_ffmpeg_vfilter_c, k->pfnHFilter=_ffmpeg_hfilter_c;
+    k->pfnSse=_ffmpeg_sse_c, k->pfnSsim4x4=_ffmpeg_ssim4x4_c, k->pfnSum8x8=_ffmpeg_sum8x8_c;
+#ifdef FF_HAVE_X86_SIMD
+    if(isa==FF_ISA_SSE4) k->pfnLoad8=_ffmpeg_load8_sse4, k->pfnStore8=_ffmpeg_store8_sse4, k->pfnMat3=_ffmpeg_mat3_sse4, k->pfnVFilter=_ffmpeg_vfilter_sse4, k->pfnHFilter=_ffmpeg_hfilter_sse4;
+    if(isa==FF_ISA_AVX2) k->pfnLoad8=_ffmpeg_load8_avx2, k->pfnStore8=_ffmpeg_store8_avx2, k->pfnMat3=_ffmpeg_mat3_avx2, k->pfnVFilter=_ffmpeg_vfilter_avx2, k->pfnHFilter=_ffmpeg_hfilter_avx2;
+    // the row filter gathers 8 taps per output, 512-bit registers would only add padding
+    if(isa==FF_ISA_AVX512) k->pfnLoad8=_ffmpeg_load8_avx512, k->pfnStore8=_ffmpeg_store8_avx512, k->pfnMat3=_ffmpeg_mat3_avx512, k->pfnVFilter=_ffmpeg_vfilter_avx512, k->pfnHFilter=_ffmpeg_hfilter_avx2;
+    if(isa==FF_ISA_SSE4) k->pfnSse=_ffmpeg_sse_sse4, k->pfnSsim4x4=_ffmpeg_ssim4x4_sse4, k->pfnSum8x8=_ffmpeg_sum8x8_sse4;
+    if(isa>=FF_ISA_AVX2) k->pfnSse=_ffmpeg_sse_avx2, k->pfnSsim4x4=_ffmpeg_ssim4x4_avx2, k->pfnSum8x8=_ffmpeg_sum8x8_avx2;
+#endif
+    return k->isa=isa;
+}
+static forceinline const FFSimdKernel* ffmpeg_simd()
+{
+    FFSimdKernel* k=_ffmpeg_simd_table();
+    if(k->isa==FF_ISA_AUTO) ffmpeg_simd_set_isa(FF_ISA_AUTO);
+    return k;
+}
+
+// pixel format conversion between any two FFPixFmt in process: rows are unpacked to 16-bit 4:4:4 (YUV or RGB),
+// go through one 3x3 matrix (range change, YUV<->RGB) and are packed again. chroma is upsampled bilinearly
+// (left-sited horizontally, centered vertically) and downsampled with [1 2 1]/4 horizontally and a 2-row average vertically.
+typedef struct _FFCvtFmt
+{
+    int isRGB, isGray, isFull, depth, xshift, yshift, cn, pOrder[4];  // pOrder: byte position of R,G,B,A in a packed pixel (-1: none)
+}_FFCvtFmt;
+static int _ffmpeg_cvt_fmt(FFPixFmt pixfmt, OUT _FFCvtFmt* f)
+{
+    static const int ppOrder[6][4]={{2, 1, 0, -1}, {0, 1, 2, -1}, {2, 1, 0, 3}, {0, 1, 2, 3}, {3, 2, 1, 0}, {1, 2, 3, 0}};
+    memset(f, 0, sizeof(_FFCvtFmt));
+    if(pixfmt<=FF_YUV || pixfmt>FF_MAX)
+        return 0;
+    f->isRGB=ffmpeg_yuv_isRGB(pixfmt), f->isGray=(pixfmt==FF_GRAY), f->cn=ffmpeg_yuv_channel(pixfmt);
+    f->isFull=(f->isRGB || f->isGray || (FF_J420<=pixfmt && pixfmt<=FF_J444));
+    f->depth=(pixfmt==FF_BGR48 || pixfmt==FF_RGB48?16:ffmpeg_bit_depth(pixfmt));
+    f->xshift=ffmpeg_yuv_half_width(pixfmt), f->yshift=ffmpeg_yuv_half_height(pixfmt);
+    if(pixfmt==FF_BGR48 || pixfmt==FF_RGB48) memcpy(f->pOrder, ppOrder[pixfmt==FF_RGB48], sizeof(f->pOrder)), f->cn=3;
+    else if(f->isRGB) memcpy(f->pOrder, ppOrder[pixfmt-FF_BGR], sizeof(f->pOrder));
+    return 1;
+}
+// bytes per row of plane i of a frame without padding
+static forceinline int ffmpeg_yuv_plane_stride(int width, FFPixFmt pixfmt, int plane)
+{
+    int scale=ffmpeg_is_10bit(pixfmt)+1;
+    if(ffmpeg_yuv_isRGB(pixfmt)) return plane==0?width*ffmpeg_yuv_channel(pixfmt)*scale:0;
+    if(plane>=ffmpeg_yuv_channel(pixfmt)) return 0;
+    return (plane==0?width:(width>>ffmpeg_yuv_half_width(pixfmt)))*scale;
+}
+static void _ffmpeg_cvt_kr_kb(FFColSpc spc, OUT double* pKr, OUT double* pKb)
+{
+    switch(spc)
+    {
+    case FF_COL_SPC_BT601: *pKr=0.299, *pKb=0.114; break;
+    case FF_COL_SPC_BT2020: *pKr=0.2627, *pKb=0.0593; break;
+    case FF_COL_SPC_SMPTE240M: *pKr=0.212, *pKb=0.087; break;
+    default: *pKr=0.2126, *pKb=0.0722; break;
+    }
+}
+// Q12 matrix + offsets (with rounding) mapping src 16-bit components to dst ones, returns 0 for identity
+static int _ffmpeg_cvt_matrix(const _FFCvtFmt* s, const _FFCvtFmt* d, FFColSpc spc, OUT int pCoef[12])
+{
+    double m[3][3]={{1, 0, 0}, {0, 1, 0}, {0, 0, 1}}, inOff[3]={0, 0, 0}, outOff[3]={0, 0, 0}, kr, kb;
+    _ffmpeg_cvt_kr_kb(spc, &kr, &kb);
+    double kg=1-kr-kb;
+    if(s->isRGB==d->isRGB && (s->isRGB || s->isFull==d->isFull))
+        return 0;
+    if(!s->isRGB)
+    {
+        // YUV -> normalized Y [0, 65535], chroma [-32768, 32767]
+        double ys=(s->isFull?1:255.0/219), cs=(s->isFull?1:255.0/224);
+        inOff[0]=(s->isFull?0:16*256), inOff[1]=inOff[2]=32768;
+        if(d->isRGB)
+        {
+            double pm[3][3]={{ys, 0, cs*2*(1-kr)}, {ys, -cs*2*(1-kb)*kb/kg, -cs*2*(1-kr)*kr/kg}, {ys, cs*2*(1-kb), 0}};
+            memcpy(m, pm, sizeof(m));
+        }
+        else
+        {
+            double yd=(d->isFull?1:219.0/255), cd=(d->isFull?1:224.0/255);
+            m[0][0]=ys*yd, m[1][1]=m[2][2]=cs*cd;
+            outOff[0]=(d->isFull?0:16*256), outOff[1]=outOff[2]=32768;
+        }
+    }
+    else
+    {
+        double yd=(d->isFull?1:219.0/255), cd=(d->isFull?1:224.0/255);
+        double pm[3][3]={{yd*kr, yd*kg, yd*kb}, {-cd*kr/(2*(1-kb)), -cd*kg/(2*(1-kb)), cd*0.5}, {cd*0.5, -cd*kg/(2*(1-kr)), -cd*kb/(2*(1-kr))}};
+        memcpy(m, pm, sizeof(m));
+        outOff[0]=(d->isFull?0:16*256), outOff[1]=outOff[2]=32768;
+    }
+    for(int i=0; i<3; i++)
+    {
+        double o=outOff[i]*4096+2048;
+        for(int j=0; j<3; j++)
+        {
+            pCoef[i*3+j]=(int)(m[i][j]*4096+(m[i][j]<0?-0.5:0.5));
+            o-=pCoef[i*3+j]*inOff[j];
+        }
+        pCoef[9+i]=(int)o;
+    }
+    return 1;
+}
+typedef struct _FFCvtCtx
+{
+    const uint8* ppSrc[4];
+    uint8* ppDst[4];
+    int pSrcStride[4], pDstStride[4], width, height, bandRows, isMatrix;
+    int pCoef[12];
+    _FFCvtFmt s, d;
+}_FFCvtCtx;
+static forceinline void _ffmpeg_cvt_load(const uint8* p, int depth, uint16* pDst, int n)
+{
+    if(depth==8) ffmpeg_simd()->pfnLoad8(p, pDst, n);
+    else for(int i=0; i<n; i++) pDst[i]=(uint16)(((const uint16*)p)[i]<<(16-depth));
+}
+static forceinline void _ffmpeg_cvt_store(const uint16* pSrc, int depth, uint8* p, int n)
+{
+    if(depth==8) ffmpeg_simd()->pfnStore8(pSrc, p, n);
+    else
+    {
+        int shift=16-depth, maxv=(1<<depth)-1, r=(shift?1<<(shift-1):0);
+        for(int i=0; i<n; i++) ((uint16*)p)[i]=(uint16)MIN((pSrc[i]+r)>>shift, maxv);
+    }
+}
+// source row y as 16-bit 4:4:4 in pRow[0..3] (pTmp: 2 rows of scratch)
+static void _ffmpeg_cvt_unpack(const _FFCvtCtx* c, int y, uint16* pRow[4], uint16* pTmp)
+{
+    const _FFCvtFmt* f=&c->s;
+    int w=c->width, bytes=(f->depth>8?2:1);
+    if(f->isRGB)
+    {
+        const uint8* p=c->ppSrc[0]+(int64)y*c->pSrcStride[0];
+        for(int k=0; k<4; k++)
+        {
+            int pos=f->pOrder[k];
+            if(pos<0) { for(int x=0; x<w; x++) pRow[k][x]=65535; continue; }
+            if(bytes==1) for(int x=0; x<w; x++) pRow[k][x]=(uint16)(p[x*f->cn+pos]<<8);
+            else for(int x=0; x<w; x++) pRow[k][x]=((const uint16*)p)[x*f->cn+pos];
+        }
+        return;
+    }
+    _ffmpeg_cvt_load(c->ppSrc[0]+(int64)y*c->pSrcStride[0], f->depth, pRow[0], w);
+    for(int x=0; x<w; x++) pRow[3][x]=65535;
+    if(f->isGray)
+    {
+        for(int x=0; x<w; x++) pRow[1][x]=pRow[2][x]=32768;
+        return;
+    }
+    int cw=w>>f->xshift, ch=c->height>>f->yshift;
+    if(cw==0 || ch==0)
+    {
+        for(int x=0; x<w; x++) pRow[1][x]=pRow[2][x]=32768;
+        return;
+    }
+    for(int k=1; k<3; k++)
+    {
+        uint16 *pA=pTmp, *pB=pTmp+cw, *pC=(f->xshift?pTmp:pRow[k]);
+        if(f->yshift)
+        {
+            // chroma rows sit between luma rows 2i and 2i+1: 3/4 of the nearest + 1/4 of the next one
+            int cy=MIN(y>>1, ch-1), cy2=BETWEEN((y&1)?cy+1:cy-1, 0, ch-1);
+            _ffmpeg_cvt_load(c->ppSrc[k]+(int64)cy*c->pSrcStride[k], f->depth, pA, cw);
+            _ffmpeg_cvt_load(c->ppSrc[k]+(int64)cy2*c->pSrcStride[k], f->depth, pB, cw);
+            for(int x=0; x<cw; x++) pC[x]=(uint16)((3*pA[x]+pB[x]+2)>>2);
+        }
+        else
+            _ffmpeg_cvt_load(c->ppSrc[k]+(int64)y*c->pSrcStride[k], f->depth, pC, cw);
+        if(f->xshift)
+        {
+            for(int x=0; x<w; x++)
+            {
+                int i=MIN(x>>1, cw-1), i2=MIN(i+1, cw-1);
+                pRow[k][x]=(uint16)((x&1)?(pC[i]+pC[i2]+1)>>1:pC[i]);
+            }
+        }
+    }
+}
+// packs 1 or 2 (vertically subsampled dst) rows starting at y
+static void _ffmpeg_cvt_pack(const _FFCvtCtx* c, int y, uint16* ppRow[2][4], int rows, uint16* pTmp)
+{
+    const _FFCvtFmt* f=&c->d;
+    int w=c->width, bytes=(f->depth>8?2:1);
+    for(int r=0; r<rows; r++)
+    {
+        uint8* p=c->ppDst[0]+(int64)(y+r)*c->pDstStride[0];
+        if(!f->isRGB)
+        {
+            _ffmpeg_cvt_store(ppRow[r][0], f->depth, p, w);
+            continue;
+        }
+        for(int k=0; k<4; k++)
+        {
+            int pos=f->pOrder[k];
+            if(pos<0) continue;
+            if(bytes==1)
+            {
+                uint8* pT=(uint8*)pTmp;
+                ffmpeg_simd()->pfnStore8(ppRow[r][k], pT, w);
+                for(int x=0; x<w; x++) p[x*f->cn+pos]=pT[x];
+            }
+            else for(int x=0; x<w; x++) ((uint16*)p)[x*f->cn+pos]=ppRow[r][k][x];
+        }
+    }
+    if(f->isRGB || f->isGray || (y>>f->yshift)>=(c->height>>f->yshift))
+        return;  // odd height: the last luma row has no chroma row
+    int cw=w>>f->xshift;
+    for(int k=1; k<3; k++)
+    {
+        uint16* pC=pTmp;
+        for(int x=0; x<w; x++) pC[x]=(uint16)(rows==2?(ppRow[0][k][x]+ppRow[1][k][x]+1)>>1:ppRow[0][k][x]);
+        if(f->xshift)
+        {
+            for(int x=0; x<cw; x++)
+            {
+                int l=MAX(2*x-1, 0), r=MIN(2*x+1, w-1);
+                pC[x]=(uint16)((pC[l]+2*pC[2*x]+pC[r]+2)>>2);  // pC[2x-1] is overwritten only after it is used
+            }
+        }
+        _ffmpeg_cvt_store(pC, f->depth, c->ppDst[k]+(int64)(y>>f->yshift)*c->pDstStride[k], cw);
+    }
+}
+static void _ffmpeg_cvt_band(void* pArg, int band)
+{
+    const _FFCvtCtx* c=(const _FFCvtCtx*)pArg;
+    int w=c->width, y0=band*c->bandRows, y1=MIN(c->height, y0+c->bandRows), step=(c->d.yshift?2:1);
+    uint16* pBuf=(uint16*)malloc(sizeof(uint16)*(size_t)(w+16)*10);
+    uint16* ppRow[2][4];
+    for(int i=0; i<8; i++) ppRow[i/4][i%4]=pBuf+(size_t)(w+16)*i;
+    uint16* pTmp=pBuf+(size_t)(w+16)*8;
+    for(int y=y0; y<y1; y+=step)
+    {
+        int rows=MIN(step, c->height-y);
+        for(int r=0; r<rows; r++)
+        {
+            _ffmpeg_cvt_unpack(c, y+r, ppRow[r], pTmp);
+            if(c->isMatrix) ffmpeg_simd()->pfnMat3(ppRow[r][0], ppRow[r][1], ppRow[r][2], w, c->pCoef);
+        }
+        _ffmpeg_cvt_pack(c, y, ppRow, rows, pTmp);
+    }
+    free(pBuf);
+}
+// converts planes ppSrc (pSrcStride: bytes per row, NULL: unpadded) into ppDst, row bands run on 'threads' threads (<=0: all cores).
+// spc selects the YUV<->RGB matrix, FF_COL_SPC_UNKNOWN: bt709 for height>=720, bt601 below. returns 0 for unsupported formats
+static int ffmpeg_convert(const uint8* const ppSrc[4], const int pSrcStride[4], FFPixFmt srcFmt, uint8* const ppDst[4], const int pDstStride[4], FFPixFmt dstFmt,
+    int width, int height, FFColSpc spc, int threads)
+{
+    _FFCvtCtx c;
+    memset(&c, 0, sizeof(c));
+    if(!_ffmpeg_cvt_fmt(srcFmt, &c.s) || !_ffmpeg_cvt_fmt(dstFmt, &c.d) || width<=0 || height<=0)
+        return 0;
+    for(int i=0; i<4; i++)
+    {
+        c.ppSrc[i]=ppSrc[i], c.ppDst[i]=ppDst[i];
+        c.pSrcStride[i]=(pSrcStride?pSrcStride[i]:ffmpeg_yuv_plane_stride(width, srcFmt, i));
+        c.pDstStride[i]=(pDstStride?pDstStride[i]:ffmpeg_yuv_plane_stride(width, dstFmt, i));
+    }
+    c.width=width, c.height=height;
+    spc=(spc==FF_COL_SPC_UNKNOWN?(height>=720?FF_COL_SPC_BT709:FF_COL_SPC_BT601):spc);
+    c.isMatrix=_ffmpeg_cvt_matrix(&c.s, &c.d, spc, c.pCoef);
+    threads=(threads<=0?ffmpeg_get_cpu_num():threads);
+    int bands=BETWEEN(height/32, 1, threads*2);
+    c.bandRows=((height+bands-1)/bands+1)&~1;
+    bands=(height+c.bandRows-1)/c.bandRows;
+    _ffmpeg_parallel_for(bands, _ffmpeg_cvt_band, &c, threads);
+    return 1;
+}
+// same for frames packed as ffmpeg_get_frame() returns them
+static forceinline int ffmpeg_convert_frame(const void* pSrc, FFPixFmt srcFmt, void* pDst, FFPixFmt dstFmt, int width, int height, FFColSpc spc, int threads)
+{
+    uint8 *ppSrc[4], *ppDst[4];
+    ffmpeg_yuv_split_planes((uint8*)pSrc, width, height, srcFmt, ppSrc);
+    ffmpeg_yuv_split_planes((uint8*)pDst, width, height, dstFmt, ppDst);
+    return ffmpeg_convert((const uint8* const*)ppSrc, NULL, srcFmt, ppDst, NULL, dstFmt, width, height, spc, threads);
+}
+
+// resampling between frame sizes of the same FFPixFmt: separable tent filter on 16-bit samples (bilinear when upscaling, widened
+// to the scale factor when downscaling so that every source pixel contributes), Q14 weights. the vertical pass uses the SIMD kernel.
+#define FF_SCALE_MAX_TAPS 64
+typedef struct _FFScaleAxis
+{
+    int taps, stride;  // stride: taps rounded up to 8
+    int* pFirst;  // n source positions of tap 0, may lie outside the source (edge pixels are replicated)
+    short* pCoef;  // n*stride Q14 weights, each group sums to 16384, zero padded
+}_FFScaleAxis;
+static int _ffmpeg_scale_axis(int srcN, int dstN, OUT _FFScaleAxis* a)
+{
+    double scale=(double)srcN/dstN, support=BETWEEN(scale, 1.0, (FF_SCALE_MAX_TAPS-2)/2.0);
+    a->taps=(int)ceil(support*2)+1, a->stride=(a->taps+7)&~7;
+    a->pFirst=(int*)malloc(sizeof(int)*dstN), a->pCoef=(short*)calloc((size_t)dstN*a->stride, sizeof(short));
+    if(a->pFirst==0 || a->pCoef==0)
+        return 0;
+    for(int i=0; i<dstN; i++)
+    {
+        double center=(i+0.5)*scale-0.5, pWeight[FF_SCALE_MAX_TAPS], sum=0;
+        int first=(int)floor(center-support)+1, total=0, best=0;
+        short* pCoef=a->pCoef+(size_t)i*a->stride;
+        for(int k=0; k<a->taps; k++)
+            pWeight[k]=MAX(0.0, 1-fabs(first+k-center)/support), sum+=pWeight[k];
+        for(int k=0; k<a->taps; k++)
+        {
+            pCoef[k]=(short)(pWeight[k]/sum*16384+0.5), total+=pCoef[k];
+            best=(pCoef[k]>pCoef[best]?k:best);
+        }
+        pCoef[best]=(short)(pCoef[best]+16384-total), a->pFirst[i]=first;
+    }
+    return 1;
+}
+// the axes of every plane for one pixfmt, source and destination size, kept by callers that scale many frames the same way
+typedef struct _FFScaleAxes
+{
+    FFPixFmt pixfmt;
+    int srcWidth, srcHeight, dstWidth, dstHeight, planeNum;
+    _FFScaleAxis pX[4], pY[4];
+}_FFScaleAxes;
+static void _ffmpeg_scale_axes_free(_FFScaleAxes* a)
+{
+    for(int i=0; i<4; i++)
+        free(a->pX[i].pFirst), free(a->pX[i].pCoef), free(a->pY[i].pFirst), free(a->pY[i].pCoef);
+    memset(a, 0, sizeof(*a));
+}
+// returns 0 for unsupported formats or sizes (a is then empty)
+static int _ffmpeg_scale_axes(FFPixFmt pixfmt, int srcWidth, int srcHeight, int dstWidth, int dstHeight, OUT _FFScaleAxes* a)
+{
+    _FFCvtFmt f;
+    int64 pSize[4];
+    int isOK=1;
+    memset(a, 0, sizeof(*a));
+    if(!_ffmpeg_cvt_fmt(pixfmt, &f) || srcWidth<=0 || srcHeight<=0 || dstWidth<=0 || dstHeight<=0)
+        return 0;
+    a->pixfmt=pixfmt, a->srcWidth=srcWidth, a->srcHeight=srcHeight, a->dstWidth=dstWidth, a->dstHeight=dstHeight;
+    a->planeNum=ffmpeg_yuv_plane_size(srcWidth, srcHeight, pixfmt, pSize);
+    for(int i=0; i<a->planeNum; i++)
+    {
+        int xs=(i>0?f.xshift:0), ys=(i>0?f.yshift:0);
+        if((srcWidth>>xs)<=0 || (srcHeight>>ys)<=0 || (dstWidth>>xs)<=0 || (dstHeight>>ys)<=0)
+            continue;
+        isOK&=_ffmpeg_scale_axis(srcWidth>>xs, dstWidth>>xs, &a->pX[i]) & _ffmpeg_scale_axis(srcHeight>>ys, dstHeight>>ys, &a->pY[i]);
+    }
+    if(!isOK) _ffmpeg_scale_axes_free(a);
+    return isOK;
+}
+typedef struct _FFScaleCtx
+{
+    const uint8* ppSrc[4];
+    uint8* ppDst[4];
+    int pSrcStride[4], pDstStride[4], pSrcW[4], pSrcH[4], pDstW[4], pDstH[4], pFirstBand[5];
+    int planeNum, cn, depth, bandRows;
+    const _FFScaleAxes* pAxes;
+}_FFScaleCtx;
+static void _ffmpeg_scale_band(void* pArg, int band)
+{
+    const _FFScaleCtx* c=(const _FFScaleCtx*)pArg;
+    int p=0;
+    while(band>=c->pFirstBand[p+1]) p++;
+    const _FFScaleAxis *ax=&c->pAxes->pX[p], *ay=&c->pAxes->pY[p];
+    int cn=c->cn, srcW=c->pSrcW[p], srcN=srcW*cn, dstN=c->pDstW[p]*cn, taps=ay->taps, pad=ax->stride+ax->taps, pTag[FF_SCALE_MAX_TAPS];
+    int y0=(band-c->pFirstBand[p])*c->bandRows, y1=MIN(c->pDstH[p], y0+c->bandRows);
+    uint16* pBuf=(uint16*)malloc(sizeof(uint16)*((size_t)(srcN+16)*taps+(size_t)(srcW+2*pad)*cn+dstN+16));
+    uint16 *pCol=pBuf+(size_t)(srcN+16)*taps+(size_t)pad*cn, *pOut=pCol+(size_t)(srcW+pad)*cn;
+    const uint16* ppRow[FF_SCALE_MAX_TAPS];
+    for(int k=0; k<taps; k++) pTag[k]=-1;
+    for(int y=y0; y<y1; y++)
+    {
+        // consecutive taps fall into distinct slots, rows shared with the previous output row stay loaded
+        for(int k=0; k<taps; k++)
+        {
+            int idx=BETWEEN(ay->pFirst[y]+k, 0, c->pSrcH[p]-1), slot=idx%taps;
+            uint16* pRow=pBuf+(size_t)(srcN+16)*slot;
+            if(pTag[slot]!=idx)
+                _ffmpeg_cvt_load(c->ppSrc[p]+(int64)idx*c->pSrcStride[p], c->depth, pRow, srcN), pTag[slot]=idx;
+            ppRow[k]=pRow;
+        }
+        ffmpeg_simd()->pfnVFilter(ppRow, ay->pCoef+(size_t)y*ay->stride, taps, pCol, srcN);
+        for(int j=1; j<=pad; j++)
+            for(int ch=0; ch<cn; ch++) pCol[-j*cn+ch]=pCol[ch], pCol[(srcW-1+j)*cn+ch]=pCol[(srcW-1)*cn+ch];
+        if(cn==1)
+            ffmpeg_simd()->pfnHFilter(pCol, ax->pFirst, ax->pCoef, ax->stride, pOut, dstN);
+        for(int x=0; x<c->pDstW[p] && cn>1; x++)
+        {
+            const short* pCoef=ax->pCoef+(size_t)x*ax->stride;
+            const uint16* pS=pCol+ax->pFirst[x]*cn;
+            for(int ch=0; ch<cn; ch++)
+            {
+                int sum=8192;
+                for(int k=0; k<ax->taps; k++) sum+=pCoef[k]*pS[k*cn+ch];
+                pOut[x*cn+ch]=(uint16)MIN(sum>>14, 65535);
+            }
+        }
+        _ffmpeg_cvt_store(pOut, c->depth, c->ppDst[p]+(int64)y*c->pDstStride[p], dstN);
+    }
+    free(pBuf);
+}
+// ffmpeg_scale() with axes built by _ffmpeg_scale_axes(), the planes have its pixfmt and sizes
+static int _ffmpeg_scale_run(const _FFScaleAxes* a, const uint8* const ppSrc[4], const int pSrcStride[4], uint8* const ppDst[4], const int pDstStride[4], int threads)
+{
+    _FFCvtFmt f;
+    _FFScaleCtx c;
+    memset(&c, 0, sizeof(c));
+    if(a->planeNum==0 || !_ffmpeg_cvt_fmt(a->pixfmt, &f))
+        return 0;
+    c.planeNum=a->planeNum, c.cn=(f.isRGB?ffmpeg_yuv_channel(a->pixfmt):1), c.depth=f.depth, c.pAxes=a;
+    threads=(threads<=0?ffmpeg_get_cpu_num():threads);
+    c.bandRows=MAX(8, (a->dstHeight+threads*2-1)/(threads*2));
+    for(int i=0; i<c.planeNum; i++)
+    {
+        int xs=(i>0?f.xshift:0), ys=(i>0?f.yshift:0);
+        c.ppSrc[i]=ppSrc[i], c.ppDst[i]=ppDst[i];
+        c.pSrcStride[i]=(pSrcStride?pSrcStride[i]:ffmpeg_yuv_plane_stride(a->srcWidth, a->pixfmt, i));
+        c.pDstStride[i]=(pDstStride?pDstStride[i]:ffmpeg_yuv_plane_stride(a->dstWidth, a->pixfmt, i));
+        c.pSrcW[i]=a->srcWidth>>xs, c.pSrcH[i]=a->srcHeight>>ys, c.pDstW[i]=a->dstWidth>>xs, c.pDstH[i]=a->dstHeight>>ys;
+        c.pFirstBand[i+1]=c.pFirstBand[i];
+        if(c.pSrcW[i]<=0 || c.pSrcH[i]<=0 || c.pDstW[i]<=0 || c.pDstH[i]<=0)
+            continue;
+        c.pFirstBand[i+1]+=(c.pDstH[i]+c.bandRows-1)/c.bandRows;
+    }
+    for(int i=c.planeNum; i<4; i++)
+        c.pFirstBand[i+1]=c.pFirstBand[i];
+    _ffmpeg_parallel_for(c.pFirstBand[c.planeNum], _ffmpeg_scale_band, &c, threads);
+    return 1;
+}
+// resamples planes ppSrc (srcWidth x srcHeight) into ppDst (dstWidth x dstHeight) of the same pixfmt (pStride: bytes per row, NULL: unpadded),
+// row bands of all planes run on 'threads' threads (<=0: all cores). returns 0 for unsupported formats or sizes
+static int ffmpeg_scale(const uint8* const ppSrc[4], const int pSrcStride[4], uint8* const ppDst[4], const int pDstStride[4], FFPixFmt pixfmt,
+    int srcWidth, int srcHeight, int dstWidth, int dstHeight, int threads)
+{
+    _FFScaleAxes a;
+    int isOK=_ffmpeg_scale_axes(pixfmt, srcWidth, srcHeight, dstWidth, dstHeight, &a) && _ffmpeg_scale_run(&a, ppSrc, pSrcStride, ppDst, pDstStride, threads);
+    _ffmpeg_scale_axes_free(&a);
+    return isOK;
+}
+
+#define ffmpeg_yuv_frame_num(pFileName, width, height, pixfmt) (int)(ffmpeg_yuv_get_filesize(pFileName)/ffmpeg_yuv_compute_frame_size(width, height, pixfmt))
+// pipe transport: on linux ffmpeg is started with posix_spawn (no shell) on raw pipe fds with an enlarged pipe buffer,
+// frames move with large read()/write() (or vmsplice) straight between the pipe and the caller's buffers.
+// every FILE* created this way is registered as a FFStream, ffmpeg_close() reaps the child process.
+#define FF_PIPE_SIZE (1<<20)
+#define FF_HIST_BUCKETS 24  // latency histogram: bucket i counts calls of [2^i, 2^(i+1)) us, bucket 0 includes <1 us
+typedef struct FFStream FFStream;
+typedef struct FFReaderState FFReaderState;
+// snapshot of a reader/writer: throughput, time spent blocked inside read/write calls and how the ffmpeg child is doing
+typedef struct FFStreamStat
+{
+    int64 bytes, frames, calls, shortCalls;  // shortCalls: calls that moved less than requested (stall, EOF or error)
+    double elapsedSec, fps, mbPerSec;
+    double blockedMs, maxCallMs, p50CallMs, p99CallMs;  // percentiles are bucket upper bounds of pHist
+    int64 pHist[FF_HIST_BUCKETS];
+    int isRunning;  // the child process has not exited yet
+    int exitCode;  // exit code, 128+signal if killed, -1 while running or unknown
+    char pStderr[512];  // last bytes the child wrote to stderr, when the command line discards it
+}FFStreamStat;
+struct FFStream
+{
+    FILE* fp;
+    int fd, isWriter, isVmsplice;
+    int64 pid;
+    int64 nBytes;  // bytes moved since the current ffmpeg process started
+    int errFd;  // >0: anonymous file collecting the stderr that the command line sends to /dev/null
+    int64 frameSize;  // bytes per frame if known, for frame counts
+    int isExited, exitStatus;  // wait status once the process is reaped
+    int64 startUs, bytes, calls, shortCalls, blockedUs, maxUs, pHist[FF_HIST_BUCKETS];  // instrumentation of every read/write call
+    int64 (*pfnRead)(FFStream* s, void* pData, int64 size);
+    int64 (*pfnWrite)(FFStream* s, const void* pData, int64 size);
+    int (*pfnClose)(FFStream* s);
+    void* pPriv;
+    FFReaderState* pReader;  // creation arguments of a reader, used by ffmpeg_seek_frame()
+    void (*pfnFreeReader)(FFReaderState* r);
+    void* pMux;  // container state of a writer that frames its output (ffmpeg_create_vfr_writer()), freed on close
+    uint8* pStage;  // staging buffer of ffmpeg_get_frame_ex()/ffmpeg_set_frame_ex() for padded planes, freed on close
+    int64 stageSize;
+    FFStream* pNext;
+};
+static FFStream** _ffmpeg_stream_list(FFMutex** ppMutex)
+{
+    static FFStream* pHead=0;
+    static FFMutex mutex=FF_MUTEX_INITIALIZER;
+    *ppMutex=&mutex;
+    return &pHead;
+}
+// bumped by every register/unregister, invalidates the per-thread lookup caches of ffmpeg_stream_find()
+static volatile long* _ffmpeg_stream_gen()
+{
+    static volatile long gen=0;
+    return &gen;
+}
+static void _ffmpeg_stream_register(FFStream* s)
+{
+    FFMutex* pMutex;
+    FFStream** ppHead=_ffmpeg_stream_list(&pMutex);
+    s->startUs=ffmpeg_get_time_us();
+    ffmpeg_mutex_lock(pMutex);
+    s->pNext=*ppHead, *ppHead=s;
+    ffmpeg_atomic_add(_ffmpeg_stream_gen(), 1);
+    ffmpeg_mutex_unlock(pMutex);
+}
+// returns the stream record of fp, NULL if fp is a plain stdio stream. every read and write looks its stream up, so the last
+// answer of each thread is kept until the registry changes and the locked list walk is only taken on a miss
+static FFStream* ffmpeg_stream_find(FILE* fp)
+{
+    static FF_THREAD_LOCAL FILE* pLastFp=0;
+    static FF_THREAD_LOCAL FFStream* pLast=0;
+    static FF_THREAD_LOCAL long lastGen=-1;
+    FFMutex* pMutex;
+    FFStream** ppHead=_ffmpeg_stream_list(&pMutex), *s;
+    if(*ppHead==0 || fp==0)
+        return NULL;
+    long gen=ffmpeg_atomic_load(_ffmpeg_stream_gen());
+    if(fp==pLastFp && gen==lastGen)
+        return pLast;
+    ffmpeg_mutex_lock(pMutex);
+    for(s=*ppHead; s && s->fp!=fp; s=s->pNext);
+    ffmpeg_mutex_unlock(pMutex);
+    pLastFp=fp, pLast=s, lastGen=gen;
+    return s;
+}
+static FFStream* _ffmpeg_stream_unregister(FILE* fp)
+{
+    FFMutex* pMutex;
+    FFStream** ppHead=_ffmpeg_stream_list(&pMutex), **pp, *s=0;
+    ffmpeg_mutex_lock(pMutex);
+    for(pp=ppHead; *pp && (*pp)->fp!=fp; pp=&(*pp)->pNext);
+    if(*pp) s=*pp, *pp=s->pNext;
+    ffmpeg_atomic_add(_ffmpeg_stream_gen(), 1);
+    ffmpeg_mutex_unlock(pMutex);
+    return s;
+}
+static forceinline void _ffmpeg_stream_set_frame_size(FILE* fp, int64 frameSize)
+{
+    FFStream* s=ffmpeg_stream_find(fp);
+    if(s) s->frameSize=frameSize;
+}
+static forceinline void _ffmpeg_stream_account(FFStream* s, int64 n, int64 size, int64 us)
+{
+    int bucket=0;
+    while(bucket<FF_HIST_BUCKETS-1 && (us>>(bucket+1))>0) bucket++;
+    s->nBytes+=n, s->bytes+=n, s->calls++, s->shortCalls+=(n<size);
+    s->blockedUs+=us, s->maxUs=MAX(s->maxUs, us), s->pHist[bucket]++;
+}
+static forceinline int64 _ffmpeg_read(FILE* fp, void* pData, int64 size)
+{
+    FFStream* s=ffmpeg_stream_find(fp);
+    if(s==0)
+        return (int64)fread(pData, 1, (size_t)size, fp);
+    int64 t=ffmpeg_get_time_us();
+    int64 n=(s->pfnRead?s->pfnRead(s, pData, size):(int64)fread(pData, 1, (size_t)size, fp));
+    _ffmpeg_stream_account(s, n, size, ffmpeg_get_time_us()-t);
+    return n;
+}
+static forceinline int64 _ffmpeg_write(FILE* fp, const void* pData, int64 size)
+{
+    FFStream* s=ffmpeg_stream_find(fp);
+    if(s==0)
+        return (int64)fwrite(pData, 1, (size_t)size, fp);
+    int64 t=ffmpeg_get_time_us();
+    int64 n=(s->pfnWrite?s->pfnWrite(s, pData, size):(int64)fwrite(pData, 1, (size_t)size, fp));
+    _ffmpeg_stream_account(s, n, size, ffmpeg_get_time_us()-t);
+    return n;
+}
+
+#ifdef __linux__
+// warm worker pool: small helper processes forked once (create the pool early, while the process is still small) that start
+// ffmpeg on request. every ffmpeg launched by _ffmpeg_spawn() (readers, writers, probes, ffmpeg_run) goes through the enabled
+// pool: the pipe end is passed over a unix socket and the helper fork/execs it, so the big application process never forks.
+// maxActive bounds the number of ffmpeg processes alive at the same time, further opens block until one is closed.
+#define FF_WORKER_MSG_SIZE 8192
+enum { _FF_WORKER_SPAWN, _FF_WORKER_WAIT, _FF_WORKER_PING };
+typedef struct _FFWorkerMsg
+{
+    int op, argc, isWriter, isErr2Out, hasOut, hasErr, hasErrFd;  // hasErrFd: a second fd in the message becomes stderr
+    int64 pid;
+}_FFWorkerMsg;  // followed by argc+hasOut+hasErr '\0' terminated strings
+typedef struct FFWorkerPoolStat
+{
+    int64 spawns, reuses, restarts, failures, limitWaits;  // reuses: spawns served by a helper that had served before
+    int workers, active, peak;
+    double openMsAvg, openMsMax, limitWaitMs;  // open: request to pid, without the time blocked on maxActive
+}FFWorkerPoolStat;
+typedef struct FFWorkerPool FFWorkerPool;
+typedef struct FFWorker
+{
+    FFWorkerPool* pPool;
+    int sock;
+    int64 pid, served;
+    FFMutex mutex;
+}FFWorker;
+struct FFWorkerPool
+{
+    FFWorker* pWorker;
+    int workerNum, maxActive, next;
+    FFWorkerPoolStat stat;
+    int64 openUs;
+    FFMutex mutex;
+    FFCond cond;
+};
+static FFWorkerPool** _ffmpeg_worker_pool_current()
+{
+    static FFWorkerPool* pPool=0;
+    return &pPool;
+}
+// helper process: only system calls from here on, the parent may have had other threads holding malloc/stdio locks at fork()
+static void _ffmpeg_worker_main(int sock)
+{
+    long maxFd=MIN(sysconf(_SC_OPEN_MAX), 65536);
+    for(int fd=3; fd<maxFd; fd++)
+        if(fd!=sock) close(fd);
+    signal(SIGPIPE, SIG_DFL);
+    static char pBuf[FF_WORKER_MSG_SIZE];
+    for(;;)
+    {
+        char pCtrl[CMSG_SPACE(2*sizeof(int))];
+        struct iovec iov={pBuf, sizeof(pBuf)-1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov=&iov, msg.msg_iovlen=1, msg.msg_control=pCtrl, msg.msg_controllen=sizeof(pCtrl);
+        ssize_t n=recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if(n<0 && errno==EINTR) continue;
+        if(n<(ssize_t)sizeof(_FFWorkerMsg)) _exit(0);
+        struct cmsghdr* c=CMSG_FIRSTHDR(&msg);
+        int pFd[2]={-1, -1}, fd=-1, errFd=-1;
+        if(c && c->cmsg_level==SOL_SOCKET && c->cmsg_type==SCM_RIGHTS) memcpy(pFd, CMSG_DATA(c), MIN(sizeof(pFd), c->cmsg_len-CMSG_LEN(0)));
+        _FFWorkerMsg* m=(_FFWorkerMsg*)pBuf;
+        fd=pFd[0], errFd=(m->hasErrFd?pFd[1]:-1);
+        int64 ret=-1;
+        pBuf[n]=0;
+        if(m->op==_FF_WORKER_SPAWN && fd>=0 && m->argc>0 && m->argc<256)
+        {
+            char *ppArgv[256], *p=pBuf+sizeof(_FFWorkerMsg), *pOut=0, *pErr=0;
+            for(int i=0; i<m->argc; i++) ppArgv[i]=p, p+=strlen(p)+1;
+            ppArgv[m->argc]=0;
+            if(m->hasOut) pOut=p, p+=strlen(p)+1;
+            if(m->hasErr) pErr=p;
+            pid_t pid=fork();
+            if(pid==0)
+            {
+                dup2(fd, m->isWriter?0:1);
+                int k;
+                if(pOut && (k=open(pOut, O_WRONLY|O_CREAT|O_TRUNC, 0644))>=0) dup2(k, 1), close(k);
+                if(errFd>=0) dup2(errFd, 2);
+                else if(pErr && (k=open(pErr, O_WRONLY|O_CREAT|O_TRUNC, 0644))>=0) dup2(k, 2), close(k);
+                else if(!pErr && m->isErr2Out) dup2(1, 2);
+                execvp(ppArgv[0], ppArgv);
+                _exit(127);
+            }
+            ret=pid;
+        }
+        else if(m->op==_FF_WORKER_WAIT)
+        {
+            int status=0;
+            while(waitpid((pid_t)m->pid, &status, 0)<0 && errno==EINTR);
+            ret=status;
+        }
+        else if(m->op==_FF_WORKER_PING)
+            ret=getpid();
+        if(fd>=0) close(fd);
+        if(errFd>=0) close(errFd);
+        while(send(sock, &ret, sizeof(ret), MSG_NOSIGNAL)<0 && errno==EINTR);
+    }
+}
+static int _ffmpeg_worker_start(FFWorker* w)
+{
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv)!=0)
+        return 0;
+    pid_t pid=fork();
+    if(pid==0)
+    {
+        close(sv[0]);
+        _ffmpeg_worker_main(sv[1]);
+    }
+    close(sv[1]);
+    if(pid<0)
+    {
+        close(sv[0]);
+        return 0;
+    }
+    w->sock=sv[0], w->pid=pid, w->served=0;
+    return 1;
+}
+static void _ffmpeg_worker_stop(FFWorker* w)
+{
+    if(w->pid<=0)
+        return;
+    close(w->sock);
+    kill((pid_t)w->pid, SIGTERM);
+    while(waitpid((pid_t)w->pid, NULL, 0)<0 && errno==EINTR);
+    w->pid=0, w->sock=-1;
+}
+// one request/reply passing fd and errFd (if >=0) along, timeoutMs<0 waits forever. returns 0 if the helper is gone
+static int _ffmpeg_worker_call(FFWorker* w, const void* pMsg, int len, int fd, int errFd, int timeoutMs, OUT int64* pRet)
+{
+    int pFd[2]={fd, errFd}, fdNum=(fd>=0)+(fd>=0 && errFd>=0);
+    char pCtrl[CMSG_SPACE(2*sizeof(int))];
+    struct iovec iov={(void*)pMsg, (size_t)len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(pCtrl, 0, sizeof(pCtrl));
+    msg.msg_iov=&iov, msg.msg_iovlen=1;
+    if(fdNum>0)
+    {
+        msg.msg_control=pCtrl, msg.msg_controllen=CMSG_SPACE(fdNum*sizeof(int));
+        struct cmsghdr* c=CMSG_FIRSTHDR(&msg);
+        c->cmsg_level=SOL_SOCKET, c->cmsg_type=SCM_RIGHTS, c->cmsg_len=CMSG_LEN(fdNum*sizeof(int));
+        memcpy(CMSG_DATA(c), pFd, fdNum*sizeof(int));
+    }
+    if(w->pid<=0)
+        return 0;
+    ssize_t n;
+    while((n=sendmsg(w->sock, &msg, MSG_NOSIGNAL))<0 && errno==EINTR);
+    if(n!=len)
+        return 0;
+    if(timeoutMs>=0)
+    {
+        struct pollfd pfd={w->sock, POLLIN, 0};
+        if(poll(&pfd, 1, timeoutMs)<=0)
+            return 0;
+    }
+    while((n=recv(w->sock, pRet, sizeof(int64), 0))<0 && errno==EINTR);
+    return n==(ssize_t)sizeof(int64);
+}
+static forceinline void _ffmpeg_worker_restart(FFWorker* w)
+{
+    _ffmpeg_worker_stop(w);
+    _ffmpeg_worker_start(w);
+    ffmpeg_mutex_lock(&w->pPool->mutex);
+    w->pPool->stat.restarts++;
+    ffmpeg_mutex_unlock(&w->pPool->mutex);
+}
+// starts ppArgv with childFd as its stdin (writer) or stdout (reader) and errFd (if >=0) as its stderr,
+// returns its pid (-1 on failure) and the helper that owns it
+static int64 _ffmpeg_worker_spawn(FFWorkerPool* p, char** ppArgv, int childFd, int errFd, int isWriter, const char* pOut, const char* pErr, int isErr2Out, OUT FFWorker** ppWorker)
+{
+    char pMsg[FF_WORKER_MSG_SIZE];
+    _FFWorkerMsg* m=(_FFWorkerMsg*)pMsg;
+    int len=(int)sizeof(_FFWorkerMsg);
+    memset(m, 0, sizeof(_FFWorkerMsg));
+    m->op=_FF_WORKER_SPAWN, m->isWriter=isWriter, m->isErr2Out=isErr2Out, m->hasOut=(pOut!=0), m->hasErr=(pErr!=0), m->hasErrFd=(errFd>=0);
+    for(m->argc=0; ppArgv[m->argc]; m->argc++);
+    for(int i=0; i<m->argc+2; i++)
+    {
+        const char* s=(i<m->argc?ppArgv[i]:(i==m->argc?pOut:pErr));
+        int n=(s?(int)strlen(s)+1:0);
+        if(len+n>=FF_WORKER_MSG_SIZE)
+            return -1;
+        if(n) memcpy(pMsg+len, s, n), len+=n;
+    }
+    int64 t=ffmpeg_get_time_us(), pid=-1;
+    ffmpeg_mutex_lock(&p->mutex);
+    if(p->stat.active>=p->maxActive)
+    {
+        p->stat.limitWaits++;
+        while(p->stat.active>=p->maxActive)
+            ffmpeg_cond_wait(&p->cond, &p->mutex);
+        p->stat.limitWaitMs+=(ffmpeg_get_time_us()-t)*1e-3;
+        t=ffmpeg_get_time_us();
+    }
+    p->stat.active++, p->stat.peak=MAX(p->stat.peak, p->stat.active);
+    FFWorker* w=&p->pWorker[p->next++%p->workerNum];
+    ffmpeg_mutex_unlock(&p->mutex);
+    ffmpeg_mutex_lock(&w->mutex);
+    int isOK=_ffmpeg_worker_call(w, pMsg, len, childFd, errFd, -1, &pid);
+    if(!isOK)
+    {
+        _ffmpeg_worker_restart(w);
+        isOK=_ffmpeg_worker_call(w, pMsg, len, childFd, errFd, -1, &pid);
+    }
+    int isReuse=(w->served++>0);
+    ffmpeg_mutex_unlock(&w->mutex);
+    t=ffmpeg_get_time_us()-t;
+    ffmpeg_mutex_lock(&p->mutex);
+    if(isOK && pid>0)
+    {
+        p->stat.spawns++, p->stat.reuses+=isReuse;
+        p->openUs+=t, p->stat.openMsMax=MAX(p->stat.openMsMax, t*1e-3);
+    }
+    else
+    {
+        p->stat.failures++, p->stat.active--, pid=-1;
+        ffmpeg_cond_broadcast(&p->cond);
+    }
+    ffmpeg_mutex_unlock(&p->mutex);
+    *ppWorker=w;
+    return pid;
+}
+// waits for a process started by _ffmpeg_worker_spawn() and frees its slot, returns its wait status
+static int _ffmpeg_worker_wait(FFWorker* w, int64 pid)
+{
+    _FFWorkerMsg m;
+    int64 status=-1;
+    memset(&m, 0, sizeof(m));
+    m.op=_FF_WORKER_WAIT, m.pid=pid;
+    ffmpeg_mutex_lock(&w->mutex);
+    _ffmpeg_worker_call(w, &m, (int)sizeof(m), -1, -1, -1, &status);
+    ffmpeg_mutex_unlock(&w->mutex);
+    FFWorkerPool* p=w->pPool;
+    ffmpeg_mutex_lock(&p->mutex);
+    p->stat.active--;
+    ffmpeg_cond_broadcast(&p->cond);
+    ffmpeg_mutex_unlock(&p->mutex);
+    return (int)status;
+}
+// pings every helper (timeoutMs each) and restarts the ones that do not answer, returns the number that were healthy
+static int ffmpeg_worker_pool_check(FFWorkerPool* p, int timeoutMs)
+{
+    int healthy=0;
+    for(int i=0; i<p->workerNum; i++)
+    {
+        FFWorker* w=&p->pWorker[i];
+        _FFWorkerMsg m;
+        int64 ret=0;
+        memset(&m, 0, sizeof(m));
+        m.op=_FF_WORKER_PING;
+        ffmpeg_mutex_lock(&w->mutex);
+        if(_ffmpeg_worker_call(w, &m, (int)sizeof(m), -1, -1, timeoutMs, &ret) && ret==w->pid)
+            healthy++;
+        else
+            _ffmpeg_worker_restart(w);
+        ffmpeg_mutex_unlock(&w->mutex);
+    }
+    return healthy;
+}
+// workerNum helpers (<=0: 2), maxActive ffmpeg processes at a time (<=0: number of cores). pFFmpeg (NULL: ffmpeg) is run once
+// through every helper so that the binary and its libraries are in the page cache before the first real open
+static FFWorkerPool* ffmpeg_worker_pool_create(int workerNum, int maxActive, const char* pFFmpeg)
+{
+    FFWorkerPool* p=(FFWorkerPool*)calloc(1, sizeof(FFWorkerPool));
+    p->workerNum=(workerNum<=0?2:workerNum), p->maxActive=(maxActive<=0?ffmpeg_get_cpu_num():maxActive);
+    p->pWorker=(FFWorker*)calloc(p->workerNum, sizeof(FFWorker));
+    ffmpeg_mutex_init(&p->mutex);
+    ffmpeg_cond_init(&p->cond);
+    for(int i=0; i<p->workerNum; i++)
+    {
+        FFWorker* w=&p->pWorker[i];
+        w->pPool=p, w->sock=-1;
+        ffmpeg_mutex_init(&w->mutex);
+        if(!_ffmpeg_worker_start(w))
+            printf("ffmpeg_worker_pool: starting helper %d failed\n", i);
+    }
+    p->stat.workers=p->workerNum;
+    char pBin[1024];
+    snprintf(pBin, sizeof(pBin), "%s", pFFmpeg?pFFmpeg:FFMPEG_BIN);
+    char* ppArgv[]={pBin, (char*)"-loglevel", (char*)"quiet", (char*)"-version", NULL};
+    for(int i=0; i<p->workerNum; i++)
+    {
+        int fd=open(IO_NULL, O_WRONLY|O_CLOEXEC);
+        FFWorker* w;
+        int64 pid=_ffmpeg_worker_spawn(p, ppArgv, fd, -1, 0, NULL, IO_NULL, 0, &w);
+        if(fd>=0) close(fd);
+        if(pid>0) _ffmpeg_worker_wait(w, pid);
+    }
+    memset(&p->stat, 0, sizeof(p->stat)), p->openUs=0;
+    p->stat.workers=p->workerNum;
+    return p;
+}
+// routes every ffmpeg start of this process through p, NULL goes back to spawning directly
+static forceinline void ffmpeg_worker_pool_enable(FFWorkerPool* p)
+{
+    *_ffmpeg_worker_pool_current()=p;
+}
+static FFWorkerPoolStat ffmpeg_worker_pool_get_stat(FFWorkerPool* p)
+{
+    ffmpeg_mutex_lock(&p->mutex);
+    FFWorkerPoolStat s=p->stat;
+    s.openMsAvg=(s.spawns>0?p->openUs*1e-3/s.spawns:0);
+    ffmpeg_mutex_unlock(&p->mutex);
+    return s;
+}
+static void ffmpeg_worker_pool_print_stat(FFWorkerPool* p)
+{
+    FFWorkerPoolStat s=ffmpeg_worker_pool_get_stat(p);
+    printf("worker pool: workers=%d  spawns=%lld (reused %lld)  open avg=%.2f ms max=%.2f ms  active=%d peak=%d  limit waits=%lld (%.1f ms)  restarts=%lld  failures=%lld\n",
+        s.workers, (long long)s.spawns, (long long)s.reuses, s.openMsAvg, s.openMsMax, s.active, s.peak, (long long)s.limitWaits, s.limitWaitMs, (long long)s.restarts, (long long)s.failures);
+}
+// every reader/writer started through p has to be closed before
+static void ffmpeg_worker_pool_close(FFWorkerPool* p)
+{
+    if(p==0)
+        return;
+    if(*_ffmpeg_worker_pool_current()==p)
+        ffmpeg_worker_pool_enable(NULL);
+    for(int i=0; i<p->workerNum; i++)
+    {
+        _ffmpeg_worker_stop(&p->pWorker[i]);
+        ffmpeg_mutex_destroy(&p->pWorker[i].mutex);
+    }
+    ffmpeg_cond_destroy(&p->cond);
+    ffmpeg_mutex_destroy(&p->mutex);
+    free(p->pWorker); free(p);
+}
+static int64 _ffmpeg_fd_read(FFStream* s, void* pData, int64 size)
+{
+    int64 n=0;
+    while(n<size)
+    {
+        ssize_t k=read(s->fd, (uint8*)pData+n, (size_t)MIN(size-n, (int64)1<<30));
+        if(k<0 && errno==EINTR) continue;
+        if(k<=0) break;
+        n+=k;
+    }
+    return n;
+}
+static int64 _ffmpeg_fd_write(FFStream* s, const void* pData, int64 size)
+{
+    int64 n=0;
+    while(n<size)
+    {
+        ssize_t k;
+        if(s->isVmsplice)
+        {
+            struct iovec iov={(uint8*)pData+n, (size_t)MIN(size-n, (int64)1<<30)};
+            k=vmsplice(s->fd, &iov, 1, 0);
+            if(k<0 && errno==EINVAL) { s->isVmsplice=0; continue; }
+        }
+        else
+            k=write(s->fd, (const uint8*)pData+n, (size_t)MIN(size-n, (int64)1<<30));
+        if(k<0 && errno==EINTR) continue;
+        if(k<=0) break;
+        n+=k;
+    }
+    return n;
+}
+// reaps the ffmpeg process of s, directly or through the pool helper that started it (s->pPriv)
+static int _ffmpeg_fd_reap(FFStream* s)
+{
+    int status=0;
+    if(s->pid<=0)
+        return s->exitStatus;
+    if(s->pPriv)
+        status=_ffmpeg_worker_wait((FFWorker*)s->pPriv, s->pid);
+    else
+        while(waitpid((pid_t)s->pid, &status, 0)<0 && errno==EINTR);
+    s->pid=0, s->isExited=1, s->exitStatus=status;
+    return status;
+}
+static int _ffmpeg_fd_close(FFStream* s)
+{
+    fclose(s->fp);
+    return _ffmpeg_fd_reap(s);
+}
+// splits pCmd in place into argv, "2>file", "1>file", ">file" and "2>&1" are turned into redirections.
+// returns 0 if pCmd uses other shell syntax and has to go through popen()
+static int _ffmpeg_split_cmd(char* pCmd, char** ppArgv, int maxArgc, OUT char** ppOut, OUT char** ppErr, OUT int* pErr2Out)
+{
+    int argc=0;
+    char* p=pCmd;
+    *ppOut=*ppErr=0, *pErr2Out=0;
+    while(*p)
+    {
+        while(*p==' ' || *p=='\t') p++;
+        if(*p==0) break;
+        char *pToken=p, *q=p;
+        while(*p && *p!=' ' && *p!='\t')
+        {
+            if(*p=='"' || *p=='\'')
+            {
+                char c=*p++;
+                while(*p && *p!=c) *q++=*p++;
+                if(*p==0) return 0;
+                p++;
+            }
+            else if(strchr("|;&$`<*?(){}\\", *p) && !(p[0]=='&' && p>pToken && p[-1]=='>' && p[1]=='1'))
+                return 0;
+            else
+                *q++=*p++;
+        }
+        if(*p) p++;
+        *q=0;
+        if(strcmp(pToken, "2>&1")==0) *pErr2Out=1;
+        else if(strncmp(pToken, "2>", 2)==0 && pToken[2]) *ppErr=pToken+2;
+        else if(strncmp(pToken, "1>", 2)==0 && pToken[2]) *ppOut=pToken+2;
+        else if(pToken[0]=='>' && pToken[1]) *ppOut=pToken+1;
+        else if(strchr(pToken, '>')) return 0;
+        else if(argc<maxArgc-1) ppArgv[argc++]=pToken;
+        else return 0;
+    }
+    ppArgv[argc]=0;
+    return argc;
+}
+extern char** environ;
+static FILE* _ffmpeg_spawn(const char* pCmd, const char* pMode)
+{
+    char *ppArgv[256], *pOut, *pErr, *pBuf=strdup(pCmd);
+    int isWriter=(pMode[0]=='w'), isErr2Out, fds[2]={-1, -1};
+    FILE* fp=0;
+    if(_ffmpeg_split_cmd(pBuf, ppArgv, 256, &pOut, &pErr, &isErr2Out)<=0 || pipe2(fds, O_CLOEXEC)!=0)
+    {
+        free(pBuf);
+        return popen(pCmd, pMode);
+    }
+    int parentFd=fds[isWriter?1:0], childFd=fds[isWriter?0:1];
+    fcntl(parentFd, F_SETPIPE_SZ, FF_PIPE_SIZE);
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, childFd, isWriter?0:1);
+    // stderr that would be discarded goes to an unlinked temp file instead, ffmpeg_stream_get_stat() reports its tail
+    int errFd=(pErr && strcmp(pErr, IO_NULL)==0?open("/tmp", O_TMPFILE|O_RDWR|O_CLOEXEC, 0600):-1);
+    if(pOut) posix_spawn_file_actions_addopen(&fa, 1, pOut, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(errFd>=0) posix_spawn_file_actions_adddup2(&fa, errFd, 2);
+    else if(pErr) posix_spawn_file_actions_addopen(&fa, 2, pErr, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    else if(isErr2Out) posix_spawn_file_actions_adddup2(&fa, 1, 2);
+    FFWorkerPool* pPool=*_ffmpeg_worker_pool_current();
+    FFWorker* pWorker=0;
+    pid_t pid=0;
+    int ret=-1;
+    if(pPool)
+        pid=(pid_t)_ffmpeg_worker_spawn(pPool, ppArgv, childFd, errFd, isWriter, pOut, pErr, isErr2Out, &pWorker), ret=(pid>0?0:-1);
+    else
+        ret=posix_spawnp(&pid, ppArgv[0], &fa, NULL, ppArgv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(childFd);
+    free(pBuf);
+    FFStream* s=(FFStream*)calloc(1, sizeof(FFStream));
+    s->fd=parentFd, s->isWriter=isWriter, s->pid=(ret==0?pid:0), s->pPriv=(ret==0?pWorker:0), s->errFd=errFd;
+    if(ret!=0 || (fp=fdopen(parentFd, pMode))==0)
+    {
+        close(parentFd);
+        if(errFd>=0) close(errFd);
+        _ffmpeg_fd_reap(s);
+        free(s);
+        return NULL;
+    }
+    s->fp=fp;
+    s->pfnRead=_ffmpeg_fd_read, s->pfnWrite=_ffmpeg_fd_write, s->pfnClose=_ffmpeg_fd_close;
+    _ffmpeg_stream_register(s);
+    return fp;
+}
+// vmsplice maps the caller's pages into the pipe instead of copying them: a buffer passed to ffmpeg_set_frame*() must stay
+// unmodified until at least FF_PIPE_SIZE more bytes are written after it (e.g. ffmpeg_async_create_writer() with 2+ buffers of frameSize>=FF_PIPE_SIZE)
+static forceinline void ffmpeg_writer_set_vmsplice(FILE* fp, int isEnable)
+{
+    FFStream* s=ffmpeg_stream_find(fp);
+    if(s && s->isWriter && s->pfnWrite==_ffmpeg_fd_write)
+        s->isVmsplice=isEnable;
+}
+#else
+#define _ffmpeg_spawn popen
+#define ffmpeg_writer_set_vmsplice(fp, isEnable)
+#endif
+static void _ffmpeg_stream_get_stat(FFStream* s, OUT FFStreamStat* p)
+{
+    memset(p, 0, sizeof(FFStreamStat));
+    p->bytes=s->bytes, p->calls=s->calls, p->shortCalls=s->shortCalls, p->frames=(s->frameSize>0?s->bytes/s->frameSize:0);
+    p->elapsedSec=(ffmpeg_get_time_us()-s->startUs)/1e6, p->blockedMs=s->blockedUs/1e3, p->maxCallMs=s->maxUs/1e3;
+    p->fps=(p->elapsedSec>0?p->frames/p->elapsedSec:0), p->mbPerSec=(p->elapsedSec>0?p->bytes/p->elapsedSec/1e6:0);
+    memcpy(p->pHist, s->pHist, sizeof(p->pHist));
+    for(int64 i=0, n=0; i<FF_HIST_BUCKETS; i++)
+    {
+        n+=p->pHist[i];
+        if(p->p50CallMs==0 && n*2>=p->calls && n>0) p->p50CallMs=(2<<i)/1e3;
+        if(p->p99CallMs==0 && n*100>=p->calls*99 && n>0) p->p99CallMs=(2<<i)/1e3;
+    }
+    p->exitCode=-1;
+#ifdef __linux__
+    int status=s->exitStatus;
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    // WNOWAIT leaves the zombie for ffmpeg_close(), helper owned children are only known once reaped
+    if(s->pid>0 && s->pPriv==0 && waitid(P_PID, (id_t)s->pid, &info, WEXITED|WNOHANG|WNOWAIT)==0 && info.si_pid==(pid_t)s->pid)
+        status=(info.si_code==CLD_EXITED?(info.si_status&0xff)<<8:info.si_status&0x7f);
+    p->isRunning=(s->pid>0 && info.si_pid==0);
+    if(!p->isRunning && (s->isExited || s->pid>0))
+        p->exitCode=(WIFEXITED(status)?WEXITSTATUS(status):128+WTERMSIG(status));
+    struct stat st;
+    if(s->errFd>0 && fstat(s->errFd, &st)==0 && st.st_size>0)
+    {
+        int64 n=MIN((int64)st.st_size, (int64)sizeof(p->pStderr)-1);
+        n=pread(s->errFd, p->pStderr, (size_t)n, st.st_size-n);
+        p->pStderr[MAX(0, n)]=0;
+    }
+#endif
+}
+// closes a reader/writer and fills pStat (if not NULL) with its final numbers, returns the exit status of the ffmpeg child if it is known
+static int _ffmpeg_pclose_ex(FILE* fp, OUT FFStreamStat* pStat)
+{
+    FFStream* s=_ffmpeg_stream_unregister(fp);
+    if(pStat) memset(pStat, 0, sizeof(FFStreamStat)), pStat->exitCode=-1;
+    if(s==0)
+        return fclose(fp);
+    int ret=(s->pfnClose?s->pfnClose(s):fclose(s->fp));
+    if(pStat)
+    {
+        _ffmpeg_stream_get_stat(s, pStat);
+        if(!s->isExited) pStat->exitCode=(ret==0?0:-1);
+    }
+#ifdef __linux__
+    if(s->errFd>0) close(s->errFd);
+#endif
+    if(s->pReader && s->pfnFreeReader) s->pfnFreeReader(s->pReader);
+    free(s->pMux), free(s->pStage), free(s);
+    return ret;
+}
+static forceinline int _ffmpeg_pclose(FILE* fp)
+{
+    return _ffmpeg_pclose_ex(fp, NULL);
+}
+// copies size bytes (size<=0: until end of stream) from a reader to a writer without processing, with splice() when both are pipes
+static int64 ffmpeg_reader_passthrough(FILE* pReader, FILE* pWriter, int64 size)
+{
+    int64 n=0, limit=(size>0?size:((int64)1<<62));
+#ifdef __linux__
+    FFStream *r=ffmpeg_stream_find(pReader), *w=ffmpeg_stream_find(pWriter);
+    if(r && w && r->pfnRead==_ffmpeg_fd_read && w->pfnWrite==_ffmpeg_fd_write)
+    {
+        while(n<limit)
+        {
+            ssize_t k=splice(r->fd, NULL, w->fd, NULL, (size_t)MIN(limit-n, (int64)FF_PIPE_SIZE), SPLICE_F_MOVE|SPLICE_F_MORE);
+            if(k<0 && errno==EINTR) continue;
+            if(k<=0) break;
+            n+=k;
+        }
+        return n;
+    }
+#endif
+    int bufSize=FF_PIPE_SIZE;
+    uint8* pBuf=(uint8*)malloc(bufSize);
+    while(n<limit)
+    {
+        int64 k=_ffmpeg_read(pReader, pBuf, MIN(limit-n, (int64)bufSize));
+        if(k<=0 || _ffmpeg_write(pWriter, pBuf, k)<k) break;
+        n+=k;
+    }
+    free(pBuf);
+    return n;
+}
+static FFColSpc _ffmpeg_str2ColorSpace(const char* pName)
+{
+    if(strcmp(pName, "bt709")==0) return FF_COL_SPC_BT709;
+    if(strcmp(pName, "bt470bg")==0 || strcmp(pName, "smpte170m")==0) return FF_COL_SPC_BT601;
+    if(strcmp(pName, "bt2020nc")==0 || strcmp(pName, "bt2020c")==0) return FF_COL_SPC_BT2020;
+    if(strcmp(pName, "smpte240m")==0) return FF_COL_SPC_SMPTE240M;
+    return FF_COL_SPC_UNKNOWN;
+}
+static FFColPri _ffmpeg_str2ColorPrims(const char* pName)
+{
+    if(strcmp(pName, "bt709")==0) return FF_COL_PRI_BT709;
+    if(strcmp(pName, "bt470bg")==0) return FF_COL_PRI_BT601PAL;
+    if(strcmp(pName, "smpte170m")==0 || strcmp(pName, "smpte240m")==0) return FF_COL_PRI_BT601NTSC;
+    if(strcmp(pName, "bt2020")==0) return FF_COL_PRI_BT2020;
+    if(strcmp(pName, "bt470m")==0) return FF_COL_PRI_BT470M;
+    return FF_COL_PRI_UNKNOWN;
+}
+static FFColTrc _ffmpeg_str2ColorTrans(const char* pName)
+{
+    if(strcmp(pName, "bt709")==0) return FF_COL_TRC_BT709;
+    if(strcmp(pName, "smpte170m")==0) return FF_COL_TRC_BT601;
+    if(strcmp(pName, "arib-std-b67")==0) return FF_COL_TRC_HLG;
+    if(strcmp(pName, "smpte2084")==0) return FF_COL_TRC_PQ;
+    if(strcmp(pName, "smpte240m")==0) return FF_COL_TRC_SMPTE240M;
+    return FF_COL_TRC_UNKNOWN;
+}
+
+#define FF_COL_SPC_LIST_NAME {"unknown", "bt709", "bt601", "bt2020nc", "smpte240m"}
+#define FF_COL_PRI_LIST_NAME {"unknown", "bt709", "bt470bg", "smpte170m", "bt2020", "bt470m"}
+#define FF_COL_TRC_LIST_NAME {"unknown", "bt709", "smpte170m", "HLG", "PQ", "smpte240m"}
+static const char* ffmpeg_GetColorSpaceName(FFColSpc spc) { const char* ppName[]=FF_COL_SPC_LIST_NAME; return ppName[BETWEEN(spc, FF_COL_SPC_UNKNOWN, FF_COL_SPC_MAX)]; }
+static const char* ffmpeg_GetColorPrimsName(FFColPri pri) { const char* ppName[]=FF_COL_PRI_LIST_NAME; return ppName[BETWEEN(pri, FF_COL_PRI_UNKNOWN, FF_COL_PRI_MAX)]; }
+static const char* ffmpeg_GetColorTransName(FFColTrc trc) { const char* ppName[]=FF_COL_TRC_LIST_NAME; return ppName[BETWEEN(trc, FF_COL_TRC_UNKNOWN, FF_COL_TRC_MAX)]; }
+
+// file name should like this: "xxxx_wxh_fps.fmt.yuv" or "xxxx_wxh_fps.fmt"
+static FFPixFmt _ffmpeg_yuv_split_width_height(const char* pFileName, OUT int* pWidth, OUT int* pHeight, OUT double* pFps, double defFps)
+{
+    FFPixFmt fmt0=FF_NONE, fmt1=FF_NONE;
+    int len=(int)strlen(pFileName);
+    int namePos=len-1, extPos=len-1;
+    while(namePos>=0 && pFileName[namePos]!='\\' && pFileName[namePos]!='/')
+        namePos--;
+    namePos++;
+    while(extPos>=namePos && pFileName[extPos]!='.')
+        extPos--;
+    if(pFileName[extPos]=='.' && (fmt0=ffmpeg_yuv_str2pixfmt(pFileName+extPos+1))==FF_YUV)
+    {
+        int j=extPos-1;
+        while(j>0 && pFileName[j]!='.')
+            j--;
+        if(pFileName[j]=='.'&& (fmt1=ffmpeg_yuv_str2pixfmt(pFileName+j+1))>FF_YUV)
+            fmt0=fmt1;
+    }
+    fmt0=(fmt0<=FF_YUV?ffmpeg_yuv_get_default_pixfmt():fmt0);
+    int i, width=0, height=0;
+    double fps=0;
+    for(i=extPos-1; i>namePos; i--)
+    {
+        if((pFileName[i]=='x' || pFileName[i]=='X') && (IS_NUMBER(pFileName[i-1]) && IS_NUMBER(pFileName[i+1])))
+        {
+            int j=i-1, k, radix=1;
+            for(j=i-1, width=0; j>=namePos && IS_NUMBER(pFileName[j]); j--, radix*=10)
+                width=radix*(pFileName[j]-'0')+width;
+            for(k=i+1, height=0; k<extPos && IS_NUMBER(pFileName[k]); k++)
+                height=10*height+(pFileName[k]-'0');
+            if(k<extPos && IS_NUMBER(pFileName[k+1]))
+                fps=atof(pFileName+k+1);
+            break;
+        }
+    }
+    if(pWidth) *pWidth=width;
+    if(pHeight) *pHeight=height;
+    if(pFps) *pFps=(fps<=0?defFps:fps);
+    return fmt0;
+}
+static forceinline FFPixFmt ffmpeg_yuv_split_width_height(const char* pFileName, OUT int* pWidth, OUT int* pHeight, OUT double* pFps)
+{
+    return _ffmpeg_yuv_split_width_height(pFileName, pWidth, pHeight, pFps, 25);
+}
+// y4m: "YUV4MPEG2 W H F Ip A C" header line, then "FRAME\n" and the planes of every frame. geometry and timing travel in-band
+static int _ffmpeg_y4m_is_file(const char* pName)
+{
+    const char* p=strrchr(pName, '.');
+    return p && stricmp(p, ".y4m")==0;
+}
+// parses a stream header line, returns 0 if it is not one or its colorspace has no FFPixFmt
+static int _ffmpeg_y4m_parse_header(const char* pLine, OUT FFInfo* pInfo)
+{
+    static const char* ppTag[]={"420jpeg", "420mpeg2", "420paldv", "420", "422", "444", "420p10", "422p10", "444p10", "mono"};
+    static const FFPixFmt pFmt[]={FF_I420, FF_I420, FF_I420, FF_I420, FF_I422, FF_I444, FF_I420P10, FF_I422P10, FF_I444P10, FF_GRAY};
+    int num=1, den=1, isFull=0;
+    if(strncmp(pLine, "YUV4MPEG2 ", 10)!=0)
+        return 0;
+    memset(pInfo, 0, sizeof(FFInfo));
+    pInfo->pixfmt=FF_I420, pInfo->fps=25;
+    // callers read the first frame into the same buffer, tokens end at the line end
+    const char* pEnd=pLine+strcspn(pLine, "\n");
+    for(const char* p=pLine+9; p; p=(const char*)memchr(p, ' ', pEnd-p))
+    {
+        p+=(*p==' ');
+        if(*p=='W') pInfo->width=atoi(p+1);
+        else if(*p=='H') pInfo->height=atoi(p+1);
+        else if(*p=='F' && sscanf(p+1, "%d:%d", &num, &den)==2 && num>0 && den>0) pInfo->fps=(double)num/den;
+        else if(strncmp(p, "XCOLORRANGE=FULL", 16)==0) isFull=1;
+        else if(*p=='C')
+        {
+            int len=(int)strcspn(p+1, " \n"), i=0;
+            while(i<(int)(sizeof(ppTag)/sizeof(*ppTag)) && ((int)strlen(ppTag[i])!=len || strncmp(p+1, ppTag[i], len)!=0)) i++;
+            pInfo->pixfmt=(i<(int)(sizeof(ppTag)/sizeof(*ppTag))?pFmt[i]:FF_NONE);
+        }
+    }
+    if(isFull && pInfo->pixfmt>=FF_I420 && pInfo->pixfmt<=FF_I444)
+        pInfo->pixfmt=(FFPixFmt)(pInfo->pixfmt+FF_J420-FF_I420);
+    strcpy(pInfo->pCodec, "rawvideo");
+    return pInfo->pixfmt>FF_YUV && pInfo->width>0 && pInfo->height>0;
+}
+// header line with '\n', 0 if pixfmt can not be stored in y4m
+static int _ffmpeg_y4m_make_header(FFPixFmt pixfmt, int width, int height, double fps, OUT char pHeader[128])
+{
+    static const char* ppTag[]={"420jpeg", "422", "444", "420jpeg", "422", "444", "420p10 XYSCSS=420P10", "422p10 XYSCSS=422P10", "444p10 XYSCSS=444P10"};
+    const char* pTag=(pixfmt==FF_GRAY?"mono":(pixfmt>=FF_I420 && pixfmt<=FF_I444P10?ppTag[pixfmt-FF_I420]:NULL));
+    int num=(int)(fps*1000+0.5), den=1000, n=(int)(fps*1.001+0.5);
+    if(pTag==0 || width<=0 || height<=0)
+        return 0;
+    // 1000/1001 rates exactly, integer rates as n:1
+    if(fabs(fps-n/1.001)<1e-4) num=n*1000, den=1001;
+    else if(fabs(fps-(int)(fps+0.5))<1e-6) num=(int)(fps+0.5), den=1;
+    sprintf(pHeader, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C%s%s\n", width, height, MAX(1, num), den, pTag, pixfmt>=FF_J420 && pixfmt<=FF_J444?" XCOLORRANGE=FULL":"");
+    return 1;
+}
+static forceinline int _ffmpeg_y4m_has_pixfmt(FFPixFmt pixfmt)
+{
+    char pHeader[128];
+    return _ffmpeg_y4m_make_header(pixfmt, 1, 1, 25, pHeader);
+}
+// raw yuv files ("xxx_wxh_fps.fmt.yuv") and y4m files are read/written natively through a memory map, no ffmpeg process is involved.
+// ffmpeg_yuv_map_frame() returns the planes of frame idx inside the map (zero copy), a writer grows the file with ftruncate.
+typedef struct FFYuvMap
+{
+    FFPixFmt pixfmt;
+    int width, height, frameNum, isWriter;
+    double fps;
+    int64 frameSize, mapSize, dataSize;
+    int64 pos;  // frame data offset used by ffmpeg_get_frame()/ffmpeg_set_frame() on the FILE* interface, frame headers not counted
+    int64 headerSize;  // y4m: stream header bytes, every frame is preceded by frameHeader bytes ("FRAME\n"); 0 for raw yuv
+    int frameHeader;
+    uint8* pBase;
+    int fd;
+}FFYuvMap;
+#define _ffmpeg_yuv_map_offset(p, pos) ((p)->headerSize+(pos)/(p)->frameSize*((p)->frameSize+(p)->frameHeader)+(p)->frameHeader+(pos)%(p)->frameSize)
+#ifndef _WIN32
+static int _ffmpeg_yuv_map_resize(FFYuvMap* p, int64 mapSize)
+{
+    if(p->pBase) munmap(p->pBase, (size_t)p->mapSize);
+    p->pBase=0, p->mapSize=0;
+    if(p->isWriter && ftruncate(p->fd, (off_t)mapSize)!=0)
+        return 0;
+    if(mapSize>0)
+    {
+        void* pMap=mmap(NULL, (size_t)mapSize, p->isWriter?PROT_READ|PROT_WRITE:PROT_READ, MAP_SHARED, p->fd, 0);
+        if(pMap==MAP_FAILED)
+            return 0;
+        p->pBase=(uint8*)pMap, p->mapSize=mapSize;
+        if(!p->isWriter) madvise(p->pBase, (size_t)mapSize, MADV_SEQUENTIAL);
+    }
+    return 1;
+}
+// reads the y4m stream header of fd into p, 0 if frames carry parameters (no fixed frame stride to map)
+static int _ffmpeg_y4m_map_header(FFYuvMap* p)
+{
+    char pBuf[256+7]={0};
+    FFInfo info;
+    ssize_t n=pread(p->fd, pBuf, sizeof(pBuf)-1, 0);
+    char* pEnd=(n>0?strchr(pBuf, '\n'):NULL);
+    if(pEnd==0 || !_ffmpeg_y4m_parse_header(pBuf, &info) || strncmp(pEnd+1, "FRAME", 5)!=0 || (pEnd[6]!='\n' && pEnd[6]!=0))
+        return 0;
+    p->pixfmt=info.pixfmt, p->width=info.width, p->height=info.height, p->fps=info.fps;
+    p->headerSize=pEnd+1-pBuf, p->frameHeader=6;
+    return 1;
+}
+// pixfmt/width/height<=0: taken from the file name (raw yuv) or the stream header (y4m, which ignores them)
+static FFYuvMap* ffmpeg_yuv_map_open(const char* pName, FFPixFmt pixfmt, int width, int height)
+{
+    FFYuvMap* p=(FFYuvMap*)calloc(1, sizeof(FFYuvMap));
+    int isY4m=_ffmpeg_y4m_is_file(pName);
+    FFPixFmt fmt=(isY4m?FF_NONE:ffmpeg_yuv_split_width_height(pName, &p->width, &p->height, &p->fps));
+    p->pixfmt=(pixfmt>FF_YUV?pixfmt:fmt);
+    if(width>0 && height>0) p->width=width, p->height=height;
+    int64 fileSize=ffmpeg_yuv_get_filesize(pName);
+    if((p->fd=open(pName, O_RDONLY))<0 || (isY4m && !_ffmpeg_y4m_map_header(p)) || (p->frameSize=ffmpeg_yuv_compute_frame_size(p->width, p->height, p->pixfmt))<=0)
+    {
+        printf("Open '%s' failed\n", pName);
+        if(p->fd>=0) close(p->fd);
+        free(p);
+        return NULL;
+    }
+    p->frameNum=(int)((fileSize-p->headerSize)/(p->frameSize+p->frameHeader)), p->dataSize=fileSize;
+    if(!_ffmpeg_yuv_map_resize(p, fileSize))
+    {
+        printf("Map '%s' failed\n", pName);
+        close(p->fd); free(p);
+        return NULL;
+    }
+    return p;
+}
+// a .y4m name writes a y4m file (pixfmt must be planar yuv or gray), fps only goes to its header
+static FFYuvMap* ffmpeg_yuv_map_create_ex(const char* pName, FFPixFmt pixfmt, int width, int height, double fps, int frameNumHint)
+{
+    FFYuvMap* p=(FFYuvMap*)calloc(1, sizeof(FFYuvMap));
+    char pHeader[128];
+    int isY4m=_ffmpeg_y4m_is_file(pName);
+    p->pixfmt=pixfmt, p->width=width, p->height=height, p->fps=fps, p->isWriter=1;
+    p->frameSize=ffmpeg_yuv_compute_frame_size(width, height, pixfmt);
+    if(p->frameSize<=0 || (isY4m && !_ffmpeg_y4m_make_header(pixfmt, width, height, fps, pHeader)) || (p->fd=open(pName, O_RDWR|O_CREAT|O_TRUNC, 0644))<0)
+    {
+        printf("Create '%s' failed\n", pName);
+        free(p);
+        return NULL;
+    }
+    if(isY4m)
+        p->headerSize=p->dataSize=(int64)strlen(pHeader), p->frameHeader=6;
+    _ffmpeg_yuv_map_resize(p, p->headerSize+(p->frameSize+p->frameHeader)*MAX(1, frameNumHint));
+    if(isY4m && p->pBase)
+        memcpy(p->pBase, pHeader, (size_t)p->headerSize);
+    return p;
+}
+static forceinline FFYuvMap* ffmpeg_yuv_map_create(const char* pName, FFPixFmt pixfmt, int width, int height, int frameNumHint)
+{
+    return ffmpeg_yuv_map_create_ex(pName, pixfmt, width, height, 25, frameNumHint);
+}
+static uint8* ffmpeg_yuv_map_frame(FFYuvMap* p, int idx, OUT uint8* ppData[4])
+{
+    if(idx<0 || (!p->isWriter && idx>=p->frameNum))
+        return NULL;
+    int64 offset=_ffmpeg_yuv_map_offset(p, idx*p->frameSize);
+    if(p->isWriter && offset+p->frameSize>p->mapSize && !_ffmpeg_yuv_map_resize(p, MAX(offset+p->frameSize, p->mapSize*2)))
+        return NULL;
+    uint8* pFrame=p->pBase+offset;
+    if(!p->isWriter)
+    {
+        // prefetch the next frame while the caller works on this one
+        int64 next=offset+p->frameSize+p->frameHeader, page=sysconf(_SC_PAGESIZE), start=next/page*page;
+        if(next<p->mapSize) madvise(p->pBase+start, (size_t)MIN(p->frameSize+next-start, p->mapSize-start), MADV_WILLNEED);
+    }
+    else
+    {
+        if(p->frameHeader) memcpy(pFrame-p->frameHeader, "FRAME\n", 6);
+        p->frameNum=MAX(p->frameNum, idx+1), p->dataSize=MAX(p->dataSize, offset+p->frameSize);
+    }
+    if(ppData)
+        ffmpeg_yuv_split_planes(pFrame, p->width, p->height, p->pixfmt, ppData);
+    return pFrame;
+}
+static void ffmpeg_yuv_map_close(FFYuvMap* p)
+{
+    if(p==0)
+        return;
+    if(p->pBase) munmap(p->pBase, (size_t)p->mapSize);
+    if(p->isWriter && ftruncate(p->fd, (off_t)p->dataSize)!=0)
+        printf("ffmpeg_yuv_map_close: truncate failed\n");
+    close(p->fd);
+    free(p);
+}
+// FILE* interface on top of the map, used by ffmpeg_create_reader_full()/ffmpeg_create_writer_ex() for raw yuv files
+static int64 _ffmpeg_yuv_map_read(FFStream* s, void* pData, int64 size)
+{
+    FFYuvMap* p=(FFYuvMap*)s->pPriv;
+    int64 n=0, end=(p->frameHeader?p->frameNum*p->frameSize:p->dataSize);
+    // frame by frame, y4m frame headers are skipped
+    while(n<size && p->pos<end)
+    {
+        int64 k=MIN(MIN(size-n, end-p->pos), p->frameSize-p->pos%p->frameSize);
+        ffmpeg_yuv_map_frame(p, (int)(p->pos/p->frameSize), NULL);
+        memcpy((uint8*)pData+n, p->pBase+_ffmpeg_yuv_map_offset(p, p->pos), (size_t)k);
+        n+=k, p->pos+=k;
+    }
+    return n;
+}
+static int64 _ffmpeg_yuv_map_write(FFStream* s, const void* pData, int64 size)
+{
+    FFYuvMap* p=(FFYuvMap*)s->pPriv;
+    int64 n=0;
+    while(n<size)
+    {
+        int64 k=MIN(size-n, p->frameSize-p->pos%p->frameSize), offset=_ffmpeg_yuv_map_offset(p, p->pos);
+        if(offset+k>p->mapSize && !_ffmpeg_yuv_map_resize(p, MAX(offset+k, p->mapSize*2)))
+            break;
+        if(p->frameHeader && p->pos%p->frameSize==0) memcpy(p->pBase+offset-p->frameHeader, "FRAME\n", 6);
+        memcpy(p->pBase+offset, (const uint8*)pData+n, (size_t)k);
+        n+=k, p->pos+=k;
+        p->dataSize=MAX(p->dataSize, offset+k);
+    }
+    p->frameNum=(int)((p->dataSize-p->headerSize)/(p->frameSize+p->frameHeader));
+    return n;
+}
+static int _ffmpeg_yuv_map_stream_close(FFStream* s)
+{
+    ffmpeg_yuv_map_close((FFYuvMap*)s->pPriv);
+    return fclose(s->fp);
+}
+static FILE* _ffmpeg_yuv_map_stream(FFYuvMap* p, int64 pos)
+{
+    FILE* fp=(p?fopen(IO_NULL, p->isWriter?IO_W:IO_R):0);
+    if(fp==0)
+    {
+        ffmpeg_yuv_map_close(p);
+        return NULL;
+    }
+    p->pos=pos;
+    FFStream* s=(FFStream*)calloc(1, sizeof(FFStream));
+    s->fp=fp, s->fd=p->fd, s->isWriter=p->isWriter, s->pPriv=p;
+    s->pfnRead=_ffmpeg_yuv_map_read, s->pfnWrite=_ffmpeg_yuv_map_write, s->pfnClose=_ffmpeg_yuv_map_stream_close;
+    s->frameSize=p->frameSize;
+    _ffmpeg_stream_register(s);
+    return fp;
+}
+// the map behind a raw yuv reader/writer, NULL if fp is not backed by one
+static forceinline FFYuvMap* ffmpeg_get_yuv_map(FILE* fp)
+{
+    FFStream* s=ffmpeg_stream_find(fp);
+    return (s && s->pfnRead==_ffmpeg_yuv_map_read)?(FFYuvMap*)s->pPriv:NULL;
+}
+#else
+#define ffmpeg_get_yuv_map(fp) ((FFYuvMap*)0)
+#endif
+// container index: exact frame count, fps and keyframes of mp4/mov (moov sample tables) and mkv/webm (cluster blocks), no process, no decode.
+// pPts/pKeyFrame are in presentation order (the order ffmpeg outputs frames), pSampleSize/pSampleOffset in decode (file) order.
+typedef struct FFIndex
+{
+    int frame_num, sample_num, key_num;
+    int width, height;
+    double fps, sec;
+    int64 timescale;
+    int64* pPts;          // presentation time of every frame in us, ascending
+    int* pKeyFrame;       // frame index (into pPts) of every keyframe, ascending
+    int* pSampleSize;
+    int64* pSampleOffset; // file offset of every sample, 0 if unknown
+    char pCodec[16];
+}FFIndex;
+static void ffmpeg_free_video_index(FFIndex* p)
+{
+    if(p==0)
+        return;
+    free(p->pPts); free(p->pKeyFrame); free(p->pSampleSize); free(p->pSampleOffset);
+    free(p);
+}
+static int _ffmpeg_cmp_int(const void* a, const void* b)
+{
+    int x=*(const int*)a, y=*(const int*)b;
+    return (x>y)-(x<y);
+}
+static int _ffmpeg_cmp_int64(const void* a, const void* b)
+{
+    int64 x=*(const int64*)a, y=*(const int64*)b;
+    return (x>y)-(x<y);
+}
+// pSamplePts/pIsKey: sample_num entries in decode order, builds pPts/pKeyFrame from them. frees p and returns NULL on failure
+static FFIndex* _ffmpeg_index_finish(FFIndex* p, const int64* pSamplePts, const uint8* pIsKey)
+{
+    int n=0, k=0;
+    p->pPts=(int64*)malloc(sizeof(int64)*MAX(1, p->sample_num));
+    p->pKeyFrame=(int*)malloc(sizeof(int)*MAX(1, p->sample_num));
+    if(p->pPts==0 || p->pKeyFrame==0)
+    {
+        ffmpeg_free_video_index(p);
+        return NULL;
+    }
+    for(int i=0; i<p->sample_num; i++)
+    {
+        if(pSamplePts[i]>=0)  // samples before the edit list start are not output by ffmpeg
+            p->pPts[n++]=pSamplePts[i];
+    }
+    qsort(p->pPts, n, sizeof(int64), _ffmpeg_cmp_int64);
+    p->frame_num=n;
+    for(int i=0; i<p->sample_num; i++)
+    {
+        if(pIsKey[i] && pSamplePts[i]>=0)
+        {
+            int64* pFind=(int64*)bsearch(&pSamplePts[i], p->pPts, n, sizeof(int64), _ffmpeg_cmp_int64);
+            if(pFind) p->pKeyFrame[k++]=(int)(pFind-p->pPts);
+        }
+    }
+    qsort(p->pKeyFrame, k, sizeof(int), _ffmpeg_cmp_int);
+    p->key_num=k;
+    if(n>1 && p->fps<=0)
+        p->fps=(n-1)*1e6/MAX(1, p->pPts[n-1]-p->pPts[0]);
+    if(p->sec<=0 && p->fps>0)
+        p->sec=n/p->fps;
+    if(n==0)
+    {
+        ffmpeg_free_video_index(p);
+        return NULL;
+    }
+    return p;
+}
+
+#define _ffmpeg_be16(p) (((p)[0]<<8)|(p)[1])
+#define _ffmpeg_be32(p) (((unsigned)(p)[0]<<24)|((unsigned)(p)[1]<<16)|((unsigned)(p)[2]<<8)|(unsigned)(p)[3])
+#define _ffmpeg_be64(p) (((uint64)_ffmpeg_be32(p)<<32)|_ffmpeg_be32((p)+4))
+#define FF_MP4_MAX_MOOV ((int64)256<<20)  // a 2 hour 60 fps track needs a few MB of sample tables, larger is a broken file
+// payload of the first child box of the given type, size in *pSize
+static const uint8* _ffmpeg_mp4_box(const uint8* p, int64 size, const char* pType, OUT int64* pSize)
+{
+    while(size>=8)
+    {
+        int64 boxSize=_ffmpeg_be32(p), head=8;
+        if(boxSize==1 && size>=16) boxSize=(int64)_ffmpeg_be64(p+8), head=16;
+        else if(boxSize==0) boxSize=size;
+        if(boxSize<head || boxSize>size)
+            break;
+        if(memcmp(p+4, pType, 4)==0)
+        {
+            *pSize=boxSize-head;
+            return p+head;
+        }
+        p+=boxSize, size-=boxSize;
+    }
+    *pSize=0;
+    return NULL;
+}
+static const uint8* _ffmpeg_mp4_path(const uint8* p, int64 size, const char* pPath, OUT int64* pSize)
+{
+    for(; p && *pPath; pPath+=(pPath[4]=='/'?5:4))
+        p=_ffmpeg_mp4_box(p, size, pPath, &size);
+    *pSize=size;
+    return p;
+}
+static FFIndex* _ffmpeg_mp4_index(FILE* fp)
+{
+    uint8 pHead[16], *pMoov=0;
+    int64 pos=0, moovSize=0, fileSize=(fseek64(fp, 0, SEEK_END)==0?ftell64(fp):0);
+    while(fseek64(fp, pos, SEEK_SET)==0 && fread(pHead, 1, 8, fp)==8)
+    {
+        int64 boxSize=_ffmpeg_be32(pHead), head=8;
+        if(boxSize==1 && fread(pHead+8, 1, 8, fp)==8) boxSize=(int64)_ffmpeg_be64(pHead+8), head=16;
+        if(memcmp(pHead+4, "moov", 4)==0 && boxSize>head && boxSize-head<=MIN(FF_MP4_MAX_MOOV, fileSize-pos-head))
+        {
+            moovSize=boxSize-head;
+            if((pMoov=(uint8*)malloc((size_t)moovSize))!=NULL && fread(pMoov, 1, (size_t)moovSize, fp)!=(size_t)moovSize)
+                free(pMoov), pMoov=0;
+            break;
+        }
+        if(boxSize<head)
+            break;
+        pos+=boxSize;
+    }
+    if(pMoov==0)
+        return NULL;
+    FFIndex* pIndex=0;
+    int64 movieScale=1000, size, trakSize;
+    const uint8 *p, *pTrak=pMoov;
+    if((p=_ffmpeg_mp4_box(pMoov, moovSize, "mvhd", &size)) && size>=24)
+        movieScale=(p[0]==1?_ffmpeg_be32(p+20):_ffmpeg_be32(p+12));
+    // first video track
+    for(int64 left=moovSize; (p=_ffmpeg_mp4_box(pTrak, left, "trak", &trakSize)); left-=p+trakSize-pTrak, pTrak=p+trakSize)
+    {
+        const uint8 *pHdlr=_ffmpeg_mp4_path(p, trakSize, "mdia/hdlr", &size), *pStbl;
+        if(pHdlr==0 || size<12 || memcmp(pHdlr+8, "vide", 4)!=0)
+            continue;
+        int64 stblSize, timescale=0, mediaTime=0, emptyEdit=0, n, i, j, k;
+        if((pStbl=_ffmpeg_mp4_path(p, trakSize, "mdia/mdhd", &size)) && size>=24)
+            timescale=(pStbl[0]==1?_ffmpeg_be32(pStbl+20):_ffmpeg_be32(pStbl+12));
+        if((pStbl=_ffmpeg_mp4_path(p, trakSize, "edts/elst", &size)) && size>=8)
+        {
+            int isV1=(pStbl[0]==1), entry=(isV1?20:12);
+            n=_ffmpeg_be32(pStbl+4);
+            for(i=0; i<n && 8+(i+1)*entry<=size; i++)
+            {
+                const uint8* e=pStbl+8+i*entry;
+                int64 segDur=(isV1?(int64)_ffmpeg_be64(e):_ffmpeg_be32(e)), t=(isV1?(int64)_ffmpeg_be64(e+8):(int)_ffmpeg_be32(e+4));
+                if(t==-1) { emptyEdit+=segDur; continue; }
+                mediaTime=t;
+                break;
+            }
+        }
+        pStbl=_ffmpeg_mp4_path(p, trakSize, "mdia/minf/stbl", &stblSize);
+        const uint8 *pStsz=_ffmpeg_mp4_box(pStbl, stblSize, "stsz", &size), *pStts, *pCtts, *pStss, *pStsc, *pStco;
+        int64 sttsSize, cttsSize, stssSize, stscSize, stcoSize, isCo64=0, fieldSize=32;
+        if(pStsz==0 && (pStsz=_ffmpeg_mp4_box(pStbl, stblSize, "stz2", &size)))
+            fieldSize=pStsz[7];
+        pStts=_ffmpeg_mp4_box(pStbl, stblSize, "stts", &sttsSize);
+        if(timescale<=0 || pStsz==0 || size<12 || pStts==0 || sttsSize<8)
+            break;
+        // the sample count is only trusted as far as the tables can back it: the stts counts, the stsz/stz2 entries that fit
+        // the box, or for a constant sample size the samples that fit the file
+        int64 sttsNum=0, constSize=(fieldSize==32?_ffmpeg_be32(pStsz+4):0), num=_ffmpeg_be32(pStts+4);
+        for(i=0; i<num && 8+(i+1)*8<=sttsSize; i++)
+            sttsNum+=_ffmpeg_be32(pStts+8+i*8);
+        n=MIN(MIN((int64)_ffmpeg_be32(pStsz+8), sttsNum), (int64)0x7FFFFFFF);
+        if(constSize>0) n=MIN(n, fileSize/constSize);
+        else n=(fieldSize==4 || fieldSize==8 || fieldSize==16 || fieldSize==32?MIN(n, (size-12)*8/fieldSize):0);
+        if(n<=0 || (pIndex=(FFIndex*)calloc(1, sizeof(FFIndex)))==NULL)
+            break;
+        pIndex->timescale=timescale;
+        pIndex->sample_num=(int)n;
+        pIndex->pSampleSize=(int*)calloc((size_t)n, sizeof(int));
+        pIndex->pSampleOffset=(int64*)calloc((size_t)n, sizeof(int64));
+        int64* pSamplePts=(int64*)calloc((size_t)n, sizeof(int64));
+        uint8* pIsKey=(uint8*)malloc((size_t)n);
+        if(pIndex->pSampleSize==0 || pIndex->pSampleOffset==0 || pSamplePts==0 || pIsKey==0)
+        {
+            printf("ffmpeg_get_video_index: alloc %lld samples failed\n", (long long)n);
+            ffmpeg_free_video_index(pIndex), pIndex=0;
+            free(pSamplePts); free(pIsKey);
+            break;
+        }
+        for(i=0; i<n; i++)
+        {
+            if(fieldSize==32) pIndex->pSampleSize[i]=(constSize>0?(int)constSize:(int)_ffmpeg_be32(pStsz+12+i*4));
+            else if(fieldSize==16) pIndex->pSampleSize[i]=_ffmpeg_be16(pStsz+12+i*2);
+            else if(fieldSize==8) pIndex->pSampleSize[i]=pStsz[12+i];
+            else pIndex->pSampleSize[i]=(i&1?pStsz[12+i/2]&15:pStsz[12+i/2]>>4);
+        }
+        // decode time from stts, composition offset from ctts
+        int64 dts=0;
+        for(i=0, k=0; i<num && 8+(i+1)*8<=sttsSize; i++)
+        {
+            int64 count=_ffmpeg_be32(pStts+8+i*8), delta=_ffmpeg_be32(pStts+12+i*8);
+            for(j=0; j<count && k<n; j++, k++, dts+=delta)
+                pSamplePts[k]=dts;
+        }
+        for(; k<n; k++) pSamplePts[k]=dts;
+        if((pCtts=_ffmpeg_mp4_box(pStbl, stblSize, "ctts", &cttsSize)) && cttsSize>=8)
+        {
+            num=_ffmpeg_be32(pCtts+4);
+            for(i=0, k=0; i<num && 8+(i+1)*8<=cttsSize; i++)
+            {
+                int64 count=_ffmpeg_be32(pCtts+8+i*8), offset=(int)_ffmpeg_be32(pCtts+12+i*8);
+                for(j=0; j<count && k<n; j++, k++)
+                    pSamplePts[k]+=offset;
+            }
+        }
+        for(i=0; i<n; i++)
+        {
+            int64 t=pSamplePts[i]-mediaTime;
+            pSamplePts[i]=(t<0?-1:(int64)(t*1e6/timescale+0.5)+(int64)(emptyEdit*1e6/movieScale+0.5));
+        }
+        pIndex->sec=(double)dts/timescale;
+        if(_ffmpeg_be32(pStts+4)==1)  // constant frame rate: exact timescale/delta
+            pIndex->fps=(double)timescale/MAX(1, _ffmpeg_be32(pStts+12));
+        if((pStss=_ffmpeg_mp4_box(pStbl, stblSize, "stss", &stssSize)) && stssSize>=8)
+        {
+            memset(pIsKey, 0, (size_t)MAX(1, n));
+            num=_ffmpeg_be32(pStss+4);
+            for(i=0; i<num && 8+(i+1)*4<=stssSize; i++)
+            {
+                int64 idx=(int64)_ffmpeg_be32(pStss+8+i*4)-1;
+                if(0<=idx && idx<n) pIsKey[idx]=1;
+            }
+        }
+        else
+            memset(pIsKey, 1, (size_t)MAX(1, n));
+        // sample offsets from stsc + stco/co64
+        pStsc=_ffmpeg_mp4_box(pStbl, stblSize, "stsc", &stscSize);
+        if((pStco=_ffmpeg_mp4_box(pStbl, stblSize, "stco", &stcoSize))==0 && (pStco=_ffmpeg_mp4_box(pStbl, stblSize, "co64", &stcoSize)))
+            isCo64=1;
+        if(pStsc && stscSize>=8 && pStco && stcoSize>=8)
+        {
+            int64 chunkNum=_ffmpeg_be32(pStco+4), entryNum=_ffmpeg_be32(pStsc+4), s=0;
+            for(i=0; i<entryNum && 8+(i+1)*12<=stscSize && s<n; i++)
+            {
+                int64 first=_ffmpeg_be32(pStsc+8+i*12), last=(i+1<entryNum && 8+(i+2)*12<=stscSize?_ffmpeg_be32(pStsc+20+i*12):chunkNum+1), perChunk=_ffmpeg_be32(pStsc+12+i*12);
+                for(int64 c=first; c<last && c<=chunkNum && s<n; c++)
+                {
+                    if(8+c*(isCo64?8:4)>stcoSize) break;
+                    int64 offset=(isCo64?(int64)_ffmpeg_be64(pStco+8+(c-1)*8):_ffmpeg_be32(pStco+8+(c-1)*4));
+                    for(j=0; j<perChunk && s<n; j++, s++)
+                        pIndex->pSampleOffset[s]=offset, offset+=pIndex->pSampleSize[s];
+                }
+            }
+        }
+        const uint8* pStsd=_ffmpeg_mp4_box(pStbl, stblSize, "stsd", &size);
+        if(pStsd && size>=8+36)
+        {
+            memcpy(pIndex->pCodec, pStsd+12, 4);
+            pIndex->width=_ffmpeg_be16(pStsd+8+32), pIndex->height=_ffmpeg_be16(pStsd+8+34);
+        }
+        pIndex=_ffmpeg_index_finish(pIndex, pSamplePts, pIsKey);
+        free(pSamplePts); free(pIsKey);
+        break;
+    }
+    free(pMoov);
+    return pIndex;
+}
+
+// EBML variable length integer, id keeps its length marker, size==-1: unknown
+static int _ffmpeg_ebml_vint(FILE* fp, int isId, OUT int64* pValue)
+{
+    int c=fgetc(fp), len=1;
+    if(c==EOF || c==0)
+        return 0;
+    while(!(c&(0x80>>(len-1)))) len++;
+    int64 value=(isId?c:(c&(0xFF>>len))), allOnes=((c&(0xFF>>len))==(0xFF>>len));
+    for(int i=1; i<len; i++)
+    {
+        int b=fgetc(fp);
+        if(b==EOF) return 0;
+        value=(value<<8)|b, allOnes&=(b==0xFF);
+    }
+    *pValue=(!isId && allOnes?-1:value);
+    return len;
+}
+static int64 _ffmpeg_ebml_uint(FILE* fp, int64 size)
+{
+    int64 v=0;
+    for(int64 i=0; i<size && i<8; i++) v=(v<<8)|(fgetc(fp)&0xFF);
+    return v;
+}
+static FFIndex* _ffmpeg_mkv_index(FILE* fp)
+{
+    int64 id, size, timecodeScale=1000000, clusterTime=0, groupEnd=-1, defaultDuration=0, pos=0, cap=0, n=0;
+    int videoTrack=-1, curTrack=0, curType=0, curWidth=0, curHeight=0;
+    int64 curDuration=0;
+    double duration=0;
+    char pCurCodec[16]={0};
+    FFIndex* pIndex=(FFIndex*)calloc(1, sizeof(FFIndex));
+    int64* pSamplePts=0;
+    uint8* pIsKey=0;
+    int isFailed=0;
+    fseek64(fp, 0, SEEK_SET);
+    if(pIndex==0 || !_ffmpeg_ebml_vint(fp, 1, &id) || id!=0x1A45DFA3 || !_ffmpeg_ebml_vint(fp, 0, &size) || size<0 || fseek64(fp, size, SEEK_CUR)!=0)
+    {
+        free(pIndex);
+        return NULL;
+    }
+    // flat scan: descend into the master elements we need, skip everything else
+    while(_ffmpeg_ebml_vint(fp, 1, &id) && _ffmpeg_ebml_vint(fp, 0, &size))
+    {
+        pos=ftell64(fp);
+        if(groupEnd>=0 && pos>groupEnd) groupEnd=-1;
+        if(id==0x18538067 || id==0x1654AE6B || id==0xE0 || id==0x1F43B675 || id==0x1549A966)
+            continue;  // Segment, Tracks, Video, Cluster, Info
+        if(id==0xAE || id==0xA0)  // TrackEntry, BlockGroup
+        {
+            if(id==0xAE) curTrack=curType=curWidth=curHeight=0, curDuration=0, pCurCodec[0]=0;
+            else groupEnd=(size>=0?pos+size:-1);
+            continue;
+        }
+        if(size<0)
+            break;
+        if(id==0x2AD7B1) timecodeScale=_ffmpeg_ebml_uint(fp, size);
+        else if(id==0x4489 && (size==4 || size==8))
+        {
+            uint8 b[8];
+            if(fread(b, 1, (size_t)size, fp)!=(size_t)size) break;
+            if(size==4) { unsigned u=_ffmpeg_be32(b); float f; memcpy(&f, &u, 4); duration=f; }
+            else { uint64 u=_ffmpeg_be64(b); double d; memcpy(&d, &u, 8); duration=d; }
+        }
+        else if(id==0xD7) curTrack=(int)_ffmpeg_ebml_uint(fp, size);
+        else if(id==0x83) curType=(int)_ffmpeg_ebml_uint(fp, size);
+        else if(id==0x23E383) curDuration=_ffmpeg_ebml_uint(fp, size);
+        else if(id==0xB0) curWidth=(int)_ffmpeg_ebml_uint(fp, size);
+        else if(id==0xBA) curHeight=(int)_ffmpeg_ebml_uint(fp, size);
+        else if(id==0x86)
+        {
+            int len=(int)MIN(size, 15);
+            if(fread(pCurCodec, 1, len, fp)!=(size_t)len) break;
+            pCurCodec[len]=0;
+        }
+        else if(id==0xE7) clusterTime=_ffmpeg_ebml_uint(fp, size);
+        else if((id==0xA3 || id==0xA1) && videoTrack>0)  // SimpleBlock, Block
+        {
+            int64 track;
+            int lenTrack=_ffmpeg_ebml_vint(fp, 0, &track);
+            uint8 b[4];
+            if(lenTrack==0 || fread(b, 1, 4, fp)!=4) break;
+            if(track==videoTrack)
+            {
+                int frames=((b[2]>>1)&3)?b[3]+1:1;  // laced blocks carry several frames
+                for(int f=0; f<frames; f++)
+                {
+                    if(n==cap)
+                    {
+                        // what was grown is kept so that the failure path frees it
+                        cap=MAX(1024, cap*2);
+                        int64 *pPts=(int64*)realloc(pSamplePts, sizeof(int64)*cap), *pOffset=(int64*)realloc(pIndex->pSampleOffset, sizeof(int64)*cap);
+                        uint8* pKey=(uint8*)realloc(pIsKey, cap);
+                        int* pSize=(int*)realloc(pIndex->pSampleSize, sizeof(int)*cap);
+                        if(pPts) pSamplePts=pPts;
+                        if(pOffset) pIndex->pSampleOffset=pOffset;
+                        if(pKey) pIsKey=pKey;
+                        if(pSize) pIndex->pSampleSize=pSize;
+                        if(pPts==0 || pOffset==0 || pKey==0 || pSize==0 || cap>0x7FFFFFFF)
+                        {
+                            printf("ffmpeg_get_video_index: alloc %lld samples failed\n", (long long)cap);
+                            isFailed=1;
+                            break;
+                        }
+                    }
+                    int64 t=(clusterTime+(short)_ffmpeg_be16(b))*timecodeScale+f*defaultDuration;
+                    pSamplePts[n]=MAX(0, t/1000);
+                    pIsKey[n]=(id==0xA3?(b[2]>>7):1);
+                    pIndex->pSampleSize[n]=(int)(size-lenTrack-3)/frames;
+                    pIndex->pSampleOffset[n]=(f==0?pos+lenTrack+3:0);
+                    n++;
+                }
+            }
+            if(isFailed)
+                break;
+        }
+        else if(id==0xFB && groupEnd>=0 && n>0)  // ReferenceBlock: the block of this group is not a keyframe
+            pIsKey[n-1]=0;
+        // fields of a track entry can come in any order, keep the first video entry up to date while it is parsed
+        if((id==0xD7 || id==0x83 || id==0x23E383 || id==0xB0 || id==0xBA || id==0x86) && curType==1 && curTrack>0 && (videoTrack<0 || videoTrack==curTrack))
+        {
+            videoTrack=curTrack, defaultDuration=curDuration;
+            pIndex->width=curWidth, pIndex->height=curHeight;
+            strcpy(pIndex->pCodec, pCurCodec);
+        }
+        if(fseek64(fp, pos+size, SEEK_SET)!=0)
+            break;
+    }
+    if(isFailed)
+    {
+        ffmpeg_free_video_index(pIndex);
+        free(pSamplePts); free(pIsKey);
+        return NULL;
+    }
+    pIndex->sample_num=(int)n;
+    pIndex->timescale=1000000000/MAX(1, timecodeScale);
+    if(defaultDuration>0) pIndex->fps=1e9/defaultDuration;
+    pIndex->sec=duration*timecodeScale*1e-9;
+    pIndex=(n>0?_ffmpeg_index_finish(pIndex, pSamplePts, pIsKey):(ffmpeg_free_video_index(pIndex), (FFIndex*)0));
+    free(pSamplePts); free(pIsKey);
+    return pIndex;
+}
+// NULL if pName is not mp4/mov/mkv/webm or has no video track
+static FFIndex* ffmpeg_get_video_index(const char* pName)
+{
+    const char* pExt=strrchr(pName, '.');
+    FILE* fp;
+    if(pExt==0 || (fp=fopen(pName, "rb"))==0)
+        return NULL;
+    FFIndex* p=0;
+    if(stricmp(pExt, ".mp4")==0 || stricmp(pExt, ".mov")==0 || stricmp(pExt, ".m4v")==0 || stricmp(pExt, ".3gp")==0)
+        p=_ffmpeg_mp4_index(fp);
+    else if(stricmp(pExt, ".mkv")==0 || stricmp(pExt, ".webm")==0)
+        p=_ffmpeg_mkv_index(fp);
+    fclose(fp);
+    return p;
+}
+// y4m files are described by their own header, no ffmpeg process is needed
+static int _ffmpeg_y4m_probe_video_info(const char* pName, OUT FFInfo* pInfo)
+{
+    char pBuf[256+7]={0};
+    FILE* fp=(_ffmpeg_y4m_is_file(pName)?fopen(pName, "rb"):NULL);
+    int n=(fp?(int)fread(pBuf, 1, sizeof(pBuf)-1, fp):0);
+    char* pEnd=strchr(pBuf, '\n');
+    if(fp) fclose(fp);
+    if(n<=0 || pEnd==0 || !_ffmpeg_y4m_parse_header(pBuf, pInfo))
+        return 0;
+    int64 frameSize=ffmpeg_yuv_compute_frame_size(pInfo->width, pInfo->height, pInfo->pixfmt), filesize=ffmpeg_yuv_get_filesize(pName);
+    // exact when frames carry no parameters, as everything but very old encoders writes them
+    pInfo->frame_num=(int)((filesize-(pEnd+1-pBuf))/(frameSize+6));
+    pInfo->sec=pInfo->frame_num/pInfo->fps;
+    pInfo->video_bitrate=pInfo->total_bitrate=(float)((double)filesize*8e-3/MAX(1e-4, pInfo->sec));
+    return 1;
+}
+static FFInfo* _ffmpeg_probe_video_info(const char* pName, OUT FFInfo* pInfo)
+{
+    memset(pInfo, 0, sizeof(FFInfo));
+    if(_ffmpeg_y4m_probe_video_info(pName, pInfo))
+        return pInfo;
+    if(!ffmpeg_is_rawfile(pName))
+    {
+        char pPixfmt[32]={0}, pCodec[128]={0};
+        int cmdLen=1024, textLen=128*1024, len=cmdLen+textLen;
+        char *pText=(char*)malloc(len);
+        memset(pText, 0, len);
+        char* pCmd=pText+textLen;
+        sprintf(pCmd, "%s -i \"%s\" 2>&1", FFMPEG_BIN, pName);
+        FILE *fp=_ffmpeg_spawn(pCmd, "r");
+        int isFindVideo=0, isFindAudio=0, limit=1;
+        double fps=-1, tbr=-1, tbn=-1, tbc=-1;
+        if(fp)
+        {
+            const char* p=0;
+            int isFindVideo=0;
+            //Printf_DEBUG(TEXT_COLOR_YELLOW, "%s\n", pCmd);
+            while(fgets(pText, textLen, fp))
+            {
+                //Printf_DEBUG(TEXT_COLOR_YELLOW, pText);
+                if(isFindVideo==0 && strncmp(pText, "  Duration: ", strlen("  Duration: "))==0)
+                {
+                    //Printf_DEBUG(TEXT_COLOR_WHITE, pText);
+                    int h, m, s, ms;
+                    if(sscanf(pText, "  Duration: %d:%d:%d.%d", &h, &m, &s, &ms)==4)
+                        pInfo->sec=h*3600+m*60+s+ms/100.0;
+                    if((p=strstr(pText, "bitrate: ")))
+                        pInfo->total_bitrate=(float)atof(p+strlen("bitrate: "));
+                        //sscanf(p, "bitrate: %d kb/s", &pInfo->total_bitrate);
+                }
+                if(sscanf(pText, "  Stream #%*[^ ] Video: %127[^,], %30[0-9a-zA-Z]", pCodec, pPixfmt)==2)
+                {
+                    isFindVideo=1;
+                    //Printf_DEBUG(TEXT_COLOR_MAGENTA, pText);
+                    if(sscanf(pCodec, "%15[0-9a-zA-Z]", pInfo->pCodec)<1)
+                        strcpy(pInfo->pCodec, "unknown");
+                    pInfo->pixfmt=ffmpeg_string2pixfmt(pPixfmt);
+                    p=strstr(pText, pPixfmt)+strlen(pPixfmt);
+                    if(p[0]=='(')
+                    {
+                        char pRange[16]={0}, pColorSpace[16]={0}, pColorPrims[16]={0}, pColorTrans[16]={0};
+                        int nRet=0;
+                        if((nRet=sscanf(p+1, "%15[0-9a-zA-Z], %15[0-9a-zA-Z]/%15[0-9a-zA-Z]/%15[-0-9a-zA-Z]", pRange, pColorSpace, pColorPrims, pColorTrans))<4)
+                        {
+                            if(_ffmpeg_str2ColorSpace(pRange)>FF_COL_SPC_UNKNOWN && _ffmpeg_str2ColorSpace(pColorSpace)==FF_COL_SPC_UNKNOWN)
+                                strcpy(pColorSpace, pRange);
+                            if(nRet<=2) { strcpy(pColorPrims, pColorSpace); strcpy(pColorTrans, pColorSpace); }
+                        }
+                        pInfo->col_spc=_ffmpeg_str2ColorSpace(pColorSpace);
+                        pInfo->col_pri=_ffmpeg_str2ColorPrims(pColorPrims);
+                        pInfo->col_trc=_ffmpeg_str2ColorTrans(pColorTrans);
+                        p=strstr(p, ")")+1;
+                    }
+                    if(sscanf(p+1, "%dx%d", &pInfo->width, &pInfo->height)<2)
+                        pInfo->width=pInfo->height=0;
+                    double fps=0, tbr=0, tbn=0;
+                    if(NULL!=(p=strstr(pText, " fps"))) { while(p>pText && p[-1]!=' ') p--; fps=atof(p); }
+                    if(NULL!=(p=strstr(pText, " tbr"))) { while(p>pText && p[-1]!=' ') p--; tbr=atof(p); }
+                    if(NULL!=(p=strstr(pText, " tbn"))) { while(p>pText && p[-1]!=' ') p--; tbn=atof(p); }
+                    if(fps>0 && tbr>0)
+                        pInfo->fps=(0.5<=fps/tbr && fps/tbr<=2?tbr:fps);
+                    else
+                        pInfo->fps=(tbr>0?tbr:fps);
+                    if(NULL!=(p=strstr(pText, " kb/s"))) { while(p>pText && p[-1]!=' ') p--; pInfo->video_bitrate=(float)atof(p); }
+                    pInfo->frame_num=(int)(pInfo->fps*pInfo->sec+0.5);
+                    break;
+                }
+            }
+            _ffmpeg_pclose(fp);
+        }
+        free(pText);
+        // the "Duration:" estimate is often off for vfr/edit-listed files, the container index is exact
+        FFIndex* pIndex=(pInfo->width>0?ffmpeg_get_video_index(pName):0);
+        if(pIndex)
+        {
+            pInfo->frame_num=pIndex->frame_num;
+            if(pIndex->fps>0) pInfo->fps=pIndex->fps;
+            ffmpeg_free_video_index(pIndex);
+        }
+    }
+    else
+    {
+        int64 filesize=ffmpeg_yuv_get_filesize(pName);
+        pInfo->pixfmt=ffmpeg_yuv_split_width_height(pName, &pInfo->width, &pInfo->height, &pInfo->fps);
+        int64 framesize=ffmpeg_yuv_compute_frame_size(pInfo->width, pInfo->height, pInfo->pixfmt);
+        pInfo->frame_num=(int)(filesize/MAX(1, framesize));
+        pInfo->sec=pInfo->frame_num/pInfo->fps;
+        pInfo->video_bitrate=pInfo->total_bitrate=(float)((double)filesize*8e-3/MAX(1e-4, pInfo->sec));
+        strcpy(pInfo->pCodec, "rawvideo");
+    }
+    return pInfo;
+}
+// probe cache: ffmpeg_get_video_info() results keyed by (path, size, mtime), so repeated lookups cost a stat() instead of an ffmpeg process.
+// ffmpeg_probe_cache_open() adds an on-disk database (append-only text file, the last line of a path wins) shared across runs.
+typedef struct FFProbeStat
+{
+    int64 hits, misses, entries;
+}FFProbeStat;
+typedef struct FFProbeEntry
+{
+    int64 size, mtime;
+    FFInfo info;
+    struct FFProbeEntry* pNext;
+    char pName[1];
+}FFProbeEntry;
+typedef struct FFProbeCache
+{
+    FFProbeEntry** ppBucket;
+    int bucketNum, isDisable;
+    FFProbeStat stat;
+    FILE* fpDb;
+    FFMutex mutex;
+}FFProbeCache;
+static FFProbeCache* _ffmpeg_probe_cache()
+{
+    static FFProbeCache cache={0, 0, 0, {0, 0, 0}, 0, FF_MUTEX_INITIALIZER};
+    return &cache;
+}
+static forceinline int _ffmpeg_file_stamp(const char* pName, OUT int64* pSize, OUT int64* pMtime)
+{
+    struct stat64 buf;
+    if(stat64(pName, &buf)!=0)
+        return 0;
+    *pSize=(int64)buf.st_size;
+#ifdef __linux__
+    *pMtime=(int64)buf.st_mtim.tv_sec*1000000000+buf.st_mtim.tv_nsec;
+#else
+    *pMtime=(int64)buf.st_mtime*1000000000;
+#endif
+    return 1;
+}
+static forceinline uint64 _ffmpeg_hash_string(const char* p)
+{
+    uint64 h=14695981039346656037ULL;
+    while(*p) h=(h^(uint8)*p++)*1099511628211ULL;
+    return h;
+}
+// caller holds the mutex
+static void _ffmpeg_probe_cache_put(FFProbeCache* c, const char* pName, int64 size, int64 mtime, const FFInfo* pInfo)
+{
+    if(c->ppBucket==0 || c->stat.entries>=c->bucketNum)
+    {
+        int num=MAX(1024, c->bucketNum*2);
+        FFProbeEntry** ppBucket=(FFProbeEntry**)calloc(num, sizeof(FFProbeEntry*));
+        for(int i=0; i<c->bucketNum; i++)
+        {
+            for(FFProbeEntry *e=c->ppBucket[i], *pNext; e; e=pNext)
+            {
+                int k=(int)(_ffmpeg_hash_string(e->pName)%num);
+                pNext=e->pNext, e->pNext=ppBucket[k], ppBucket[k]=e;
+            }
+        }
+        free(c->ppBucket);
+        c->ppBucket=ppBucket, c->bucketNum=num;
+    }
+    FFProbeEntry** pp=&c->ppBucket[_ffmpeg_hash_string(pName)%c->bucketNum];
+    for(; *pp && strcmp((*pp)->pName, pName)!=0; pp=&(*pp)->pNext);
+    if(*pp==0)
+    {
+        *pp=(FFProbeEntry*)calloc(1, sizeof(FFProbeEntry)+strlen(pName));
+        strcpy((*pp)->pName, pName);
+        c->stat.entries++;
+    }
+    (*pp)->size=size, (*pp)->mtime=mtime, (*pp)->info=*pInfo;
+}
+static FFProbeEntry* _ffmpeg_probe_cache_get(FFProbeCache* c, const char* pName)
+{
+    if(c->ppBucket==0)
+        return NULL;
+    FFProbeEntry* e=c->ppBucket[_ffmpeg_hash_string(pName)%c->bucketNum];
+    for(; e && strcmp(e->pName, pName)!=0; e=e->pNext);
+    return e;
+}
+#define FF_PROBE_DB_FORMAT "%lld\t%lld\t%d\t%d\t%d\t%.17g\t%.17g\t%d\t%.9g\t%.9g\t%d\t%d\t%d\t%s\t"
+static void _ffmpeg_probe_db_write(FILE* fp, const char* pName, int64 size, int64 mtime, const FFInfo* p)
+{
+    fprintf(fp, FF_PROBE_DB_FORMAT "%s\n", (long long)size, (long long)mtime, (int)p->pixfmt, p->width, p->height, p->fps, p->sec, p->frame_num,
+        p->total_bitrate, p->video_bitrate, (int)p->col_spc, (int)p->col_pri, (int)p->col_trc, p->pCodec[0]?p->pCodec:"unknown", pName);
+    fflush(fp);
+}
+// loads pDbFile (created if missing) and appends every new probe result to it, NULL closes the database
+static int ffmpeg_probe_cache_open(const char* pDbFile)
+{
+    FFProbeCache* c=_ffmpeg_probe_cache();
+    ffmpeg_mutex_lock(&c->mutex);
+    if(c->fpDb) fclose(c->fpDb);
+    c->fpDb=0;
+    int num=0;
+    FILE* fp=(pDbFile?fopen(pDbFile, "r"):0);
+    if(fp)
+    {
+        char* pLine=(char*)malloc(8192);
+        while(fgets(pLine, 8192, fp))
+        {
+            FFInfo info;
+            long long size, mtime;
+            int pixfmt, spc, pri, trc, pos=0;
+            memset(&info, 0, sizeof(info));
+            char* pEnd=strchr(pLine, '\n');
+            if(pEnd) *pEnd=0;
+            if(sscanf(pLine, "%lld\t%lld\t%d\t%d\t%d\t%lg\t%lg\t%d\t%g\t%g\t%d\t%d\t%d\t%15s\t%n", &size, &mtime, &pixfmt, &info.width, &info.height, &info.fps, &info.sec,
+                &info.frame_num, &info.total_bitrate, &info.video_bitrate, &spc, &pri, &trc, info.pCodec, &pos)<14 || pos==0 || pLine[pos]==0)
+                continue;
+            info.pixfmt=(FFPixFmt)pixfmt, info.col_spc=(FFColSpc)spc, info.col_pri=(FFColPri)pri, info.col_trc=(FFColTrc)trc;
+            _ffmpeg_probe_cache_put(c, pLine+pos, size, mtime, &info);
+            num++;
+        }
+        free(pLine);
+        fclose(fp);
+    }
+    if(pDbFile && (c->fpDb=fopen(pDbFile, "a"))==0)
+        printf("Open probe cache '%s' failed\n", pDbFile);
+    ffmpeg_mutex_unlock(&c->mutex);
+    return num;
+}
+static forceinline void ffmpeg_probe_cache_enable(int isEnable)
+{
+    _ffmpeg_probe_cache()->isDisable=!isEnable;
+}
+static FFProbeStat ffmpeg_probe_cache_get_stat()
+{
+    FFProbeCache* c=_ffmpeg_probe_cache();
+    ffmpeg_mutex_lock(&c->mutex);
+    FFProbeStat stat=c->stat;
+    ffmpeg_mutex_unlock(&c->mutex);
+    return stat;
+}
+// drops the in-process entries, the database file (if any) is kept
+static void ffmpeg_probe_cache_clear()
+{
+    FFProbeCache* c=_ffmpeg_probe_cache();
+    ffmpeg_mutex_lock(&c->mutex);
+    for(int i=0; i<c->bucketNum; i++)
+    {
+        for(FFProbeEntry *e=c->ppBucket[i], *pNext; e; e=pNext)
+            pNext=e->pNext, free(e);
+    }
+    free(c->ppBucket);
+    c->ppBucket=0, c->bucketNum=0, c->stat.entries=0;
+    ffmpeg_mutex_unlock(&c->mutex);
+}
+// ffmpeg_yuv_set_default_pixfmt() before ffmpeg_video_info() if pName is xxx_wxh_fps.yuv
+static FFInfo* ffmpeg_get_video_info(const char* pName, OUT FFInfo* pInfo)
+{
+    static FFInfo info;
+    if(pInfo==0) pInfo=&info;
+    FFProbeCache* c=_ffmpeg_probe_cache();
+    int64 size=0, mtime=0;
+    if(c->isDisable || ffmpeg_is_rawfile(pName) || !_ffmpeg_file_stamp(pName, &size, &mtime))
+        return _ffmpeg_probe_video_info(pName, pInfo);
+    ffmpeg_mutex_lock(&c->mutex);
+    FFProbeEntry* e=_ffmpeg_probe_cache_get(c, pName);
+    int isHit=(e && e->size==size && e->mtime==mtime);
+    if(isHit) *pInfo=e->info, c->stat.hits++;
+    else c->stat.misses++;
+    ffmpeg_mutex_unlock(&c->mutex);
+    if(isHit)
+        return pInfo;
+    _ffmpeg_probe_video_info(pName, pInfo);
+    if(pInfo->width>0 && pInfo->height>0)
+    {
+        ffmpeg_mutex_lock(&c->mutex);
+        _ffmpeg_probe_cache_put(c, pName, size, mtime, pInfo);
+        if(c->fpDb) _ffmpeg_probe_db_write(c->fpDb, pName, size, mtime, pInfo);
+        ffmpeg_mutex_unlock(&c->mutex);
+    }
+    return pInfo;
+}
+// probes num files on up to 'threads' workers (<=0: 4), results go to pInfo[i] in the order of ppName
+typedef struct _FFProbeBatch
+{
+    const char** ppName;
+    FFInfo* pInfo;
+    int num, next;
+    FFMutex mutex;
+}_FFProbeBatch;
+static void* _ffmpeg_probe_batch_proc(void* pArg)
+{
+    _FFProbeBatch* b=(_FFProbeBatch*)pArg;
+    for(;;)
+    {
+        ffmpeg_mutex_lock(&b->mutex);
+        int i=b->next++;
+        ffmpeg_mutex_unlock(&b->mutex);
+        if(i>=b->num)
+            break;
+        ffmpeg_get_video_info(b->ppName[i], &b->pInfo[i]);
+    }
+    return NULL;
+}
+static void ffmpeg_get_video_info_batch(const char** ppName, int num, OUT FFInfo* pInfo, int threads)
+{
+    _FFProbeBatch batch={ppName, pInfo, num, 0, FF_MUTEX_INITIALIZER};
+    FFThread pThread[64];
+    int n=0;
+    threads=BETWEEN(threads<=0?4:threads, 1, 64);
+    for(int i=1; i<MIN(threads, num); i++)
+        n+=ffmpeg_thread_create(&pThread[n], _ffmpeg_probe_batch_proc, &batch);
+    _ffmpeg_probe_batch_proc(&batch);
+    for(int i=0; i<n; i++)
+        ffmpeg_thread_join(pThread[i]);
+}
+static forceinline int ffmpeg_yuv_had_fps(const char* pName)
+{
+    if(ffmpeg_is_rawfile(pName))
+    {
+        double fps=0;
+        _ffmpeg_yuv_split_width_height(pName, 0, 0, &fps, -1);
+        return (fps>0);
+    }
+    return 1;
+}
+// everything needed to restart the ffmpeg process of a reader at another frame
+struct FFReaderState
+{
+    char *pName, *pFFmpeg, *pParam;
+    char pSrcInfo[128], pThread[32];
+    FFPixFmt pixfmt;
+    int width, height;
+    int64 frameSize;
+    double fps;
+    int frameOffset;  // frame index the current ffmpeg process started at
+    int isIndexLoaded;
+    FFIndex* pIndex;
+    int isStartLoaded;
+    double startSec;  // without index: time of the first frame, the origin of -copyts timestamps (B-frame delay in avi etc.)
+    // fast scan readers (ffmpeg_create_scan_reader()): output frame k is source frame k*scanStride (keyframe k*scanStride if isKeyOnly)
+    int isScan, isKeyOnly, scanStride, isShowInfo;
+    int64 errPos;  // parsed part of the showinfo log in the stderr file
+    int isY4m;  // ffmpeg sends y4m (pixfmt/size unknown at open), the stream header is parsed and frame headers are dropped
+};
+static void _ffmpeg_reader_state_free(FFReaderState* r)
+{
+    free(r->pName); free(r->pFFmpeg); free(r->pParam);
+    ffmpeg_free_video_index(r->pIndex);
+    free(r);
+}
+static FFIndex* _ffmpeg_reader_index(FFReaderState* r)
+{
+    if(!r->isIndexLoaded)
+        r->pIndex=ffmpeg_get_video_index(r->pName), r->isIndexLoaded=1;
+    return r->pIndex;
+}
+// pts of the first decoded frame as ffmpeg -copyts sees it, asked once per reader from showinfo
+static double _ffmpeg_reader_start_time(FFReaderState* r)
+{
+    if(r->isStartLoaded)
+        return r->startSec;
+    char pCmd[4096], pLine[1024];
+    const char* p;
+    snprintf(pCmd, sizeof(pCmd), "%s -hide_banner -copyts %s -i \"%s\" -an -vf showinfo -frames:v 1 -f null - 2>&1", r->pFFmpeg, r->pSrcInfo, r->pName);
+    FILE* fp=_ffmpeg_spawn(pCmd, IO_R);
+    while(fp && fgets(pLine, sizeof(pLine), fp))
+    {
+        if(!r->isStartLoaded && strstr(pLine, "showinfo") && strstr(pLine, " n:") && (p=strstr(pLine, "pts_time:"))!=NULL)
+            r->startSec=atof(p+9), r->isStartLoaded=1;
+    }
+    if(fp) _ffmpeg_pclose(fp);
+    r->isStartLoaded=1;
+    return r->startSec;
+}
+// time (seconds) halfway between frame idxFrame-1 and idxFrame, from the container index when there is one
+static double _ffmpeg_reader_frame_time(FFReaderState* r, int idxFrame)
+{
+    FFIndex* pIndex=_ffmpeg_reader_index(r);
+    if(pIndex && idxFrame<pIndex->frame_num)
+        return (idxFrame>0?(pIndex->pPts[idxFrame-1]+pIndex->pPts[idxFrame])/2:pIndex->pPts[0]-1)*1e-6;
+    if(r->fps<=0)
+    {
+        FFInfo info;
+        r->fps=MAX(1e-3, ffmpeg_get_video_info(r->pName, &info)->fps);
+    }
+    return _ffmpeg_reader_start_time(r)+(idxFrame-0.5)/r->fps;
+}
+// starts ffmpeg so that its first output frame is idxFrame: -ss jumps near it (decoding from the keyframe before it),
+// select on the original timestamps (-copyts) drops everything before frame idxFrame exactly
+static FILE* _ffmpeg_reader_spawn(FFReaderState* r, int idxFrame)
+{
+    char pCmd[4096], pSS[64]="", pFilter[160]="", pSelect[192]="";
+    int n=0;
+    if(idxFrame>0)
+    {
+        double t=_ffmpeg_reader_frame_time(r, idxFrame);
+        sprintf(pSS, "-ss %.6f -copyts", t);
+        n=sprintf(pFilter, "select='gte(t,%.6f)'", t);
+    }
+    // scan readers: keyframes only are decoded at all, the stride is applied after the decoder, showinfo logs the pts of what is kept
+    if(r->isScan && r->scanStride>1) n+=sprintf(pFilter+n, "%sselect='not(mod(n,%d))'", n?",":"", r->scanStride);
+    if(r->isScan && r->isShowInfo) n+=sprintf(pFilter+n, "%sshowinfo", n?",":"");
+    if(n>0) sprintf(pSelect, "-vf \"%s\" ", pFilter);
+    // frames are passed through as decoded: a cfr output would repeat each keyframe of a scan to fill the gap to the next
+    if(n>0 || r->isScan) strcat(pSelect, "-vsync 0");
+    n=snprintf(pCmd, sizeof(pCmd), "%s %s %s %s %s -i \"%s\" -loglevel %s ", r->pFFmpeg, pSS, r->pSrcInfo, r->pThread, r->isKeyOnly?"-skip_frame nokey":"", r->pName, r->isShowInfo?"info":"error");
+    if(r->isY4m)
+    {
+        // what is not known yet is left to ffmpeg and read back from the stream header
+        n+=snprintf(pCmd+n, sizeof(pCmd)-n, "-f yuv4mpegpipe -strict -1 ");
+        if(r->pixfmt>FF_YUV) n+=snprintf(pCmd+n, sizeof(pCmd)-n, "-pix_fmt %s ", ffmpeg_pixfmt2string(r->pixfmt));
+        if(r->width>0 && r->height>0) n+=snprintf(pCmd+n, sizeof(pCmd)-n, "-s %dx%d -sws_flags bicubic ", r->width, r->height);
+        n+=snprintf(pCmd+n, sizeof(pCmd)-n, "%s %s - ", pSelect, r->pParam);
+    }
+    else
+        n+=snprintf(pCmd+n, sizeof(pCmd)-n, "-f image2pipe -pix_fmt %s -vcodec rawvideo -s %dx%d -sws_flags bicubic %s %s - ", ffmpeg_pixfmt2string(r->pixfmt), r->width, r->height, pSelect, r->pParam);
+    snprintf(pCmd+n, sizeof(pCmd)-n, " 2>" IO_NULL);
+    // Printf_DEBUG(TEXT_COLOR_BLUE, "%s\n", pCmd);
+    return _ffmpeg_spawn(pCmd, IO_R);
+}
+#ifdef __linux__
+// stream header of a y4m pipe, read byte by byte so that nothing of the first frame is consumed
+static int _ffmpeg_y4m_pipe_header(FFStream* s, OUT FFInfo* pInfo)
+{
+    char pLine[256];
+    int n=0;
+    while(n<(int)sizeof(pLine)-1 && _ffmpeg_fd_read(s, pLine+n, 1)==1 && pLine[n]!='\n') n++;
+    pLine[n]=0;
+    return _ffmpeg_y4m_parse_header(pLine, pInfo);
+}
+// frame data of a y4m pipe: the "FRAME[ params]\n" line before every frame is dropped, s->nBytes counts frame data only
+static int64 _ffmpeg_y4m_pipe_read(FFStream* s, void* pData, int64 size)
+{
+    int64 n=0;
+    while(n<size)
+    {
+        int64 pos=(s->nBytes+n)%s->frameSize;
+        char pHead[8];
+        if(pos==0)
+        {
+            if(_ffmpeg_fd_read(s, pHead, 6)!=6 || strncmp(pHead, "FRAME", 5)!=0)
+                break;
+            while(pHead[5]!='\n')
+                if(_ffmpeg_fd_read(s, pHead+5, 1)!=1) return n;
+        }
+        int64 k=MIN(size-n, s->frameSize-pos);
+        int64 m=_ffmpeg_fd_read(s, (uint8*)pData+n, k);
+        n+=m;
+        if(m<k) break;
+    }
+    return n;
+}
+// opens a reader whose pixfmt and/or size come from ffmpeg itself, NULL (r untouched but for the spawn fields) if that fails
+static FILE* _ffmpeg_y4m_reader_open(FFReaderState* r, const char* pName, const char* pFFmpeg, const char* pParam, FFPixFmt pixfmt, int width, int height, int idxFrame)
+{
+    FFInfo info;
+    r->pName=strdup(pName), r->pFFmpeg=strdup(pFFmpeg), r->pParam=strdup(pParam);
+    r->pixfmt=pixfmt, r->width=(height>0?MAX(0, width):0), r->height=(width>0?MAX(0, height):0), r->isY4m=1, r->frameOffset=MAX(0, idxFrame);
+    FILE* fp=_ffmpeg_reader_spawn(r, r->frameOffset);
+    FFStream* s=ffmpeg_stream_find(fp);
+    if(s && s->pfnRead==_ffmpeg_fd_read && _ffmpeg_y4m_pipe_header(s, &info))
+    {
+        r->pixfmt=info.pixfmt, r->width=info.width, r->height=info.height, r->fps=info.fps;
+        r->frameSize=ffmpeg_yuv_compute_frame_size(r->width, r->height, r->pixfmt);
+        s->pfnRead=_ffmpeg_y4m_pipe_read, s->pReader=r, s->pfnFreeReader=_ffmpeg_reader_state_free, s->frameSize=r->frameSize;
+        return fp;
+    }
+    if(fp) _ffmpeg_pclose(fp);
+    free(r->pName); free(r->pFFmpeg); free(r->pParam);
+    r->pName=r->pFFmpeg=r->pParam=0, r->isY4m=0, r->frameOffset=0;
+    return NULL;
+}
+#endif
+static FILE* ffmpeg_create_reader_full(const char* pName, FFPixFmt pixfmt, int width, int height, int idxFrame, int threads, const char* pFFmpeg, const char* pParam)
+{
+    FILE *fp=0;
+    FFReaderState* r=(FFReaderState*)calloc(1, sizeof(FFReaderState));
+    int isVideo=!ffmpeg_is_rawfile(pName), isY4m=_ffmpeg_y4m_is_file(pName);
+    pFFmpeg=(pFFmpeg==0?FFMPEG_BIN:pFFmpeg);
+    pParam=(pParam==0?"":pParam);
+    if(threads>0) sprintf(r->pThread, "-threads %d", threads);
+#ifdef __linux__
+    // a video of unknown pixfmt or size: ffmpeg sends y4m and its stream header says what it is, no probe process beforehand.
+    // packed rgb has no y4m colorspace, those readers probe
+    if(isVideo && !isY4m && (pixfmt<=FF_YUV || ((width<=0 || height<=0) && _ffmpeg_y4m_has_pixfmt(pixfmt))) && (fp=_ffmpeg_y4m_reader_open(r, pName, pFFmpeg, pParam, pixfmt, width, height, idxFrame))!=NULL)
+        return fp;
+#endif
+    if(pixfmt<=FF_YUV || width<=0 || height<=0 || !isVideo || isY4m)
+    {
+        FFInfo info;
+        ffmpeg_get_video_info(pName, &info);
+        if(pixfmt<=FF_YUV)
+            pixfmt=info.pixfmt;
+        if(width<=0 || height<=0)
+            width=info.width, height=info.height;
+        r->fps=info.fps;
+#ifndef _WIN32
+        // same geometry and format as the raw or y4m file: map it instead of piping it through ffmpeg
+        if((!isVideo || isY4m) && pixfmt==info.pixfmt && width==info.width && height==info.height && pParam[0]==0)
+        {
+            FFYuvMap* pMap=ffmpeg_yuv_map_open(pName, info.pixfmt, info.width, info.height);
+            // y4m frames with parameters have no fixed stride, ffmpeg reads those
+            if(pMap || !isY4m)
+            {
+                free(r);
+                return pMap?_ffmpeg_yuv_map_stream(pMap, (int64)MAX(0, idxFrame)*pMap->frameSize):NULL;
+            }
+        }
+#endif
+        if(!isVideo)
+            sprintf(r->pSrcInfo, "-s %dx%d -pix_fmt %s -f rawvideo -r %g", info.width, info.height, ffmpeg_pixfmt2string(info.pixfmt), info.fps);
+    }
+    //if(threads<=0) threads=2;
+    r->pName=strdup(pName), r->pFFmpeg=strdup(pFFmpeg), r->pParam=strdup(pParam);
+    r->pixfmt=pixfmt, r->width=width, r->height=height, r->frameSize=ffmpeg_yuv_compute_frame_size(width, height, pixfmt);
+    r->frameOffset=MAX(0, idxFrame);
+    fp=_ffmpeg_reader_spawn(r, r->frameOffset);
+    FFStream* s=ffmpeg_stream_find(fp);
+    if(fp && s==0)
+    {
+        // popen() fallback: register a plain stdio stream so that the reader can still be positioned forward
+        s=(FFStream*)calloc(1, sizeof(FFStream));
+        s->fp=fp, s->fd=-1;
+        _ffmpeg_stream_register(s);
+    }
+    if(s)
+        s->pReader=r, s->pfnFreeReader=_ffmpeg_reader_state_free, s->frameSize=r->frameSize;
+    else
+        _ffmpeg_reader_state_free(r);
+    return fp;
+}
+static forceinline FILE* ffmpeg_create_reader_ex(const char* pName, FFPixFmt pixfmt, int width, int height, int threads, const char* pFFmpeg)
+{
+    return ffmpeg_create_reader_full(pName, pixfmt, width, height, 0, threads, pFFmpeg, NULL);
+}
+static forceinline FILE* ffmpeg_create_reader(const char* pName, FFPixFmt pixfmt)
+{
+    return ffmpeg_create_reader_ex(pName, pixfmt, 0, 0, 0, NULL);
+}
+// pixfmt, size and fps (0 if unknown) a reader delivers, e.g. after opening a video without giving them. returns 0 if fp is no reader
+static int ffmpeg_reader_get_info(FILE* fp, OUT FFInfo* pInfo)
+{
+    FFStream* s=ffmpeg_stream_find(fp);
+    memset(pInfo, 0, sizeof(FFInfo));
+#ifndef _WIN32
+    FFYuvMap* pMap=ffmpeg_get_yuv_map(fp);
+    if(pMap && !pMap->isWriter)
+    {
+        pInfo->pixfmt=pMap->pixfmt, pInfo->width=pMap->width, pInfo->height=pMap->height, pInfo->fps=pMap->fps, pInfo->frame_num=pMap->frameNum;
+        return 1;
+    }
+#endif
+    if(s==0 || s->pReader==0)
+        return 0;
+    pInfo->pixfmt=s->pReader->pixfmt, pInfo->width=s->pReader->width, pInfo->height=s->pReader->height, pInfo->fps=s->pReader->fps;
+    return 1;
+}
+static int64 ffmpeg_get_frame(FILE* fp, void* pData, int64 dataSize)
+{
+    return _ffmpeg_read(fp, pData, dataSize);
+}
+// fast scan for indexing and thumbnails: ffmpeg decodes keyframes only (-skip_frame nokey, the other frames are not even decoded),
+// keeps every stride-th frame and scales it to fit maxWidth x maxHeight. frames are read with ffmpeg_get_scan_frame(), which also
+// returns where each frame is in the source: from the container index of mp4/mkv, else from ffmpeg's showinfo log (linux)
+typedef struct FFScanParam
+{
+    int isKeyOnly;
+    int stride;                 // <=1: every (key)frame
+    int maxWidth, maxHeight;    // <=0: no limit, the aspect ratio is kept
+    FFPixFmt pixfmt;            // <=FF_YUV: the source pixfmt
+    int threads;
+}FFScanParam;
+static int _ffmpeg_scan_source_frame(FFReaderState* r, int64 k)
+{
+    FFIndex* pIndex=_ffmpeg_reader_index(r);
+    int64 idx=k*MAX(1, r->scanStride);
+    if(r->isKeyOnly)
+        return (pIndex && idx<pIndex->key_num?pIndex->pKeyFrame[idx]:-1);
+    return (pIndex==0 || idx<pIndex->frame_num?(int)idx:-1);
+}
+// pts (seconds) of the next showinfo line in the stderr file: ffmpeg logs it before the frame reaches the pipe
+static double _ffmpeg_scan_next_pts(FFStream* s, FFReaderState* r)
+{
+#ifdef __linux__
+    char pLine[1024];
+    while(s->errFd>=0)
+    {
+        ssize_t n=pread(s->errFd, pLine, sizeof(pLine)-1, r->errPos);
+        if(n<=0)
+            break;
+        pLine[n]=0;
+        char *pEnd=strchr(pLine, '\n'), *pTime;
+        if(pEnd==0 && n<(ssize_t)sizeof(pLine)-1)
+            break;
+        int64 len=(pEnd?pEnd-pLine+1:n);
+        r->errPos+=len;
+        // the parsed part of the log is given back every MB, a long scan would otherwise keep a line per frame. the size is
+        // kept, ffmpeg goes on writing at its offset and ffmpeg_stream_get_stat() still finds the tail
+        if(((r->errPos-len)>>20)!=(r->errPos>>20))
+            fallocate(s->errFd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, 0, r->errPos&~(((int64)1<<20)-1));
+        if(pEnd) *pEnd=0;
+        if(strstr(pLine, "showinfo") && strstr(pLine, " n:") && (pTime=strstr(pLine, "pts_time:"))!=NULL)
+            return atof(pTime+9);
+    }
+#endif
+    return -1;
+}
+// pWidth/pHeight/pPixfmt (if not NULL) receive the output geometry
+static FILE* ffmpeg_create_scan_reader(const char* pName, const FFScanParam* pParam, OUT int* pWidth, OUT int* pHeight, OUT FFPixFmt* pPixfmt)
+{
+    FFInfo info;
+    ffmpeg_get_video_info(pName, &info);
+    if(info.width<=0 || info.height<=0)
+    {
+        printf("ffmpeg_create_scan_reader: can not get '%s' info\n", pName);
+        return NULL;
+    }
+    FFReaderState* r=(FFReaderState*)calloc(1, sizeof(FFReaderState));
+    double scale=1;
+    if(pParam->maxWidth>0) scale=MIN(scale, (double)pParam->maxWidth/info.width);
+    if(pParam->maxHeight>0) scale=MIN(scale, (double)pParam->maxHeight/info.height);
+    r->pixfmt=(pParam->pixfmt>FF_YUV?pParam->pixfmt:info.pixfmt);
+    // even sizes keep subsampled chroma whole
+    r->width=(scale<1?MAX(2, (int)(info.width*scale)&~1):info.width), r->height=(scale<1?MAX(2, (int)(info.height*scale)&~1):info.height);
+    r->frameSize=ffmpeg_yuv_compute_frame_size(r->width, r->height, r->pixfmt), r->fps=info.fps;
+    r->pName=strdup(pName), r->pFFmpeg=strdup(FFMPEG_BIN), r->pParam=strdup("-an -sn -dn");
+    r->isScan=1, r->isKeyOnly=pParam->isKeyOnly, r->scanStride=MAX(1, pParam->stride);
+    if(ffmpeg_is_rawfile(pName))
+        sprintf(r->pSrcInfo, "-s %dx%d -pix_fmt %s -f rawvideo -r %g", info.width, info.height, ffmpeg_pixfmt2string(info.pixfmt), info.fps), r->isKeyOnly=0;
+    if(pParam->threads>0) sprintf(r->pThread, "-threads %d", pParam->threads);
+#ifdef __linux__
+    r->isShowInfo=(r->pSrcInfo[0]==0 && _ffmpeg_reader_index(r)==0);
+#endif
+    FILE* fp=_ffmpeg_reader_spawn(r, 0);
+    FFStream* s=ffmpeg_stream_find(fp);
+    if(fp && s==0)
+    {
+        s=(FFStream*)calloc(1, sizeof(FFStream));
+        s->fp=fp, s->fd=-1;
+        _ffmpeg_stream_register(s);
+    }
+    if(s==0)
+    {
+        _ffmpeg_reader_state_free(r);
+        return NULL;
+    }
+    s->pReader=r, s->pfnFreeReader=_ffmpeg_reader_state_free, s->frameSize=r->frameSize;
+    if(pWidth) *pWidth=r->width;
+    if(pHeight) *pHeight=r->height;
+    if(pPixfmt) *pPixfmt=r->pixfmt;
+    return fp;
+}
+// reads the next frame of a scan reader. pIdxFrame: frame index in the source (-1 if unknown), pSec: its time after the first frame (-1 if unknown)
+static int64 ffmpeg_get_scan_frame(FILE* fp, void* pData, int64 dataSize, OUT int* pIdxFrame, OUT double* pSec)
+{
+    FFStream* s=ffmpeg_stream_find(fp);
+    FFReaderState* r=(s?s->pReader:NULL);
+    int idx=(r && r->isScan?_ffmpeg_scan_source_frame(r, (s->nBytes+r->frameSize-1)/r->frameSize):-1);
+    int64 n=_ffmpeg_read(fp, pData, dataSize);
+    double sec=-1;
+    if(r && r->isScan && n>0)
+    {
+        FFIndex* pIndex=_ffmpeg_reader_index(r);
+        if(r->isShowInfo) sec=_ffmpeg_scan_next_pts(s, r);
+        else if(pIndex && idx>=0) sec=(pIndex->pPts[idx]-pIndex->pPts[0])*1e-6;
+        else if(idx>=0 && r->fps>0) sec=idx/r->fps;
+        if(idx<0 && sec>=0 && r->fps>0) idx=(int)(sec*r->fps+0.5);
+    }
+    if(pIdxFrame) *pIdxFrame=idx;
+    if(pSec) *pSec=sec;
+    return n;
+}
+static int64 ffmpeg_get_frame2(FILE* fp, void* pY, int64 ySize, void* pU, int64 uSize, void* pV, int64 vSize)
+{
+    int64 y=_ffmpeg_read(fp, pY, ySize), u=_ffmpeg_read(fp, pU, uSize), v=_ffmpeg_read(fp, pV, vSize);
+    return y+u+v;
+}
+static int64 ffmpeg_get_frame3(FILE* fp, uint8* ppData[4], FFPixFmt pixfmt, int width, int height)
+{
+    int64 pSize[4], nSize=0;
+    int scale=ffmpeg_is_10bit(pixfmt)+1, cn=ffmpeg_yuv_plane_size(width, height, pixfmt, pSize);
+    for(int i=0; i<cn; i++)
+        nSize+=_ffmpeg_read(fp, ppData[i], pSize[i])/scale;
+    return nSize;
+}
+// threads: encoder threads, <=0 leaves the choice to the encoder
+static FILE* ffmpeg_create_writer_full(const char* pName, FFPixFmt pixfmt, int width, int height, double fps, double crf, const char* pCodec, const char* pFFmpegParam, int threads, const char* pFFmpeg)
+{
+    FILE *fp=0;
+#ifndef _WIN32
+    // y4m of planar yuv or gray is written natively, size, pixfmt and fps go to its header
+    char pHeader[128];
+    if(_ffmpeg_y4m_is_file(pName) && pFFmpeg==0 && pFFmpegParam==0 && _ffmpeg_y4m_make_header(pixfmt, width, height, fps, pHeader))
+    {
+        FFYuvMap* pMap=ffmpeg_yuv_map_create_ex(pName, pixfmt, width, height, fps, 0);
+        return pMap?_ffmpeg_yuv_map_stream(pMap, 0):NULL;
+    }
+#endif
+    pFFmpeg=(pFFmpeg==0?FFMPEG_BIN:pFFmpeg);
+    if(!ffmpeg_is_rawfile(pName))
+    {
+        char pCmd[4096];
+        int n=sprintf(pCmd, "%s -y -loglevel error -f rawvideo -vcodec rawvideo -s %dx%d -pix_fmt %s -r %g -i - -an ", pFFmpeg, width, height, ffmpeg_pixfmt2string(pixfmt), fps);
+        if(pCodec) n+=sprintf(pCmd+n, "-vcodec %s ", pCodec);
+        if(crf>=0) n+=sprintf(pCmd+n, "-crf %g ", crf);
+        if(pFFmpegParam)
+            n+=sprintf(pCmd+n, "%s ", pFFmpegParam);
+        else if(pCodec && strcmp(pCodec, LIBX265)==0)
+            n+=sprintf(pCmd+n, "-tag:v hvc1 ");
+        if(threads>0) n+=sprintf(pCmd+n, "-threads %d ", threads);
+        n+=sprintf(pCmd+n, "\"%s\" 2>" IO_NULL " 1>" IO_NULL, pName);
+        fp=_ffmpeg_spawn(pCmd, IO_W);
+        _ffmpeg_stream_set_frame_size(fp, ffmpeg_yuv_compute_frame_size(width, height, pixfmt));
+    }
+    else
+    {
+#ifndef _WIN32
+        FFYuvMap* pMap=ffmpeg_yuv_map_create(pName, pixfmt, width, height, 0);
+        fp=(pMap?_ffmpeg_yuv_map_stream(pMap, 0):NULL);
+#else
+        fp=fopen(pName, "wb");
+#endif
+    }
+    return fp;
+}
+static forceinline FILE* ffmpeg_create_writer_ex(const char* pName, FFPixFmt pixfmt, int width, int height, double fps, double crf, const char* pCodec, const char* pFFmpegParam, const char* pFFmpeg)
+{
+    return ffmpeg_create_writer_full(pName, pixfmt, width, height, fps, crf, pCodec, pFFmpegParam, 4, pFFmpeg);
+}
+static forceinline FILE* ffmpeg_create_writer(const char* pName, FFPixFmt pixfmt, int width, int height, double fps, double crf, const char* pCodec, const char* pFFmpegParam)
+{
+    return ffmpeg_create_writer_ex(pName, pixfmt, width, height, fps, crf, pCodec, pFFmpegParam, 0);
+}
+static int64 ffmpeg_set_frame(FILE* fp, void* pData, int64 dataSize)
+{
+    return _ffmpeg_write(fp, pData, dataSize);
+}
+static int64 ffmpeg_set_frame2(FILE* fp, void* pY, int64 ySize, void* pU, int64 uSize, void* pV, int64 vSize)
+{
+    int64 y=_ffmpeg_write(fp, pY, ySize), u=_ffmpeg_write(fp, pU, uSize), v=_ffmpeg_write(fp, pV, vSize);
+    return y+u+v;
+}
+static int64 ffmpeg_set_frame3(FILE* fp, uint8* ppData[4], FFPixFmt pixfmt, int width, int height)
+{
+    int64 pSize[4], nSize=0;
+    int scale=ffmpeg_is_10bit(pixfmt)+1, cn=ffmpeg_yuv_plane_size(width, height, pixfmt, pSize);
+    for(int i=0; i<cn; i++)
+        nSize+=_ffmpeg_write(fp, ppData[i], pSize[i])/scale;
+    return nSize;
+}
+static void ffmpeg_close(FILE* fp)
+{
+    _ffmpeg_pclose(fp);
+}
+// cheap enough to call every frame from the thread that owns fp, from other threads the numbers may be slightly torn
+static FFStreamStat ffmpeg_stream_get_stat(FILE* fp)
+{
+    FFStreamStat stat;
+    FFStream* s=ffmpeg_stream_find(fp);
+    if(s)
+        _ffmpeg_stream_get_stat(s, &stat);
+    else
+        memset(&stat, 0, sizeof(stat)), stat.exitCode=-1;
+    return stat;
+}
+static void ffmpeg_stream_print_stat(const FFStreamStat* p, const char* pName)
+{
+    printf("%s: frames=%lld  %.2f MB  %.2f s  %.1f fps  %.1f MB/s  calls=%lld (short %lld)  blocked=%.1f ms  call p50=%.3f ms p99=%.3f ms max=%.3f ms  exit=%d\n",
+        pName?pName:"stream", (long long)p->frames, p->bytes/1e6, p->elapsedSec, p->fps, p->mbPerSec, (long long)p->calls, (long long)p->shortCalls,
+        p->blockedMs, p->p50CallMs, p->p99CallMs, p->maxCallMs, p->exitCode);
+    if(p->pStderr[0] && p->exitCode!=0 && !p->isRunning)
+        printf("%s stderr: %s\n", pName?pName:"stream", p->pStderr);
+}
+// ffmpeg_close() that also returns the final stats, the result is the exit code of the ffmpeg child (see FFStreamStat::exitCode)
+static int ffmpeg_close_ex(FILE* fp, OUT FFStreamStat* pStat)
+{
+    FFStreamStat stat;
+    _ffmpeg_pclose_ex(fp, &stat);
+    if(pStat) *pStat=stat;
+    return stat.exitCode;
+}
+// index of the frame the next ffmpeg_get_frame*() returns, -1 if unknown. for scan readers the index in the source
+static int ffmpeg_tell_frame(FILE* fp)
+{
+    FFStream* s=ffmpeg_stream_find(fp);
+    if(s && s->pReader && s->pReader->isScan)
+        return _ffmpeg_scan_source_frame(s->pReader, (s->nBytes+s->pReader->frameSize-1)/s->pReader->frameSize);
+    if(s && s->pReader && s->pReader->frameSize>0)
+        return s->pReader->frameOffset+(int)((s->nBytes+s->pReader->frameSize-1)/s->pReader->frameSize);
+#ifndef _WIN32
+    FFYuvMap* pMap=ffmpeg_get_yuv_map(fp);
+    if(pMap)
+        return (int)((pMap->pos+pMap->frameSize-1)/pMap->frameSize);
+#endif
+    return -1;
+}
+// discards size bytes of a reader
+static int64 _ffmpeg_reader_skip(FFStream* s, int64 size)
+{
+    int64 n=0;
+#ifdef __linux__
+    static int fdNull=-2;
+    if(fdNull==-2) fdNull=open(IO_NULL, O_WRONLY|O_CLOEXEC);
+    while(s->pfnRead==_ffmpeg_fd_read && fdNull>=0 && n<size)
+    {
+        ssize_t k=splice(s->fd, NULL, fdNull, NULL, (size_t)MIN(size-n, (int64)FF_PIPE_SIZE), SPLICE_F_MOVE);
+        if(k<0 && errno==EINTR) continue;
+        if(k<=0) break;
+        n+=k;
+    }
+    if(n==size || s->pfnRead==_ffmpeg_fd_read)
+    {
+        s->nBytes+=n;
+        return n;
+    }
+#endif
+    int bufSize=(int)MIN(size-n, (int64)FF_PIPE_SIZE);
+    uint8* pBuf=(uint8*)malloc(MAX(1, bufSize));
+    while(n<size)
+    {
+        int64 k=_ffmpeg_read(s->fp, pBuf, MIN(size-n, (int64)bufSize));
+        if(k<=0) break;
+        n+=k;
+    }
+    free(pBuf);
+    return n;
+}
+#define FF_SEEK_SKIP_SEC 2.0  // without a container index, forward seeks up to this far decode through instead of restarting
+// positions a reader of ffmpeg_create_reader*() so that the next ffmpeg_get_frame*() returns frame idxFrame (presentation order).
+// inside the current GOP ahead of the reader the frames in between are skipped, otherwise ffmpeg is restarted at the
+// keyframe before idxFrame and the landing frame is selected by its timestamp. the FILE* stays the same. returns 1 on success
+static int ffmpeg_seek_frame(FILE* fp, int idxFrame)
+{
+    FFStream* s=ffmpeg_stream_find(fp);
+    if(s==0 || idxFrame<0)
+        return 0;
+#ifndef _WIN32
+    FFYuvMap* pMap=ffmpeg_get_yuv_map(fp);
+    if(pMap)
+    {
+        pMap->pos=(int64)idxFrame*pMap->frameSize;
+        return idxFrame<pMap->frameNum;
+    }
+#endif
+    FFReaderState* r=s->pReader;
+    if(r==0 || r->frameSize<=0 || r->isScan)
+        return 0;
+    int64 frameSize=r->frameSize;
+    int cur=ffmpeg_tell_frame(fp);
+    // finish a partially read frame first
+    if(s->nBytes%frameSize)
+        _ffmpeg_reader_skip(s, frameSize-s->nBytes%frameSize);
+    FFIndex* pIndex=_ffmpeg_reader_index(r);
+    int isForward=(idxFrame>=cur);
+    if(isForward && pIndex)
+    {
+        // keyframe at or before idxFrame: if the reader is already past it, decoding on is cheaper than a restart
+        int lo=0, hi=pIndex->key_num-1, key=0;
+        while(lo<=hi)
+        {
+            int mid=(lo+hi)/2;
+            if(pIndex->pKeyFrame[mid]<=idxFrame) key=pIndex->pKeyFrame[mid], lo=mid+1;
+            else hi=mid-1;
+        }
+        isForward=(key<=cur);
+    }
+    else if(isForward)  // no keyframe positions: skipping only beats a restart over a short distance
+        isForward=(idxFrame-cur<=(r->fps>0?r->fps:25)*FF_SEEK_SKIP_SEC);
+#ifndef __linux__
+    isForward=(idxFrame>=cur);  // no restart without fd replacement
+#endif
+    if(isForward)
+        return _ffmpeg_reader_skip(s, (int64)(idxFrame-cur)*frameSize)==(int64)(idxFrame-cur)*frameSize;
+#ifdef __linux__
+    // a worker pool slot is given back before the new process takes one
+    if(s->pPriv && s->pid>0)
+        kill((pid_t)s->pid, SIGTERM), _ffmpeg_fd_reap(s);
+    FILE* fpNew=_ffmpeg_reader_spawn(r, idxFrame);
+    FFStream* t=_ffmpeg_stream_unregister(fpNew);
+    if(t==0 || t->pfnRead!=_ffmpeg_fd_read)
+    {
+        if(t && t->errFd>0) close(t->errFd);
+        if(t) _ffmpeg_fd_close(t), free(t);
+        else if(fpNew) pclose(fpNew);
+        return 0;
+    }
+    // the old pipe end is replaced in place, the old ffmpeg gets EPIPE and exits. dup2() would clear close-on-exec and
+    // every later ffmpeg would inherit the read end, keeping a killed one blocked on a pipe nobody drains
+    dup3(t->fd, s->fd, O_CLOEXEC);
+    fclose(fpNew);
+    if(s->pid>0)
+        kill((pid_t)s->pid, SIGTERM), _ffmpeg_fd_reap(s);
+    if(s->errFd>0) close(s->errFd);
+    s->pid=t->pid, s->pPriv=t->pPriv, s->nBytes=0, s->errFd=t->errFd, s->isExited=0, s->exitStatus=0;
+    r->frameOffset=idxFrame;
+    free(t);
+    FFInfo info;
+    return !r->isY4m || _ffmpeg_y4m_pipe_header(s, &info);
+#else
+    return 0;
+#endif
+}
+static int ffmpeg_get_frame_num(const char* pName)
+{
+    int frameNum=0;
+    FFInfo info;
+    FFIndex* pIndex=ffmpeg_get_video_index(pName);
+    if(pIndex)
+    {
+        frameNum=pIndex->frame_num;
+        ffmpeg_free_video_index(pIndex);
+        return frameNum;
+    }
+    ffmpeg_get_video_info(pName, &info);
+    if(info.frame_num>0)
+        return info.frame_num;
+    if(info.width*info.height>0 && info.pixfmt>FF_YUV)
+    {
+        int64 frameSize=ffmpeg_yuv_compute_frame_size(info.width, info.height, info.pixfmt);
+        uint8 *pData=(uint8*)malloc((size_t)frameSize);
+        FILE* fp=ffmpeg_create_reader(pName, info.pixfmt);
+        while(ffmpeg_get_frame(fp, pData, frameSize)==frameSize)
+            frameNum++;
+        free(pData);
+        ffmpeg_close(fp);
+    }
+    return frameNum;
+}
+
+// reference counted frame with 64-byte aligned planes and strides, recycled through a lock-free FFFramePool.
+// a frame from ffmpeg_frame_alloc()/ffmpeg_frame_pool_get() has refCount 1, every ffmpeg_frame_ref() needs one ffmpeg_frame_unref()
+#define FF_FRAME_ALIGN 64
+typedef struct FFFramePool FFFramePool;
+typedef struct FFFrame
+{
+    uint8* ppData[4];
+    int pStride[4];  // bytes per row, multiple of FF_FRAME_ALIGN
+    int planeNum;
+    FFPixFmt pixfmt;
+    int width, height;
+    int64 pts;  // frame index in the stream, -1 if unknown
+    volatile long refCount;
+    FFFramePool* pPool;
+    uint8* pBuf;
+    size_t bufSize;
+}FFFrame;
+typedef struct FFFramePoolStat
+{
+    int64 allocs, reuses, drops;  // drops: frames freed on unref because the pool was full or closed
+}FFFramePoolStat;
+// bounded MPMC queue of free frames (Vyukov): cell i is writable when seq==pos and readable when seq==pos+1
+typedef struct _FFFrameCell
+{
+    volatile long seq;
+    FFFrame* pFrame;
+}_FFFrameCell;
+struct FFFramePool
+{
+    FFPixFmt pixfmt;
+    int width, height;
+    long mask;
+    _FFFrameCell* pCell;
+    char pad0[FF_FRAME_ALIGN];
+    volatile long enqPos;
+    char pad1[FF_FRAME_ALIGN];
+    volatile long deqPos;
+    char pad2[FF_FRAME_ALIGN];
+    volatile long refCount, isClosed;  // refCount: 1 for the owner + 1 per frame alive
+    volatile long allocs, reuses, drops;
+};
+static FFFrame* _ffmpeg_frame_new(FFPixFmt pixfmt, int width, int height)
+{
+    int64 pSize[4];
+    int yshift=ffmpeg_yuv_half_height(pixfmt), cn=ffmpeg_yuv_plane_size(width, height, pixfmt, pSize);
+    FFFrame* f=(FFFrame*)calloc(1, sizeof(FFFrame));
+    if(f==0)
+        return NULL;
+    f->pixfmt=pixfmt, f->width=width, f->height=height, f->planeNum=cn, f->pts=-1, f->refCount=1;
     for(int i=0; i<cn; i++)
-        nSize+=(int)fread(ppData[i], scale, pSize[i], fp);
+    {
+        f->pStride[i]=(ffmpeg_yuv_plane_stride(width, pixfmt, i)+FF_FRAME_ALIGN-1)&~(FF_FRAME_ALIGN-1);
+        f->bufSize+=(size_t)f->pStride[i]*(i==0?height:height>>yshift);
+    }
+    // page aligned so that pipe reads can land directly in the frame
+    f->pBuf=(uint8*)ffmpeg_aligned_malloc(MAX(f->bufSize, 1), 4096);
+    if(f->pBuf==0)
+    {
+        printf("ffmpeg_frame: alloc %lld bytes failed\n", (long long)f->bufSize);
+        free(f);
+        return NULL;
+    }
+    size_t offset=0;
+    for(int i=0; i<cn; offset+=(size_t)f->pStride[i]*(i==0?height:height>>yshift), i++)
+        f->ppData[i]=f->pBuf+offset;
+    return f;
+}
+static void _ffmpeg_frame_delete(FFFrame* f)
+{
+    ffmpeg_aligned_free(f->pBuf);
+    free(f);
+}
+static forceinline FFFrame* ffmpeg_frame_alloc(FFPixFmt pixfmt, int width, int height)
+{
+    return _ffmpeg_frame_new(pixfmt, width, height);
+}
+static forceinline FFFrame* ffmpeg_frame_ref(FFFrame* f)
+{
+    ffmpeg_atomic_add(&f->refCount, 1);
+    return f;
+}
+// bytes of the frame without padding, as ffmpeg_get_frame() would transfer
+static forceinline int64 ffmpeg_frame_data_size(const FFFrame* f)
+{
+    return ffmpeg_yuv_compute_frame_size(f->width, f->height, f->pixfmt);
+}
+static int _ffmpeg_frame_pool_push(FFFramePool* p, FFFrame* f)
+{
+    long pos=ffmpeg_atomic_load(&p->enqPos);
+    _FFFrameCell* c;
+    for(;;)
+    {
+        c=&p->pCell[pos&p->mask];
+        long dif=(long)((unsigned long)ffmpeg_atomic_load(&c->seq)-(unsigned long)pos);
+        if(dif==0 && ffmpeg_atomic_cas(&p->enqPos, pos, pos+1))
+            break;
+        if(dif<0)
+            return 0;
+        pos=ffmpeg_atomic_load(&p->enqPos);
+    }
+    c->pFrame=f;
+    ffmpeg_atomic_store(&c->seq, pos+1);
+    return 1;
+}
+static FFFrame* _ffmpeg_frame_pool_pop(FFFramePool* p)
+{
+    long pos=ffmpeg_atomic_load(&p->deqPos);
+    _FFFrameCell* c;
+    for(;;)
+    {
+        c=&p->pCell[pos&p->mask];
+        long dif=(long)((unsigned long)ffmpeg_atomic_load(&c->seq)-(unsigned long)(pos+1));
+        if(dif==0 && ffmpeg_atomic_cas(&p->deqPos, pos, pos+1))
+            break;
+        if(dif<0)
+            return NULL;
+        pos=ffmpeg_atomic_load(&p->deqPos);
+    }
+    FFFrame* f=c->pFrame;
+    ffmpeg_atomic_store(&c->seq, pos+p->mask+1);
+    return f;
+}
+static void _ffmpeg_frame_pool_unref(FFFramePool* p)
+{
+    if(ffmpeg_atomic_add(&p->refCount, -1)>0)
+        return;
+    free(p->pCell);
+    ffmpeg_aligned_free(p);
+}
+static void _ffmpeg_frame_pool_drain(FFFramePool* p)
+{
+    FFFrame* f;
+    while((f=_ffmpeg_frame_pool_pop(p))!=NULL)
+    {
+        _ffmpeg_frame_delete(f);
+        _ffmpeg_frame_pool_unref(p);
+    }
+}
+static void ffmpeg_frame_unref(FFFrame* f)
+{
+    if(f==0 || ffmpeg_atomic_add(&f->refCount, -1)>0)
+        return;
+    FFFramePool* p=f->pPool;
+    if(p==0)
+    {
+        _ffmpeg_frame_delete(f);
+        return;
+    }
+    // the pool may be closed (and drained) between the check and the push: hold it until the frame is accounted for
+    ffmpeg_atomic_add(&p->refCount, 1);
+    if(!ffmpeg_atomic_load(&p->isClosed) && _ffmpeg_frame_pool_push(p, f))
+    {
+        if(ffmpeg_atomic_load(&p->isClosed))
+            _ffmpeg_frame_pool_drain(p);
+        _ffmpeg_frame_pool_unref(p);
+        return;
+    }
+    _ffmpeg_frame_pool_unref(p);
+    ffmpeg_atomic_add(&p->drops, 1);
+    _ffmpeg_frame_delete(f);
+    _ffmpeg_frame_pool_unref(p);
+}
+// capacity: number of free frames kept for reuse (rounded up to a power of two), frames beyond it are allocated and freed on demand
+static FFFramePool* ffmpeg_frame_pool_create(FFPixFmt pixfmt, int width, int height, int capacity)
+{
+    long num=2;
+    while(num<capacity) num<<=1;
+    FFFramePool* p=(FFFramePool*)ffmpeg_aligned_malloc(sizeof(FFFramePool), FF_FRAME_ALIGN);
+    if(p==0)
+        return NULL;
+    memset(p, 0, sizeof(FFFramePool));
+    p->pCell=(_FFFrameCell*)calloc(num, sizeof(_FFFrameCell));
+    if(p->pCell==0)
+    {
+        ffmpeg_aligned_free(p);
+        return NULL;
+    }
+    p->pixfmt=pixfmt, p->width=width, p->height=height, p->mask=num-1, p->refCount=1;
+    for(long i=0; i<num; i++)
+        p->pCell[i].seq=i;
+    return p;
+}
+static FFFrame* ffmpeg_frame_pool_get(FFFramePool* p)
+{
+    FFFrame* f=_ffmpeg_frame_pool_pop(p);
+    if(f)
+        ffmpeg_atomic_add(&p->reuses, 1);
+    else if((f=_ffmpeg_frame_new(p->pixfmt, p->width, p->height))!=NULL)
+    {
+        f->pPool=p;
+        ffmpeg_atomic_add(&p->refCount, 1);
+        ffmpeg_atomic_add(&p->allocs, 1);
+    }
+    if(f)
+        f->refCount=1, f->pts=-1;
+    return f;
+}
+static FFFramePoolStat ffmpeg_frame_pool_get_stat(FFFramePool* p)
+{
+    FFFramePoolStat s={ffmpeg_atomic_load(&p->allocs), ffmpeg_atomic_load(&p->reuses), ffmpeg_atomic_load(&p->drops)};
+    return s;
+}
+// frames still referenced stay valid, they are freed by their last ffmpeg_frame_unref()
+static void ffmpeg_frame_pool_close(FFFramePool* p)
+{
+    if(p==0)
+        return;
+    ffmpeg_atomic_store(&p->isClosed, 1);
+    _ffmpeg_frame_pool_drain(p);
+    _ffmpeg_frame_pool_unref(p);
+}
+#define FF_STAGE_BYTES (8<<20)  // padded planes move through the staging buffer in pieces of at most this many bytes
+// rows of a padded plane per read/write call: the whole plane when it fits the stream's staging buffer, 1 without one
+// (a plain stdio stream, which buffers by itself, or out of memory)
+static int _ffmpeg_frame_stage_rows(FILE* fp, const FFFrame* f, OUT uint8** ppStage)
+{
+    FFStream* s=ffmpeg_stream_find(fp);
+    int64 size=MIN((int64)ffmpeg_yuv_plane_stride(f->width, f->pixfmt, 0)*f->height, FF_STAGE_BYTES);  // plane 0 is the largest
+    if(s && s->stageSize<size)
+    {
+        free(s->pStage);
+        s->pStage=(uint8*)malloc((size_t)size), s->stageSize=(s->pStage?size:0);
+    }
+    *ppStage=(s?s->pStage:NULL);
+    return *ppStage?MAX(1, (int)(size/ffmpeg_yuv_plane_stride(f->width, f->pixfmt, 0))):1;
+}
+// reads one frame into f, plane by plane through the stream's staging buffer into the padded planes. returns the bytes read
+// (ffmpeg_frame_data_size() for a full frame)
+static int64 ffmpeg_get_frame_ex(FILE* fp, FFFrame* f)
+{
+    int yshift=ffmpeg_yuv_half_height(f->pixfmt), isPacked=1;
+    int64 nSize=0;
+    f->pts=ffmpeg_tell_frame(fp);
+    for(int i=0; i<f->planeNum; i++)
+        isPacked&=(f->pStride[i]==ffmpeg_yuv_plane_stride(f->width, f->pixfmt, i));
+    if(isPacked)
+        return ffmpeg_get_frame(fp, f->pBuf, ffmpeg_frame_data_size(f));
+    uint8* pStage;
+    int stageRows=_ffmpeg_frame_stage_rows(fp, f, &pStage);
+    for(int i=0; i<f->planeNum; i++)
+    {
+        int rowSize=ffmpeg_yuv_plane_stride(f->width, f->pixfmt, i), rows=(i==0?f->height:f->height>>yshift);
+        for(int y=0, k; y<rows; y+=k)
+        {
+            uint8* pDst=f->ppData[i]+(size_t)y*f->pStride[i];
+            k=(pStage?MIN(stageRows, rows-y):1);
+            int64 n=_ffmpeg_read(fp, pStage?pStage:pDst, (int64)k*rowSize);
+            for(int64 j=0; pStage && j<n; j+=rowSize)
+                memcpy(pDst+(size_t)(j/rowSize)*f->pStride[i], pStage+j, (size_t)MIN(rowSize, n-j));
+            nSize+=n;
+            if(n<(int64)k*rowSize)
+                return nSize;
+        }
+    }
+    return nSize;
+}
+static int64 ffmpeg_set_frame_ex(FILE* fp, const FFFrame* f)
+{
+    int yshift=ffmpeg_yuv_half_height(f->pixfmt), isPacked=1;
+    int64 nSize=0;
+    for(int i=0; i<f->planeNum; i++)
+        isPacked&=(f->pStride[i]==ffmpeg_yuv_plane_stride(f->width, f->pixfmt, i));
+    if(isPacked)
+        return ffmpeg_set_frame(fp, f->pBuf, ffmpeg_frame_data_size(f));
+    uint8* pStage;
+    int stageRows=_ffmpeg_frame_stage_rows(fp, f, &pStage);
+    for(int i=0; i<f->planeNum; i++)
+    {
+        int rowSize=ffmpeg_yuv_plane_stride(f->width, f->pixfmt, i), rows=(i==0?f->height:f->height>>yshift);
+        for(int y=0, k; y<rows; y+=k)
+        {
+            const uint8* pSrc=f->ppData[i]+(size_t)y*f->pStride[i];
+            k=(pStage?MIN(stageRows, rows-y):1);
+            for(int j=0; pStage && j<k; j++)
+                memcpy(pStage+(size_t)j*rowSize, pSrc+(size_t)j*f->pStride[i], rowSize);
+            int64 n=_ffmpeg_write(fp, pStage?pStage:pSrc, (int64)k*rowSize);
+            nSize+=n;
+            if(n<(int64)k*rowSize)
+                return nSize;
+        }
+    }
+    return nSize;
+}
+
+// row-slice streaming for frames too large to hold (an 8K RGB48 frame is ~200 MB): a frame arrives as slices of up to
+// sliceRows rows of one plane in pipe order (plane 0 top to bottom, then plane 1 ...; packed RGB is one plane, so it streams
+// truly row-wise). the reader owns one slice buffer, processing starts after the first slice and peak memory is a slice
+#define FF_SLICE_ROWS 64
+typedef struct FFSlice
+{
+    int64 frame;  // frame index, counted from the first slice read
+    int plane, y, rows;  // rows [y, y+rows) of plane
+    int width, rowBytes, stride;  // width of the plane in pixels, bytes per row without/with padding
+    int isFirst, isLast;  // first/last slice of the frame
+    uint8* pData;
+}FFSlice;
+typedef struct FFSliceReader
+{
+    FILE* fp;
+    FFPixFmt pixfmt;
+    int width, height, planeNum, sliceRows;
+    int pWidth[4], pRowBytes[4], pRows[4];
+    int plane, y;
+    int64 frame;
+    uint8* pBuf;
+}FFSliceReader;
+static void ffmpeg_slice_reader_close(FFSliceReader* p)
+{
+    if(p==0)
+        return;
+    ffmpeg_aligned_free(p->pBuf);
+    free(p);
+}
+// fp: any reader of pixfmt width x height, sliceRows<=0: FF_SLICE_ROWS. for 4:2:0 chroma slices hold sliceRows/2 rows so
+// that slice k of every plane covers the same picture rows
+static FFSliceReader* ffmpeg_slice_reader_create(FILE* fp, FFPixFmt pixfmt, int width, int height, int sliceRows)
+{
+    int64 pSize[4], maxRowBytes=0;
+    FFSliceReader* p=(FFSliceReader*)calloc(1, sizeof(FFSliceReader));
+    if(p==0 || fp==0 || width<=0 || height<=0 || ffmpeg_yuv_compute_frame_size(width, height, pixfmt)<=0)
+    {
+        free(p);
+        return NULL;
+    }
+    p->fp=fp, p->pixfmt=pixfmt, p->width=width, p->height=height, p->sliceRows=(sliceRows>0?sliceRows:FF_SLICE_ROWS);
+    p->planeNum=ffmpeg_yuv_plane_size(width, height, pixfmt, pSize);
+    for(int i=0; i<p->planeNum; i++)
+    {
+        p->pRowBytes[i]=ffmpeg_yuv_plane_stride(width, pixfmt, i), p->pRows[i]=(i==0?height:height>>ffmpeg_yuv_half_height(pixfmt));
+        p->pWidth[i]=(i==0?width:width>>ffmpeg_yuv_half_width(pixfmt));
+        maxRowBytes=MAX(maxRowBytes, p->pRowBytes[i]);
+    }
+    if((p->pBuf=(uint8*)ffmpeg_aligned_malloc((size_t)(maxRowBytes*p->sliceRows), 4096))==NULL)
+    {
+        printf("ffmpeg_slice_reader_create: alloc %lld bytes failed\n", (long long)(maxRowBytes*p->sliceRows));
+        ffmpeg_slice_reader_close(p);
+        return NULL;
+    }
+    return p;
+}
+// reads the next slice into pSlice (pData stays valid until the next call). returns 1, 0 at the end of the stream or on a
+// short read, the incomplete frame is dropped then
+static int ffmpeg_slice_read(FFSliceReader* p, OUT FFSlice* pSlice)
+{
+    int plane=p->plane, sliceRows=(plane==0?p->sliceRows:MAX(1, p->sliceRows>>ffmpeg_yuv_half_height(p->pixfmt)));
+    int rows=MIN(sliceRows, p->pRows[plane]-p->y);
+    int64 size=(int64)rows*p->pRowBytes[plane];
+    if(_ffmpeg_read(p->fp, p->pBuf, size)!=size)
+        return 0;
+    pSlice->frame=p->frame, pSlice->plane=plane, pSlice->y=p->y, pSlice->rows=rows;
+    pSlice->width=p->pWidth[plane], pSlice->rowBytes=pSlice->stride=p->pRowBytes[plane];
+    pSlice->isFirst=(plane==0 && p->y==0), pSlice->isLast=(plane==p->planeNum-1 && p->y+rows==p->pRows[plane]);
+    pSlice->pData=p->pBuf;
+    if((p->y+=rows)==p->pRows[plane])
+        p->y=0, p->plane=(plane+1)%p->planeNum, p->frame+=(p->plane==0);
+    return 1;
+}
+// writes the rows of a slice (stride may include padding). slices must come in pipe order, as ffmpeg_slice_read() returns
+// them; returns the bytes written
+static int64 ffmpeg_slice_write(FILE* fp, const FFSlice* pSlice)
+{
+    int64 nSize=0;
+    if(pSlice->stride==pSlice->rowBytes)
+        return _ffmpeg_write(fp, pSlice->pData, (int64)pSlice->rows*pSlice->rowBytes);
+    for(int y=0; y<pSlice->rows; y++)
+    {
+        int64 n=_ffmpeg_write(fp, pSlice->pData+(size_t)y*pSlice->stride, pSlice->rowBytes);
+        nSize+=n;
+        if(n<pSlice->rowBytes)
+            break;
+    }
     return nSize;
 }
-static FILE* ffmpeg_create_writer_ex(const char* pName, FFPixFmt pixfmt, int width, int height, double fps, double crf, const char* pCodec, const char* pFFmpegParam, const char* pFFmpeg)
+// converts src into the format of dst (same size), see ffmpeg_convert()
+static forceinline int ffmpeg_frame_convert(const FFFrame* pSrc, FFFrame* pDst, FFColSpc spc, int threads)
+{
+    if(pSrc->width!=pDst->width || pSrc->height!=pDst->height)
+        return 0;
+    pDst->pts=pSrc->pts;
+    return ffmpeg_convert((const uint8* const*)pSrc->ppData, pSrc->pStride, pSrc->pixfmt, pDst->ppData, pDst->pStride, pDst->pixfmt, pSrc->width, pSrc->height, spc, threads);
+}
+// resamples src to the size of dst (same pixfmt), see ffmpeg_scale()
+static forceinline int ffmpeg_frame_scale(const FFFrame* pSrc, FFFrame* pDst, int threads)
+{
+    if(pSrc->pixfmt!=pDst->pixfmt)
+        return 0;
+    pDst->pts=pSrc->pts;
+    return ffmpeg_scale((const uint8* const*)pSrc->ppData, pSrc->pStride, pDst->ppData, pDst->pStride, pSrc->pixfmt, pSrc->width, pSrc->height, pDst->width, pDst->height, threads);
+}
+
+// asynchronous read-ahead/write-behind: a background thread moves frames between the ffmpeg pipe and a ring of bufNum buffers.
+// reader: p=ffmpeg_async_get_frame() ... ffmpeg_async_release_frame(); writer: p=ffmpeg_async_acquire_frame() ... ffmpeg_async_submit_frame().
+// frames are released/submitted in the order they were handed out, several may be held at the same time (up to bufNum).
+// transcode without a copy: p=ffmpeg_async_get_frame(pReader) ... ffmpeg_async_forward_frame(pWriter, pReader, p).
+typedef struct FFAsyncStat
+{
+    int64 frames;
+    int64 appWaits, pipeWaits;  // appWaits: app blocked on ffmpeg (ffmpeg is the bottleneck), pipeWaits: pipe thread blocked on app (app is the bottleneck)
+    double appWaitMs, pipeWaitMs;
+}FFAsyncStat;
+typedef struct FFAsync
+{
+    FILE* fp;
+    int isWriter, bufNum;
+    int64 frameSize;
+    uint8* pBuf;
+    int64* pLen;
+    uint8** ppFrom;  // writer: slot data forwarded from pFrom's ring instead of pBuf
+    struct FFAsync* pFrom;
+    int head, count, borrowed;  // [head, head+count) filled slots, the first 'borrowed' of them (reader) or after them (writer) are held by app
+    int isEnd, isError;
+    FFAsyncStat stat;
+    FFMutex mutex;
+    FFCond cond;
+    FFThread thread;
+}FFAsync;
+#define _ffmpeg_async_slot(p, i) ((p)->pBuf+(size_t)((i)%(p)->bufNum)*(p)->frameSize)
+static void _ffmpeg_async_wait(FFAsync* p, int isApp)
+{
+    int64 t=ffmpeg_get_time_us();
+    ffmpeg_cond_wait(&p->cond, &p->mutex);
+    t=ffmpeg_get_time_us()-t;
+    if(isApp) p->stat.appWaits++, p->stat.appWaitMs+=t*1e-3;
+    else p->stat.pipeWaits++, p->stat.pipeWaitMs+=t*1e-3;
+}
+static void* _ffmpeg_async_reader_proc(void* pArg)
+{
+    FFAsync* p=(FFAsync*)pArg;
+    ffmpeg_mutex_lock(&p->mutex);
+    while(!p->isEnd)
+    {
+        if(p->count==p->bufNum)
+        {
+            _ffmpeg_async_wait(p, 0);
+            continue;
+        }
+        int idx=(p->head+p->count)%p->bufNum;
+        ffmpeg_mutex_unlock(&p->mutex);
+        int64 len=ffmpeg_get_frame(p->fp, _ffmpeg_async_slot(p, idx), p->frameSize);
+        ffmpeg_mutex_lock(&p->mutex);
+        p->pLen[idx]=len;
+        if(len>0) p->count++;
+        if(len<p->frameSize) p->isEnd=1;
+        ffmpeg_cond_broadcast(&p->cond);
+    }
+    ffmpeg_mutex_unlock(&p->mutex);
+    return NULL;
+}
+// gives back the oldest frame returned by ffmpeg_async_get_frame()
+static void ffmpeg_async_release_frame(FFAsync* p)
+{
+    ffmpeg_mutex_lock(&p->mutex);
+    if(p->borrowed>0)
+    {
+        p->head=(p->head+1)%p->bufNum, p->count--, p->borrowed--;
+        ffmpeg_cond_broadcast(&p->cond);
+    }
+    ffmpeg_mutex_unlock(&p->mutex);
+}
+static void* _ffmpeg_async_writer_proc(void* pArg)
+{
+    FFAsync* p=(FFAsync*)pArg;
+    ffmpeg_mutex_lock(&p->mutex);
+    while(p->count>0 || !p->isEnd)
+    {
+        if(p->count==0)
+        {
+            _ffmpeg_async_wait(p, 0);
+            continue;
+        }
+        int idx=p->head;
+        int64 len=p->pLen[idx];
+        uint8* pData=p->ppFrom[idx];
+        FFAsync* pFrom=p->pFrom;
+        ffmpeg_mutex_unlock(&p->mutex);
+        int64 n=(p->isError?len:ffmpeg_set_frame(p->fp, pData?pData:_ffmpeg_async_slot(p, idx), len));
+        if(pData) ffmpeg_async_release_frame(pFrom);
+        ffmpeg_mutex_lock(&p->mutex);
+        if(n<len) p->isError=1;
+        p->head=(p->head+1)%p->bufNum, p->count--;
+        ffmpeg_cond_broadcast(&p->cond);
+    }
+    ffmpeg_mutex_unlock(&p->mutex);
+    return NULL;
+}
+static FFAsync* _ffmpeg_async_create(FILE* fp, int64 frameSize, int bufNum, int isWriter)
+{
+    if(fp==0 || frameSize<=0)
+        return NULL;
+    FFAsync* p=(FFAsync*)calloc(1, sizeof(FFAsync));
+    if(p==0)
+        return NULL;
+    p->fp=fp, p->isWriter=isWriter, p->frameSize=frameSize, p->bufNum=MAX(2, bufNum);
+    p->pBuf=(uint8*)ffmpeg_aligned_malloc((size_t)p->bufNum*frameSize, 4096);
+    p->pLen=(int64*)calloc(p->bufNum, sizeof(int64));
+    p->ppFrom=(uint8**)calloc(p->bufNum, sizeof(uint8*));
+    if(p->pBuf==0 || p->pLen==0 || p->ppFrom==0)
+    {
+        printf("ffmpeg_async: alloc %d x %lld bytes failed\n", p->bufNum, (long long)frameSize);
+        ffmpeg_aligned_free(p->pBuf); free(p->pLen); free(p->ppFrom); free(p);
+        return NULL;
+    }
+    ffmpeg_mutex_init(&p->mutex);
+    ffmpeg_cond_init(&p->cond);
+    if(!ffmpeg_thread_create(&p->thread, isWriter?_ffmpeg_async_writer_proc:_ffmpeg_async_reader_proc, p))
+    {
+        ffmpeg_cond_destroy(&p->cond); ffmpeg_mutex_destroy(&p->mutex);
+        ffmpeg_aligned_free(p->pBuf); free(p->pLen); free(p->ppFrom); free(p);
+        return NULL;
+    }
+    return p;
+}
+// fp is still owned by the caller: ffmpeg_async_close() first, then ffmpeg_close(fp)
+static forceinline FFAsync* ffmpeg_async_create_reader(FILE* fp, int64 frameSize, int bufNum)
+{
+    return _ffmpeg_async_create(fp, frameSize, bufNum, 0);
+}
+static forceinline FFAsync* ffmpeg_async_create_writer(FILE* fp, int64 frameSize, int bufNum)
+{
+    return _ffmpeg_async_create(fp, frameSize, bufNum, 1);
+}
+// returns the next decoded frame (NULL at the end of stream), valid until it is released
+static uint8* ffmpeg_async_get_frame(FFAsync* p, OUT int64* pSize)
+{
+    uint8* pData=NULL;
+    ffmpeg_mutex_lock(&p->mutex);
+    while(p->borrowed>=p->count && !p->isEnd)
+        _ffmpeg_async_wait(p, 1);
+    if(p->borrowed<p->count)
+    {
+        int idx=(p->head+p->borrowed++)%p->bufNum;
+        pData=_ffmpeg_async_slot(p, idx);
+        if(pSize) *pSize=p->pLen[idx];
+        p->stat.frames++;
+    }
+    else if(pSize) *pSize=0;
+    ffmpeg_mutex_unlock(&p->mutex);
+    return pData;
+}
+// returns a free buffer of frameSize bytes to be filled by app (NULL if the encoder pipe is broken)
+static uint8* ffmpeg_async_acquire_frame(FFAsync* p)
+{
+    uint8* pData=NULL;
+    ffmpeg_mutex_lock(&p->mutex);
+    while(p->count+p->borrowed>=p->bufNum && !p->isError)
+        _ffmpeg_async_wait(p, 1);
+    if(!p->isError)
+        pData=_ffmpeg_async_slot(p, p->head+p->count+p->borrowed++);
+    ffmpeg_mutex_unlock(&p->mutex);
+    return pData;
+}
+// queues the oldest acquired buffer for writing, dataSize<=0 means frameSize
+static int ffmpeg_async_submit_frame(FFAsync* p, int64 dataSize)
+{
+    ffmpeg_mutex_lock(&p->mutex);
+    int isOK=(p->borrowed>0 && !p->isError);
+    if(p->borrowed>0)
+    {
+        int idx=(p->head+p->count)%p->bufNum;
+        p->pLen[idx]=(dataSize<=0?p->frameSize:MIN(dataSize, p->frameSize)), p->ppFrom[idx]=NULL;
+        p->count++, p->borrowed--;
+        p->stat.frames++;
+        ffmpeg_cond_broadcast(&p->cond);
+    }
+    ffmpeg_mutex_unlock(&p->mutex);
+    return isOK;
+}
+// queues pData, the newest frame returned by ffmpeg_async_get_frame(pReader), for writing straight from the reader's ring:
+// the writer thread releases it in pReader once written. every frame of pReader goes this way (releases stay in order),
+// no buffer of p is held meanwhile, and p is closed before pReader. returns 0 if the encoder pipe is broken (the frame
+// is then still held in pReader)
+static int ffmpeg_async_forward_frame(FFAsync* p, FFAsync* pReader, uint8* pData, int64 dataSize)
+{
+    ffmpeg_mutex_lock(&p->mutex);
+    while(p->count>=p->bufNum && !p->isError)
+        _ffmpeg_async_wait(p, 1);
+    int isOK=(!p->isError && p->borrowed==0);
+    if(isOK)
+    {
+        int idx=(p->head+p->count)%p->bufNum;
+        p->pLen[idx]=(dataSize<=0?p->frameSize:MIN(dataSize, p->frameSize)), p->ppFrom[idx]=pData, p->pFrom=pReader;
+        p->count++;
+        p->stat.frames++;
+        ffmpeg_cond_broadcast(&p->cond);
+    }
+    ffmpeg_mutex_unlock(&p->mutex);
+    return isOK;
+}
+static FFAsyncStat ffmpeg_async_get_stat(FFAsync* p)
+{
+    ffmpeg_mutex_lock(&p->mutex);
+    FFAsyncStat stat=p->stat;
+    ffmpeg_mutex_unlock(&p->mutex);
+    return stat;
+}
+static void ffmpeg_async_print_stat(FFAsync* p, const char* pName)
+{
+    FFAsyncStat s=ffmpeg_async_get_stat(p);
+    const char* pBottleneck=(s.appWaitMs>s.pipeWaitMs?"ffmpeg":"app");
+    printf("%s: frames=%lld  app waits=%lld (%.1f ms)  pipe waits=%lld (%.1f ms)  bottleneck=%s\n", pName?pName:(p->isWriter?"writer":"reader"),
+        (long long)s.frames, (long long)s.appWaits, s.appWaitMs, (long long)s.pipeWaits, s.pipeWaitMs, pBottleneck);
+}
+// writer: flushes all submitted frames before returning
+static void ffmpeg_async_close(FFAsync* p)
+{
+    if(p==0)
+        return;
+    ffmpeg_mutex_lock(&p->mutex);
+    p->isEnd=1;
+    if(!p->isWriter) p->count=p->borrowed=0;
+    ffmpeg_cond_broadcast(&p->cond);
+    ffmpeg_mutex_unlock(&p->mutex);
+    ffmpeg_thread_join(p->thread);
+    ffmpeg_cond_destroy(&p->cond);
+    ffmpeg_mutex_destroy(&p->mutex);
+    ffmpeg_aligned_free(p->pBuf); free(p->pLen); free(p->ppFrom); free(p);
+}
+
+// per-frame processing stage (denoise, LUT, overlay...) on the work-stealing pool: pfn runs over row bands, or tiles, of every
+// plane. band heights and tile widths follow the chroma subsampling (ffmpeg_yuv_half_width/height) so a chroma band covers the
+// luma rows of the luma band with the same index. up to depth frames are in flight: the bands of frame k+1 start while those of
+// frame k finish, frames retire in submission order. submit/wait/close belong to one thread
+typedef struct FFBand
+{
+    int64 frame;  // submission index of the frame
+    int plane, x, y, width, height;  // the rectangle to process, in pixels of the plane
+    int planeWidth, planeHeight, xshift, yshift;  // shift: subsampling of the plane, 0 for luma and 4:4:4
+    int pixelBytes;  // 1 or 2 for planar formats, 3..8 for packed RGB
+    const uint8* pSrc;  // plane origins: rows and columns outside the rectangle may be read (neighbourhood filters)
+    uint8* pDst;  // == pSrc when the stage runs in place
+    int srcStride, dstStride;
+}FFBand;
+typedef void (*FFBandProc)(void* pCtx, const FFBand* pBand);
+typedef struct FFStageParam
+{
+    int bandRows;   // luma rows per band (rounded up to 16), <=0: about 3 bands per pool thread
+    int tileWidth;  // luma columns per tile (rounded up to 16), <=0: bands span the whole width
+    int depth;      // frames in flight, <=0: 2
+    FFPool* pPool;  // NULL: ffmpeg_pool_default()
+}FFStageParam;
+typedef struct FFStageStat
+{
+    int64 frames, bands;
+    double latencyMs, maxLatencyMs;  // submit to retire, mean and max
+}FFStageStat;
+typedef struct FFStage FFStage;
+typedef struct _FFStageFrame
+{
+    FFStage* pStage;
+    FFPoolGroup group;
+    const uint8* ppSrc[4];
+    uint8* ppDst[4];
+    int pSrcStride[4], pDstStride[4];
+    int64 frame, submitUs;
+}_FFStageFrame;
+struct FFStage
+{
+    FFPixFmt pixfmt;
+    int width, height, planeNum, depth;
+    FFBandProc pfn;
+    void* pCtx;
+    FFPool* pPool;
+    FFBand* pBand;  // rectangles of all planes, the pointers are filled per frame
+    int bandNum;
+    _FFStageFrame* pSlot;
+    int head, count;
+    double latencySum;
+    FFStageStat stat;
+};
+static void _ffmpeg_stage_task(void* pArg, int i)
+{
+    _FFStageFrame* f=(_FFStageFrame*)pArg;
+    FFBand b=f->pStage->pBand[i];
+    b.frame=f->frame, b.pSrc=f->ppSrc[b.plane], b.pDst=f->ppDst[b.plane], b.srcStride=f->pSrcStride[b.plane], b.dstStride=f->pDstStride[b.plane];
+    f->pStage->pfn(f->pStage->pCtx, &b);
+}
+// waits until at most maxPending frames are in flight, returns the number of frames retired (oldest first)
+static int ffmpeg_stage_wait(FFStage* p, int maxPending)
+{
+    int n=0;
+    for(; p->count>MAX(maxPending, 0); n++)
+    {
+        _FFStageFrame* f=&p->pSlot[p->head];
+        ffmpeg_pool_wait(p->pPool, &f->group);
+        double ms=(ffmpeg_get_time_us()-f->submitUs)/1e3;
+        p->head=(p->head+1)%p->depth, p->count--;
+        p->stat.frames++, p->stat.bands+=p->bandNum, p->latencySum+=ms;
+        p->stat.latencyMs=p->latencySum/p->stat.frames, p->stat.maxLatencyMs=MAX(p->stat.maxLatencyMs, ms);
+    }
+    return n;
+}
+// queues a frame (pStride: bytes per row, NULL: unpadded, ppDst NULL: in place), the planes must stay valid until it retires.
+// blocks only while depth frames are in flight, returns the number of older frames retired to make room
+static int ffmpeg_stage_submit(FFStage* p, const uint8* const ppSrc[4], const int pSrcStride[4], uint8* const ppDst[4], const int pDstStride[4])
+{
+    int n=ffmpeg_stage_wait(p, p->depth-1);
+    _FFStageFrame* f=&p->pSlot[(p->head+p->count)%p->depth];
+    for(int i=0; i<p->planeNum; i++)
+    {
+        int stride=ffmpeg_yuv_plane_stride(p->width, p->pixfmt, i);
+        f->ppSrc[i]=ppSrc[i], f->pSrcStride[i]=(pSrcStride?pSrcStride[i]:stride);
+        f->ppDst[i]=(ppDst?ppDst[i]:(uint8*)ppSrc[i]), f->pDstStride[i]=(ppDst?(pDstStride?pDstStride[i]:stride):f->pSrcStride[i]);
+    }
+    f->pStage=p, f->group.pending=0, f->frame=p->stat.frames+p->count, f->submitUs=ffmpeg_get_time_us();
+    p->count++;
+    ffmpeg_pool_submit(p->pPool, &f->group, _ffmpeg_stage_task, f, 0, p->bandNum);
+    return n;
+}
+// pDst NULL: in place
+static forceinline int ffmpeg_stage_submit_ex(FFStage* p, const FFFrame* pSrc, FFFrame* pDst)
+{
+    return ffmpeg_stage_submit(p, (const uint8* const*)pSrc->ppData, pSrc->pStride, pDst?pDst->ppData:NULL, pDst?pDst->pStride:NULL);
+}
+static forceinline FFStageStat ffmpeg_stage_get_stat(FFStage* p)
+{
+    return p->stat;
+}
+static void ffmpeg_stage_print_stat(FFStage* p, const char* pName)
+{
+    FFPoolStat pool=ffmpeg_pool_get_stat(p->pPool);
+    printf("%s: frames=%lld  bands=%d/frame  latency avg %.2f ms max %.2f ms  pool threads=%d tasks=%lld steals=%lld\n", pName?pName:"stage",
+        (long long)p->stat.frames, p->bandNum, p->stat.latencyMs, p->stat.maxLatencyMs, pool.threads, (long long)pool.tasks, (long long)pool.steals);
+}
+// finishes the frames in flight
+static void ffmpeg_stage_close(FFStage* p)
+{
+    if(p==0)
+        return;
+    ffmpeg_stage_wait(p, 0);
+    free(p->pBand), free(p->pSlot), free(p);
+}
+// pParam NULL: defaults, pfn(pCtx, band) runs on the pool threads
+static FFStage* ffmpeg_stage_create(FFPixFmt pixfmt, int width, int height, const FFStageParam* pParam, FFBandProc pfn, void* pCtx)
+{
+    if(pixfmt<=FF_YUV || pixfmt>FF_MAX || width<=0 || height<=0 || pfn==0)
+        return NULL;
+    FFStage* p=(FFStage*)calloc(1, sizeof(FFStage));
+    int64 pSize[4];
+    int isRGB=ffmpeg_yuv_isRGB(pixfmt), rows, tile;
+    if(p==0)
+        return NULL;
+    p->pixfmt=pixfmt, p->width=width, p->height=height, p->pfn=pfn, p->pCtx=pCtx;
+    p->pPool=(pParam && pParam->pPool?pParam->pPool:ffmpeg_pool_default()), p->depth=(pParam && pParam->depth>0?pParam->depth:2);
+    p->planeNum=ffmpeg_yuv_plane_size(width, height, pixfmt, pSize);
+    // multiples of 16 luma rows/columns give whole chroma rows for every subsampling
+    rows=(pParam && pParam->bandRows>0?pParam->bandRows:height/((p->pPool->threads+1)*3));
+    rows=(MAX(rows, 16)+15)&~15;
+    tile=(pParam && pParam->tileWidth>0?(MAX(pParam->tileWidth, 16)+15)&~15:width);
+    for(int k=0; k<2; k++)
+    {
+        p->bandNum=0;
+        for(int i=0; i<p->planeNum; i++)
+        {
+            int xs=(i && !isRGB?ffmpeg_yuv_half_width(pixfmt):0), ys=(i && !isRGB?ffmpeg_yuv_half_height(pixfmt):0);
+            int w=(i?width>>xs:width), h=(i?height>>ys:height), r=rows>>ys, t=(tile>=width?w:tile>>xs);
+            for(int y=0; y<h; y+=r)
+            {
+                for(int x=0; x<w; x+=t, p->bandNum++)
+                {
+                    if(k==0) continue;
+                    FFBand* b=&p->pBand[p->bandNum];
+                    memset(b, 0, sizeof(FFBand));
+                    b->plane=i, b->x=x, b->y=y, b->width=MIN(t, w-x), b->height=MIN(r, h-y), b->planeWidth=w, b->planeHeight=h;
+                    b->xshift=xs, b->yshift=ys, b->pixelBytes=(isRGB?ffmpeg_yuv_plane_stride(width, pixfmt, 0)/width:ffmpeg_is_10bit(pixfmt)+1);
+                }
+            }
+        }
+        if(k==0 && (p->pBand=(FFBand*)malloc(sizeof(FFBand)*p->bandNum))==0)
+            break;
+    }
+    p->pSlot=(_FFStageFrame*)calloc(p->depth, sizeof(_FFStageFrame));
+    if(p->pBand==0 || p->pSlot==0)
+    {
+        printf("ffmpeg_stage: alloc %d bands, %d frames failed\n", p->bandNum, p->depth);
+        free(p->pBand), free(p->pSlot), free(p);
+        return NULL;
+    }
+    return p;
+}
+
+// encoding ladder: one source feeds several encoders, each with its own size, crf, codec and params. every distinct size is scaled
+// once per frame (from the smallest already scaled size that is at least as large, or from the source), and each encoder gets a
+// reference to the frame of its size through a bounded queue drained by its own thread. a full queue blocks ffmpeg_ladder_write(),
+// so the slowest encoder sets the pace without frames piling up.
+typedef struct FFLadderRung
+{
+    const char* pName;
+    int width, height;
+    double crf;
+    const char* pCodec;
+    const char* pFFmpegParam;  // e.g. MAKE_X265_PARAM("...")
+    int threads;  // encoder threads, <=0 leaves the choice to the encoder
+}FFLadderRung;
+typedef struct FFLadderStat
+{
+    int64 frames;
+    int64 waits;  // ffmpeg_ladder_write() found the queue of this encoder full
+    double waitMs;
+    int isError;  // the encoder stopped accepting frames
+    int exitCode;  // of the encoder, set by ffmpeg_ladder_close()
+}FFLadderStat;
+typedef struct _FFLadderLevel
+{
+    int width, height, parent;  // parent: level scaled from, -1: the source
+    FFFramePool* pPool;  // NULL: the source frame itself
+    _FFScaleAxes axes;  // parent size to this size, built once for all frames
+}_FFLadderLevel;
+typedef struct FFLadder FFLadder;
+typedef struct _FFLadderOut
+{
+    FFLadder* pLadder;
+    FILE* fp;
+    int level;
+    FFFrame** ppQueue;
+    int head, count;
+    FFLadderStat stat;
+    FFCond cond;
+    FFThread thread;
+}_FFLadderOut;
+struct FFLadder
+{
+    FFPixFmt pixfmt;
+    int width, height, threads, queueNum, rungNum, levelNum, isEnd;
+    _FFLadderLevel* pLevel;
+    _FFLadderOut* pOut;
+    FFMutex mutex;
+};
+static void* _ffmpeg_ladder_proc(void* pArg)
+{
+    _FFLadderOut* o=(_FFLadderOut*)pArg;
+    FFLadder* p=o->pLadder;
+#ifdef __linux__
+    // an encoder that dies turns into EPIPE on this thread only instead of a SIGPIPE for the whole process
+    sigset_t set;
+    sigemptyset(&set), sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+#endif
+    ffmpeg_mutex_lock(&p->mutex);
+    while(o->count>0 || !p->isEnd)
+    {
+        if(o->count==0)
+        {
+            ffmpeg_cond_wait(&o->cond, &p->mutex);
+            continue;
+        }
+        FFFrame* f=o->ppQueue[o->head];
+        int isError=o->stat.isError;
+        ffmpeg_mutex_unlock(&p->mutex);
+        // a broken encoder keeps draining its queue so that the writer never blocks on it
+        if(!isError) isError=(ffmpeg_set_frame_ex(o->fp, f)!=ffmpeg_frame_data_size(f));
+        ffmpeg_frame_unref(f);
+        ffmpeg_mutex_lock(&p->mutex);
+        o->stat.isError=isError, o->stat.frames+=!isError;
+        o->head=(o->head+1)%p->queueNum, o->count--;
+        ffmpeg_cond_broadcast(&o->cond);
+    }
+    ffmpeg_mutex_unlock(&p->mutex);
+    return NULL;
+}
+// waits for all queued frames to be encoded, closes the encoders and fills pStat[rungNum] (if not NULL).
+// returns 1 if every encoder took all frames and exited with 0
+static int ffmpeg_ladder_close(FFLadder* p, OUT FFLadderStat* pStat)
+{
+    if(p==0)
+        return 0;
+    int isOK=1;
+    ffmpeg_mutex_lock(&p->mutex);
+    p->isEnd=1;
+    for(int i=0; i<p->rungNum; i++)
+        ffmpeg_cond_broadcast(&p->pOut[i].cond);
+    ffmpeg_mutex_unlock(&p->mutex);
+    for(int i=0; i<p->rungNum; i++)
+    {
+        _FFLadderOut* o=&p->pOut[i];
+        if(o->ppQueue==0)
+            continue;
+        ffmpeg_thread_join(o->thread);
+        o->stat.exitCode=ffmpeg_close_ex(o->fp, NULL);
+        isOK&=(!o->stat.isError && o->stat.exitCode==0);
+        if(pStat) pStat[i]=o->stat;
+        ffmpeg_cond_destroy(&o->cond);
+        free(o->ppQueue);
+    }
+    for(int i=0; i<p->levelNum; i++)
+        ffmpeg_frame_pool_close(p->pLevel[i].pPool), _ffmpeg_scale_axes_free(&p->pLevel[i].axes);
+    ffmpeg_mutex_destroy(&p->mutex);
+    free(p->pLevel), free(p->pOut), free(p);
+    return isOK;
+}
+// pixfmt/width/height/fps: the frames passed to ffmpeg_ladder_write(), queueNum: frames buffered per encoder (<=0: 4),
+// threads: scaling threads (<=0: all cores)
+static FFLadder* ffmpeg_ladder_create(FFPixFmt pixfmt, int width, int height, double fps, const FFLadderRung* pRung, int rungNum, int queueNum, int threads)
+{
+    if(rungNum<=0 || width<=0 || height<=0)
+        return NULL;
+    FFLadder* p=(FFLadder*)calloc(1, sizeof(FFLadder));
+    p->pixfmt=pixfmt, p->width=width, p->height=height, p->threads=threads, p->queueNum=(queueNum>0?queueNum:4), p->rungNum=rungNum;
+    p->pLevel=(_FFLadderLevel*)calloc(rungNum, sizeof(_FFLadderLevel)), p->pOut=(_FFLadderOut*)calloc(rungNum, sizeof(_FFLadderOut));
+    ffmpeg_mutex_init(&p->mutex);
+    // levels: distinct sizes from the largest to the smallest
+    for(int i=0; i<rungNum; i++)
+    {
+        int w=(pRung[i].width>0?pRung[i].width:width), h=(pRung[i].height>0?pRung[i].height:height), k=0;
+        while(k<p->levelNum && (p->pLevel[k].width!=w || p->pLevel[k].height!=h)) k++;
+        if(k<p->levelNum)
+            continue;
+        for(k=p->levelNum++; k>0 && (int64)p->pLevel[k-1].width*p->pLevel[k-1].height<(int64)w*h; k--)
+            p->pLevel[k]=p->pLevel[k-1];
+        p->pLevel[k].width=w, p->pLevel[k].height=h;
+    }
+    for(int i=0; i<p->levelNum; i++)
+    {
+        _FFLadderLevel* l=&p->pLevel[i];
+        l->parent=-1;
+        for(int k=i-1; k>=0 && l->parent<0; k--)
+            if(p->pLevel[k].width>=l->width && p->pLevel[k].height>=l->height && (p->pLevel[k].width!=width || p->pLevel[k].height!=height)) l->parent=k;
+        if(l->width==width && l->height==height)
+            continue;
+        l->pPool=ffmpeg_frame_pool_create(pixfmt, l->width, l->height, p->queueNum*rungNum+2);
+        int srcWidth=(l->parent<0?width:p->pLevel[l->parent].width), srcHeight=(l->parent<0?height:p->pLevel[l->parent].height);
+        if(!_ffmpeg_scale_axes(pixfmt, srcWidth, srcHeight, l->width, l->height, &l->axes))
+        {
+            printf("ffmpeg_ladder: scale %dx%d to %dx%d failed\n", srcWidth, srcHeight, l->width, l->height);
+            ffmpeg_ladder_close(p, NULL);
+            return NULL;
+        }
+    }
+    for(int i=0; i<rungNum; i++)
+    {
+        const FFLadderRung* r=&pRung[i];
+        _FFLadderOut* o=&p->pOut[i];
+        int w=(r->width>0?r->width:width), h=(r->height>0?r->height:height);
+        while(p->pLevel[o->level].width!=w || p->pLevel[o->level].height!=h) o->level++;
+        o->pLadder=p;
+        o->fp=ffmpeg_create_writer_full(r->pName, pixfmt, w, h, fps, r->crf, r->pCodec, r->pFFmpegParam, r->threads, NULL);
+        if(o->fp==0)
+        {
+            printf("ffmpeg_ladder: create '%s' failed\n", r->pName);
+            ffmpeg_ladder_close(p, NULL);
+            return NULL;
+        }
+        o->ppQueue=(FFFrame**)calloc(p->queueNum, sizeof(FFFrame*));
+        ffmpeg_cond_init(&o->cond);
+        if(!ffmpeg_thread_create(&o->thread, _ffmpeg_ladder_proc, o))
+        {
+            ffmpeg_cond_destroy(&o->cond);
+            free(o->ppQueue), o->ppQueue=NULL;
+            ffmpeg_close(o->fp);
+            ffmpeg_ladder_close(p, NULL);
+            return NULL;
+        }
+    }
+    return p;
+}
+// queues f (pixfmt and size of the ladder) to every encoder, the caller keeps its reference.
+// returns the number of encoders that took the frame (0: all of them failed)
+static int ffmpeg_ladder_write(FFLadder* p, FFFrame* f)
+{
+    FFFrame* ppLevel[64]={0};
+    int num=0;
+    if(f->pixfmt!=p->pixfmt || f->width!=p->width || f->height!=p->height || p->levelNum>64)
+        return 0;
+    for(int i=0; i<p->levelNum; i++)
+    {
+        _FFLadderLevel* l=&p->pLevel[i];
+        FFFrame* pParent=(l->parent<0?f:ppLevel[l->parent]);
+        if(l->width==p->width && l->height==p->height)
+            ppLevel[i]=ffmpeg_frame_ref(f);
+        else if(l->pPool && pParent && (ppLevel[i]=ffmpeg_frame_pool_get(l->pPool))!=NULL)
+            ppLevel[i]->pts=pParent->pts, _ffmpeg_scale_run(&l->axes, (const uint8* const*)pParent->ppData, pParent->pStride, ppLevel[i]->ppData, ppLevel[i]->pStride, p->threads);
+    }
+    ffmpeg_mutex_lock(&p->mutex);
+    for(int i=0; i<p->rungNum; i++)
+    {
+        _FFLadderOut* o=&p->pOut[i];
+        if(ppLevel[o->level]==0)
+            continue;
+        if(o->count==p->queueNum && !o->stat.isError)
+        {
+            int64 t=ffmpeg_get_time_us();
+            while(o->count==p->queueNum && !o->stat.isError)
+                ffmpeg_cond_wait(&o->cond, &p->mutex);
+            o->stat.waits++, o->stat.waitMs+=(ffmpeg_get_time_us()-t)*1e-3;
+        }
+        if(o->stat.isError)
+            continue;
+        o->ppQueue[(o->head+o->count++)%p->queueNum]=ffmpeg_frame_ref(ppLevel[o->level]);
+        ffmpeg_cond_broadcast(&o->cond);
+        num++;
+    }
+    ffmpeg_mutex_unlock(&p->mutex);
+    for(int i=0; i<p->levelNum; i++)
+        ffmpeg_frame_unref(ppLevel[i]);
+    return num;
+}
+// decodes pSrcName once and encodes it into every rung, returns the number of frames (-1: the source or an encoder failed)
+static int ffmpeg_transcode_ladder(const char* pSrcName, FFPixFmt pixfmt, const FFLadderRung* pRung, int rungNum, int threads)
+{
+    FFInfo info;
+    ffmpeg_get_video_info(pSrcName, &info);
+    if(info.width<=0 || info.height<=0)
+    {
+        printf("ffmpeg_transcode_ladder: can not get '%s' info\n", pSrcName);
+        return -1;
+    }
+    pixfmt=(pixfmt>FF_YUV?pixfmt:info.pixfmt);
+    FFLadder* p=ffmpeg_ladder_create(pixfmt, info.width, info.height, info.fps>0?info.fps:25, pRung, rungNum, 0, threads);
+    FILE* fp=(p?ffmpeg_create_reader_full(pSrcName, pixfmt, info.width, info.height, 0, threads, NULL, NULL):NULL);
+    FFFramePool* pPool=ffmpeg_frame_pool_create(pixfmt, info.width, info.height, 4);
+    int frameNum=0, isOK=(fp!=0);
+    for(FFFrame* f; fp && (f=ffmpeg_frame_pool_get(pPool))!=NULL; )
+    {
+        int64 n=ffmpeg_get_frame_ex(fp, f), frameSize=ffmpeg_frame_data_size(f);
+        if(n==frameSize)
+            isOK&=(ffmpeg_ladder_write(p, f)==rungNum), frameNum++;
+        ffmpeg_frame_unref(f);
+        if(n<frameSize || !isOK)
+            break;
+    }
+    if(fp) ffmpeg_close(fp);
+    ffmpeg_frame_pool_close(pPool);
+    isOK&=ffmpeg_ladder_close(p, NULL);
+    return isOK?frameNum:-1;
+}
+
+// in-process quality metrics of a distorted stream against its reference: PSNR from the squared error, SSIM on 8x8 windows stepping
+// by 4 (from 4x4 block sums, as x264 and ffmpeg's ssim filter), MS-SSIM over up to 5 scales of 2x2 averaged planes.
+// planar YUV and gray of 8 or 10 bits; row stripes of all planes run in parallel, only the current frames are held.
+#define FF_METRIC_PSNR 1
+#define FF_METRIC_SSIM 2
+#define FF_METRIC_MSSSIM 4
+#define FF_METRIC_ALL 7
+#define FF_METRIC_SCALES 5
+#define FF_METRIC_PSNR_MAX 100.0  // psnr of identical planes
+typedef struct FFMetric
+{
+    int64 frame;  // frame index, -1 for aggregates
+    int planeNum;
+    double pMse[3], pPsnr[3], pSsim[3], pMsSsim[3];  // per plane
+    double mse, psnr, ssim, msssim;  // all planes weighted by their sample count
+}FFMetric;
+typedef struct FFMetricStat
+{
+    int64 frames;
+    FFMetric avg;  // psnr of the mean mse, mean ssim and msssim
+    FFMetric min;  // worst frame for every value (mse: the largest)
+}FFMetricStat;
+typedef struct _FFMetricTask
+{
+    int plane, j0, j1, y0, y1;  // window rows [j0, j1), pixel rows [y0, y1)
+    int64 sse, windows;
+    double ssim, cs;
+}_FFMetricTask;
+typedef struct FFMetricCtx
+{
+    FFPixFmt pixfmt;
+    int width, height, flags, threads, planeNum, is16, scale;
+    double c1, c2;  // ssim constants of 64-pixel sums
+    int pWidth[3][FF_METRIC_SCALES], pHeight[3][FF_METRIC_SCALES], pScaleNum[3];
+    const uint8 *ppA[4], *ppB[4];
+    int pStrideA[4], pStrideB[4];
+    uint16 *ppBuf[3][2][FF_METRIC_SCALES];  // 2x2 averaged planes of scales 1.., [0][..] unused
+    _FFMetricTask* pTask;
+    int taskNum, taskMax;
+    int (*pSsimSum)[4];  // per task: 2 rows of 4x4 block sums of the widest plane
+    double pSum[4][3];  // sse, ssim, msssim sums per plane over all frames
+    FFMetricStat stat;
+}FFMetricCtx;
+static void _ffmpeg_metric_plane(const FFMetricCtx* p, int plane, int isB, OUT const uint8** ppData, OUT int* pStride, OUT int* pIs16)
+{
+    if(p->scale==0)
+    {
+        *ppData=(isB?p->ppB[plane]:p->ppA[plane]), *pStride=(isB?p->pStrideB[plane]:p->pStrideA[plane]), *pIs16=p->is16;
+        return;
+    }
+    *ppData=(const uint8*)p->ppBuf[plane][isB][p->scale], *pStride=p->pWidth[plane][p->scale]*2, *pIs16=1;
+}
+// stripes of whole window rows of a plane, the same for every frame
+static forceinline int _ffmpeg_metric_stripes(const FFMetricCtx* p, int plane, int scale)
+{
+    return BETWEEN(MAX(0, p->pHeight[plane][scale]/4-1)/8, 1, p->threads*2);
+}
+static void _ffmpeg_metric_task(void* pArg, int i)
+{
+    FFMetricCtx* p=(FFMetricCtx*)pArg;
+    _FFMetricTask* t=&p->pTask[i];
+    const uint8 *pA, *pB;
+    int strideA, strideB, is16, s=p->scale, w=p->pWidth[t->plane][s], bytes;
+    _ffmpeg_metric_plane(p, t->plane, 0, &pA, &strideA, &is16);
+    _ffmpeg_metric_plane(p, t->plane, 1, &pB, &strideB, &is16);
+    bytes=is16+1;
+    t->sse=0, t->windows=0, t->ssim=0, t->cs=0;
+    if(s==0 && (p->flags&FF_METRIC_PSNR))
+        for(int y=t->y0; y<t->y1; y++)
+            t->sse+=ffmpeg_simd()->pfnSse(pA+(size_t)y*strideA, pB+(size_t)y*strideB, w, is16);
+    int bw=w/4;
+    if(t->j1>t->j0 && (p->flags&(FF_METRIC_SSIM|FF_METRIC_MSSSIM)))
+    {
+        int (*pPrev)[4]=p->pSsimSum+(size_t)i*2*(p->pWidth[0][0]/4), (*pCur)[4]=pPrev+bw;
+        ffmpeg_simd()->pfnSsim4x4(pA+(size_t)t->j0*4*strideA, strideA, pB+(size_t)t->j0*4*strideB, strideB, is16, bw, pPrev);
+        for(int j=t->j0; j<t->j1; j++)
+        {
+            ffmpeg_simd()->pfnSsim4x4(pA+(size_t)(j+1)*4*strideA, strideA, pB+(size_t)(j+1)*4*strideB, strideB, is16, bw, pCur);
+            for(int x=0; x<bw-1; x++)
+            {
+                double s1=pPrev[x][0]+pPrev[x+1][0]+pCur[x][0]+pCur[x+1][0], s2=pPrev[x][1]+pPrev[x+1][1]+pCur[x][1]+pCur[x+1][1];
+                double ss=pPrev[x][2]+pPrev[x+1][2]+pCur[x][2]+pCur[x+1][2], s12=pPrev[x][3]+pPrev[x+1][3]+pCur[x][3]+pCur[x+1][3];
+                double vars=ss*64-s1*s1-s2*s2, covar=s12*64-s1*s2, cs=(2*covar+p->c2)/(vars+p->c2);
+                t->ssim+=(2*s1*s2+p->c1)/(s1*s1+s2*s2+p->c1)*cs, t->cs+=cs;
+            }
+            t->windows+=bw-1;
+            int (*pTmp)[4]=pPrev;
+            pPrev=pCur, pCur=pTmp;
+        }
+    }
+    if(s+1<p->pScaleNum[t->plane])
+    {
+        // next scale: 2x2 average of the rows this task owns
+        int w2=p->pWidth[t->plane][s+1], h2=p->pHeight[t->plane][s+1];
+        for(int k=0; k<2; k++)
+        {
+            const uint8* pSrc=(k?pB:pA);
+            int stride=(k?strideB:strideA);
+            for(int y=t->y0/2; y<MIN(t->y1/2, h2); y++)
+            {
+                const uint8 *r0=pSrc+(size_t)2*y*stride, *r1=r0+stride;
+                uint16* pDst=p->ppBuf[t->plane][k][s+1]+(size_t)y*w2;
+                if(bytes==2) for(int x=0; x<w2; x++) pDst[x]=(uint16)((((const uint16*)r0)[2*x]+((const uint16*)r0)[2*x+1]+((const uint16*)r1)[2*x]+((const uint16*)r1)[2*x+1]+2)>>2);
+                else for(int x=0; x<w2; x++) pDst[x]=(uint16)((r0[2*x]+r0[2*x+1]+r1[2*x]+r1[2*x+1]+2)>>2);
+            }
+        }
+    }
+}
+static void ffmpeg_metric_close(FFMetricCtx* p)
 {
-    FILE *fp=0;
-    pFFmpeg=(pFFmpeg==0?FFMPEG_BIN:pFFmpeg);
-    if(ffmpeg_is_videofile(pName))
+    if(p==0)
+        return;
+    for(int i=0; i<3; i++)
+        free(p->ppBuf[i][0][1]), free(p->ppBuf[i][1][1]);
+    free(p->pTask), free(p->pSsimSum);
+    free(p);
+}
+// flags: FF_METRIC_*, threads<=0: all cores. returns NULL for packed RGB or unsupported sizes
+static FFMetricCtx* ffmpeg_metric_create(FFPixFmt pixfmt, int width, int height, int flags, int threads)
+{
+    if(pixfmt<=FF_YUV || pixfmt>FF_MAX || ffmpeg_yuv_isRGB(pixfmt) || width<=0 || height<=0)
+        return NULL;
+    FFMetricCtx* p=(FFMetricCtx*)calloc(1, sizeof(FFMetricCtx));
+    int64 pSize[4];
+    double maxv=(1<<ffmpeg_bit_depth(pixfmt))-1;
+    if(p==0)
+        return NULL;
+    p->pixfmt=pixfmt, p->width=width, p->height=height, p->flags=flags, p->threads=(threads<=0?ffmpeg_get_cpu_num():threads);
+    p->planeNum=ffmpeg_yuv_plane_size(width, height, pixfmt, pSize), p->is16=ffmpeg_is_10bit(pixfmt);
+    p->c1=.01*.01*maxv*maxv*64, p->c2=.03*.03*maxv*maxv*64*63;
+    for(int i=0; i<p->planeNum; i++)
     {
-        char pCmd[1024];
-        int n=sprintf(pCmd, "%s -y -loglevel error -f rawvideo -vcodec rawvideo -s %dx%d -pix_fmt %s -r %g -i - -an ", pFFmpeg, width, height, ffmpeg_pixfmt2string(pixfmt), fps);
-        if(pCodec) n+=sprintf(pCmd+n, "-vcodec %s ", pCodec);
-        if(crf>=0) n+=sprintf(pCmd+n, "-crf %g ", crf);
-        if(pFFmpegParam)
-            n+=sprintf(pCmd+n, "%s ", pFFmpegParam);
-        else if(pCodec && strcmp(pCodec, LIBX265)==0)
-            n+=sprintf(pCmd+n, "-tag:v hvc1 ");
-        n+=sprintf(pCmd+n, "-threads 4 ");
-        n+=sprintf(pCmd+n, "\"%s\" 2>" IO_NULL " 1>" IO_NULL, pName);
-        fp=popen(pCmd, IO_W);
+        int w=(i?width>>ffmpeg_yuv_half_width(pixfmt):width), h=(i?height>>ffmpeg_yuv_half_height(pixfmt):height);
+        p->pWidth[i][0]=w, p->pHeight[i][0]=h, p->pScaleNum[i]=1;
+        // a scale needs at least one 8x8 window
+        while((flags&FF_METRIC_MSSSIM) && p->pScaleNum[i]<FF_METRIC_SCALES && (w>>p->pScaleNum[i])>=8 && (h>>p->pScaleNum[i])>=8)
+            p->pWidth[i][p->pScaleNum[i]]=w>>p->pScaleNum[i], p->pHeight[i][p->pScaleNum[i]]=h>>p->pScaleNum[i], p->pScaleNum[i]++;
+        size_t total=0;
+        for(int s=1; s<p->pScaleNum[i]; s++)
+            total+=(size_t)p->pWidth[i][s]*p->pHeight[i][s];
+        for(int k=0; k<2 && total>0; k++)
+        {
+            p->ppBuf[i][k][1]=(uint16*)malloc(total*sizeof(uint16));
+            for(int s=2; s<p->pScaleNum[i] && p->ppBuf[i][k][1]; s++)
+                p->ppBuf[i][k][s]=p->ppBuf[i][k][s-1]+(size_t)p->pWidth[i][s-1]*p->pHeight[i][s-1];
+            if(p->ppBuf[i][k][1]==0)
+            {
+                printf("ffmpeg_metric: alloc %lld bytes failed\n", (long long)(total*sizeof(uint16)));
+                ffmpeg_metric_close(p);
+                return NULL;
+            }
+        }
+    }
+    // the stripes of every scale follow from the sizes: the tasks and their ssim row sums are allocated once for all frames
+    for(int s=0; s<FF_METRIC_SCALES; s++)
+    {
+        int n=0;
+        for(int i=0; i<p->planeNum; i++)
+            n+=(s<p->pScaleNum[i]?_ffmpeg_metric_stripes(p, i, s):0);
+        p->taskMax=MAX(p->taskMax, n);
+    }
+    size_t sumSize=(flags&(FF_METRIC_SSIM|FF_METRIC_MSSSIM)?sizeof(int)*4*2*(size_t)(width/4)*p->taskMax:0);
+    p->pTask=(_FFMetricTask*)calloc(p->taskMax, sizeof(_FFMetricTask)), p->pSsimSum=(int(*)[4])malloc(sumSize);
+    if(p->pTask==0 || (sumSize>0 && p->pSsimSum==0))
+    {
+        printf("ffmpeg_metric: alloc %d tasks failed\n", p->taskMax);
+        ffmpeg_metric_close(p);
+        return NULL;
+    }
+    p->stat.avg.frame=p->stat.min.frame=-1, p->stat.avg.planeNum=p->stat.min.planeNum=p->planeNum;
+    return p;
+}
+static void _ffmpeg_metric_accumulate(FFMetricCtx* p, const FFMetric* m)
+{
+    FFMetric *a=&p->stat.avg, *n=&p->stat.min;
+    double sse=0, ssim=0, msssim=0, total=0;
+    int isFirst=(p->stat.frames++==0);
+    for(int i=0; i<p->planeNum; i++)
+    {
+        double size=(double)p->pWidth[i][0]*p->pHeight[i][0], maxv=(1<<ffmpeg_bit_depth(p->pixfmt))-1;
+        p->pSum[0][i]+=m->pMse[i], p->pSum[1][i]+=m->pSsim[i], p->pSum[2][i]+=m->pMsSsim[i];
+        a->pMse[i]=p->pSum[0][i]/p->stat.frames, a->pSsim[i]=p->pSum[1][i]/p->stat.frames, a->pMsSsim[i]=p->pSum[2][i]/p->stat.frames;
+        a->pPsnr[i]=(a->pMse[i]>0?MIN(10*log10(maxv*maxv/a->pMse[i]), FF_METRIC_PSNR_MAX):FF_METRIC_PSNR_MAX);
+        n->pMse[i]=(isFirst?m->pMse[i]:MAX(n->pMse[i], m->pMse[i])), n->pPsnr[i]=(isFirst?m->pPsnr[i]:MIN(n->pPsnr[i], m->pPsnr[i]));
+        n->pSsim[i]=(isFirst?m->pSsim[i]:MIN(n->pSsim[i], m->pSsim[i])), n->pMsSsim[i]=(isFirst?m->pMsSsim[i]:MIN(n->pMsSsim[i], m->pMsSsim[i]));
+        sse+=a->pMse[i]*size, ssim+=a->pSsim[i]*size, msssim+=a->pMsSsim[i]*size, total+=size;
+    }
+    double maxv=(1<<ffmpeg_bit_depth(p->pixfmt))-1;
+    a->mse=sse/total, a->ssim=ssim/total, a->msssim=msssim/total;
+    a->psnr=(a->mse>0?MIN(10*log10(maxv*maxv/a->mse), FF_METRIC_PSNR_MAX):FF_METRIC_PSNR_MAX);
+    n->mse=(isFirst?m->mse:MAX(n->mse, m->mse)), n->psnr=(isFirst?m->psnr:MIN(n->psnr, m->psnr));
+    n->ssim=(isFirst?m->ssim:MIN(n->ssim, m->ssim)), n->msssim=(isFirst?m->msssim:MIN(n->msssim, m->msssim));
+}
+// compares one frame (pStride: bytes per row, NULL: unpadded), fills pMetric (if not NULL) and adds it to the running stats
+static int ffmpeg_metric_frame(FFMetricCtx* p, const uint8* const ppRef[4], const int pRefStride[4], const uint8* const ppDist[4], const int pDistStride[4], OUT FFMetric* pMetric)
+{
+    static const double pWeight[FF_METRIC_SCALES]={0.0448, 0.2856, 0.3001, 0.2363, 0.1333};
+    double pSsim[3][FF_METRIC_SCALES], pCs[3][FF_METRIC_SCALES], maxv=(1<<ffmpeg_bit_depth(p->pixfmt))-1, total=0;
+    int64 pSse[3]={0, 0, 0};
+    FFMetric m;
+    memset(&m, 0, sizeof(m));
+    m.frame=p->stat.frames, m.planeNum=p->planeNum;
+    for(int i=0; i<p->planeNum; i++)
+    {
+        p->ppA[i]=ppRef[i], p->ppB[i]=ppDist[i];
+        p->pStrideA[i]=(pRefStride?pRefStride[i]:ffmpeg_yuv_plane_stride(p->width, p->pixfmt, i));
+        p->pStrideB[i]=(pDistStride?pDistStride[i]:ffmpeg_yuv_plane_stride(p->width, p->pixfmt, i));
+    }
+    for(p->scale=0; p->scale<FF_METRIC_SCALES; p->scale++)
+    {
+        // stripes of whole window rows, the last one takes the rows below the last window
+        p->taskNum=0;
+        for(int i=0; i<p->planeNum; i++)
+        {
+            if(p->scale>=p->pScaleNum[i])
+                continue;
+            int h=p->pHeight[i][p->scale], rows=MAX(0, h/4-1), num=_ffmpeg_metric_stripes(p, i, p->scale);
+            for(int k=0; k<num; k++)
+            {
+                _FFMetricTask* t=&p->pTask[p->taskNum++];
+                t->plane=i, t->j0=(int)((int64)rows*k/num), t->j1=(int)((int64)rows*(k+1)/num);
+                t->y0=t->j0*4, t->y1=(k==num-1?h:t->j1*4);
+            }
+        }
+        if(p->taskNum==0)
+            break;
+        _ffmpeg_parallel_for(p->taskNum, _ffmpeg_metric_task, p, p->threads);
+        for(int i=0; i<p->planeNum; i++)
+        {
+            double ssim=0, cs=0;
+            int64 windows=0;
+            for(int k=0; k<p->taskNum; k++)
+            {
+                _FFMetricTask* t=&p->pTask[k];
+                if(t->plane!=i) continue;
+                pSse[i]+=t->sse, ssim+=t->ssim, cs+=t->cs, windows+=t->windows;
+            }
+            pSsim[i][p->scale]=(windows>0?ssim/windows:1), pCs[i][p->scale]=(windows>0?cs/windows:1);
+        }
+    }
+    for(int i=0; i<p->planeNum; i++)
+    {
+        double size=(double)p->pWidth[i][0]*p->pHeight[i][0], msssim=1, weight=0;
+        int num=p->pScaleNum[i];
+        m.pMse[i]=pSse[i]/size;
+        m.pPsnr[i]=(pSse[i]>0?MIN(10*log10(maxv*maxv/m.pMse[i]), FF_METRIC_PSNR_MAX):FF_METRIC_PSNR_MAX);
+        m.pSsim[i]=pSsim[i][0];
+        // fewer scales on small planes: the weights of the ones used are renormalized
+        for(int s=0; s<num; s++) weight+=pWeight[s];
+        for(int s=0; s<num; s++)
+            msssim*=pow(MAX(s==num-1?pSsim[i][s]:pCs[i][s], 0.0), pWeight[s]/weight);
+        m.pMsSsim[i]=((p->flags&FF_METRIC_MSSSIM)?msssim:0);
+        m.mse+=m.pMse[i]*size, m.ssim+=m.pSsim[i]*size, m.msssim+=m.pMsSsim[i]*size, total+=size;
+    }
+    m.mse/=total, m.ssim/=total, m.msssim/=total;
+    m.psnr=(m.mse>0?MIN(10*log10(maxv*maxv/m.mse), FF_METRIC_PSNR_MAX):FF_METRIC_PSNR_MAX);
+    _ffmpeg_metric_accumulate(p, &m);
+    if(pMetric) *pMetric=m;
+    return 1;
+}
+static forceinline int ffmpeg_metric_frame_ex(FFMetricCtx* p, const FFFrame* pRef, const FFFrame* pDist, OUT FFMetric* pMetric)
+{
+    if(pRef->pixfmt!=p->pixfmt || pDist->pixfmt!=p->pixfmt || pRef->width!=p->width || pDist->width!=p->width || pRef->height!=p->height || pDist->height!=p->height)
+        return 0;
+    return ffmpeg_metric_frame(p, (const uint8* const*)pRef->ppData, pRef->pStride, (const uint8* const*)pDist->ppData, pDist->pStride, pMetric);
+}
+static forceinline FFMetricStat ffmpeg_metric_get_stat(FFMetricCtx* p)
+{
+    return p->stat;
+}
+static void ffmpeg_metric_print(const FFMetric* p, const char* pName)
+{
+    static const char* ppPlane[3]={"Y", "U", "V"};
+    printf("%s", pName?pName:"metric");
+    if(p->frame>=0) printf(" #%lld", (long long)p->frame);
+    printf(":  psnr %.3f (", p->psnr);
+    for(int i=0; i<p->planeNum; i++) printf("%s%s %.3f", i?" ":"", ppPlane[i], p->pPsnr[i]);
+    printf(")  ssim %.5f (", p->ssim);
+    for(int i=0; i<p->planeNum; i++) printf("%s%s %.5f", i?" ":"", ppPlane[i], p->pSsim[i]);
+    printf(")  ms-ssim %.5f\n", p->msssim);
+}
+// compares two readers of the same pixfmt/size frame by frame until either ends, pfnFrame (if not NULL) gets every frame.
+// each side is read ahead by its own thread with 3 buffers. returns the number of frames compared
+static int64 ffmpeg_metric_compare(FILE* pRef, FILE* pDist, FFPixFmt pixfmt, int width, int height, int flags, int threads,
+    void (*pfnFrame)(void* pCtx, const FFMetric* pMetric), void* pCtx, OUT FFMetricStat* pStat)
+{
+    FFMetricCtx* p=ffmpeg_metric_create(pixfmt, width, height, flags, threads);
+    int64 frameSize=ffmpeg_yuv_compute_frame_size(width, height, pixfmt), sizeA=0, sizeB=0;
+    FFAsync *pA=(p?ffmpeg_async_create_reader(pRef, frameSize, 3):NULL), *pB=(pA?ffmpeg_async_create_reader(pDist, frameSize, 3):NULL);
+    uint8 *pDataA, *pDataB;
+    if(pStat) memset(pStat, 0, sizeof(FFMetricStat));
+    while(pB && (pDataA=ffmpeg_async_get_frame(pA, &sizeA))!=NULL && (pDataB=ffmpeg_async_get_frame(pB, &sizeB))!=NULL && sizeA==frameSize && sizeB==frameSize)
+    {
+        uint8 *ppA[4], *ppB[4];
+        FFMetric m;
+        ffmpeg_yuv_split_planes(pDataA, width, height, pixfmt, ppA);
+        ffmpeg_yuv_split_planes(pDataB, width, height, pixfmt, ppB);
+        ffmpeg_metric_frame(p, (const uint8* const*)ppA, NULL, (const uint8* const*)ppB, NULL, &m);
+        ffmpeg_async_release_frame(pA), ffmpeg_async_release_frame(pB);
+        if(pfnFrame) pfnFrame(pCtx, &m);
+    }
+    int64 frames=(p?p->stat.frames:0);
+    if(pStat && p) *pStat=p->stat;
+    ffmpeg_async_close(pA), ffmpeg_async_close(pB);
+    ffmpeg_metric_close(p);
+    return frames;
+}
+// decodes both files at the size and pixfmt of pRefName (pixfmt<=FF_YUV) and compares them, see ffmpeg_metric_compare()
+static int64 ffmpeg_metric_compare_files(const char* pRefName, const char* pDistName, FFPixFmt pixfmt, int flags, int threads,
+    void (*pfnFrame)(void* pCtx, const FFMetric* pMetric), void* pCtx, OUT FFMetricStat* pStat)
+{
+    FFInfo info;
+    ffmpeg_get_video_info(pRefName, &info);
+    pixfmt=(pixfmt>FF_YUV?pixfmt:info.pixfmt);
+    if(info.width<=0 || info.height<=0)
+    {
+        printf("ffmpeg_metric_compare_files: can not get '%s' info\n", pRefName);
+        return 0;
+    }
+    FILE *pRef=ffmpeg_create_reader_full(pRefName, pixfmt, info.width, info.height, 0, threads, NULL, NULL);
+    FILE *pDist=ffmpeg_create_reader_full(pDistName, pixfmt, info.width, info.height, 0, threads, NULL, NULL);
+    int64 frames=(pRef && pDist?ffmpeg_metric_compare(pRef, pDist, pixfmt, info.width, info.height, flags, threads, pfnFrame, pCtx, pStat):0);
+    if(pRef) ffmpeg_close(pRef);
+    if(pDist) ffmpeg_close(pDist);
+    return frames;
+}
+
+// duplicate frame dropping for mostly static content (screen recordings, slides): every frame is reduced to the 8x8 block sums
+// of all planes (the planes downsampled by 8) and compared with the last kept frame. a frame is dropped when no block mean moved
+// by more than the threshold, bit-identical frames (equal sums and equal 64-bit hash) are counted apart. dropped frames leave a gap
+// in the timestamps of a VFR writer, so the encoder only sees the frames that changed. planar YUV and gray of 8 or 10 bits
+#define FF_DEDUP_THRESHOLD 1.0
+typedef struct FFDedupParam
+{
+    double threshold;  // largest change of any 8x8 block mean to the last kept frame, in 8-bit levels. 0: exact duplicates only
+    int maxRun;        // <=0: no limit, else at most maxRun frames in a row are dropped (bounds the time between keyframes)
+}FFDedupParam;
+typedef struct FFDedupStat
+{
+    int64 frames, kept, dropped, exact, near;  // exact: dropped as bit-identical, near: dropped within the threshold
+    int64 maxRun;  // longest run of dropped frames
+    double dropRatio, checkMs;  // checkMs: time spent in ffmpeg_dedup_check()
+}FFDedupStat;
+typedef struct FFDedupCtx
+{
+    FFPixFmt pixfmt;
+    int width, height, planeNum, is16, limit, maxRun;  // limit: threshold as a difference of block sums
+    int pWidth[3], pHeight[3], pBw[3], pBh[3];
+    int *pSig, *pKeptSig, sigNum;  // block sums of the current and of the last kept frame
+    uint64 keptHash;
+    int64 run;
+    FFDedupStat stat;
+}FFDedupCtx;
+static uint64 _ffmpeg_dedup_hash(const FFDedupCtx* p, const uint8* const ppData[4], const int pStride[4])
+{
+    uint64 h=0xcbf29ce484222325ULL;
+    for(int i=0; i<p->planeNum; i++)
+    {
+        int n=p->pWidth[i]*(p->is16+1);
+        for(int y=0; y<p->pHeight[i]; y++)
+        {
+            const uint8* r=ppData[i]+(size_t)y*pStride[i];
+            int x=0;
+            for(uint64 w; x+8<=n; x+=8)
+                memcpy(&w, r+x, 8), h=(h^w)*0x100000001b3ULL, h^=h>>29;
+            for(; x<n; x++)
+                h=(h^r[x])*0x100000001b3ULL;
+        }
+    }
+    return h;
+}
+static void _ffmpeg_dedup_signature(FFDedupCtx* p, const uint8* const ppData[4], const int pStride[4], OUT int* pSig)
+{
+    const FFSimdKernel* k=ffmpeg_simd();
+    for(int i=0; i<p->planeNum; i++)
+    {
+        int w=p->pWidth[i], h=p->pHeight[i], bw=p->pBw[i], full=w/8, bytes=p->is16+1;
+        for(int j=0; j<p->pBh[i]; j++, pSig+=bw)
+        {
+            const uint8* r=ppData[i]+(size_t)j*8*pStride[i];
+            if(j*8+8<=h) k->pfnSum8x8(r, pStride[i], p->is16, full, pSig);
+            // blocks cut by the right or bottom border sum the pixels they have
+            for(int b=(j*8+8<=h?full:0); b<bw; b++)
+            {
+                int sum=0;
+                for(int y=j*8; y<MIN(j*8+8, h); y++)
+                {
+                    const uint8* q=ppData[i]+(size_t)y*pStride[i];
+                    for(int x=b*8; x<MIN(b*8+8, w); x++) sum+=(bytes==2?((const uint16*)q)[x]:q[x]);
+                }
+                pSig[b]=sum;
+            }
+        }
+    }
+}
+static void ffmpeg_dedup_close(FFDedupCtx* p)
+{
+    if(p==0)
+        return;
+    free(p->pSig), free(p->pKeptSig), free(p);
+}
+// pParam NULL: FF_DEDUP_THRESHOLD, no run limit. returns NULL for packed RGB
+static FFDedupCtx* ffmpeg_dedup_create(FFPixFmt pixfmt, int width, int height, const FFDedupParam* pParam)
+{
+    if(pixfmt<=FF_YUV || pixfmt>FF_MAX || ffmpeg_yuv_isRGB(pixfmt) || width<=0 || height<=0)
+        return NULL;
+    FFDedupCtx* p=(FFDedupCtx*)calloc(1, sizeof(FFDedupCtx));
+    int64 pSize[4];
+    double threshold=(pParam?MAX(pParam->threshold, 0.0):FF_DEDUP_THRESHOLD);
+    p->pixfmt=pixfmt, p->width=width, p->height=height, p->maxRun=(pParam?pParam->maxRun:0);
+    p->planeNum=ffmpeg_yuv_plane_size(width, height, pixfmt, pSize), p->is16=ffmpeg_is_10bit(pixfmt);
+    p->limit=(int)(threshold*64*(p->is16?4:1));
+    for(int i=0; i<p->planeNum; i++)
+    {
+        p->pWidth[i]=(i?width>>ffmpeg_yuv_half_width(pixfmt):width), p->pHeight[i]=(i?height>>ffmpeg_yuv_half_height(pixfmt):height);
+        p->pBw[i]=(p->pWidth[i]+7)/8, p->pBh[i]=(p->pHeight[i]+7)/8, p->sigNum+=p->pBw[i]*p->pBh[i];
+    }
+    p->pSig=(int*)malloc(sizeof(int)*(size_t)p->sigNum), p->pKeptSig=(int*)malloc(sizeof(int)*(size_t)p->sigNum);
+    if(p->pSig==0 || p->pKeptSig==0)
+    {
+        ffmpeg_dedup_close(p);
+        return NULL;
+    }
+    return p;
+}
+// checks the next frame (pStride: bytes per row, NULL: the unpadded planes of ffmpeg_get_frame3()), returns 1 if it can be dropped.
+// a frame that is kept becomes the reference of the following ones
+static int ffmpeg_dedup_check(FFDedupCtx* p, const uint8* const ppData[4], const int pStride[4])
+{
+    int64 t=ffmpeg_get_time_us();
+    int pUnpadded[4]={0, 0, 0, 0}, maxDiff=0, isDrop=0, isHash=0;
+    uint64 hash=0;
+    if(pStride==0)
+    {
+        for(int i=0; i<p->planeNum; i++) pUnpadded[i]=ffmpeg_yuv_plane_stride(p->width, p->pixfmt, i);
+        pStride=pUnpadded;
+    }
+    _ffmpeg_dedup_signature(p, ppData, pStride, p->pSig);
+    if(p->stat.kept>0 && (p->maxRun<=0 || p->run<p->maxRun))
+    {
+        for(int i=0; i<p->sigNum && maxDiff<=p->limit; i++)
+            maxDiff=MAX(maxDiff, abs(p->pSig[i]-p->pKeptSig[i]));
+        // equal sums are the common case of a static screen, only then the frame is hashed
+        if(maxDiff==0) hash=_ffmpeg_dedup_hash(p, ppData, pStride), isHash=1;
+        if(isHash && hash==p->keptHash) isDrop=1, p->stat.exact++;
+        else if(maxDiff<=p->limit && p->limit>0) isDrop=1, p->stat.near++;
     }
+    p->stat.frames++;
+    if(isDrop)
+        p->stat.dropped++, p->run++, p->stat.maxRun=MAX(p->stat.maxRun, p->run);
     else
     {
-        fp=fopen(pName, "wb");
+        int* pTmp=p->pKeptSig;
+        p->pKeptSig=p->pSig, p->pSig=pTmp, p->keptHash=(isHash?hash:_ffmpeg_dedup_hash(p, ppData, pStride));
+        p->stat.kept++, p->run=0;
+    }
+    p->stat.dropRatio=(double)p->stat.dropped/p->stat.frames, p->stat.checkMs+=(ffmpeg_get_time_us()-t)/1e3;
+    return isDrop;
+}
+static forceinline FFDedupStat ffmpeg_dedup_get_stat(FFDedupCtx* p)
+{
+    return p->stat;
+}
+static void ffmpeg_dedup_print_stat(const FFDedupStat* p, const char* pName)
+{
+    printf("%s: frames=%lld  kept=%lld  dropped=%lld (%.1f%%, exact %lld, near %lld)  longest run=%lld  check %.3f ms/frame\n",
+        pName?pName:"dedup", (long long)p->frames, (long long)p->kept, (long long)p->dropped, p->dropRatio*100, (long long)p->exact, (long long)p->near,
+        (long long)p->maxRun, p->frames>0?p->checkMs/p->frames:0);
+}
+
+// VFR writer: frames are sent to ffmpeg as uncompressed matroska (V_UNCOMPRESSED, pixfmt as fourcc in ColourSpace) so that every
+// frame carries its own timestamp, -vsync vfr keeps them. one cluster per frame with known sizes, the pipe is never seeked
+typedef struct _FFMkvMux
+{
+    int64 (*pfnWrite)(FFStream* s, const void* pData, int64 size);  // the pipe below, NULL: fwrite
+    double fps;
+    int64 frameSize, pos;  // pos: bytes of the current frame written so far
+    int64 idxFrame;  // frame index of the current frame, one more than the previous if not given
+}_FFMkvMux;
+#define FF_MKV_TIME_SCALE 1000  // ns per matroska tick
+// EBML elements, all sizes are 8-byte vints so that a master element can be patched once its children are written
+static uint8* _ffmpeg_ebml_put_head(uint8* p, unsigned id, uint64 size)
+{
+    for(int k=(id>>24?24:(id>>16?16:(id>>8?8:0))); k>=0; k-=8) *p++=(uint8)(id>>k);
+    *p++=0x01;
+    for(int k=48; k>=0; k-=8) *p++=(uint8)(size>>k);
+    return p;
+}
+static uint8* _ffmpeg_ebml_put_uint(uint8* p, unsigned id, uint64 v)
+{
+    int n=1;
+    while(n<8 && (v>>(n*8))) n++;
+    p=_ffmpeg_ebml_put_head(p, id, n);
+    for(int k=(n-1)*8; k>=0; k-=8) *p++=(uint8)(v>>k);
+    return p;
+}
+static uint8* _ffmpeg_ebml_put_bin(uint8* p, unsigned id, const void* pData, int size)
+{
+    p=_ffmpeg_ebml_put_head(p, id, size);
+    memcpy(p, pData, size);
+    return p+size;
+}
+static forceinline void _ffmpeg_ebml_patch(uint8* pBody, uint8* pEnd)
+{
+    for(int k=0; k<7; k++) pBody[-1-k]=(uint8)((uint64)(pEnd-pBody)>>(k*8));
+}
+static forceinline int64 _ffmpeg_mkv_put(FFStream* s, _FFMkvMux* m, const void* pData, int64 size)
+{
+    return m->pfnWrite?m->pfnWrite(s, pData, size):(int64)fwrite(pData, 1, (size_t)size, s->fp);
+}
+static int _ffmpeg_mkv_header(FFStream* s, _FFMkvMux* m, FFPixFmt pixfmt, int width, int height)
+{
+    static const char* ppFourcc[]={"I420", "Y42B", "444P", "I420", "Y42B", "444P", "Y3\x0b\x0a", "Y3\x0a\x0a", "Y3\x00\x0a", "BGR0", "RGB0", "BGR\x18", "RGB\x18", "BGRA", "RGBA", "ABGR", "ARGB", "Y800"};
+    uint8 pBuf[512], *p=pBuf, *pBody, *pTrack, *pVideo, *pColour;
+    p=pBody=_ffmpeg_ebml_put_head(p, 0x1A45DFA3, 0);
+    p=_ffmpeg_ebml_put_uint(p, 0x4286, 1), p=_ffmpeg_ebml_put_uint(p, 0x42F7, 1), p=_ffmpeg_ebml_put_uint(p, 0x42F2, 4), p=_ffmpeg_ebml_put_uint(p, 0x42F3, 8);
+    p=_ffmpeg_ebml_put_bin(p, 0x4282, "matroska", 8), p=_ffmpeg_ebml_put_uint(p, 0x4287, 4), p=_ffmpeg_ebml_put_uint(p, 0x4285, 2);
+    _ffmpeg_ebml_patch(pBody, p);
+    // segment of unknown size (all ones), followed by Info and Tracks
+    p=_ffmpeg_ebml_put_head(p, 0x18538067, 0x00ffffffffffffffULL);
+    p=pBody=_ffmpeg_ebml_put_head(p, 0x1549A966, 0);
+    p=_ffmpeg_ebml_put_uint(p, 0x2AD7B1, FF_MKV_TIME_SCALE), p=_ffmpeg_ebml_put_bin(p, 0x4D80, "ffmpeg.h", 8), p=_ffmpeg_ebml_put_bin(p, 0x5741, "ffmpeg.h", 8);
+    _ffmpeg_ebml_patch(pBody, p);
+    p=pBody=_ffmpeg_ebml_put_head(p, 0x1654AE6B, 0);
+    p=pTrack=_ffmpeg_ebml_put_head(p, 0xAE, 0);
+    p=_ffmpeg_ebml_put_uint(p, 0xD7, 1), p=_ffmpeg_ebml_put_uint(p, 0x73C5, 1), p=_ffmpeg_ebml_put_uint(p, 0x83, 1), p=_ffmpeg_ebml_put_uint(p, 0x9C, 0);
+    p=_ffmpeg_ebml_put_bin(p, 0x86, "V_UNCOMPRESSED", 14), p=_ffmpeg_ebml_put_uint(p, 0x23E383, (uint64)(1e9/m->fps+0.5));
+    p=pVideo=_ffmpeg_ebml_put_head(p, 0xE0, 0);
+    p=_ffmpeg_ebml_put_uint(p, 0xB0, width), p=_ffmpeg_ebml_put_uint(p, 0xBA, height), p=_ffmpeg_ebml_put_bin(p, 0x2EB524, ppFourcc[pixfmt-FF_I420], 4);
+    if(pixfmt>=FF_J420 && pixfmt<=FF_J444)
+    {
+        p=pColour=_ffmpeg_ebml_put_head(p, 0x55B0, 0);
+        p=_ffmpeg_ebml_put_uint(p, 0x55B9, 2);
+        _ffmpeg_ebml_patch(pColour, p);
+    }
+    _ffmpeg_ebml_patch(pVideo, p), _ffmpeg_ebml_patch(pTrack, p), _ffmpeg_ebml_patch(pBody, p);
+    return _ffmpeg_mkv_put(s, m, pBuf, p-pBuf)==p-pBuf;
+}
+// frame data passes through, a cluster head (timestamp and SimpleBlock head) goes in front of every frame
+static int64 _ffmpeg_mkv_write(FFStream* s, const void* pData, int64 size)
+{
+    _FFMkvMux* m=(_FFMkvMux*)s->pMux;
+    int64 n=0;
+    while(n<size)
+    {
+        if(m->pos==0)
+        {
+            uint8 pHead[64], *p=pHead, *pBody;
+            int64 tick=(int64)(m->idxFrame*1e9/m->fps/FF_MKV_TIME_SCALE+0.5);
+            p=pBody=_ffmpeg_ebml_put_head(p, 0x1F43B675, 0);
+            p=_ffmpeg_ebml_put_uint(p, 0xE7, tick);
+            p=_ffmpeg_ebml_put_head(p, 0xA3, m->frameSize+4);
+            *p++=0x81, *p++=0, *p++=0, *p++=0x80;  // track 1, relative time 0, keyframe
+            _ffmpeg_ebml_patch(pBody, p+m->frameSize);
+            if(_ffmpeg_mkv_put(s, m, pHead, p-pHead)!=p-pHead)
+                break;
+        }
+        int64 k=_ffmpeg_mkv_put(s, m, (const uint8*)pData+n, MIN(size-n, m->frameSize-m->pos));
+        if(k<=0)
+            break;
+        n+=k, m->pos+=k;
+        if(m->pos==m->frameSize)
+            m->pos=0, m->idxFrame++;
+    }
+    return n;
+}
+#ifndef __linux__
+static int _ffmpeg_mkv_pclose(FFStream* s)
+{
+    return pclose(s->fp);
+}
+#endif
+// encodes frames with individual timestamps (ffmpeg_set_frame_pts()), frames written with ffmpeg_set_frame*() follow the
+// previous one by 1/fps. the gaps left by skipped frame indices become longer frame durations in pName
+static FILE* ffmpeg_create_vfr_writer(const char* pName, FFPixFmt pixfmt, int width, int height, double fps, double crf, const char* pCodec, const char* pFFmpegParam, int threads)
+{
+    char pCmd[4096];
+    if(pixfmt<FF_I420 || pixfmt>FF_MAX || width<=0 || height<=0 || fps<=0 || ffmpeg_is_rawfile(pName))
+    {
+        printf("ffmpeg_create_vfr_writer: '%s' needs a container and a known pixfmt, size and fps\n", pName);
+        return NULL;
+    }
+    int n=sprintf(pCmd, "%s -y -loglevel error -f matroska -i - -an -vsync vfr ", FFMPEG_BIN);
+    if(pCodec) n+=sprintf(pCmd+n, "-vcodec %s ", pCodec);
+    if(crf>=0) n+=sprintf(pCmd+n, "-crf %g ", crf);
+    if(pFFmpegParam)
+        n+=sprintf(pCmd+n, "%s ", pFFmpegParam);
+    else if(pCodec && strcmp(pCodec, LIBX265)==0)
+        n+=sprintf(pCmd+n, "-tag:v hvc1 ");
+    if(threads>0) n+=sprintf(pCmd+n, "-threads %d ", threads);
+    n+=sprintf(pCmd+n, "\"%s\" 2>" IO_NULL " 1>" IO_NULL, pName);
+    FILE* fp=_ffmpeg_spawn(pCmd, IO_W);
+    FFStream* s=ffmpeg_stream_find(fp);
+    if(fp && s==0)
+    {
+        s=(FFStream*)calloc(1, sizeof(FFStream));
+        s->fp=fp, s->fd=-1, s->isWriter=1;
+#ifndef __linux__
+        s->pfnClose=_ffmpeg_mkv_pclose;
+#endif
+        _ffmpeg_stream_register(s);
     }
+    if(s==0)
+        return NULL;
+    _FFMkvMux* m=(_FFMkvMux*)calloc(1, sizeof(_FFMkvMux));
+    m->pfnWrite=s->pfnWrite, m->fps=fps, m->frameSize=ffmpeg_yuv_compute_frame_size(width, height, pixfmt);
+    s->pMux=m, s->frameSize=m->frameSize;
+    if(!_ffmpeg_mkv_header(s, m, pixfmt, width, height))
+    {
+        _ffmpeg_pclose(fp);
+        return NULL;
+    }
+    s->pfnWrite=_ffmpeg_mkv_write;
     return fp;
 }
-static forceinline FILE* ffmpeg_create_writer(const char* pName, FFPixFmt pixfmt, int width, int height, double fps, double crf, const char* pCodec, const char* pFFmpegParam)
+// writes a frame with the timestamp idxFrame/fps of a VFR writer, plain writers ignore idxFrame
+static int64 ffmpeg_set_frame_pts(FILE* fp, void* pData, int64 dataSize, int64 idxFrame)
 {
-    return ffmpeg_create_writer_ex(pName, pixfmt, width, height, fps, crf, pCodec, pFFmpegParam, 0);
+    FFStream* s=ffmpeg_stream_find(fp);
+    _FFMkvMux* m=(s && s->pfnWrite==_ffmpeg_mkv_write?(_FFMkvMux*)s->pMux:NULL);
+    if(m && m->pos==0) m->idxFrame=idxFrame;
+    return _ffmpeg_write(fp, pData, dataSize);
 }
-static int ffmpeg_set_frame(FILE* fp, void* pData, int dataSize)
+// transcodes pSrcName with duplicate frames dropped (see FFDedupCtx), the output keeps the timing of the source. the last frame
+// is always written so the duration is kept. returns the number of frames encoded, 0 on failure
+static int64 ffmpeg_transcode_dedup(const char* pSrcName, const char* pDstName, double crf, const char* pCodec, const char* pFFmpegParam, int threads,
+    const FFDedupParam* pDedupParam, OUT FFDedupStat* pStat)
 {
-    return (int)fwrite(pData, 1, dataSize, fp);
+    FFInfo info;
+    ffmpeg_get_video_info(pSrcName, &info);
+    if(pStat) memset(pStat, 0, sizeof(FFDedupStat));
+    FFDedupCtx* p=(info.width>0 && info.height>0?ffmpeg_dedup_create(info.pixfmt, info.width, info.height, pDedupParam):NULL);
+    if(p==0)
+    {
+        printf("ffmpeg_transcode_dedup: can not get '%s' info or its pixfmt is not planar\n", pSrcName);
+        return 0;
+    }
+    int64 frameSize=ffmpeg_yuv_compute_frame_size(info.width, info.height, info.pixfmt);
+    int cur=0, isPending=0;
+    uint8* pFrame=(uint8*)malloc((size_t)frameSize*2), *ppData[2][4];
+    if(pFrame==0)
+    {
+        printf("ffmpeg_transcode_dedup: alloc %lld bytes failed\n", (long long)frameSize*2);
+        ffmpeg_dedup_close(p);
+        return 0;
+    }
+    // a reader or writer that fails to start ends the loop at once, both are released below
+    FILE *pReader=ffmpeg_create_reader_full(pSrcName, info.pixfmt, info.width, info.height, 0, threads, NULL, NULL);
+    FILE *pWriter=(pReader?ffmpeg_create_vfr_writer(pDstName, info.pixfmt, info.width, info.height, info.fps, crf, pCodec, pFFmpegParam, threads):NULL);
+    int64 idx=0, written=0;
+    ffmpeg_yuv_split_planes(pFrame, info.width, info.height, info.pixfmt, ppData[0]);
+    ffmpeg_yuv_split_planes(pFrame+frameSize, info.width, info.height, info.pixfmt, ppData[1]);
+    // two buffers: the frame before the current one is still there when the source ends on a dropped frame
+    for(; pWriter && ffmpeg_get_frame3(pReader, ppData[cur], info.pixfmt, info.width, info.height)*(ffmpeg_is_10bit(info.pixfmt)+1)==frameSize; idx++, cur^=1)
+    {
+        isPending=ffmpeg_dedup_check(p, (const uint8* const*)ppData[cur], NULL);
+        if(!isPending && ffmpeg_set_frame_pts(pWriter, ppData[cur][0], frameSize, idx)!=frameSize)
+            break;
+        written+=!isPending;
+    }
+    if(isPending && ffmpeg_set_frame_pts(pWriter, ppData[cur^1][0], frameSize, idx-1)==frameSize)
+        written++;
+    if(pStat) *pStat=p->stat;
+    int ret=(pWriter?ffmpeg_close_ex(pWriter, NULL):-1);
+    if(pReader) ffmpeg_close(pReader);
+    ffmpeg_dedup_close(p);
+    free(pFrame);
+    return ret==0?written:0;
 }
-static int ffmpeg_set_frame2(FILE* fp, void* pY, int ySize, void* pU, int uSize, void* pV, int vSize)
+
+// runs a command line to completion, returns its exit code (-1 if it could not be started)
+static int ffmpeg_run(const char* pCmd)
 {
-    int y=(int)fwrite(pY, 1, ySize, fp), u=(int)fwrite(pU, 1, uSize, fp), v=(int)fwrite(pV, 1, vSize, fp);
-    return y+u+v;
+    FILE* fp=_ffmpeg_spawn(pCmd, IO_R);
+    if(fp==0)
+        return -1;
+    char pBuf[4096];
+    while(_ffmpeg_read(fp, pBuf, sizeof(pBuf))>0);
+    int status=_ffmpeg_pclose(fp);
+#ifdef __linux__
+    return WIFEXITED(status)?WEXITSTATUS(status):-1;
+#else
+    return status;
+#endif
 }
-static int ffmpeg_set_frame3(FILE* fp, uint8* ppData[4], FFPixFmt pixfmt, int width, int height)
+// segment-parallel transcoding: the source is split at keyframes into segNum segments, every segment is decoded and encoded by
+// its own reader/writer pair, and the encoded segments are concatenated in order with stream copy.
+// every segment starts with an IDR in a closed GOP; overlap>0 additionally encodes that many frames before each segment start
+// (rate control warm-up), they end up in their own GOP and are cut out losslessly by the concat step.
+typedef struct FFSegmentParam
 {
-    int scale=ffmpeg_is_10bit(pixfmt)+1, yshift=ffmpeg_yuv_half_height(pixfmt), xshift=ffmpeg_yuv_half_width(pixfmt), nSize=0;
-    int pSize[4]={width*height, (height>>yshift)*(width>>xshift), (height>>yshift)*(width>>xshift), (height>>yshift)*(width>>xshift)}, cn=ffmpeg_yuv_channel(pixfmt);
-    if(ffmpeg_yuv_isRGB(pixfmt))
-        pSize[0]=width*height*cn, cn=1;
-    for(int i=0; i<cn; i++)
-        nSize+=(int)fwrite(ppData[i], scale, pSize[i], fp);
-    return nSize;
+    int segNum;           // <=0: one segment per 8 cores
+    int threads;          // encoder threads per segment, <=0: cores/segNum
+    int overlap;          // frames encoded ahead of every segment but the first
+    int minFrames;        // shortest segment, <=0: 2 seconds
+    const char* pTmpDir;  // segment files, NULL: next to the output
+}FFSegmentParam;
+typedef struct _FFSegmentJob
+{
+    const char *pSrcName, *pCodec;
+    char pDstName[1024], pParam[2048];
+    FFPixFmt pixfmt;
+    int width, height, start, num, overlap, threads;
+    double fps, crf;
+    int frames;
+}_FFSegmentJob;
+static void* _ffmpeg_segment_proc(void* pArg)
+{
+    _FFSegmentJob* j=(_FFSegmentJob*)pArg;
+    char pRange[32];
+    int total=j->num+j->overlap;
+    int64 frameSize=ffmpeg_yuv_compute_frame_size(j->width, j->height, j->pixfmt);
+    sprintf(pRange, "-frames:v %d", total);
+    FILE *pReader=ffmpeg_create_reader_full(j->pSrcName, j->pixfmt, j->width, j->height, j->start-j->overlap, j->threads, NULL, pRange);
+    FILE *pWriter=ffmpeg_create_writer_full(j->pDstName, j->pixfmt, j->width, j->height, j->fps, j->crf, j->pCodec, j->pParam, j->threads, NULL);
+    uint8* pData=(uint8*)malloc((size_t)frameSize);
+    for(j->frames=0; pReader && pWriter && j->frames<total; j->frames++)
+    {
+        if(ffmpeg_get_frame(pReader, pData, frameSize)!=frameSize || ffmpeg_set_frame(pWriter, pData, frameSize)!=frameSize)
+            break;
+    }
+    free(pData);
+    if(pReader) ffmpeg_close(pReader);
+    if(pWriter) ffmpeg_close(pWriter);
+    return NULL;
 }
-static void ffmpeg_close(FILE* fp)
+// appends pOpt to the "-x265-params"/"-x264-params" list of pParam (or adds the list)
+static void _ffmpeg_add_codec_param(char* pOut, int outSize, const char* pParam, const char* pKey, const char* pOpt)
 {
-    fclose(fp);
+    const char* p=strstr(pParam, pKey);
+    if(p)
+        snprintf(pOut, outSize, "%.*s%s:%s", (int)(p-pParam+strlen(pKey)), pParam, pOpt, p+strlen(pKey));
+    else
+        snprintf(pOut, outSize, "%s %s%s ", pParam, pKey, pOpt);
 }
-static int ffmpeg_get_frame_num(const char* pName)
+static int ffmpeg_transcode_segments(const char* pSrcName, const char* pDstName, FFPixFmt pixfmt, double crf, const char* pCodec, const char* pFFmpegParam, const FFSegmentParam* pSegParam)
 {
-    int frameNum=0;
+    FFSegmentParam param={0, 0, 0, 0, NULL};
     FFInfo info;
-    ffmpeg_get_video_info(pName, &info);
-    if(info.frame_num>0)
-        return info.frame_num;
-    if(info.width*info.height>0 && info.pixfmt>FF_YUV)
+    if(pSegParam) param=*pSegParam;
+    ffmpeg_get_video_info(pSrcName, &info);
+    if(info.width<=0 || info.height<=0 || info.frame_num<=0 || info.fps<=0)
     {
-        int frameSize=ffmpeg_yuv_compute_frame_size(info.width, info.height, info.pixfmt);
-        uint8 *pData=(uint8*)malloc(frameSize);
-        FILE* fp=ffmpeg_create_reader(pName, info.pixfmt);
-        while(ffmpeg_get_frame(fp, pData, frameSize)==frameSize)
-            frameNum++;
-        free(pData);
-        ffmpeg_close(fp);
+        printf("ffmpeg_transcode_segments: can not get '%s' info\n", pSrcName);
+        return 0;
     }
-    return frameNum;
+    pixfmt=(pixfmt>FF_YUV?pixfmt:info.pixfmt);
+    int cpuNum=ffmpeg_get_cpu_num(), frameNum=info.frame_num;
+    int segNum=(param.segNum>0?param.segNum:MAX(1, cpuNum/8)), minFrames=(param.minFrames>0?param.minFrames:(int)(2*info.fps+0.5));
+    int overlap=MAX(0, param.overlap), threads=(param.threads>0?param.threads:MAX(1, cpuNum/segNum));
+    // segment starts at the keyframes closest to an even split, a start too far from any keyframe just decodes from the one before
+    FFIndex* pIndex=ffmpeg_get_video_index(pSrcName);
+    if(pIndex) frameNum=pIndex->frame_num;
+    segNum=BETWEEN(segNum, 1, MAX(1, frameNum/minFrames));
+    int* pStart=(int*)malloc(sizeof(int)*(segNum+1)), n=0, maxShift=frameNum/segNum/4;
+    pStart[n++]=0;
+    for(int i=1; i<segNum; i++)
+    {
+        int target=(int)((int64)i*frameNum/segNum), best=target;
+        for(int k=0; pIndex && k<pIndex->key_num; k++)
+        {
+            int d=abs(pIndex->pKeyFrame[k]-target);
+            if(d<=maxShift && (best==target || d<abs(best-target)))
+                best=pIndex->pKeyFrame[k];
+        }
+        if(best-pStart[n-1]>=minFrames && frameNum-best>=minFrames)
+            pStart[n++]=best;
+    }
+    pStart[n]=frameNum, segNum=n;
+    ffmpeg_free_video_index(pIndex);
+    // per segment encoder parameters: closed GOP, and an IDR where the real segment starts after the overlap
+    const char* pExt=strrchr(pDstName, '.');
+    char pBase[1024], pList[1100], pParam[2048];
+    const char* pName=pDstName+strlen(pDstName);
+    while(pName>pDstName && pName[-1]!='/' && pName[-1]!='\\') pName--;
+    if(param.pTmpDir) snprintf(pBase, sizeof(pBase), "%s/%.*s", param.pTmpDir, (int)((pExt?pExt:pDstName+strlen(pDstName))-pName), pName);
+    else snprintf(pBase, sizeof(pBase), "%.*s", (int)((pExt?pExt:pDstName+strlen(pDstName))-pDstName), pDstName);
+    int isX265=(pCodec && strcmp(pCodec, LIBX265)==0);
+    const char* pBaseParam=(pFFmpegParam?pFFmpegParam:(isX265?"-tag:v hvc1 ":""));
+    if(isX265) _ffmpeg_add_codec_param(pParam, sizeof(pParam), pBaseParam, "-x265-params ", "open-gop=0");
+    else snprintf(pParam, sizeof(pParam), "%s", pBaseParam);
+    _FFSegmentJob* pJob=(_FFSegmentJob*)calloc(segNum, sizeof(_FFSegmentJob));
+    FFThread* pThread=(FFThread*)calloc(segNum, sizeof(FFThread));
+    int* pIsRun=(int*)calloc(segNum, sizeof(int)), isOK=1;
+    for(int i=0; i<segNum; i++)
+    {
+        _FFSegmentJob* j=&pJob[i];
+        j->pSrcName=pSrcName, j->pCodec=pCodec, j->pixfmt=pixfmt, j->width=info.width, j->height=info.height;
+        j->start=pStart[i], j->num=pStart[i+1]-pStart[i], j->overlap=(i>0?MIN(overlap, pStart[i]):0), j->threads=threads;
+        j->fps=info.fps, j->crf=crf;
+        snprintf(j->pDstName, sizeof(j->pDstName), "%s.seg%03d%s", pBase, i, pExt?pExt:".mp4");
+        if(j->overlap>0) snprintf(j->pParam, sizeof(j->pParam), "%s -forced-idr 1 -force_key_frames \"expr:eq(n,%d)\" ", pParam, j->overlap);
+        else snprintf(j->pParam, sizeof(j->pParam), "%s", pParam);
+        pIsRun[i]=ffmpeg_thread_create(&pThread[i], _ffmpeg_segment_proc, j);
+        if(!pIsRun[i]) _ffmpeg_segment_proc(j);
+    }
+    for(int i=0; i<segNum; i++)
+    {
+        if(pIsRun[i]) ffmpeg_thread_join(pThread[i]);
+        isOK&=(pJob[i].frames==pJob[i].num+pJob[i].overlap);
+    }
+    // lossless concatenation, the overlap GOP of every segment is skipped with inpoint
+    snprintf(pList, sizeof(pList), "%s.segs.txt", pBase);
+    FILE* fp=(isOK?fopen(pList, "w"):0);
+    if(fp)
+    {
+        char pCmd[4096];
+        fprintf(fp, "ffconcat version 1.0\n");
+        for(int i=0; i<segNum; i++)
+        {
+            fprintf(fp, "file '%s'\n", pJob[i].pDstName);
+            if(pJob[i].overlap>0) fprintf(fp, "inpoint %.6f\n", (pJob[i].overlap+0.25)/info.fps);
+        }
+        fclose(fp);
+        snprintf(pCmd, sizeof(pCmd), "%s -y -loglevel error -f concat -safe 0 -i \"%s\" -c copy %s\"%s\" 2>" IO_NULL, FFMPEG_BIN, pList, isX265?"-tag:v hvc1 ":"", pDstName);
+        isOK=(ffmpeg_run(pCmd)==0);
+        remove(pList);
+    }
+    else if(isOK)
+        isOK=0, printf("ffmpeg_transcode_segments: create '%s' failed\n", pList);
+    for(int i=0; i<segNum; i++)
+        remove(pJob[i].pDstName);
+    free(pJob); free(pThread); free(pIsRun); free(pStart);
+    return isOK;
+}
+
+// batch transcoding on a fixed core budget, for the best aggregate fps of a box rather than of a job. every job gets a core share
+// from its pixel rate and codec (shares are widened when the jobs cannot fill the budget), its encoder runs with that many threads
+// and its decoder with a quarter. jobs start in list order whenever their share is free, later smaller jobs fill the gaps.
+// with isPin the ffmpeg children of a job are bound to the cores of its share, taken NUMA node by node (linux).
+typedef struct FFBatchJob
+{
+    const char *pSrcName, *pDstName;
+    double crf;
+    const char *pCodec, *pFFmpegParam;  // NULL: encoder defaults
+    // results of ffmpeg_batch_run()
+    int cores, decThreads, encThreads, firstCpu;  // firstCpu: first core of the share in NUMA order, -1 if not pinned
+    int64 frames;
+    double startSec, sec, fps;  // startSec: since the batch started
+    int exitCode;  // of the encoder, -1 if it did not run
+    char* pBuf;  // strings of jobs from ffmpeg_batch_load()
+}FFBatchJob;
+typedef struct FFBatchParam
+{
+    int cores;    // core budget, <=0: all cores of the process
+    int isPin;    // bind every job to its cores
+    int maxJobs;  // concurrent jobs, <=0: as many as the budget allows
+}FFBatchParam;
+typedef struct FFBatchStat
+{
+    int jobs, failed;
+    int64 frames;
+    double sec, fps;  // wall time of the batch, frames of all jobs per wall second
+    double coreUsage; // average share of the budget in use
+}FFBatchStat;
+typedef struct _FFBatch
+{
+    FFBatchJob* pJob;
+    int num, budget, isPin, running, active, pCpu[1024], cpuNum;  // running: cores in use, active: jobs
+    int* pCpuUsed;  // job index+1 holding each slot of pCpu
+    double coreSec;
+    int64 startUs;
+    FFMutex mutex;
+    FFCond cond;
+}_FFBatch;
+typedef struct _FFBatchTask
+{
+    _FFBatch* b;
+    int idx;
+}_FFBatchTask;
+// usable cores, grouped by NUMA node so that a contiguous range of slots stays on one node where it can
+static int _ffmpeg_batch_cpu_order(int* pCpu, int maxNum)
+{
+    int num=0;
+#ifdef __linux__
+    cpu_set_t mask, seen;
+    CPU_ZERO(&seen);
+    if(sched_getaffinity(0, sizeof(mask), &mask)!=0)
+        return 0;
+    for(int node=0; node<64; node++)
+    {
+        char pName[64], pList[1024];
+        sprintf(pName, "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* fp=fopen(pName, "r");
+        if(fp==0) continue;
+        pList[0]=0;
+        if(fgets(pList, sizeof(pList), fp)==0) pList[0]=0;
+        fclose(fp);
+        for(char* p=pList; *p>='0' && *p<='9'; )
+        {
+            int lo=(int)strtol(p, &p, 10), hi=lo;
+            if(*p=='-') hi=(int)strtol(p+1, &p, 10);
+            for(int c=lo; c<=hi && c<CPU_SETSIZE; c++)
+                if(CPU_ISSET(c, &mask) && !CPU_ISSET(c, &seen) && num<maxNum) pCpu[num++]=c, CPU_SET(c, &seen);
+            if(*p==',') p++;
+        }
+    }
+    for(int c=0; c<CPU_SETSIZE && num<maxNum; c++)
+        if(CPU_ISSET(c, &mask) && !CPU_ISSET(c, &seen)) pCpu[num++]=c;
+#else
+    for(num=0; num<MIN(maxNum, ffmpeg_get_cpu_num()); num++) pCpu[num]=num;
+#endif
+    return num;
+}
+// cores a job is worth: 2 per 1080p of x264-class work, hevc 3x and av1 4x that, between 1 and 16
+static int _ffmpeg_batch_share(const FFInfo* pInfo, const char* pCodec)
+{
+    double mpix=(double)pInfo->width*pInfo->height/(1920*1080), cost=1;
+    if(pCodec && (strstr(pCodec, "265") || strstr(pCodec, "hevc"))) cost=3;
+    else if(pCodec && (strstr(pCodec, "av1") || strstr(pCodec, "aom") || strstr(pCodec, "svt"))) cost=4;
+    return BETWEEN((int)(mpix*cost*2+0.5), 1, 16);
+}
+#ifdef __linux__
+static void _ffmpeg_batch_pin(FILE* fp, const cpu_set_t* pMask)
+{
+    FFStream* s=ffmpeg_stream_find(fp);
+    if(s && s->pid>0) sched_setaffinity((pid_t)s->pid, sizeof(cpu_set_t), pMask);
+}
+#endif
+static void* _ffmpeg_batch_proc(void* pArg)
+{
+    _FFBatchTask* t=(_FFBatchTask*)pArg;
+    _FFBatch* b=t->b;
+    FFBatchJob* j=&b->pJob[t->idx];
+    FFInfo info;
+    int64 start=ffmpeg_get_time_us();
+    ffmpeg_get_video_info(j->pSrcName, &info);
+#ifdef __linux__
+    // a failing encoder is an EPIPE of this job, not a SIGPIPE of the process
+    sigset_t set;
+    sigemptyset(&set), sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    // children started from this thread inherit the mask, children of worker pool helpers are bound after the start
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for(int i=0; i<b->cpuNum && j->firstCpu>=0; i++)
+        if(b->pCpuUsed[i]==t->idx+1) CPU_SET(b->pCpu[i], &mask);
+    if(j->firstCpu>=0) sched_setaffinity(0, sizeof(mask), &mask);
+#endif
+    FILE *pReader=(info.width>0?ffmpeg_create_reader_full(j->pSrcName, info.pixfmt, info.width, info.height, 0, j->decThreads, NULL, NULL):NULL);
+    FILE *pWriter=(pReader?ffmpeg_create_writer_full(j->pDstName, info.pixfmt, info.width, info.height, info.fps, j->crf, j->pCodec, j->pFFmpegParam, j->encThreads, NULL):NULL);
+#ifdef __linux__
+    if(j->firstCpu>=0) _ffmpeg_batch_pin(pReader, &mask), _ffmpeg_batch_pin(pWriter, &mask);
+#endif
+    int64 frameSize=(info.width>0?ffmpeg_yuv_compute_frame_size(info.width, info.height, info.pixfmt):1);
+    j->frames=(pWriter?ffmpeg_reader_passthrough(pReader, pWriter, 0)/frameSize:0);
+    if(pReader) ffmpeg_close(pReader);
+    j->exitCode=(pWriter?ffmpeg_close_ex(pWriter, NULL):-1);
+    j->sec=(ffmpeg_get_time_us()-start)/1e6, j->fps=(j->sec>0?j->frames/j->sec:0);
+    ffmpeg_mutex_lock(&b->mutex);
+    for(int i=0; i<b->cpuNum; i++)
+        if(b->pCpuUsed[i]==t->idx+1) b->pCpuUsed[i]=0;
+    b->running-=j->cores, b->active--, b->coreSec+=j->cores*j->sec;
+    ffmpeg_cond_broadcast(&b->cond);
+    ffmpeg_mutex_unlock(&b->mutex);
+    return NULL;
+}
+// the cores of a share: the first run of free slots in NUMA order, else whatever is free. returns the first core
+static int _ffmpeg_batch_take(_FFBatch* b, int idx, int cores)
+{
+    int first=-1, run=0;
+    for(int i=0; i<b->cpuNum && first<0; i++)
+    {
+        run=(b->pCpuUsed[i]?0:run+1);
+        if(run==cores) first=i-cores+1;
+    }
+    for(int i=(first>=0?first:0), n=0; i<b->cpuNum && n<cores; i++)
+        if(b->pCpuUsed[i]==0) b->pCpuUsed[i]=idx+1, n++, first=(first<0?i:first);
+    return first>=0?b->pCpu[first]:-1;
+}
+// runs num jobs, returns the number that succeeded (encoder exit code 0 with at least one frame)
+static int ffmpeg_batch_run(FFBatchJob* pJob, int num, const FFBatchParam* pParam, OUT FFBatchStat* pStat)
+{
+    FFBatchParam param={0, 0, 0};
+    _FFBatch b;
+    if(pParam) param=*pParam;
+    memset(&b, 0, sizeof(b));
+    b.pJob=pJob, b.num=num, b.isPin=param.isPin, b.startUs=ffmpeg_get_time_us();
+    b.cpuNum=_ffmpeg_batch_cpu_order(b.pCpu, 1024);
+    b.budget=MAX(1, param.cores>0?param.cores:b.cpuNum);
+    if(b.isPin) b.budget=MIN(b.budget, MAX(1, b.cpuNum));
+    b.pCpuUsed=(int*)calloc(MAX(1, b.cpuNum), sizeof(int));
+    ffmpeg_mutex_init(&b.mutex), ffmpeg_cond_init(&b.cond);
+    // shares from the sources, widened together when all jobs at once would still leave cores idle
+    int total=0;
+    for(int i=0; i<num; i++)
+    {
+        FFInfo info;
+        ffmpeg_get_video_info(pJob[i].pSrcName, &info);
+        pJob[i].cores=MIN(_ffmpeg_batch_share(&info, pJob[i].pCodec), b.budget), total+=pJob[i].cores;
+        pJob[i].frames=0, pJob[i].sec=pJob[i].fps=0, pJob[i].exitCode=-1, pJob[i].firstCpu=-1;
+    }
+    for(int i=0; i<num && total>0 && total<b.budget; i++)
+        pJob[i].cores=MIN(b.budget, pJob[i].cores*b.budget/total);
+    for(int i=0; i<num; i++)
+        pJob[i].encThreads=pJob[i].cores, pJob[i].decThreads=MAX(1, pJob[i].cores/4);
+    _FFBatchTask* pTask=(_FFBatchTask*)calloc(MAX(1, num), sizeof(_FFBatchTask));
+    FFThread* pThread=(FFThread*)calloc(MAX(1, num), sizeof(FFThread));
+    int* pState=(int*)calloc(MAX(1, num), sizeof(int)), started=0;  // 0: waiting, 1: own thread, 2: ran inline
+    ffmpeg_mutex_lock(&b.mutex);
+    while(started<num)
+    {
+        for(int i=0; i<num; i++)
+        {
+            if(pState[i] || (b.running+pJob[i].cores>b.budget && b.running>0) || (param.maxJobs>0 && b.active>=param.maxJobs))
+                continue;
+            FFBatchJob* j=&pJob[i];
+            b.running+=j->cores, b.active++, started++;
+            j->firstCpu=(b.isPin?_ffmpeg_batch_take(&b, i, j->cores):-1);
+            j->startSec=(ffmpeg_get_time_us()-b.startUs)/1e6;
+            pTask[i].b=&b, pTask[i].idx=i, pState[i]=1;
+            if(!ffmpeg_thread_create(&pThread[i], _ffmpeg_batch_proc, &pTask[i]))
+            {
+                pState[i]=2;
+                ffmpeg_mutex_unlock(&b.mutex);
+                _ffmpeg_batch_proc(&pTask[i]);
+                ffmpeg_mutex_lock(&b.mutex);
+            }
+        }
+        if(started<num)
+            ffmpeg_cond_wait(&b.cond, &b.mutex);
+    }
+    ffmpeg_mutex_unlock(&b.mutex);
+    int ok=0;
+    FFBatchStat stat;
+    memset(&stat, 0, sizeof(stat));
+    for(int i=0; i<num; i++)
+    {
+        if(pState[i]==1) ffmpeg_thread_join(pThread[i]);
+        int isOK=(pJob[i].exitCode==0 && pJob[i].frames>0);
+        ok+=isOK, stat.failed+=!isOK, stat.frames+=pJob[i].frames;
+    }
+    stat.jobs=num, stat.sec=(ffmpeg_get_time_us()-b.startUs)/1e6;
+    stat.fps=(stat.sec>0?stat.frames/stat.sec:0), stat.coreUsage=(stat.sec>0?b.coreSec/(stat.sec*b.budget):0);
+    if(pStat) *pStat=stat;
+    ffmpeg_cond_destroy(&b.cond), ffmpeg_mutex_destroy(&b.mutex);
+    free(b.pCpuUsed); free(pTask); free(pThread); free(pState);
+    return ok;
+}
+static void ffmpeg_batch_print(const FFBatchJob* pJob, int num, const FFBatchStat* pStat)
+{
+    for(int i=0; i<num; i++)
+    {
+        const FFBatchJob* j=&pJob[i];
+        printf("%3d %s -> %s: cores=%d (dec %d enc %d)", i, j->pSrcName, j->pDstName, j->cores, j->decThreads, j->encThreads);
+        if(j->firstCpu>=0) printf(" cpu %d+", j->firstCpu);
+        printf("  start %.2f s  %lld frames  %.2f s  %.1f fps  exit=%d\n", j->startSec, (long long)j->frames, j->sec, j->fps, j->exitCode);
+    }
+    if(pStat)
+        printf("batch: %d jobs (%d failed)  %lld frames  %.2f s  %.1f fps aggregate  core usage %.0f%%\n",
+            pStat->jobs, pStat->failed, (long long)pStat->frames, pStat->sec, pStat->fps, pStat->coreUsage*100);
+}
+static void ffmpeg_batch_free(FFBatchJob* pJob, int num)
+{
+    for(int i=0; pJob && i<num; i++)
+        free(pJob[i].pBuf);
+    free(pJob);
+}
+// job list, one job per line: input output [crf|-] [codec|-] [ffmpeg params...]. names with spaces in "", '#' starts a comment line
+static FFBatchJob* ffmpeg_batch_load(const char* pListName, OUT int* pNum)
+{
+    FILE* fp=fopen(pListName, "r");
+    FFBatchJob* pJob=0;
+    int num=0, max=0;
+    char pLine[4096];
+    *pNum=0;
+    if(fp==0)
+    {
+        printf("ffmpeg_batch_load: open '%s' failed\n", pListName);
+        return NULL;
+    }
+    while(fgets(pLine, sizeof(pLine), fp))
+    {
+        char *ppField[4]={0, 0, 0, 0}, *p, *pBuf;
+        int n=0;
+        pLine[strcspn(pLine, "\r\n")]=0;
+        for(p=pLine; *p==' ' || *p=='\t'; p++);
+        if(*p==0 || *p=='#')
+            continue;
+        p=pBuf=strdup(p);
+        while(n<4 && *p)
+        {
+            char c=(*p=='"'?*p++:' ');
+            ppField[n++]=p;
+            while(*p && *p!=c && !(c==' ' && *p=='\t')) p++;
+            if(*p) *p++=0;
+            while(*p==' ' || *p=='\t') p++;
+        }
+        if(n<2)
+        {
+            printf("ffmpeg_batch_load: bad line '%s'\n", pLine);
+            free(pBuf);
+            continue;
+        }
+        if(num==max)
+            max=MAX(16, max*2), pJob=(FFBatchJob*)realloc(pJob, sizeof(FFBatchJob)*max);
+        FFBatchJob* j=&pJob[num++];
+        memset(j, 0, sizeof(FFBatchJob));
+        j->pSrcName=ppField[0], j->pDstName=ppField[1], j->pBuf=pBuf;
+        j->crf=(ppField[2] && strcmp(ppField[2], "-")!=0?atof(ppField[2]):FF_CRF_AUTO);
+        j->pCodec=(ppField[3] && strcmp(ppField[3], "-")!=0?ppField[3]:NULL);
+        j->pFFmpegParam=(*p?p:NULL);
+    }
+    fclose(fp);
+    *pNum=num;
+    return pJob;
 }
 
 #endif // __FFMPEG_H__
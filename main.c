@@ -1,30 +1,93 @@
 #include "ffmpeg.h"
+// per-frame filter of the processing stage (-bands), here a plain copy of the band
+static void copy_band(void* pCtx, const FFBand* b)
+{
+    (void)pCtx;
+    for(int y=b->y; y<b->y+b->height; y++)
+        memcpy(b->pDst+(size_t)y*b->dstStride+(size_t)b->x*b->pixelBytes, b->pSrc+(size_t)y*b->srcStride+(size_t)b->x*b->pixelBytes, (size_t)b->width*b->pixelBytes);
+}
 int main(int argc, const char* argv[])
 {
     if(argc<3)
     {
-        printf("usage: test input.mp4 output.mp4 [-crf xx]\n");
+        printf("usage: test input.mp4 output.mp4 [-crf xx] [-dedup threshold] [-bands]\n");
+        printf("       test -batch jobs.txt [-cores n] [-pin]   (lines: input output [crf|-] [codec|-] [params])\n");
         return -1;
     }
+    if(strcmp(argv[1], "-batch")==0)
+    {
+        FFBatchParam param={0, 0, 0};
+        FFBatchStat stat;
+        int num=0;
+        for(int i=3; i<argc; i++)
+        {
+            if(strcmp(argv[i], "-cores")==0 && i+1<argc) param.cores=atoi(argv[++i]);
+            else if(strcmp(argv[i], "-pin")==0) param.isPin=1;
+        }
+        FFBatchJob* pJob=ffmpeg_batch_load(argv[2], &num);
+        int ok=ffmpeg_batch_run(pJob, num, &param, &stat);
+        ffmpeg_batch_print(pJob, num, &stat);
+        ffmpeg_batch_free(pJob, num);
+        return ok==num;
+    }
     const char *pSrcName=argv[1], *pDstName=argv[2];
     double crf=(argc>=5 && strcmp(argv[3], "-crf")==0)?atof(argv[4]):FF_CRF_AUTO;
+    int isBands=0;
+    for(int i=3; i<argc; i++)
+        isBands|=(strcmp(argv[i], "-bands")==0);
     FFInfo *p=ffmpeg_get_video_info(pSrcName, 0);
     int width=p->width, height=p->height, frameNum=p->frame_num;
-    int frameSize=ffmpeg_yuv_compute_frame_size(width, height, p->pixfmt);
+    int64 frameSize=ffmpeg_yuv_compute_frame_size(width, height, p->pixfmt);
     printf("width=%d  height=%d  pix_fmt=%s  frameNum=%d\n", p->width, p->height, ffmpeg_pixfmt2string(p->pixfmt), frameNum);
     printf("col_spc=%s  col_pri=%s col_trc=%s\n", ffmpeg_GetColorSpaceName(p->col_spc), ffmpeg_GetColorPrimsName(p->col_pri), ffmpeg_GetColorTransName(p->col_trc));
-    uint8* pX=(uint8*)malloc(frameSize);
     const char* pParam=(p->col_trc==FF_COL_TRC_HLG?MAKE_X265_PARAM(HDR_PARAM_HLG):(p->col_trc==FF_COL_TRC_PQ?MAKE_X265_PARAM(HDR_PARAM_PQ):MAKE_X265_PARAM(SDR_PARAM_BT709)));
+    for(int i=3; i+1<argc; i++)
+    {
+        if(strcmp(argv[i], "-dedup")!=0)
+            continue;
+        // static content: frames that did not change are dropped, the output is VFR
+        FFDedupParam param={atof(argv[i+1]), 0};
+        FFDedupStat stat;
+        int64 frames=ffmpeg_transcode_dedup(pSrcName, pDstName, crf, LIBX265, pParam, 0, &param, &stat);
+        ffmpeg_dedup_print_stat(&stat, "dedup");
+        return frames>0;
+    }
     FILE *pReader=ffmpeg_create_reader(pSrcName, p->pixfmt);
     FILE *pWriter=ffmpeg_create_writer(pDstName, p->pixfmt, width, height, p->fps, crf, LIBX265, pParam);
-    for(int i=0; i<frameNum; i++)
+    // decoder, processing and encoder run concurrently, each side keeps up to 4 frames in flight. without -bands the frames
+    // are written from the reader's ring, which then holds the frames of both sides
+    FFAsync *pAsyncReader=ffmpeg_async_create_reader(pReader, frameSize, isBands?4:8), *pAsyncWriter=ffmpeg_async_create_writer(pWriter, frameSize, 4);
+    // -bands: frames go through the processing stage, the bands of 2 frames are processed on the pool at the same time and
+    // frames leave the stage in order
+    FFStage* pStage=(isBands?ffmpeg_stage_create(p->pixfmt, width, height, NULL, copy_band, NULL):NULL);
+    for(int i=0; i<frameNum && pStage==0; i++)
     {
         printf("\r%4d/%d ", i+1, frameNum);
-        ffmpeg_get_frame(pReader, pX, frameSize);
-        ffmpeg_set_frame(pWriter, pX, frameSize);
+        uint8 *pSrc=ffmpeg_async_get_frame(pAsyncReader, 0);
+        if(pSrc==0 || !ffmpeg_async_forward_frame(pAsyncWriter, pAsyncReader, pSrc, frameSize))
+            break;
+    }
+    for(int i=0, n=0; i<=frameNum && pStage; i++)
+    {
+        uint8 *pSrc=(i<frameNum?ffmpeg_async_get_frame(pAsyncReader, 0):NULL), *pDst=(pSrc?ffmpeg_async_acquire_frame(pAsyncWriter):NULL);
+        if(pSrc && pDst)
+        {
+            uint8 *ppSrc[4], *ppDst[4];
+            printf("\r%4d/%d ", i+1, frameNum);
+            ffmpeg_yuv_split_planes(pSrc, width, height, p->pixfmt, ppSrc);
+            ffmpeg_yuv_split_planes(pDst, width, height, p->pixfmt, ppDst);
+            n=ffmpeg_stage_submit(pStage, (const uint8* const*)ppSrc, NULL, ppDst, NULL);
+        }
+        else
+            n=ffmpeg_stage_wait(pStage, 0), i=frameNum;
+        for(; n>0; n--)
+            ffmpeg_async_release_frame(pAsyncReader), ffmpeg_async_submit_frame(pAsyncWriter, frameSize);
     }
     printf("\n");
+    if(pStage) ffmpeg_stage_print_stat(pStage, "stage");
+    ffmpeg_async_print_stat(pAsyncReader, "reader"); ffmpeg_async_print_stat(pAsyncWriter, "writer");
+    ffmpeg_stage_close(pStage);
+    ffmpeg_async_close(pAsyncWriter); ffmpeg_async_close(pAsyncReader);
     ffmpeg_close(pReader); ffmpeg_close(pWriter);
-    free(pX);
     return 1;
 }
\ No newline at end of file
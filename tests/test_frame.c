@@ -0,0 +1,130 @@
+// ffmpeg_get_frame_ex()/ffmpeg_set_frame_ex() with padded strides: every pixel format through raw files (a registered stream,
+// planes go through its staging buffer) and plain stdio (row by row), a plane larger than the staging buffer, and the
+// per-thread stream lookup cache across close and reopen
+#include "ffmpeg.h"
+
+static int g_fail=0;
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); g_fail++; } } while(0)
+
+static const char* g_ppName[]={"yuv", "I420", "I422", "I444", "J420", "J422", "J444", "I420P10", "I422P10", "I444P10", "BGR48", "RGB48", "BGR", "RGB", "BGRA", "RGBA", "ABGR", "ARGB", "Gray"};
+
+static int plane_rows(const FFFrame* f, int i)
+{
+    return i==0?f->height:f->height>>ffmpeg_yuv_half_height(f->pixfmt);
+}
+// frame idx has row bytes (i, y, x, idx) and padding pad; pRef gets the packed frame
+static void fill_frame(FFFrame* f, int idx, uint8 pad, uint8* pRef)
+{
+    memset(f->pBuf, pad, f->bufSize);
+    for(int i=0; i<f->planeNum; i++)
+    {
+        int rowSize=ffmpeg_yuv_plane_stride(f->width, f->pixfmt, i);
+        for(int y=0; y<plane_rows(f, i); y++)
+        {
+            for(int x=0; x<rowSize; x++)
+                f->ppData[i][(size_t)y*f->pStride[i]+x]=(uint8)(i*71+y*13+x*7+idx*29);
+            if(pRef) memcpy(pRef, f->ppData[i]+(size_t)y*f->pStride[i], rowSize), pRef+=rowSize;
+        }
+    }
+}
+// rows equal to pRef, padding still pad
+static int frame_equal(const FFFrame* f, const uint8* pRef, uint8 pad)
+{
+    for(int i=0; i<f->planeNum; i++)
+    {
+        int rowSize=ffmpeg_yuv_plane_stride(f->width, f->pixfmt, i);
+        for(int y=0; y<plane_rows(f, i); y++, pRef+=rowSize)
+        {
+            const uint8* p=f->ppData[i]+(size_t)y*f->pStride[i];
+            if(memcmp(p, pRef, rowSize)!=0)
+                return 0;
+            for(int x=rowSize; x<f->pStride[i]; x++)
+                if(p[x]!=pad) return 0;
+        }
+    }
+    return 1;
+}
+static int file_equal(const char* pName, const uint8* pRef, int64 size)
+{
+    uint8* p=(uint8*)malloc((size_t)size+1);
+    FILE* fp=fopen(pName, "rb");
+    int64 n=(fp?(int64)fread(p, 1, (size_t)size+1, fp):-1);
+    if(fp) fclose(fp);
+    int ret=(n==size && memcmp(p, pRef, (size_t)size)==0);
+    free(p);
+    return ret;
+}
+
+static void test_format(FFPixFmt fmt, int w, int h, int frames)
+{
+    char pName[128];
+    snprintf(pName, sizeof(pName), "test_frame.tmp_%dx%d.%s.yuv", w, h, g_ppName[fmt]);
+    FFFrame *f=ffmpeg_frame_alloc(fmt, w, h), *g=ffmpeg_frame_alloc(fmt, w, h);
+    int64 frameSize=ffmpeg_frame_data_size(f);
+    uint8* pRef=(uint8*)malloc((size_t)(frameSize*frames));
+    CHECK(f->pStride[0]>ffmpeg_yuv_plane_stride(w, fmt, 0), "%s %dx%d is not padded", g_ppName[fmt], w, h);
+    // registered raw file stream, for the formats whose name the raw file parser takes back (not BGR48/RGB48, read as BGR/RGB)
+    FILE* fp=(ffmpeg_yuv_str2pixfmt(g_ppName[fmt])==fmt?ffmpeg_create_writer(pName, fmt, w, h, 25, -1, NULL, NULL):NULL);
+    for(int k=0; k<frames; k++)
+        fill_frame(f, k, 0xEE, pRef+k*frameSize);
+    if(fp)
+    {
+        CHECK(ffmpeg_stream_find(fp), "%s raw writer", g_ppName[fmt]);
+        for(int k=0; k<frames; k++)
+        {
+            fill_frame(f, k, 0xEE, NULL);
+            CHECK(ffmpeg_set_frame_ex(fp, f)==frameSize, "%s set_frame_ex %d", g_ppName[fmt], k);
+        }
+        ffmpeg_close(fp);
+        CHECK(file_equal(pName, pRef, frameSize*frames), "%s %dx%d raw file content", g_ppName[fmt], w, h);
+        fp=ffmpeg_create_reader(pName, fmt);
+        FFStream* s=ffmpeg_stream_find(fp);
+        CHECK(fp && s && s->pid==0, "%s raw reader is not a file map", g_ppName[fmt]);
+        for(int k=0; k<frames && fp; k++)
+        {
+            memset(g->pBuf, 0x55, g->bufSize);
+            CHECK(ffmpeg_get_frame_ex(fp, g)==frameSize && frame_equal(g, pRef+k*frameSize, 0x55) && g->pts==k, "%s %dx%d get_frame_ex %d", g_ppName[fmt], w, h, k);
+        }
+        CHECK(fp && ffmpeg_get_frame_ex(fp, g)==0, "%s read past the end", g_ppName[fmt]);
+        if(fp) ffmpeg_close(fp);
+    }
+    // plain stdio stream
+    fp=fopen(pName, "wb");
+    CHECK(ffmpeg_stream_find(fp)==0, "plain file found as stream");
+    for(int k=0; k<frames; k++)
+        fill_frame(f, k, 0xEE, NULL), ffmpeg_set_frame_ex(fp, f);
+    fclose(fp);
+    CHECK(file_equal(pName, pRef, frameSize*frames), "%s stdio file content", g_ppName[fmt]);
+    fp=fopen(pName, "rb");
+    memset(g->pBuf, 0x55, g->bufSize);
+    CHECK(ffmpeg_get_frame_ex(fp, g)==frameSize && frame_equal(g, pRef, 0x55), "%s stdio get_frame_ex", g_ppName[fmt]);
+    fclose(fp);
+    remove(pName);
+    free(pRef);
+    ffmpeg_frame_unref(f), ffmpeg_frame_unref(g);
+}
+
+int main()
+{
+    for(int fmt=FF_I420; fmt<=FF_MAX; fmt++)
+        test_format((FFPixFmt)fmt, 67, 34, 3);
+    // a plane of 8.6 MB moves in two staging pieces
+    test_format(FF_GRAY, 4100, 2100, 2);
+
+    // lookups stay right when the registry changes under the cached answer, pKeep keeps the registry from being empty
+    FILE* pPlain=fopen("test_frame.tmp.bin", "wb");
+    FILE* pKeep=ffmpeg_create_writer("test_frame.tmp_8x8.Gray.yuv", FF_GRAY, 8, 8, 25, -1, NULL, NULL);
+    FILE* fp=ffmpeg_create_writer("test_frame.tmp_16x16.Gray.yuv", FF_GRAY, 16, 16, 25, -1, NULL, NULL);
+    FFStream* s=ffmpeg_stream_find(fp);
+    CHECK(s && s->fp==fp && ffmpeg_stream_find(fp)==s && ffmpeg_stream_find(pPlain)==0 && ffmpeg_stream_find(fp)==s, "lookup");
+    ffmpeg_close(fp);
+    FILE* fp2=ffmpeg_create_writer("test_frame.tmp_16x16.Gray.yuv", FF_GRAY, 16, 16, 25, -1, NULL, NULL);
+    s=ffmpeg_stream_find(fp2);
+    CHECK(s && s->fp==fp2, "lookup after reopen");
+    ffmpeg_close(fp2);
+    CHECK(ffmpeg_stream_find(fp2)==0 && ffmpeg_stream_find(pPlain)==0, "lookup after close");
+    ffmpeg_close(pKeep), fclose(pPlain);
+    remove("test_frame.tmp.bin"), remove("test_frame.tmp_16x16.Gray.yuv"), remove("test_frame.tmp_8x8.Gray.yuv");
+    printf(g_fail?"test_frame: %d failures\n":"test_frame: all passed\n", g_fail);
+    return g_fail!=0;
+}
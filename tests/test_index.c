@@ -0,0 +1,106 @@
+// container index parsing: cactus.mp4 against its known tables, then hand-built mp4 files whose sample tables claim far
+// more samples than the file holds. those must give a bounded index or NULL, never a huge allocation or a write past it.
+// the mkv index of cactus.mp4 remuxed (needs ffmpeg in PATH) must also survive each of its growth reallocs failing
+#define _GNU_SOURCE
+#include <stdlib.h>
+static int g_reallocFail=-1;  // >=0: calls to realloc() before the one that fails
+static void* test_realloc(void* p, size_t size)
+{
+    return g_reallocFail>=0 && g_reallocFail--==0?NULL:realloc(p, size);
+}
+#define realloc test_realloc
+#include "ffmpeg.h"
+
+static int g_fail=0;
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); g_fail++; } } while(0)
+
+static uint8* put32(uint8* p, unsigned v)
+{
+    p[0]=(uint8)(v>>24), p[1]=(uint8)(v>>16), p[2]=(uint8)(v>>8), p[3]=(uint8)v;
+    return p+4;
+}
+// box of type with payload [pBody, pBody+size)
+static uint8* put_box(uint8* p, const char* pType, const uint8* pBody, int size)
+{
+    p=put32(p, (unsigned)(8+size));
+    memcpy(p, pType, 4), memcpy(p+4, pBody, size);
+    return p+4+size;
+}
+// minimal mp4: ftyp, moov of one video track with the given stsz/stz2 payload and an stts of one entry
+static int write_mp4(const char* pName, const char* pSizeBox, const uint8* pStsz, int stszSize, unsigned sttsCount, unsigned moovSizeDelta)
+{
+    static uint8 pBuf[4096], pTmp[4096], pStbl[1024], pMinf[1024], pMdia[1024], pTrak[1024];
+    uint8 pMvhd[100]={0}, pMdhd[24]={0}, pHdlr[24]={0}, pStts[16]={0}, *p;
+    put32(pMvhd+12, 1000), put32(pMdhd+12, 24000), memcpy(pHdlr+8, "vide", 4);
+    put32(pStts+4, 1), put32(pStts+8, sttsCount), put32(pStts+12, 1001);
+    p=put_box(pStbl, pSizeBox, pStsz, stszSize), p=put_box(p, "stts", pStts, sizeof(pStts));
+    int n=(int)(put_box(pMinf, "stbl", pStbl, (int)(p-pStbl))-pMinf);
+    p=put_box(pMdia, "mdhd", pMdhd, sizeof(pMdhd)), p=put_box(p, "hdlr", pHdlr, sizeof(pHdlr)), p=put_box(p, "minf", pMinf, n);
+    n=(int)(put_box(pTrak, "mdia", pMdia, (int)(p-pMdia))-pTrak);
+    p=put_box(pTmp, "mvhd", pMvhd, sizeof(pMvhd)), p=put_box(p, "trak", pTrak, n);
+    uint8* pEnd=put_box(pBuf, "ftyp", (const uint8*)"isom\0\0\0\0", 8);
+    pEnd=put_box(pEnd, "moov", pTmp, (int)(p-pTmp));
+    put32(pEnd-(p-pTmp)-8, (unsigned)(p-pTmp)+8+moovSizeDelta);
+    FILE* fp=fopen(pName, "wb");
+    if(fp==0)
+        return 0;
+    fwrite(pBuf, 1, pEnd-pBuf, fp);
+    fclose(fp);
+    return 1;
+}
+
+int main()
+{
+    const char* pName="test_index.tmp.mp4";
+    uint8 pStsz[64]={0};
+    FFIndex* p=ffmpeg_get_video_index("../cactus.mp4");
+    CHECK(p && p->frame_num==334 && p->sample_num==334 && p->key_num==2 && p->width==1280 && p->height==720, "cactus.mp4 index");
+    ffmpeg_free_video_index(p);
+    // constant sample size, 4G samples claimed by stsz and stts: bounded by what fits the file
+    put32(pStsz+4, 1), put32(pStsz+8, 0xFFFFFFF0u);
+    write_mp4(pName, "stsz", pStsz, 12, 0xFFFFFFF0u, 0);
+    p=ffmpeg_get_video_index(pName);
+    CHECK(p==0 || p->sample_num<4096, "constant stsz sample count not bounded (%d)", p?p->sample_num:-1);
+    ffmpeg_free_video_index(p);
+    // table stsz claiming 4G entries in a box of 4: bounded by the box
+    put32(pStsz+4, 0), put32(pStsz+8, 0xFFFFFFF0u), put32(pStsz+12, 100), put32(pStsz+16, 200), put32(pStsz+20, 300), put32(pStsz+24, 400);
+    write_mp4(pName, "stsz", pStsz, 28, 0xFFFFFFF0u, 0);
+    p=ffmpeg_get_video_index(pName);
+    CHECK(p && p->sample_num==4 && p->pSampleSize[3]==400, "table stsz not bounded by its box (%d)", p?p->sample_num:-1);
+    ffmpeg_free_video_index(p);
+    // stts with fewer samples than stsz: bounded by stts
+    put32(pStsz+8, 4);
+    write_mp4(pName, "stsz", pStsz, 28, 3, 0);
+    p=ffmpeg_get_video_index(pName);
+    CHECK(p && p->sample_num==3 && p->frame_num==3, "stsz not bounded by stts (%d)", p?p->sample_num:-1);
+    ffmpeg_free_video_index(p);
+    // stz2 with 8-bit fields
+    memset(pStsz, 0, sizeof(pStsz)), pStsz[7]=8, put32(pStsz+8, 5), memcpy(pStsz+12, "\x01\x02\x03\x04\x05", 5);
+    write_mp4(pName, "stz2", pStsz, 17, 5, 0);
+    p=ffmpeg_get_video_index(pName);
+    CHECK(p && p->sample_num==5 && p->pSampleSize[4]==5, "stz2 8-bit fields");
+    ffmpeg_free_video_index(p);
+    // moov claiming 1.5 GB in a file of a few hundred bytes
+    write_mp4(pName, "stsz", pStsz, 17, 5, 1500u<<20);
+    p=ffmpeg_get_video_index(pName);
+    CHECK(p==0, "oversized moov accepted");
+    ffmpeg_free_video_index(p);
+    remove(pName);
+    if(system("ffmpeg -hide_banner -loglevel error -y -i ../cactus.mp4 -c copy test_index.tmp.mkv")==0)
+    {
+        p=ffmpeg_get_video_index("test_index.tmp.mkv");
+        CHECK(p && p->frame_num==334 && p->key_num==2 && p->width==1280 && p->height==720, "cactus.mkv index");
+        ffmpeg_free_video_index(p);
+        for(int i=0; i<4; i++)
+        {
+            g_reallocFail=i;
+            p=ffmpeg_get_video_index("test_index.tmp.mkv");
+            CHECK(p==0, "mkv index with realloc %d failing", i);
+            ffmpeg_free_video_index(p);
+        }
+        g_reallocFail=-1;
+        remove("test_index.tmp.mkv");
+    }
+    printf(g_fail?"test_index: %d failures\n":"test_index: all passed\n", g_fail);
+    return g_fail!=0;
+}
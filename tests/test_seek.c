@@ -0,0 +1,93 @@
+// ffmpeg_seek_frame() and scan readers on mp4 (container index) and avi (none, B-frame delay shifts its timestamps): every
+// frame carries its own index in flat luma blocks, seeks must land exactly, short forward seeks decode through and long ones
+// restart ffmpeg, scans return each kept frame once with its source index. needs ffmpeg with libx264 in PATH
+#include "ffmpeg.h"
+
+static int g_fail=0;
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); g_fail++; } } while(0)
+
+enum { W=64, H=64, FRAMES=300 };
+// three digits of 4 levels each in the top, middle and bottom third of the luma plane
+static void make_frame(uint8* p, int idx)
+{
+    memset(p, 128, W*H*3/2);
+    for(int d=0; d<3; d++, idx/=8)
+        memset(p+d*W*(H/3), 24+(idx%8)*28, W*(H/3));
+}
+static int frame_index(const uint8* p)
+{
+    int idx=0;
+    for(int d=2; d>=0; d--)
+        idx=idx*8+BETWEEN((p[d*W*(H/3)+W*(H/6)+W/2]-24+14)/28, 0, 7);
+    return idx;
+}
+
+// keyframe-only and strided scans: every frame returned once, in order, with the index it has in the source
+static void test_scan(const char* pName, int isKeyOnly, int stride, int frames)
+{
+    static uint8 pFrame[W*H*3/2];
+    FFScanParam param={isKeyOnly, stride, 0, 0, FF_I420, 0};
+    FILE* fp=ffmpeg_create_scan_reader(pName, &param, NULL, NULL, NULL);
+    int n=0, last=-1, idx;
+    double sec;
+    CHECK(fp, "%s scan reader", pName);
+    while(fp && ffmpeg_get_scan_frame(fp, pFrame, sizeof(pFrame), &idx, &sec)==sizeof(pFrame))
+    {
+        CHECK(idx==frame_index(pFrame) && idx>last && (isKeyOnly || idx%stride==0), "%s scan key %d stride %d: frame %d reported as %d after %d",
+            pName, isKeyOnly, stride, frame_index(pFrame), idx, last);
+        last=frame_index(pFrame), n++;
+    }
+    CHECK(n==frames, "%s scan key %d stride %d: %d frames instead of %d", pName, isKeyOnly, stride, n, frames);
+    if(fp) ffmpeg_close(fp);
+}
+static void test_file(const char* pName, int isIndexed)
+{
+    static uint8 pFrame[W*H*3/2];
+    FILE* fp=ffmpeg_create_writer(pName, FF_I420, W, H, 25, 10, LIBX264, "-g 250");
+    for(int i=0; i<FRAMES && fp; i++)
+        make_frame(pFrame, i), ffmpeg_set_frame(fp, pFrame, sizeof(pFrame));
+    CHECK(fp && ffmpeg_close_ex(fp, NULL)==0, "encode %s", pName);
+    FFIndex* pIndex=ffmpeg_get_video_index(pName);
+    int keyNum=(pIndex?pIndex->key_num:0);
+    CHECK((pIndex!=0)==isIndexed, "%s index", pName);
+    ffmpeg_free_video_index(pIndex);
+
+    fp=ffmpeg_create_reader(pName, FF_I420);
+    FFStream* s=ffmpeg_stream_find(fp);
+    CHECK(fp && s && ffmpeg_get_frame(fp, pFrame, sizeof(pFrame))==sizeof(pFrame) && frame_index(pFrame)==0, "%s first frame", pName);
+    if(s==0)
+        return;
+    // a short jump decodes through: same ffmpeg process
+    int64 pid=s->pid;
+    CHECK(ffmpeg_seek_frame(fp, 20) && ffmpeg_get_frame(fp, pFrame, sizeof(pFrame))==sizeof(pFrame), "%s seek 20", pName);
+    CHECK(frame_index(pFrame)==20 && s->pid==pid, "%s seek 20 landed on %d, restart %d", pName, frame_index(pFrame), s->pid!=pid);
+    // a long jump restarts ffmpeg instead of decoding everything in between
+    CHECK(ffmpeg_seek_frame(fp, 280) && ffmpeg_get_frame(fp, pFrame, sizeof(pFrame))==sizeof(pFrame), "%s seek 280", pName);
+    CHECK(frame_index(pFrame)==280 && s->pid!=pid, "%s seek 280 landed on %d, restart %d", pName, frame_index(pFrame), s->pid!=pid);
+    CHECK(ffmpeg_tell_frame(fp)==281, "%s tell after 280: %d", pName, ffmpeg_tell_frame(fp));
+    // backwards and forwards again
+    int pTarget[]={5, 150, 151, 299, 0};
+    for(int i=0; i<(int)(sizeof(pTarget)/sizeof(*pTarget)); i++)
+    {
+        int ok=ffmpeg_seek_frame(fp, pTarget[i]) && ffmpeg_get_frame(fp, pFrame, sizeof(pFrame))==sizeof(pFrame);
+        CHECK(ok && frame_index(pFrame)==pTarget[i], "%s seek %d landed on %d", pName, pTarget[i], ok?frame_index(pFrame):-1);
+    }
+    ffmpeg_close(fp);
+    // keyframes of an avi decoded with -skip_frame nokey get no usable pts from ffmpeg, only the indexed file scans them
+    if(isIndexed) test_scan(pName, 1, 1, keyNum);
+    test_scan(pName, 0, 50, FRAMES/50);
+    remove(pName);
+}
+
+int main()
+{
+    if(system("ffmpeg -hide_banner -version >/dev/null 2>&1")!=0)
+    {
+        printf("test_seek: no ffmpeg in PATH, skipped\n");
+        return 0;
+    }
+    test_file("test_seek.tmp.mp4", 1);
+    test_file("test_seek.tmp.avi", 0);
+    printf(g_fail?"test_seek: %d failures\n":"test_seek: all passed\n", g_fail);
+    return g_fail!=0;
+}
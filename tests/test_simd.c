@@ -0,0 +1,240 @@
+// bit-exactness of the SIMD kernels against the C ones, for every ISA the cpu supports: each FFSimdKernel entry on random
+// rows of odd lengths, then ffmpeg_convert() over all FFPixFmt pairs, ffmpeg_scale() over all FFPixFmt and ffmpeg_metric_frame()
+// over the planar formats, at odd sizes
+#include "ffmpeg.h"
+
+static int g_fail=0;
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); g_fail++; } } while(0)
+
+static unsigned g_seed=1;
+static unsigned rnd()
+{
+    g_seed=g_seed*1103515245+12345;
+    return g_seed>>8;
+}
+static void fill(uint8* p, size_t size)
+{
+    for(size_t i=0; i<size; i++) p[i]=(uint8)rnd();
+}
+static void fill16(uint16* p, size_t n, unsigned mask)
+{
+    for(size_t i=0; i<n; i++) p[i]=(uint16)(rnd()&mask);
+}
+// Q14 filter of taps coefficients >=0 that sum to 16384, as the scaler builds them
+static void make_filter(short* pCoef, int taps)
+{
+    int left=16384;
+    for(int k=0; k<taps-1; k++)
+    {
+        int c=(int)(rnd()%(unsigned)(left+1));
+        pCoef[k]=(short)c, left-=c;
+    }
+    pCoef[taps-1]=(short)left;
+}
+static const char* isa_name(FFIsa isa)
+{
+    static const char* ppName[]={"c", "sse4", "avx2", "avx512"};
+    return ppName[isa];
+}
+
+static void test_kernels(const FFSimdKernel* c, const FFSimdKernel* k)
+{
+    const char* pName=isa_name(k->isa);
+    enum { N=301 };
+    uint8 pA[N*2*8], pB[N*2*8], p8a[N]={0}, p8b[N]={0};
+    uint16 pW[3][N], pX[3][N], pY[3][N], pOutA[N], pOutB[N];
+    for(int n=0; n<N; n+=(n<70?1:23))
+    {
+        fill(p8a, n);
+        c->pfnLoad8(p8a, pOutA, n), k->pfnLoad8(p8a, pOutB, n);
+        CHECK(memcmp(pOutA, pOutB, n*2)==0, "%s load8 n=%d", pName, n);
+        fill16(pW[0], n, 0xFFFF);
+        c->pfnStore8(pW[0], p8a, n), k->pfnStore8(pW[0], p8b, n);
+        CHECK(memcmp(p8a, p8b, n)==0, "%s store8 n=%d", pName, n);
+        // matrix: Q12 coefficients in [-2, 2], offsets as large as a range change needs
+        int pCoef[12];
+        for(int j=0; j<9; j++) pCoef[j]=(int)(rnd()%16385)-8192;
+        for(int j=9; j<12; j++) pCoef[j]=(int)(rnd()%(1u<<28))-(1<<27);
+        for(int j=0; j<3; j++) fill16(pW[j], n, 0xFFFF), memcpy(pX[j], pW[j], n*2);
+        c->pfnMat3(pW[0], pW[1], pW[2], n, pCoef), k->pfnMat3(pX[0], pX[1], pX[2], n, pCoef);
+        CHECK(memcmp(pW[0], pX[0], n*2)==0 && memcmp(pW[1], pX[1], n*2)==0 && memcmp(pW[2], pX[2], n*2)==0, "%s mat3 n=%d", pName, n);
+        // vertical filter over 1..8 rows
+        for(int taps=1; taps<=8; taps++)
+        {
+            short pTap[8];
+            const uint16* ppRow[8];
+            make_filter(pTap, taps);
+            for(int j=0; j<taps; j++) ppRow[j]=pY[j%3];
+            for(int j=0; j<3; j++) fill16(pY[j], n, 0xFFFF);
+            c->pfnVFilter(ppRow, pTap, taps, pOutA, n), k->pfnVFilter(ppRow, pTap, taps, pOutB, n);
+            CHECK(memcmp(pOutA, pOutB, n*2)==0, "%s vfilter n=%d taps=%d", pName, n, taps);
+        }
+        // row filter: stride coefficients per output starting at pFirst[i]
+        for(int stride=8; stride<=24; stride+=8)
+        {
+            static short pTap[N*24];
+            int pFirst[N];
+            uint16 pSrc[N+32];
+            fill16(pSrc, N+32, 0xFFFF);
+            for(int i=0; i<n; i++) pFirst[i]=(int)(rnd()%(N+32-stride)), make_filter(pTap+i*stride, stride);
+            c->pfnHFilter(pSrc, pFirst, pTap, stride, pOutA, n), k->pfnHFilter(pSrc, pFirst, pTap, stride, pOutB, n);
+            CHECK(memcmp(pOutA, pOutB, n*2)==0, "%s hfilter n=%d stride=%d", pName, n, stride);
+        }
+        // metrics kernels on 8-bit and 10-bit samples, rows of odd strides
+        for(int is16=0; is16<2; is16++)
+        {
+            int stride=n*(is16+1)+1+(int)(rnd()%7), blocks4=n/4, blocks8=n/8, pSumA[N][4], pSumB[N][4], pS8a[N], pS8b[N];
+            fill(pA, sizeof(pA)), fill(pB, sizeof(pB));
+            if(is16)
+                for(size_t i=0; i<sizeof(pA)/2; i++) ((uint16*)pA)[i]&=1023, ((uint16*)pB)[i]&=1023;
+            CHECK(c->pfnSse(pA, pB, n, is16)==k->pfnSse(pA, pB, n, is16), "%s sse n=%d is16=%d", pName, n, is16);
+            c->pfnSsim4x4(pA, stride&~is16, pB, (stride+3)&~is16, is16, blocks4, pSumA);
+            k->pfnSsim4x4(pA, stride&~is16, pB, (stride+3)&~is16, is16, blocks4, pSumB);
+            CHECK(memcmp(pSumA, pSumB, sizeof(int)*4*blocks4)==0, "%s ssim4x4 n=%d is16=%d", pName, n, is16);
+            c->pfnSum8x8(pA, stride&~is16, is16, blocks8, pS8a), k->pfnSum8x8(pA, stride&~is16, is16, blocks8, pS8b);
+            CHECK(memcmp(pS8a, pS8b, sizeof(int)*blocks8)==0, "%s sum8x8 n=%d is16=%d", pName, n, is16);
+        }
+    }
+}
+
+// planes of a frame with padded strides, 10-bit formats get in-range samples
+typedef struct TestFrame
+{
+    uint8* ppData[4];
+    int pStride[4], planeNum;
+    uint8* pBuf;
+    size_t bufSize;
+}TestFrame;
+static void frame_alloc(TestFrame* f, FFPixFmt pixfmt, int width, int height)
+{
+    int yshift=ffmpeg_yuv_half_height(pixfmt);
+    size_t offset[4], size=0;
+    memset(f, 0, sizeof(TestFrame));
+    f->planeNum=(ffmpeg_yuv_isRGB(pixfmt)?1:ffmpeg_yuv_channel(pixfmt));
+    for(int i=0; i<f->planeNum; i++)
+    {
+        int rows=(i==0?height:height>>yshift);
+        f->pStride[i]=ffmpeg_yuv_plane_stride(width, pixfmt, i)+2*(i+1);
+        offset[i]=size, size+=(size_t)f->pStride[i]*rows;
+    }
+    f->pBuf=(uint8*)malloc(MAX(size, 1)), f->bufSize=size;
+    for(int i=0; i<f->planeNum; i++) f->ppData[i]=f->pBuf+offset[i];
+}
+static void frame_fill(TestFrame* f, FFPixFmt pixfmt)
+{
+    fill(f->pBuf, f->bufSize);
+    if(ffmpeg_is_10bit(pixfmt) && !ffmpeg_yuv_isRGB(pixfmt))
+        for(size_t i=0; i<f->bufSize/2; i++) ((uint16*)f->pBuf)[i]&=1023;
+}
+// compares the visible rows of two frames, padding is not written by the library
+static int frame_equal(const TestFrame* a, const TestFrame* b, FFPixFmt pixfmt, int width, int height)
+{
+    for(int i=0; i<a->planeNum; i++)
+    {
+        int rows=(i==0?height:height>>ffmpeg_yuv_half_height(pixfmt)), rowSize=ffmpeg_yuv_plane_stride(width, pixfmt, i);
+        for(int y=0; y<rows; y++)
+            if(memcmp(a->ppData[i]+(size_t)y*a->pStride[i], b->ppData[i]+(size_t)y*b->pStride[i], rowSize)!=0)
+                return 0;
+    }
+    return 1;
+}
+
+static void test_convert(FFIsa isa)
+{
+    static const int pSize[][2]={{1, 1}, {7, 5}, {33, 18}, {67, 9}};
+    for(int s=0; s<(int)(sizeof(pSize)/sizeof(*pSize)); s++)
+    {
+        int w=pSize[s][0], h=pSize[s][1];
+        for(int src=FF_MIN+1; src<=FF_MAX; src++)
+        {
+            TestFrame in, outC, outK;
+            frame_alloc(&in, (FFPixFmt)src, w, h), frame_fill(&in, (FFPixFmt)src);
+            for(int dst=FF_MIN+1; dst<=FF_MAX; dst++)
+            {
+                frame_alloc(&outC, (FFPixFmt)dst, w, h), frame_alloc(&outK, (FFPixFmt)dst, w, h);
+                ffmpeg_simd_set_isa(FF_ISA_C);
+                int rc=ffmpeg_convert((const uint8* const*)in.ppData, in.pStride, (FFPixFmt)src, outC.ppData, outC.pStride, (FFPixFmt)dst, w, h, FF_COL_SPC_UNKNOWN, 1);
+                ffmpeg_simd_set_isa(isa);
+                int rk=ffmpeg_convert((const uint8* const*)in.ppData, in.pStride, (FFPixFmt)src, outK.ppData, outK.pStride, (FFPixFmt)dst, w, h, FF_COL_SPC_UNKNOWN, 1);
+                CHECK(rc==1 && rk==1 && frame_equal(&outC, &outK, (FFPixFmt)dst, w, h), "%s convert %s->%s %dx%d",
+                    isa_name(isa), ffmpeg_pixfmt2string((FFPixFmt)src), ffmpeg_pixfmt2string((FFPixFmt)dst), w, h);
+                free(outC.pBuf), free(outK.pBuf);
+            }
+            free(in.pBuf);
+        }
+    }
+}
+
+static void test_scale(FFIsa isa)
+{
+    static const int pSize[][4]={{67, 35, 19, 11}, {19, 11, 67, 35}, {65, 33, 65, 17}, {33, 9, 101, 9}, {5, 3, 1, 1}};
+    for(int s=0; s<(int)(sizeof(pSize)/sizeof(*pSize)); s++)
+    {
+        int sw=pSize[s][0], sh=pSize[s][1], dw=pSize[s][2], dh=pSize[s][3];
+        for(int fmt=FF_MIN+1; fmt<=FF_MAX; fmt++)
+        {
+            TestFrame in, outC, outK;
+            frame_alloc(&in, (FFPixFmt)fmt, sw, sh), frame_fill(&in, (FFPixFmt)fmt);
+            frame_alloc(&outC, (FFPixFmt)fmt, dw, dh), frame_alloc(&outK, (FFPixFmt)fmt, dw, dh);
+            ffmpeg_simd_set_isa(FF_ISA_C);
+            int rc=ffmpeg_scale((const uint8* const*)in.ppData, in.pStride, outC.ppData, outC.pStride, (FFPixFmt)fmt, sw, sh, dw, dh, 1);
+            ffmpeg_simd_set_isa(isa);
+            int rk=ffmpeg_scale((const uint8* const*)in.ppData, in.pStride, outK.ppData, outK.pStride, (FFPixFmt)fmt, sw, sh, dw, dh, 1);
+            CHECK(rc==rk && (rc==0 || frame_equal(&outC, &outK, (FFPixFmt)fmt, dw, dh)), "%s scale %s %dx%d->%dx%d",
+                isa_name(isa), ffmpeg_pixfmt2string((FFPixFmt)fmt), sw, sh, dw, dh);
+            free(in.pBuf), free(outC.pBuf), free(outK.pBuf);
+        }
+    }
+}
+
+static void test_metric(FFIsa isa)
+{
+    static const int pSize[][2]={{67, 35}, {129, 71}};
+    for(int s=0; s<(int)(sizeof(pSize)/sizeof(*pSize)); s++)
+    {
+        int w=pSize[s][0], h=pSize[s][1];
+        for(int fmt=FF_MIN+1; fmt<=FF_MAX; fmt++)
+        {
+            if(ffmpeg_yuv_isRGB((FFPixFmt)fmt))
+                continue;
+            TestFrame a, b;
+            FFMetric mc, mk;
+            frame_alloc(&a, (FFPixFmt)fmt, w, h), frame_alloc(&b, (FFPixFmt)fmt, w, h);
+            frame_fill(&a, (FFPixFmt)fmt), frame_fill(&b, (FFPixFmt)fmt);
+            ffmpeg_simd_set_isa(FF_ISA_C);
+            FFMetricCtx* p=ffmpeg_metric_create((FFPixFmt)fmt, w, h, FF_METRIC_ALL, 1);
+            int rc=ffmpeg_metric_frame(p, (const uint8* const*)a.ppData, a.pStride, (const uint8* const*)b.ppData, b.pStride, &mc);
+            ffmpeg_metric_close(p);
+            ffmpeg_simd_set_isa(isa);
+            p=ffmpeg_metric_create((FFPixFmt)fmt, w, h, FF_METRIC_ALL, 1);
+            int rk=ffmpeg_metric_frame(p, (const uint8* const*)a.ppData, a.pStride, (const uint8* const*)b.ppData, b.pStride, &mk);
+            ffmpeg_metric_close(p);
+            CHECK(rc && rk && memcmp(&mc, &mk, sizeof(FFMetric))==0, "%s metric %s %dx%d", isa_name(isa), ffmpeg_pixfmt2string((FFPixFmt)fmt), w, h);
+            free(a.pBuf), free(b.pBuf);
+        }
+    }
+}
+
+int main()
+{
+    FFSimdKernel c, k;
+    ffmpeg_simd_set_isa(FF_ISA_C), c=*ffmpeg_simd();
+    for(int isa=FF_ISA_SSE4; isa<=FF_ISA_AVX512; isa++)
+    {
+        if(ffmpeg_simd_set_isa((FFIsa)isa)!=(FFIsa)isa)
+        {
+            printf("%s: not supported by this cpu, skipped\n", isa_name((FFIsa)isa));
+            continue;
+        }
+        k=*ffmpeg_simd();
+        int fail=g_fail;
+        test_kernels(&c, &k);
+        test_convert((FFIsa)isa);
+        test_scale((FFIsa)isa);
+        test_metric((FFIsa)isa);
+        printf("%s: %s\n", isa_name((FFIsa)isa), g_fail==fail?"ok":"FAILED");
+    }
+    ffmpeg_simd_set_isa(FF_ISA_AUTO);
+    printf(g_fail?"test_simd: %d failures\n":"test_simd: all passed\n", g_fail);
+    return g_fail!=0;
+}
@@ -0,0 +1,71 @@
+// native y4m: headers written for every format y4m carries must probe and read back the same, and the header parser must
+// stop at the end of the header line even when the first frame's bytes look like header tokens
+#include "ffmpeg.h"
+
+static int g_fail=0;
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); g_fail++; } } while(0)
+
+// writes frames of pixfmt whose bytes start with pPrefix (if not NULL) and are (k*31+i) after it
+static int write_y4m(const char* pName, FFPixFmt pixfmt, int w, int h, double fps, int frames, const char* pPrefix)
+{
+    int64 frameSize=ffmpeg_yuv_compute_frame_size(w, h, pixfmt), n=0;
+    uint8* p=(uint8*)malloc((size_t)frameSize);
+    FILE* fp=ffmpeg_create_writer(pName, pixfmt, w, h, fps, -1, NULL, NULL);
+    for(int k=0; k<frames && fp && p; k++)
+    {
+        for(int64 i=0; i<frameSize; i++)
+            p[i]=(uint8)(k*31+i);
+        if(pPrefix) memcpy(p, pPrefix, strlen(pPrefix));
+        n+=(ffmpeg_set_frame(fp, p, frameSize)==frameSize);
+    }
+    if(fp) ffmpeg_close(fp);
+    free(p);
+    return (int)n;
+}
+static int read_y4m(const char* pName, FFPixFmt pixfmt, int w, int h, int frames, const char* pPrefix)
+{
+    int64 frameSize=ffmpeg_yuv_compute_frame_size(w, h, pixfmt), n=0;
+    uint8* p=(uint8*)malloc((size_t)frameSize);
+    FILE* fp=ffmpeg_create_reader(pName, pixfmt);
+    for(int k=0; k<frames && fp && p && ffmpeg_get_frame(fp, p, frameSize)==frameSize; k++)
+    {
+        int isOK=1;
+        for(int64 i=(pPrefix?(int64)strlen(pPrefix):0); i<frameSize && isOK; i++)
+            isOK=(p[i]==(uint8)(k*31+i));
+        n+=isOK && (pPrefix==0 || memcmp(p, pPrefix, strlen(pPrefix))==0);
+    }
+    if(fp) ffmpeg_close(fp);
+    free(p);
+    return (int)n;
+}
+
+int main()
+{
+    char pName[64];
+    FFPixFmt pFmt[]={FF_I420, FF_I422, FF_I444, FF_J420, FF_J422, FF_J444, FF_I420P10, FF_I422P10, FF_I444P10, FF_GRAY};
+    double pFps[]={25, 30000/1001.0, 23.5};
+    for(int i=0; i<(int)(sizeof(pFmt)/sizeof(*pFmt)); i++)
+    {
+        double fps=pFps[i%3];
+        FFInfo info;
+        snprintf(pName, sizeof(pName), "test_y4m.tmp%d.y4m", i);  // one name per format, probes are cached by path
+        CHECK(write_y4m(pName, pFmt[i], 66, 34, fps, 3, NULL)==3, "%s write", ffmpeg_pixfmt2string(pFmt[i]));
+        ffmpeg_get_video_info(pName, &info);
+        CHECK(info.pixfmt==pFmt[i] && info.width==66 && info.height==34 && fabs(info.fps-fps)<1e-3 && info.frame_num==3,
+            "%s probed as %s %dx%d %g fps %d frames", ffmpeg_pixfmt2string(pFmt[i]), ffmpeg_pixfmt2string(info.pixfmt), info.width, info.height, info.fps, info.frame_num);
+        CHECK(read_y4m(pName, pFmt[i], 66, 34, 3, NULL)==3, "%s read back", ffmpeg_pixfmt2string(pFmt[i]));
+        remove(pName);
+    }
+    // the first frame's luma holds header tokens, the parser must not see them
+    const char* pTokens=" W2 H2 F1:1 C444 XCOLORRANGE=FULL ";
+    FFInfo info;
+    snprintf(pName, sizeof(pName), "test_y4m.tmp.y4m");
+    CHECK(write_y4m(pName, FF_I420, 64, 64, 25, 2, pTokens)==2, "token frame write");
+    ffmpeg_get_video_info(pName, &info);
+    CHECK(info.pixfmt==FF_I420 && info.width==64 && info.height==64 && fabs(info.fps-25)<1e-3,
+        "frame bytes leaked into the header: %s %dx%d %g fps", ffmpeg_pixfmt2string(info.pixfmt), info.width, info.height, info.fps);
+    CHECK(read_y4m(pName, FF_I420, 64, 64, 2, pTokens)==2, "token frame read back");
+    remove(pName);
+    printf(g_fail?"test_y4m: %d failures\n":"test_y4m: all passed\n", g_fail);
+    return g_fail!=0;
+}